@@ -6,6 +6,7 @@
 #include "raster.h"
 #include "banner.h"
 #include "crc.h"
+#include "digest.h"
 #include "default_icon_png.h"
 #include "utf16.h"
 #include "log.h"
@@ -92,18 +93,18 @@ void BannerPutTitles(Banner &banner)
 {
 	for (int l=0; l<GetBannerLanguageCount(banner.version); l++)
 	{
-		int text_idx = bannertext[l] ? l : 1;
+		int text_idx = ctx->bannertext[l] ? l : 1;
 		// convert initial title
-		if (!utf16_convert_from_system(bannertext[text_idx], 0, banner.title[l], BANNER_TITLE_LENGTH * 2))
+		if (!utf16_convert_from_system(ctx->bannertext[text_idx], 0, banner.title[l], BANNER_TITLE_LENGTH * 2))
 		{
 			// avoid repeating error message more than once
 			if (l == text_idx)
 			{
 				fprintf(stderr, "WARNING: UTF-16 conversion failed, using fallback.\n");
 			}
-			for (int i=0; bannertext[text_idx][i] && (i<BANNER_TITLE_LENGTH); i++)
+			for (int i=0; ctx->bannertext[text_idx][i] && (i<BANNER_TITLE_LENGTH); i++)
 			{
-				banner.title[l][i] = bannertext[text_idx][i];
+				banner.title[l][i] = ctx->bannertext[text_idx][i];
 			}
 		}
 		banner.title[l][BANNER_TITLE_LENGTH-1] = 0;
@@ -134,8 +135,8 @@ unsigned short ExtractBannerVersion(FILE *fNDS, unsigned int banner_offset)
  */
 void FixBannerCRC(char *ndsfilename, unsigned int banner_offset, unsigned int bannersize)
 {
-	fNDS = fopen(ndsfilename, "r+b");
-	if (!fNDS)
+	ctx->fNDS = fopen(ndsfilename, "r+b");
+	if (!ctx->fNDS)
 		LogFatal("Cannot open file '%s'.\n", ndsfilename);
 
 	// banner info
@@ -143,20 +144,21 @@ void FixBannerCRC(char *ndsfilename, unsigned int banner_offset, unsigned int ba
 	{
 		Banner banner = {};
 
-		if (fseek(fNDS, banner_offset, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, banner_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek banner (1)\n", __func__);
 
-		if (fread(&banner, 1, bannersize, fNDS)) {
+		if (fread(&banner, 1, bannersize, ctx->fNDS)) {
 			InsertBannerCRC(banner, bannersize);
 
-			if (fseek(fNDS, banner_offset, SEEK_SET) == -1)
+			if (fseek(ctx->fNDS, banner_offset, SEEK_SET) == -1)
 				LogFatal("%s: Failed to seek banner (2)\n", __func__);
 
-			if (fwrite(&banner, bannersize, 1, fNDS) != 1)
+			if (fwrite(&banner, bannersize, 1, ctx->fNDS) != 1)
 				LogFatal("%s: Failed to write banner\n", __func__);
 		}
 	}
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
 }
 
 static bool IconPrepareValidateRasterImage(RasterImage &bmp, bool force_zero_transparent)
@@ -300,23 +302,24 @@ void IconToRasterImage()
 {
 	Banner banner = {};
 
-	fNDS = fopen(ndsfilename, "rb");
-	if (!fNDS)
-		LogFatal("Cannot open file '%s'.\n", ndsfilename);
+	ctx->fNDS = fopen(ctx->ndsfilename, "rb");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'.\n", ctx->ndsfilename);
 
-	if (fseek(fNDS, header.banner_offset, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, ctx->header.banner_offset, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek banner data\n", __func__);
 
-	if (fread(&banner, 1, sizeof(banner), fNDS) != sizeof(banner))
+	if (fread(&banner, 1, sizeof(banner), ctx->fNDS) != sizeof(banner))
 		LogFatal("%s: Failed to read banner data\n", __func__);
 
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
 
 	RasterImage bmp(32, 32, 1, 3);
 	IconBannerToRaster(banner.tile_data, banner.palette, bmp, 0);
 
-	if (bannerfilename == NULL) bannerfilename = banneranimfilename;
-	bmp.saveFile(bannerfilename);
+	if (ctx->bannerfilename == NULL) ctx->bannerfilename = ctx->banneranimfilename;
+	bmp.saveFile(ctx->bannerfilename);
 }
 
 void IconFromRasterImage()
@@ -324,44 +327,51 @@ void IconFromRasterImage()
 	RasterImage *bmp, *bmp_anim;
 	bmp = new RasterImage;
 
-	if (bannerfilename == NULL || banneranimfilename == NULL)
+	if (ctx->bannerfilename == NULL || ctx->banneranimfilename == NULL)
 	{
-		if (bannerfilename == NULL && banneranimfilename == NULL)
+		if (ctx->bannerfilename == NULL && ctx->banneranimfilename == NULL)
 		{
-			bannerfilename = "default_icon.png";
-			banneranimfilename = "default_icon.png";
+			ctx->bannerfilename = "default_icon.png";
+			ctx->banneranimfilename = "default_icon.png";
 
-			if (!bmp->loadBuffer(default_icon_png, default_icon_png_size, bannerfilename)) exit(1);
+			if (!bmp->loadBuffer(default_icon_png, default_icon_png_size, ctx->bannerfilename))
+				LogFatal("%s: Failed to load default icon\n", __func__);
 		}
 		else
 		{
-			if      (bannerfilename == NULL)     bannerfilename = banneranimfilename;
-			else if (banneranimfilename == NULL) banneranimfilename = bannerfilename;
+			if      (ctx->bannerfilename == NULL)     ctx->bannerfilename = ctx->banneranimfilename;
+			else if (ctx->banneranimfilename == NULL) ctx->banneranimfilename = ctx->bannerfilename;
 
-			if (!bmp->loadFile(bannerfilename)) exit(1);
+			if (!bmp->loadFile(ctx->bannerfilename))
+				LogFatal("Cannot load icon '%s'.\n", ctx->bannerfilename);
 		}
 
-		if (!IconPrepareValidateRasterImage(*bmp, IsRasterImageExtensionFilename(bannerfilename))) exit(1);
+		if (!IconPrepareValidateRasterImage(*bmp, IsRasterImageExtensionFilename(ctx->bannerfilename)))
+			LogFatal("Invalid icon '%s'.\n", ctx->bannerfilename);
 		bmp_anim = bmp;
 	}
 	else
 	{
 		bmp_anim = new RasterImage;
 
-		if (!bmp->loadFile(bannerfilename)) exit(1);
-		if (!bmp_anim->loadFile(banneranimfilename)) exit(1);
+		if (!bmp->loadFile(ctx->bannerfilename))
+			LogFatal("Cannot load icon '%s'.\n", ctx->bannerfilename);
+		if (!bmp_anim->loadFile(ctx->banneranimfilename))
+			LogFatal("Cannot load icon '%s'.\n", ctx->banneranimfilename);
 
-		if (!IconPrepareValidateRasterImage(*bmp, IsRasterImageExtensionFilename(bannerfilename))) exit(1);
-		if (!IconPrepareValidateRasterImage(*bmp_anim, IsRasterImageExtensionFilename(banneranimfilename))) exit(1);
+		if (!IconPrepareValidateRasterImage(*bmp, IsRasterImageExtensionFilename(ctx->bannerfilename)))
+			LogFatal("Invalid icon '%s'.\n", ctx->bannerfilename);
+		if (!IconPrepareValidateRasterImage(*bmp_anim, IsRasterImageExtensionFilename(ctx->banneranimfilename)))
+			LogFatal("Invalid icon '%s'.\n", ctx->banneranimfilename);
 	}
 
 	Banner banner = {};
 
 	banner.version = 0x0001;
-	if (bannertext[6]) banner.version = 0x0002;
-	if (bannertext[7]) banner.version = 0x0003;
+	if (ctx->bannertext[6]) banner.version = 0x0002;
+	if (ctx->bannertext[7]) banner.version = 0x0003;
 	if (bmp_anim->frames > 1 || bmp != bmp_anim) banner.version = 0x0103;
-	bannersize = CalcBannerSize(banner.version);
+	ctx->bannersize = CalcBannerSize(banner.version);
 
 	IconRasterToBanner(*bmp, 0, banner.tile_data, banner.palette);
 
@@ -414,8 +424,7 @@ void IconFromRasterImage()
 				{
 					if (frame_alloc_idx >= 8)
 					{
-						fprintf(stderr, "Could not convert animated icon - too many unique frames.\n");
-						exit(1);
+						LogFatal("Could not convert animated icon - too many unique frames.\n");
 					}
 					fa_id = frame_alloc_idx++;
 					fa_variant = 0;
@@ -429,8 +438,8 @@ void IconFromRasterImage()
 	}
 
 	BannerPutTitles(banner);
-	InsertBannerCRC(banner, bannersize);
+	InsertBannerCRC(banner, ctx->bannersize);
 
-	if (fwrite(&banner, 1, bannersize, fNDS) != bannersize)
+	if (RomWrite(&banner, ctx->bannersize, ctx->fNDS) != ctx->bannersize)
 		LogFatal("%s: Failed to write banner data\n", __func__);
 }
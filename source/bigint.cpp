@@ -1,7 +1,8 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 /*
 	big integer class for RSA calculation
-	Numbers stored in big endian order.
+	Numbers stored as 32-bit limbs, least significant first. Modular
+	multiplications are done in Montgomery form.
 */
 
 /*
@@ -10,86 +11,312 @@
 #include <stdio.h>
 #include <string.h>
 #include "bigint.h"
+#include "log.h"
 
 /*
- * Sub
- * Subtract (shifted) b from a.
+ * LimbCount
+ * Number of limbs that are used (without leading zero limbs).
  */
-int BigInt::Sub(BigInt &a, BigInt &b, int b_shift)
+static unsigned int LimbCount(const BigInt &a)
 {
-	unsigned int b_byte = sizeof(data) - 1 + (b_shift / 8);
-	int b_bit = (b_shift % 8);
-	int carry = 0;
-	for (int ia=sizeof(data)-1; ia>=0; ia--)
+	unsigned int n = BIGINT_LIMBS;
+	while (n > 0 && a.limbs[n - 1] == 0) n--;
+	return n;
+}
+
+/*
+ * Montgomery
+ * Multiplication modulo an odd number m. Numbers in Montgomery form are stored
+ * as a*R mod m, with R = 2^(32*n), where n is the number of limbs of m.
+ */
+struct Montgomery
+{
+	const BigInt &m;
+	unsigned int n;		// number of limbs of m
+	uint32_t m_inv;		// -1/m mod 2^32
+	BigInt r2;			// R^2 mod m
+
+	Montgomery(const BigInt &modulus);
+	void Double(BigInt &a) const;
+	void Reduce(BigInt &out, const BigInt &a) const;
+	void Mul(BigInt &out, const BigInt &a, const BigInt &b) const;
+	void ToMont(BigInt &out, const BigInt &a) const;
+	void FromMont(BigInt &out, const BigInt &a) const;
+};
+
+/*
+ * SubIfNotLess
+ * Subtracts m from the n+1 limbs of t if t >= m.
+ */
+static void SubIfNotLess(uint32_t *t, const BigInt &m, unsigned int n)
+{
+	if (t[n] == 0)
 	{
-		unsigned char b_data_shifted = 0;
-		if (b_byte + 1 < sizeof(b.data)) b_data_shifted |= b.data[b_byte + 1] >> (8 - b_bit);
-		if (b_byte + 0 < sizeof(b.data)) b_data_shifted |= b.data[b_byte + 0] << b_bit;
-		b_byte--;
-		int r = a.data[ia] - b_data_shifted + carry;
-		data[ia] = r;
-		carry = r>>8;
+		for (int i=n-1; i>=0; i--)
+		{
+			if (t[i] != m.limbs[i])
+			{
+				if (t[i] < m.limbs[i]) return;
+				break;
+			}
+		}
 	}
-	return carry;
+
+	uint64_t borrow = 0;
+	for (unsigned int i=0; i<n; i++)
+	{
+		uint64_t r = (uint64_t)t[i] - m.limbs[i] - borrow;
+		t[i] = (uint32_t)r;
+		borrow = (r >> 32) & 1;
+	}
+	t[n] -= (uint32_t)borrow;
+}
+
+Montgomery::Montgomery(const BigInt &modulus) : m(modulus)
+{
+	n = LimbCount(m);
+	if (n == 0 || !(m.limbs[0] & 1))
+		LogFatal("%s: The modulus must be odd\n", __func__);
+
+	// Newton's method, each iteration doubles the number of correct bits
+	uint32_t inv = m.limbs[0];
+	for (int i=0; i<5; i++) inv *= 2 - m.limbs[0] * inv;
+	m_inv = -inv;
+
+	// 2^(64*n) mod m
+	memset(&r2, 0, sizeof(r2));
+	r2.limbs[0] = 1;
+	for (unsigned int i=0; i<64*n; i++) Double(r2);
 }
 
 /*
- * MulMod
- * Multiply two numbers and perform modulo.
+ * Double
+ * a = 2*a mod m, with a < m.
  */
-void BigInt::MulMod(BigInt &a, BigInt &b, BigInt &m)
+void Montgomery::Double(BigInt &a) const
 {
-	memset(this, 0, sizeof(*this));
-	for (unsigned int ia=sizeof(data) - 1; ia>=sizeof(data)/2; ia--)
+	uint32_t t[BIGINT_LIMBS + 1];
+	uint32_t carry = 0;
+	for (unsigned int i=0; i<n; i++)
 	{
-		int carry = 0;
-		for (unsigned int ib=sizeof(data) - 1; ib>=sizeof(data)/2; ib--)
+		t[i] = (a.limbs[i] << 1) | carry;
+		carry = a.limbs[i] >> 31;
+	}
+	t[n] = carry;
+	SubIfNotLess(t, m, n);
+	memcpy(a.limbs, t, n * sizeof(uint32_t));
+}
+
+/*
+ * Reduce
+ * out = a mod m, for any a. Only needed when a has more limbs than m.
+ */
+void Montgomery::Reduce(BigInt &out, const BigInt &a) const
+{
+	BigInt r;
+	memset(&r, 0, sizeof(r));
+
+	unsigned int bits = a.BitLength();
+	if (bits <= 32*n)
+	{
+		memcpy(r.limbs, a.limbs, n * sizeof(uint32_t));
+		uint32_t t[BIGINT_LIMBS + 1];
+		memcpy(t, r.limbs, n * sizeof(uint32_t));
+		t[n] = 0;
+		SubIfNotLess(t, m, n);	// a < R < 2*m
+		memcpy(r.limbs, t, n * sizeof(uint32_t));
+	}
+	else
+	{
+		for (int i=bits-1; i>=0; i--)
 		{
-			int iab = ia + ib - sizeof(data) + 1;
-			unsigned int r = a.data[ia] * b.data[ib] + carry + data[iab];
-			data[iab] = r;
-			carry = r>>8;
+			Double(r);
+			if ((a.limbs[i / 32] >> (i % 32)) & 1)
+			{
+				// r + 1 <= m, so one subtraction is enough
+				uint32_t t[BIGINT_LIMBS + 1];
+				memcpy(t, r.limbs, n * sizeof(uint32_t));
+				t[n] = 0;
+				for (unsigned int j=0; j<=n && ++t[j] == 0; j++);
+				SubIfNotLess(t, m, n);
+				memcpy(r.limbs, t, n * sizeof(uint32_t));
+			}
 		}
 	}
 
-	for (int shift=sizeof(data)/2*8; shift>=0; shift--)
+	out = r;
+}
+
+/*
+ * Mul
+ * out = a*b/R mod m, with a, b < m. Coarsely integrated operand scanning.
+ */
+void Montgomery::Mul(BigInt &out, const BigInt &a, const BigInt &b) const
+{
+	uint32_t t[BIGINT_LIMBS + 2];
+	memset(t, 0, (n + 2) * sizeof(uint32_t));
+
+	for (unsigned int i=0; i<n; i++)
 	{
-		BigInt subbed;
-		if (!subbed.Sub(*this, m, shift))	// positive?
+		uint64_t c = 0;
+		for (unsigned int j=0; j<n; j++)
+		{
+			c = (uint64_t)a.limbs[j] * b.limbs[i] + t[j] + c;
+			t[j] = (uint32_t)c;
+			c >>= 32;
+		}
+		c += t[n];
+		t[n] = (uint32_t)c;
+		t[n + 1] = (uint32_t)(c >> 32);
+
+		uint32_t q = t[0] * m_inv;
+		c = ((uint64_t)q * m.limbs[0] + t[0]) >> 32;
+		for (unsigned int j=1; j<n; j++)
 		{
-			memcpy(this, &subbed, sizeof(*this));
+			c = (uint64_t)q * m.limbs[j] + t[j] + c;
+			t[j - 1] = (uint32_t)c;
+			c >>= 32;
 		}
+		c += t[n];
+		t[n - 1] = (uint32_t)c;
+		t[n] = t[n + 1] + (uint32_t)(c >> 32);
 	}
+
+	SubIfNotLess(t, m, n);
+
+	memset(&out, 0, sizeof(out));
+	memcpy(out.limbs, t, n * sizeof(uint32_t));
+}
+
+/*
+ * ToMont
+ */
+void Montgomery::ToMont(BigInt &out, const BigInt &a) const
+{
+	BigInt r;
+	Reduce(r, a);
+	Mul(out, r, r2);
+}
+
+/*
+ * FromMont
+ */
+void Montgomery::FromMont(BigInt &out, const BigInt &a) const
+{
+	BigInt one;
+	memset(&one, 0, sizeof(one));
+	one.limbs[0] = 1;
+	Mul(out, a, one);
+}
+
+/*
+ * BitLength
+ */
+unsigned int BigInt::BitLength() const
+{
+	unsigned int n = LimbCount(*this);
+	if (n == 0) return 0;
+
+	unsigned int bits = 32 * n;
+	for (uint32_t top = limbs[n - 1]; !(top & 0x80000000); top <<= 1) bits--;
+	return bits;
+}
+
+/*
+ * Compare
+ */
+int BigInt::Compare(const BigInt &b) const
+{
+	for (int i=BIGINT_LIMBS-1; i>=0; i--)
+	{
+		if (limbs[i] != b.limbs[i]) return (limbs[i] < b.limbs[i]) ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * MulMod
+ * Multiply two numbers and perform modulo. m must be odd.
+ */
+void BigInt::MulMod(const BigInt &a, const BigInt &b, const BigInt &m)
+{
+	Montgomery mont(m);
+	BigInt ra, rb, ab;
+	mont.Reduce(ra, a);
+	mont.ToMont(rb, b);
+	mont.Mul(ab, ra, rb);	// a*b*R/R
+	*this = ab;
 }
 
 /*
  * PowMod
- * Raise to power 65537 and perform modulo.
+ * Raise to power e and perform modulo. m must be odd. Uses windows of 4 bits
+ * for big exponents.
  */
-void BigInt::PowMod(BigInt &n, BigInt &m)
+void BigInt::PowMod(const BigInt &n, const BigInt &e, const BigInt &m)
 {
-	BigInt n65536;
-	memcpy(&n65536, &n, sizeof(n));
-	for (int i=0; i<16; i++)	// 16 times n^2 = n^65536
+	Montgomery mont(m);
+
+	unsigned int bits = e.BitLength();
+	unsigned int window = (bits > 64) ? 4 : 1;
+
+	BigInt table[16];
+	mont.ToMont(table[1], n);
+	if (window > 1)
+	{
+		mont.Mul(table[2], table[1], table[1]);
+		for (int i=3; i<16; i++) mont.Mul(table[i], table[i - 1], table[1]);
+	}
+
+	// 1 in Montgomery form
+	BigInt one, x;
+	memset(&one, 0, sizeof(one));
+	one.limbs[0] = 1;
+	mont.ToMont(x, one);
+
+	// the exponent is processed from the top, in groups of window bits
+	int pos = ((bits + window - 1) / window) * window;
+	while (pos > 0)
 	{
-		BigInt tmp;
-		tmp.MulMod(n65536, n65536, m);
-		memcpy(&n65536, &tmp, sizeof(n));
+		pos -= window;
+
+		for (unsigned int i=0; i<window; i++) mont.Mul(x, x, x);
+
+		unsigned int digit = 0;
+		for (int i=window-1; i>=0; i--)
+		{
+			unsigned int bit = pos + i;
+			digit = (digit << 1) | ((e.limbs[bit / 32] >> (bit % 32)) & 1);
+		}
+		if (digit) mont.Mul(x, x, table[digit]);
 	}
-	MulMod(n, n65536, m);	// final result: n^1 * n^65536
+
+	mont.FromMont(*this, x);
+}
+
+/*
+ * PowMod
+ * Raise to power 65537 and perform modulo.
+ */
+void BigInt::PowMod(const BigInt &n, const BigInt &m)
+{
+	BigInt e;
+	memset(&e, 0, sizeof(e));
+	e.limbs[0] = 65537;
+	PowMod(n, e, m);
 }
 
 /*
  * print
  */
-void BigInt::print()
+void BigInt::print() const
 {
 	printf("0x");
 	bool show = false;
-	for (unsigned int i=0; i<sizeof(data); i++)
+	for (int i=BIGINT_LIMBS-1; i>=0; i--)
 	{
-		if (data[i]) show = true;
-		if (show) printf("%02X", data[i]);
+		if (limbs[i]) show = true;
+		if (show) printf("%08X", limbs[i]);
 	}
 	printf(show ? "\n" : "0\n");
 }
@@ -97,16 +324,29 @@ void BigInt::print()
 /*
  * Set
  */
-void BigInt::Set(unsigned char *data, unsigned int length)
+void BigInt::Set(const unsigned char *data, unsigned int length)
 {
 	memset(this, 0, sizeof(*this));
-	memcpy(this->data + sizeof(this->data) - length, data, length);
+	for (unsigned int i=0; i<length; i++)
+	{
+		unsigned int byte = length - 1 - i;	// from the least significant byte
+		if (byte >= sizeof(limbs))
+		{
+			if (data[i]) LogFatal("%s: Number too big (max %d bits)\n", __func__, BIGINT_MAX_BITS);
+			continue;
+		}
+		limbs[byte / 4] |= (uint32_t)data[i] << (8 * (byte % 4));
+	}
 }
 
 /*
  * Get
  */
-void BigInt::Get(unsigned char *data, unsigned int length)
+void BigInt::Get(unsigned char *data, unsigned int length) const
 {
-	memcpy(data, this->data + sizeof(this->data) - length, length);
+	for (unsigned int i=0; i<length; i++)
+	{
+		unsigned int byte = length - 1 - i;
+		data[i] = (byte < sizeof(limbs)) ? limbs[byte / 4] >> (8 * (byte % 4)) : 0;
+	}
 }
@@ -2,14 +2,21 @@
 
 #pragma once
 
+#include <stdint.h>
+
+#define BIGINT_MAX_BITS		2048
+#define BIGINT_LIMBS		(BIGINT_MAX_BITS / 32)
+
 struct BigInt
 {
-	unsigned char data[129*2];	// 128*2 doesn't seem to be enough for 1024 bit keys
-
-	int Sub(BigInt &a, BigInt &b, int b_shift);
-	void MulMod(BigInt &a, BigInt &b, BigInt &m);
-	void PowMod(BigInt &n, BigInt &m);
-	void print();
-	void Set(unsigned char *data, unsigned int length);
-	void Get(unsigned char *data, unsigned int length);
+	uint32_t limbs[BIGINT_LIMBS];	// least significant limb first
+
+	unsigned int BitLength() const;
+	int Compare(const BigInt &b) const;
+	void MulMod(const BigInt &a, const BigInt &b, const BigInt &m);
+	void PowMod(const BigInt &n, const BigInt &e, const BigInt &m);
+	void PowMod(const BigInt &n, const BigInt &m);	// e = 65537
+	void print() const;
+	void Set(const unsigned char *data, unsigned int length);	// big endian
+	void Get(unsigned char *data, unsigned int length) const;	// big endian
 };
@@ -0,0 +1,353 @@
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "catalog.h"
+#include "fileio.h"
+#include "log.h"
+#include "manifest.h"
+#include "ndscontext.h"
+#include "parallel.h"
+#include "scan.h"
+#include "utf16.h"
+
+#define CATALOG_MAGIC	"ndstool-catalog 1"
+
+/*
+ * FormatEntry
+ */
+static std::string FormatEntry(const CatalogEntry &entry)
+{
+	char buf[64];
+	std::string line = Escape(entry.path);
+
+	sprintf(buf, "\t%" PRIu64 "\t%" PRIu64 "\t%08X\t", entry.size, entry.mtime, entry.crc32);
+	line += buf;
+
+	// Hashes are printed in uppercase, like in the output of -scan. They are
+	// parsed without regard to case.
+	std::string sha1 = DigestToString(entry.sha1);
+	for (char &c : sha1)
+		c = toupper((unsigned char)c);
+	line += sha1;
+	line += "\t" + Escape(entry.gamecode);
+	line += "\t" + Escape(entry.title);
+	sprintf(buf, "\t%u\t", entry.unitcode);
+	line += buf;
+	line += Escape(entry.banner_title);
+
+	return line;
+}
+
+/*
+ * ParseEntry
+ */
+static bool ParseEntry(const std::vector<std::string> &fields, CatalogEntry &entry)
+{
+	if (fields.size() != 9)
+		return false;
+
+	entry.path = Unescape(fields[0]);
+	entry.size = strtoull(fields[1].c_str(), 0, 0);
+	entry.mtime = strtoull(fields[2].c_str(), 0, 0);
+	entry.crc32 = strtoul(fields[3].c_str(), 0, 16);
+	if (fields[4].size() != SHA1_DIGEST_SIZE * 2)
+		return false;
+	for (int i = 0; i < SHA1_DIGEST_SIZE; i++)
+	{
+		unsigned int value;
+		if (sscanf(fields[4].c_str() + i * 2, "%2x", &value) != 1)
+			return false;
+		entry.sha1[i] = value;
+	}
+	entry.gamecode = Unescape(fields[5]);
+	entry.title = Unescape(fields[6]);
+	entry.unitcode = strtoul(fields[7].c_str(), 0, 0);
+	entry.banner_title = Unescape(fields[8]);
+
+	return true;
+}
+
+/*
+ * LoadCatalog
+ * A catalog that doesn't exist is empty.
+ */
+static void LoadCatalog(const char *filename, std::map<std::string, CatalogEntry> &entries)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return;
+
+	std::string data;
+	char buf[4096];
+	size_t size;
+	while ((size = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, size);
+	fclose(f);
+
+	size_t start = 0;
+	bool first = true;
+	while (start < data.size())
+	{
+		size_t end = data.find('\n', start);
+		if (end == std::string::npos)
+			LogFatal("%s: Truncated catalog '%s'\n", __func__, filename);
+
+		std::string line = data.substr(start, end - start);
+		start = end + 1;
+
+		if (first)
+		{
+			if (line != CATALOG_MAGIC)
+				LogFatal("%s: '%s' isn't a catalog\n", __func__, filename);
+			first = false;
+			continue;
+		}
+
+		CatalogEntry entry;
+		if (!ParseEntry(SplitLine(line), entry))
+			LogFatal("%s: Invalid line in catalog '%s'\n", __func__, filename);
+
+		entries[entry.path] = entry;
+	}
+}
+
+/*
+ * SaveCatalog
+ * The catalog is written to a temporary file that replaces the old one, so
+ * that it's never left half-written.
+ */
+static void SaveCatalog(const char *filename, const std::map<std::string, CatalogEntry> &entries)
+{
+	std::string tmpname = std::string(filename) + ".tmp";
+
+	FILE *f = fopen(tmpname.c_str(), "wb");
+	if (!f)
+		LogFatal("%s: Cannot create file '%s'\n", __func__, tmpname.c_str());
+
+	fprintf(f, CATALOG_MAGIC "\n");
+	for (const auto &it : entries)
+		fprintf(f, "%s\n", FormatEntry(it.second).c_str());
+
+	bool ok = (ferror(f) == 0);
+	if (fclose(f) != 0)
+		ok = false;
+
+	if (!ok || (rename(tmpname.c_str(), filename) != 0))
+	{
+		remove(tmpname.c_str());
+		LogFatal("%s: Failed to write catalog '%s'\n", __func__, filename);
+	}
+}
+
+/*
+ * ReadEntry
+ * Returns an error message, or NULL if the ROM could be read.
+ */
+static const char *ReadEntry(CatalogEntry &entry)
+{
+	int fd = open(entry.path.c_str(), O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return strerror(errno);
+
+	struct stat st;
+	const char *error = NULL;
+	if (fstat(fd, &st) != 0)
+		error = "failed to get file information";
+
+	ScanInfo info;
+	memset((void *)&info, 0, sizeof(info));
+	if (!error)
+		error = ReadRomInfo(fd, info, true);
+	close(fd);
+
+	if (error)
+		return error;
+
+	// The size and time of the file before reading it, so that it's read again
+	// in the next update if it has been modified meanwhile
+	entry.size = info.file_size;
+	entry.mtime = GetFileMtime(st);
+	entry.crc32 = info.crc32;
+	memcpy(entry.sha1, info.sha1, SHA1_DIGEST_SIZE);
+	entry.gamecode = HeaderString(info.header.gamecode, sizeof(info.header.gamecode));
+	entry.title = HeaderString(info.header.title, sizeof(info.header.title));
+	entry.unitcode = info.header.unitcode;
+	entry.banner_title.clear();
+	if (info.bannersize)
+		entry.banner_title = utf16_convert_to_utf8(info.banner.title[1], BANNER_TITLE_LENGTH);
+
+	return NULL;
+}
+
+/*
+ * CanonicalPath
+ * Returns the absolute path of a file without "." and ".." components or
+ * symbolic links, or an empty string if the file doesn't exist.
+ */
+static std::string CanonicalPath(const std::string &path)
+{
+#ifdef _WIN32
+	char *p = _fullpath(NULL, path.c_str(), 0);
+#else
+	char *p = realpath(path.c_str(), NULL);
+#endif
+	if (!p)
+		return "";
+
+	std::string str = p;
+	free(p);
+	return str;
+}
+
+/*
+ * UpdateCatalog
+ * ROMs are stored with their canonical paths, so the same file is only added
+ * once however its path has been written.
+ */
+static bool UpdateCatalog(std::map<std::string, CatalogEntry> &entries)
+{
+	std::vector<std::string> roms;
+	FindRomFiles(ctx->catalog_args, roms);
+
+	// ROMs that have been removed. Catalogs written by older versions may have
+	// other paths to the same files, which are converted here.
+	size_t removed = 0;
+	std::map<std::string, CatalogEntry> existing;
+	for (auto &it : entries)
+	{
+		std::string path = CanonicalPath(it.first);
+		if (path.empty() || existing.count(path))
+		{
+			removed++;
+			continue;
+		}
+
+		it.second.path = path;
+		existing[path] = it.second;
+	}
+	entries.swap(existing);
+
+	// New ROMs and ROMs that have changed
+	std::vector<CatalogEntry> jobs;
+	std::set<std::string> found;
+	for (const std::string &rom : roms)
+	{
+		std::string path = CanonicalPath(rom);
+		if (path.empty() || !found.insert(path).second)
+			continue;
+
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0)
+			continue;
+
+		auto it = entries.find(path);
+		if ((it != entries.end()) && (it->second.size == (uint64_t)st.st_size)
+			&& (it->second.mtime == GetFileMtime(st)))
+			continue;
+
+		CatalogEntry entry;
+		entry.path = path;
+		jobs.push_back(entry);
+	}
+
+	std::vector<const char *> errors(jobs.size());
+	ParallelFor(jobs.size(), [&](size_t i)
+	{
+		errors[i] = ReadEntry(jobs[i]);
+	});
+
+	bool ok = true;
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (errors[i])
+		{
+			LogWarning("Cannot read ROM '%s': %s\n", jobs[i].path.c_str(), errors[i]);
+			entries.erase(jobs[i].path);
+			ok = false;
+			continue;
+		}
+		entries[jobs[i].path] = jobs[i];
+	}
+
+	LogInfo("%zu ROMs in catalog, %zu read, %zu removed\n", entries.size(), jobs.size(), removed);
+	return ok;
+}
+
+/*
+ * ParseHash
+ * Returns the number of bytes of the hash, or 0 if it isn't valid.
+ */
+static int ParseHash(const char *str, unsigned char *hash)
+{
+	size_t len = strlen(str);
+	if ((len != 8) && (len != SHA1_DIGEST_SIZE * 2))
+		return 0;
+
+	for (size_t i = 0; i < len / 2; i++)
+	{
+		unsigned int value;
+		if (!isxdigit(str[i * 2]) || !isxdigit(str[i * 2 + 1]) || (sscanf(str + i * 2, "%2x", &value) != 1))
+			return 0;
+		hash[i] = value;
+	}
+	return len / 2;
+}
+
+bool CatalogCommand(void)
+{
+	std::map<std::string, CatalogEntry> entries;
+	LoadCatalog(ctx->catalogfilename, entries);
+
+	if (strcmp(ctx->catalog_command, "update") == 0)
+	{
+		bool ok = UpdateCatalog(entries);
+		SaveCatalog(ctx->catalogfilename, entries);
+		return ok;
+	}
+	else if (strcmp(ctx->catalog_command, "gamecode") == 0)
+	{
+		if (ctx->catalog_args.size() != 1)
+			LogFatal("The gamecode command needs one game code\n");
+
+		for (const auto &it : entries)
+		{
+			if (it.second.gamecode == ctx->catalog_args[0])
+				printf("%s\n", FormatEntry(it.second).c_str());
+		}
+	}
+	else if (strcmp(ctx->catalog_command, "hash") == 0)
+	{
+		unsigned char hash[SHA1_DIGEST_SIZE];
+		int size = (ctx->catalog_args.size() == 1) ? ParseHash(ctx->catalog_args[0], hash) : 0;
+		if (size == 0)
+			LogFatal("The hash command needs a CRC32 or a SHA1 in hexadecimal\n");
+
+		for (const auto &it : entries)
+		{
+			const CatalogEntry &entry = it.second;
+			bool match;
+			if (size == 4)
+				match = (entry.crc32 == (unsigned int)((hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3]));
+			else
+				match = (memcmp(entry.sha1, hash, SHA1_DIGEST_SIZE) == 0);
+
+			if (match)
+				printf("%s\n", FormatEntry(entry).c_str());
+		}
+	}
+	else
+	{
+		LogFatal("Unknown catalog command (must be update, gamecode or hash): %s\n", ctx->catalog_command);
+	}
+
+	return true;
+}
@@ -0,0 +1,38 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "sha1.h"
+
+// Catalog of a ROM collection. It's a file with one line per ROM, with the
+// path, size and modification time of the file, its CRC32 and SHA1 and a few
+// fields of the header and the banner. When it's updated, only the ROMs that
+// are new or whose size or modification time have changed are read again. The
+// paths are stored as canonical absolute paths, so each file is only added once.
+//
+// Commands:
+//   update path...    Adds or updates the ROMs in the paths (files or
+//                     directories) and removes the ROMs that don't exist.
+//   gamecode code     Prints the ROMs with a game code.
+//   hash crc32|sha1   Prints the ROMs with a CRC32 (8 hex digits) or SHA1 (40
+//                     hex digits).
+
+struct CatalogEntry
+{
+	std::string path;
+	uint64_t size;
+	uint64_t mtime;
+	unsigned int crc32;
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+	std::string gamecode;
+	std::string title;			// title in the header
+	unsigned int unitcode;
+	std::string banner_title;	// English title of the banner
+};
+
+// Returns false if the command failed for any ROM.
+bool CatalogCommand(void);
@@ -4,6 +4,16 @@
 	by Rafael Vuijk (aka DarkFader)
 */
 
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
+#include "crc.h"
+
 unsigned short ccitt16tab[] =
 {
 	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
@@ -76,7 +86,7 @@ unsigned short crc16tab[] =
 	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
 };
 
-unsigned long crc32tab[] =
+unsigned int crc32tab[] =
 {
 	0x00000000L, 0x77073096L, 0xEE0E612CL, 0x990951BAL,
 	0x076DC419L, 0x706AF48FL, 0xE963A535L, 0x9E6495A3L,
@@ -143,3 +153,178 @@ unsigned long crc32tab[] =
 	0xB3667A2EL, 0xC4614AB8L, 0x5D681B02L, 0x2A6F2B94L,
 	0xB40BBE37L, 0xC30C8EA1L, 0x5A05DF1BL, 0x2D02EF8DL
 };
+
+/*
+ * Crc32SliceTables
+ * Tables for slicing-by-16. Table 0 is crc32tab. Table n is used for bytes
+ * that are followed by n more bytes in the same block.
+ */
+static const unsigned int (*Crc32SliceTables(void))[256]
+{
+	static unsigned int tables[16][256];
+	static bool initialized = [&]()
+	{
+		for (int i = 0; i < 256; i++)
+			tables[0][i] = crc32tab[i];
+
+		for (int n = 1; n < 16; n++)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				unsigned int crc = tables[n - 1][i];
+				tables[n][i] = (crc >> 8) ^ crc32tab[crc & 0xFF];
+			}
+		}
+		return true;
+	}();
+	(void)initialized;
+
+	return tables;
+}
+
+/*
+ * Crc32Slice16
+ * Table-based CRC32 that processes 16 bytes per iteration.
+ */
+static unsigned int Crc32Slice16(const unsigned char *data, unsigned int length, unsigned int crc)
+{
+	const unsigned int (*t)[256] = Crc32SliceTables();
+
+	while (length >= 16)
+	{
+		unsigned int a = (data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24)) ^ crc;
+
+		crc = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^
+			  t[13][(a >> 16) & 0xFF] ^ t[12][a >> 24] ^
+			  t[11][data[4]] ^ t[10][data[5]] ^ t[9][data[6]] ^ t[8][data[7]] ^
+			  t[7][data[8]] ^ t[6][data[9]] ^ t[5][data[10]] ^ t[4][data[11]] ^
+			  t[3][data[12]] ^ t[2][data[13]] ^ t[1][data[14]] ^ t[0][data[15]];
+
+		data += 16;
+		length -= 16;
+	}
+
+	while (length--)
+		crc = (crc >> 8) ^ crc32tab[(crc ^ *data++) & 0xFF];
+
+	return crc;
+}
+
+#ifdef CRC32_PCLMUL
+/*
+ * Crc32Pclmul
+ * Folds the data with carry-less multiplications, as described in "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel).
+ * The length must be a multiple of 16, and 64 or bigger.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int Crc32Pclmul(const unsigned char *data, unsigned int length, unsigned int crc)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163CD6124);
+	const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+	__m128i x5;
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+	data += 64;
+	length -= 64;
+
+	// Fold 4 blocks of 16 bytes in parallel
+	while (length >= 64)
+	{
+		__m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, y2), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, y3), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, y4), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+
+		data += 64;
+		length -= 64;
+	}
+
+	// Fold the 4 blocks into one
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// Fold the remaining blocks of 16 bytes
+	while (length >= 16)
+	{
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)), x5);
+
+		data += 16;
+		length -= 16;
+	}
+
+	// Fold 128 bits into 64 bits
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+/*
+ * HasPclmul
+ */
+static bool HasPclmul(void)
+{
+	static const bool supported = __builtin_cpu_supports("pclmul") &&
+								  __builtin_cpu_supports("sse4.1");
+	return supported;
+}
+#endif
+
+template <>
+unsigned int CalcCrc<unsigned int, crc32tab>(unsigned char *data, unsigned int length, unsigned int crc)
+{
+#ifdef CRC32_PCLMUL
+	if ((length >= 64) && HasPclmul())
+	{
+		unsigned int blocks_size = length & ~15;
+		crc = Crc32Pclmul(data, blocks_size, crc);
+		data += blocks_size;
+		length -= blocks_size;
+	}
+#endif
+
+	return Crc32Slice16(data, length, crc);
+}
@@ -7,6 +7,10 @@
 #ifndef __CRC_H
 #define __CRC_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
 //#include "little.h"		// FixCrc is not yet big endian compatible
 
 /*
@@ -14,13 +18,66 @@
  */
 extern unsigned short ccitt16tab[];
 extern unsigned short crc16tab[];
-extern unsigned long crc32tab[];
+extern unsigned int crc32tab[];
 
 /*
  * Defines
  */
 #define CRC_TEMPLATE	template <typename CrcType, CrcType *crcTable>
 
+#define CRC_SLICES		8		// bytes processed per iteration by the slicing kernels
+
+/*
+ * CcittSliceTables
+ * Tables for slicing-by-N of MSB-first CRCs, built on first use. Table n gives
+ * the effect of a byte followed by n zero bytes. Table 0 is crcTable.
+ */
+#define CcittSliceTables_	CcittSliceTables<CrcType, crcTable>
+CRC_TEMPLATE inline const CrcType (*CcittSliceTables(void))[256]
+{
+	static CrcType tables[CRC_SLICES][256];
+	static bool initialized = []()
+	{
+		for (int i=0; i<256; i++) tables[0][i] = crcTable[i];
+		for (int n=1; n<CRC_SLICES; n++)
+		{
+			for (int i=0; i<256; i++)
+			{
+				CrcType crc = tables[n-1][i];
+				tables[n][i] = (CrcType)(crc << 8) ^ crcTable[(crc >> (8*sizeof(CrcType)-8)) & 0xFF];
+			}
+		}
+		return true;
+	}();
+	(void)initialized;
+	return tables;
+}
+
+/*
+ * CrcSliceTables
+ * Same as CcittSliceTables, for reflected (LSB-first) CRCs.
+ */
+#define CrcSliceTables_		CrcSliceTables<CrcType, crcTable>
+CRC_TEMPLATE inline const CrcType (*CrcSliceTables(void))[256]
+{
+	static CrcType tables[CRC_SLICES][256];
+	static bool initialized = []()
+	{
+		for (int i=0; i<256; i++) tables[0][i] = crcTable[i];
+		for (int n=1; n<CRC_SLICES; n++)
+		{
+			for (int i=0; i<256; i++)
+			{
+				CrcType crc = tables[n-1][i];
+				tables[n][i] = (crc >> 8) ^ crcTable[crc & 0xFF];
+			}
+		}
+		return true;
+	}();
+	(void)initialized;
+	return tables;
+}
+
 /*
  * CalcCcitt
  * Does not perform final inversion.
@@ -29,6 +86,22 @@ extern unsigned long crc32tab[];
 #define CalcCcitt16	CalcCcitt<typeof(*ccitt16tab), ccitt16tab>
 CRC_TEMPLATE inline CrcType CalcCcitt(unsigned char *data, unsigned int length, CrcType crc = (CrcType)0)
 {
+	const CrcType (*tables)[256] = CcittSliceTables_();
+
+	while (length >= CRC_SLICES)
+	{
+		CrcType next = 0;
+		for (unsigned int k=0; k<CRC_SLICES; k++)
+		{
+			unsigned char b = data[k];
+			if (k < sizeof(CrcType)) b ^= crc >> (8*(sizeof(CrcType)-1-k));
+			next ^= tables[CRC_SLICES-1-k][b];
+		}
+		crc = next;
+		data += CRC_SLICES;
+		length -= CRC_SLICES;
+	}
+
 	for (unsigned int i=0; i<length; i++)
 	{
 		crc = (crc << 8) ^ crcTable[(crc >> 8) ^ data[i]];
@@ -45,6 +118,22 @@ CRC_TEMPLATE inline CrcType CalcCcitt(unsigned char *data, unsigned int length,
 #define CalcCrc32	CalcCrc<typeof(*crc32tab), crc32tab>
 CRC_TEMPLATE inline CrcType CalcCrc(unsigned char *data, unsigned int length, CrcType crc = (CrcType)~0)
 {
+	const CrcType (*tables)[256] = CrcSliceTables_();
+
+	while (length >= CRC_SLICES)
+	{
+		CrcType next = 0;
+		for (unsigned int k=0; k<CRC_SLICES; k++)
+		{
+			unsigned char b = data[k];
+			if (k < sizeof(CrcType)) b ^= crc >> (8*k);
+			next ^= tables[CRC_SLICES-1-k][b];
+		}
+		crc = next;
+		data += CRC_SLICES;
+		length -= CRC_SLICES;
+	}
+
 	for (unsigned int i=0; i<length; i++)
 	{
 		crc = (crc >> 8) ^ crcTable[(crc ^ data[i]) & 0xFF];
@@ -52,6 +141,10 @@ CRC_TEMPLATE inline CrcType CalcCrc(unsigned char *data, unsigned int length, Cr
 	return crc;
 }
 
+// CRC32 is accelerated with PCLMULQDQ if the CPU supports it, or uses
+// slicing-by-16 if it doesn't. See crc.cpp.
+template <> unsigned int CalcCrc<unsigned int, crc32tab>(unsigned char *data, unsigned int length, unsigned int crc);
+
 /*
  * FCalcCrc
  * Does not perform final inversion.
@@ -61,10 +154,19 @@ CRC_TEMPLATE inline CrcType CalcCrc(unsigned char *data, unsigned int length, Cr
 #define FCalcCrc32	FCalcCrc<typeof(*crc32tab), crc32tab>
 CRC_TEMPLATE inline CrcType FCalcCrc(FILE *f, unsigned int offset, unsigned int length, CrcType crc = (CrcType)~0)
 {
+	unsigned char buffer[16*1024];
+
 	fseek(f, offset, SEEK_SET);
-	for (unsigned int i=0; i<length; i++)
+	while (length > 0)
 	{
-		crc = (crc >> 8) ^ crcTable[(crc ^ fgetc(f)) & 0xFF];
+		unsigned int size = length > sizeof(buffer) ? sizeof(buffer) : length;
+		unsigned int read = fread(buffer, 1, size, f);
+
+		// Reading past the end of the file gives EOF, which acts as 0xFF
+		for (unsigned int i=read; i<size; i++) buffer[i] = 0xFF;
+
+		crc = CalcCrc_(buffer, size, crc);
+		length -= size;
 	}
 	return crc;
 }
@@ -87,8 +189,104 @@ CRC_TEMPLATE inline unsigned char RevCrc(unsigned char x, CrcType *value = 0)
 	return 0;
 }
 
+/*
+ * CrcMatrixTimes
+ * Multiplies a GF(2) matrix by a vector. Column n of the matrix is the effect
+ * of bit n of the CRC.
+ */
+template <typename CrcType> inline CrcType CrcMatrixTimes(const CrcType *matrix, CrcType vector)
+{
+	CrcType sum = 0;
+	for (int n=0; vector; n++, vector >>= 1)
+	{
+		if (vector & 1) sum ^= matrix[n];
+	}
+	return sum;
+}
+
+/*
+ * CrcMatrixSquare
+ */
+template <typename CrcType> inline void CrcMatrixSquare(CrcType *square, const CrcType *matrix)
+{
+	for (unsigned int n=0; n<8*sizeof(CrcType); n++)
+	{
+		square[n] = CrcMatrixTimes(matrix, matrix[n]);
+	}
+}
+
+/*
+ * CrcShift
+ * Returns the CRC after processing the specified number of zero bytes. It takes
+ * O(log(length)) matrix operations.
+ */
+#define CrcShift_	CrcShift<CrcType, crcTable>
+#define CrcShift16	CrcShift<typeof(*crc16tab), crc16tab>
+#define CrcShift32	CrcShift<typeof(*crc32tab), crc32tab>
+CRC_TEMPLATE inline CrcType CrcShift(CrcType crc, uint64_t length)
+{
+	// operator for one zero byte
+	CrcType matrix[8*sizeof(CrcType)];
+	for (unsigned int n=0; n<8*sizeof(CrcType); n++)
+	{
+		CrcType bit = (CrcType)1 << n;
+		matrix[n] = (bit >> 8) ^ crcTable[bit & 0xFF];
+	}
+
+	CrcType square[8*sizeof(CrcType)];
+	while (length)
+	{
+		if (length & 1) crc = CrcMatrixTimes(matrix, crc);
+		length >>= 1;
+		if (!length) break;
+		CrcMatrixSquare(square, matrix);
+		memcpy(matrix, square, sizeof(matrix));
+	}
+	return crc;
+}
+
+/*
+ * CrcCombine
+ * Returns the CRC of A followed by B from the CRCs of A and B, both calculated
+ * from initial_crc and without final inversion. B isn't needed, only its length.
+ * CRCs calculated from 0 can be combined by passing 0 as initial_crc.
+ */
+#define CrcCombine_	CrcCombine<CrcType, crcTable>
+#define CrcCombine16	CrcCombine<typeof(*crc16tab), crc16tab>
+#define CrcCombine32	CrcCombine<typeof(*crc32tab), crc32tab>
+CRC_TEMPLATE inline CrcType CrcCombine(CrcType crc_a, CrcType crc_b, uint64_t length_b, CrcType initial_crc = (CrcType)~0)
+{
+	return CrcShift_(crc_a ^ initial_crc, length_b) ^ crc_b;
+}
+
+/*
+ * CrcFixValue
+ * Returns the value to XOR to the CRC-sized fix field at fix_offset to cancel
+ * the change of CRC caused by XORing the data at patch_offset with data that has
+ * a CRC of patch_crc (calculated from 0). Only the distance between the patch
+ * and the fix is needed, not the data in between.
+ */
+#define CrcFixValue_	CrcFixValue<CrcType, crcTable>
+CRC_TEMPLATE inline CrcType CrcFixValue(CrcType patch_crc, unsigned int patch_offset, unsigned int patch_length, unsigned int fix_offset)
+{
+	// change of CRC right after the fix field
+	CrcType crc = CrcShift_(patch_crc, fix_offset + sizeof(CrcType) - patch_offset - patch_length);
+
+	// the CRC of the fix field alone must be the same, so undo the zero bytes that
+	// a CRC-sized value XORed with the initial CRC is equivalent to
+	for (unsigned int i=0; i<sizeof(CrcType); i++)
+	{
+		CrcType value;
+		unsigned char index = RevCrc_(crc >> (8*sizeof(CrcType)-8), &value);
+		crc = (CrcType)((crc ^ value) << 8) | index;
+	}
+	return crc;
+}
+
 /*
  * FixCrc
+ * Patches data and changes the fix field so that the CRC of the whole data
+ * stays the same.
  */
 #define FixCrc_		FixCrc<CrcType, crcTable>
 #define FixCrc16	FixCrc<typeof(*crc16tab), crc16tab>
@@ -98,39 +296,25 @@ CRC_TEMPLATE void FixCrc
 	unsigned char *data,				// data to be patched
 	unsigned int patch_offset, unsigned char *patch_data, unsigned int patch_length,	// patch data
 	unsigned int fix_offset = 0,		// position to write the fix. by default, it is immediately after the patched data
-	CrcType initial_crc = (CrcType)~0	// useful when manually calculating leading data
+	CrcType initial_crc = (CrcType)~0	// not needed, the fix doesn't depend on the leading data
 )
 {
+	(void)initial_crc;
 	if (!fix_offset) fix_offset = patch_offset + patch_length;
 
-	// calculate CRC after leading data
-	initial_crc = CalcCrc_(data, patch_offset, initial_crc);
-
-	// calculate CRC before fix
-	unsigned char buf[2*sizeof(CrcType)];
-	CrcType crc_before_fix = CalcCrc_(data + patch_offset, fix_offset - patch_offset);
-	*(CrcType *)(buf + 0) = crc_before_fix;
+	// CRC of the difference between the old and the new data
+	CrcType patch_crc = CalcCrc_(data + patch_offset, patch_length, 0) ^ CalcCrc_(patch_data, patch_length, 0);
 
 	// patch
 	memcpy(data + patch_offset, patch_data, patch_length);
 
-	// calculate CRC after unfixed
-	CrcType crc_after_unfix = CalcCrc_(data + patch_offset, fix_offset - patch_offset + sizeof(CrcType));
-	*(CrcType *)(buf + sizeof(CrcType)) = crc_after_unfix;
-
 	// fix it
-	for (int i=sizeof(CrcType); i>=1; i--)
-	{
-		CrcType value;
-		unsigned char index = RevCrc_(buf[i + sizeof(CrcType) - 1], &value);
-		*(CrcType *)(buf + i) ^= value;
-		buf[i - 1] ^= index;
-	}
-	memcpy(data + fix_offset, buf, sizeof(CrcType));
+	*(CrcType *)(data + fix_offset) ^= CrcFixValue_(patch_crc, patch_offset, patch_length, fix_offset);
 }
 
 /*
  * FFixCrc
+ * Same as FixCrc, for files. Only the patched data and the fix field are read.
  */
 #define FFixCrc_	FFixCrc<CrcType, crcTable>
 #define FFixCrc16	FFixCrc<typeof(*crc16tab), crc16tab>
@@ -140,37 +324,26 @@ CRC_TEMPLATE void FFixCrc
 	FILE *f,							// file to be patched
 	unsigned int patch_offset, unsigned char *patch_data, unsigned int patch_length,	// patch data
 	unsigned int fix_offset = 0,		// position to write the fix. by default, it is immediately after the patched data
-	CrcType initial_crc = (CrcType)~0	// useful when manually calculating leading data
+	CrcType initial_crc = (CrcType)~0	// not needed, the fix doesn't depend on the leading data
 )
 {
+	(void)initial_crc;
 	if (!fix_offset) fix_offset = patch_offset + patch_length;
 
-	// calculate CRC after leading data
-	initial_crc = FCalcCrc_(f, 0, patch_offset, initial_crc);
-
-	// calculate CRC before fix
-	unsigned char buf[2*sizeof(CrcType)];
-	CrcType crc_before_fix = FCalcCrc_(f, patch_offset, fix_offset - patch_offset);
-	*(CrcType *)(buf + 0) = crc_before_fix;
+	// CRC of the difference between the old and the new data
+	CrcType patch_crc = FCalcCrc_(f, patch_offset, patch_length, 0) ^ CalcCrc_(patch_data, patch_length, 0);
 
 	// patch
 	fseek(f, patch_offset, SEEK_SET);
 	fwrite(patch_data, 1, patch_length, f);
 
-	// calculate CRC after unfixed
-	CrcType crc_after_unfix = FCalcCrc_(f, patch_offset, fix_offset - patch_offset + sizeof(CrcType));
-	*(CrcType *)(buf + sizeof(CrcType)) = crc_after_unfix;
-
 	// fix it
-	for (int i=sizeof(CrcType); i>=1; i--)
-	{
-		CrcType value=0;
-		unsigned char index = RevCrc_(buf[i + sizeof(CrcType) - 1], &value);
-		*(CrcType *)(buf + i) ^= value;
-		buf[i - 1] ^= index;
-	}
+	CrcType fix = 0;
+	fseek(f, fix_offset, SEEK_SET);
+	if (fread(&fix, sizeof(CrcType), 1, f) != 1) fix = (CrcType)~0;	// past the end of the file
+	fix ^= CrcFixValue_(patch_crc, patch_offset, patch_length, fix_offset);
 	fseek(f, fix_offset, SEEK_SET);
-	fwrite(buf, sizeof(CrcType), 1, f);
+	fwrite(&fix, sizeof(CrcType), 1, f);
 }
 
 #endif	// __CRC_H
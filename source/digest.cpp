@@ -0,0 +1,205 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "ndstool.h"
+#include "crc.h"
+#include "digest.h"
+#include "fileio.h"
+#include "ndscreate.h"
+#include "sha1.h"
+
+/*
+ * IsCrcRegion
+ */
+static bool IsCrcRegion(int id)
+{
+	return id == DIGEST_SECURE_AREA_CRC;
+}
+
+/*
+ * RegionFeed
+ */
+static void RegionFeed(int id, const unsigned char *data, unsigned int size)
+{
+	DigestRegion &r = ctx->digest_regions[id];
+
+	if (IsCrcRegion(id))
+		r.crc = CalcCrc16((unsigned char *)data, size, r.crc);
+	else
+		sha1_hash(data, size, r.hmac);
+
+	r.next += size;
+}
+
+/*
+ * RegionFeedZeroes
+ */
+static void RegionFeedZeroes(int id, unsigned int size)
+{
+	static const unsigned char zeroes[4096] = { 0 };
+
+	while (size > 0)
+	{
+		unsigned int size2 = std::min<unsigned int>(size, sizeof(zeroes));
+		RegionFeed(id, zeroes, size2);
+		size -= size2;
+	}
+}
+
+/*
+ * RegionFinish
+ * Reads from the ROM the bytes of the region that haven't been written with
+ * RomWrite(), if any. Returns false if they can't be read.
+ */
+static bool RegionFinish(int id)
+{
+	DigestRegion &r = ctx->digest_regions[id];
+
+	if (!r.active || !r.valid)
+		return false;
+
+	if (r.next == r.end)
+		return true;
+
+	if (fflush(ctx->digest_file) != 0)
+		return false;
+
+	unsigned char buffer[4096];
+	while (r.next < r.end)
+	{
+		unsigned int size = std::min<unsigned int>(r.end - r.next, sizeof(buffer));
+		if (!ReadAt(fileno(ctx->digest_file), buffer, size, r.next))
+			return false;
+
+		RegionFeed(id, buffer, size);
+	}
+
+	return true;
+}
+
+void DigestBegin(FILE *f)
+{
+	ctx->digest_file = f;
+
+	for (int i = 0; i < DIGEST_REGION_COUNT; i++)
+		ctx->digest_regions[i].active = false;
+}
+
+void DigestEnd(void)
+{
+	DigestBegin(NULL);
+}
+
+void DigestRegionStart(int id, unsigned int offset, unsigned int end)
+{
+	if (!ctx->digest_file)
+		return;
+
+	DigestRegion &r = ctx->digest_regions[id];
+	r.active = true;
+	r.valid = true;
+	r.start = offset;
+	r.end = end;
+	r.next = offset;
+
+	if (IsCrcRegion(id))
+		r.crc = (unsigned short)~0;
+	else
+		Sha1HmacBegin(r.hmac);
+}
+
+void DigestRegionSetEnd(int id, unsigned int end)
+{
+	DigestRegion &r = ctx->digest_regions[id];
+	r.end = end;
+
+	// More data than the size of the region has been received
+	if (r.next > end)
+		r.valid = false;
+}
+
+void DigestTouch(unsigned int offset, unsigned int size)
+{
+	uint64_t end = (uint64_t)offset + size;
+
+	for (int i = 0; i < DIGEST_REGION_COUNT; i++)
+	{
+		DigestRegion &r = ctx->digest_regions[i];
+		if (r.active && (offset < r.end) && (end > r.start))
+			r.valid = false;
+	}
+}
+
+size_t RomWrite(const void *data, size_t size, FILE *f)
+{
+	if ((f == ctx->digest_file) && (f != NULL) && (size > 0))
+	{
+		long pos = ftell(f);
+
+		for (int i = 0; i < DIGEST_REGION_COUNT; i++)
+		{
+			DigestRegion &r = ctx->digest_regions[i];
+			if (!r.active || !r.valid)
+				continue;
+
+			if (pos < 0)
+			{
+				r.valid = false;
+				continue;
+			}
+
+			uint64_t lo = std::max<uint64_t>(pos, r.start);
+			uint64_t hi = std::min<uint64_t>(pos + size, r.end);
+			if (lo >= hi)
+				continue;
+
+			if (lo < r.next)
+			{
+				// This part of the region has already been received
+				r.valid = false;
+				continue;
+			}
+
+			// Skipped bytes read as zeroes
+			RegionFeedZeroes(i, lo - r.next);
+			RegionFeed(i, (const unsigned char *)data + (lo - pos), hi - lo);
+		}
+	}
+
+	return fwrite(data, 1, size, f);
+}
+
+int RomPutc(int c, FILE *f)
+{
+	unsigned char value = c;
+	if (RomWrite(&value, 1, f) != 1)
+		return EOF;
+
+	return value;
+}
+
+void DigestGetHmac(int id, u8 output[20], unsigned int offset, unsigned int size)
+{
+	DigestRegion &r = ctx->digest_regions[id];
+
+	if ((r.start == offset) && (r.end == offset + size) && RegionFinish(id))
+	{
+		sha1_ctx cx[1];
+		memcpy(cx, r.hmac, sizeof(cx));
+		Sha1HmacEnd(output, cx);
+		return;
+	}
+
+	Sha1Hmac(output, ctx->fNDS, offset, size);
+}
+
+unsigned short DigestGetCrc16(int id, unsigned int offset, unsigned int size)
+{
+	DigestRegion &r = ctx->digest_regions[id];
+
+	if ((r.start == offset) && (r.end == offset + size) && RegionFinish(id))
+		return r.crc;
+
+	return FCalcCrc16(ctx->fNDS, offset, size);
+}
@@ -0,0 +1,60 @@
+
+#pragma once
+
+#include <stdio.h>
+
+#include "sha1.h"
+#include "types.h"
+
+// Digests of regions of the ROM that are calculated while the ROM is being
+// created, as the data is written, so that the regions don't need to be read
+// back from the ROM afterwards.
+//
+// All data written to the ROM has to be written with RomWrite() or RomPutc().
+// Regions must be written in order. Gaps left with fseek() are considered to be
+// zeroes. If any byte of a region is written out of order, the region is
+// calculated from the file when the digest is requested.
+
+enum
+{
+	DIGEST_HMAC_ARM9,
+	DIGEST_HMAC_ARM7,
+	DIGEST_HMAC_ICON_TITLE,
+	DIGEST_HMAC_ARM9I,
+	DIGEST_HMAC_ARM7I,
+	DIGEST_SECURE_AREA_CRC,
+
+	DIGEST_REGION_COUNT
+};
+
+struct DigestRegion
+{
+	bool active;			// the region has been started
+	bool valid;				// all data has been received in order
+	unsigned int start;
+	unsigned int end;
+	unsigned int next;		// offset of the next byte that is expected
+	sha1_ctx hmac[1];		// used by HMAC regions
+	unsigned short crc;		// used by CRC regions
+};
+
+// Starts tracking writes to a file. All regions are cleared.
+void DigestBegin(FILE *f);
+void DigestEnd(void);
+
+// Starts a region at the specified offset. If the end isn't known yet, it can
+// be provided later with DigestRegionSetEnd().
+void DigestRegionStart(int id, unsigned int offset, unsigned int end = ~0U);
+void DigestRegionSetEnd(int id, unsigned int end);
+
+// Marks a range of the ROM as written by other means than RomWrite(). Regions
+// that overlap with it are invalidated.
+void DigestTouch(unsigned int offset, unsigned int size);
+
+size_t RomWrite(const void *data, size_t size, FILE *f);
+int RomPutc(int c, FILE *f);
+
+// They return the digest of the specified range of the ROM. If the range isn't
+// the one tracked by the region, the digest is calculated from the file.
+void DigestGetHmac(int id, u8 output[20], unsigned int offset, unsigned int size);
+unsigned short DigestGetCrc16(int id, unsigned int offset, unsigned int size);
@@ -25,17 +25,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <vector>
+
 /* Project header files. */
+#include "digest.h"
 #include "elf.h"
+#include "fileio.h"
+#include "log.h"
+#include "ndscontext.h"
 
 /* Simple assertion macro. */
-#define die(msg) \
-	do {\
-		fprintf(stderr, "%s", msg);\
-		exit(EXIT_FAILURE);\
-	} while(0)
-
-extern FILE *fNDS;
+#define die(msg) LogFatal("%s", msg)
 
 /* Function:    void ElfWriteData(size_t n, FILE *fp)
  * Description: Writes data from one file to another.
@@ -53,7 +53,7 @@ void ElfWriteData(size_t n, FILE *in, FILE *out) {
 		if (read != cur_size)
 			die("failed to read from input file\n");
 
-		size_t written = fwrite(buffer, 1, cur_size, out);
+		size_t written = RomWrite(buffer, cur_size, out);
 		if (written != cur_size)
 			die("failed to write to file\n");
 
@@ -65,10 +65,10 @@ void ElfWriteData(size_t n, FILE *in, FILE *out) {
  * Description: Read in the ELF header, and populate a list of program headers.
  * Parameters:  FILE        *fp,   the file pointer to read from.
  *              Elf32_Ehdr  *hdr,  a pointer to a header to fill.
- *              Elf32_Phdr **phdr, a pointer to pointer to place the list of
- *                                 program headers at.
+ *              std::vector<Elf32_Phdr> &phdr, the list of program headers
+ *                                 to fill.
  */
-void ElfReadHdr(FILE *fp, Elf32_Ehdr *hdr, Elf32_Phdr **phdr) {
+void ElfReadHdr(FILE *fp, Elf32_Ehdr *hdr, std::vector<Elf32_Phdr> &phdr) {
 	/* Read in ELF header. */
 	if(fread(hdr, 1, sizeof(Elf32_Ehdr), fp) != sizeof(Elf32_Ehdr))
 		die("failed to read ELF header\n");
@@ -101,11 +101,8 @@ void ElfReadHdr(FILE *fp, Elf32_Ehdr *hdr, Elf32_Phdr **phdr) {
 	if(fseek(fp, hdr->e_phoff, SEEK_SET))
 		die("failed to seek to program header table\n");
   
-	*phdr = (Elf32_Phdr*)malloc(sizeof(Elf32_Phdr) * hdr->e_phnum);
-	if(!*phdr)
-		die("failed to allocate memory\n");
-  
-	if(fread(*phdr, sizeof(Elf32_Phdr), hdr->e_phnum, fp) != hdr->e_phnum)
+	phdr.resize(hdr->e_phnum);
+	if(fread(phdr.data(), sizeof(Elf32_Phdr), hdr->e_phnum, fp) != hdr->e_phnum)
 		die("failed to read program header table\n");
 }
 
@@ -126,14 +123,16 @@ int CopyFromElf(char *elfFilename,         unsigned int *entry,
 {
 	FILE        *in;
 	Elf32_Ehdr   header;
-	Elf32_Phdr  *p_headers;
+	std::vector<Elf32_Phdr> p_headers;
 	unsigned int i;
 	unsigned int expected_address = 0;
 
 	*ram_address = 0;
 
 	/* Open ELF file. */
-	in = fopen(elfFilename, "rb");
+	/* It's closed when this function returns or a fatal error is thrown. */
+	ScopedFile file(fopen(elfFilename, "rb"));
+	in = file.Get();
 	if(!in) {
 		char errormsg[512];
 		snprintf(errormsg,512,"failed to open input file: '%s'\n",elfFilename);
@@ -141,7 +140,7 @@ int CopyFromElf(char *elfFilename,         unsigned int *entry,
 	}
   
 	/* Read in header. */
-	ElfReadHdr(in, &header, &p_headers);
+	ElfReadHdr(in, &header, p_headers);
   
 	if(entry) *entry = header.e_entry;
 	*size  = 0;
@@ -181,15 +180,11 @@ int CopyFromElf(char *elfFilename,         unsigned int *entry,
 			die("failed to seek to program header segment\n");
 
 		/* Write file image. */
-		ElfWriteData(p_headers[i].p_filesz, in, fNDS);
+		ElfWriteData(p_headers[i].p_filesz, in, ctx->fNDS);
 
 		*size += p_headers[i].p_filesz;
 		expected_address = p_headers[i].p_paddr + p_headers[i].p_filesz;
 	}
   
-	/* Clean up. */
-	free(p_headers);
-	fclose(in);
-  
 	return 0;
 }
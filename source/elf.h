@@ -26,6 +26,8 @@
 /* Expose fixed-width integral types. */
 #include <stdint.h>
 
+#include <vector>
+
 #include "little.h"
 
 /* Types for use within ELF. */
@@ -158,7 +160,7 @@ int  CopyFromElf(char *elfFilename,
                  unsigned int *size,
                  unsigned int *wram_address,
                  bool is_twl);
-void ElfReadHdr(FILE *fp, Elf32_Ehdr *hdr, Elf32_Phdr **phdr);
+void ElfReadHdr(FILE *fp, Elf32_Ehdr *hdr, std::vector<Elf32_Phdr> &phdr);
 void ElfWriteData(size_t n, FILE *in, FILE *out);
 void ElfWriteZeros(size_t n, FILE *fp);
 
@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <mutex>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "fileio.h"
+
+#ifdef _WIN32
+// There is no pread()/pwrite() in MinGW, so the file position needs to be
+// protected while it's moved around.
+static std::mutex fileio_mutex;
+#endif
+
+bool ReadAt(int fd, void *buffer, size_t size, uint64_t offset)
+{
+	unsigned char *p = (unsigned char *)buffer;
+
+#ifdef _WIN32
+	std::lock_guard<std::mutex> lock(fileio_mutex);
+
+	if (_lseeki64(fd, offset, SEEK_SET) == -1)
+		return false;
+#endif
+
+	while (size > 0)
+	{
+#ifdef _WIN32
+		ssize_t r = read(fd, p, size);
+#else
+		ssize_t r = pread(fd, p, size, offset);
+#endif
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (r == 0) // End of file
+			return false;
+
+		p += r;
+		size -= r;
+		offset += r;
+	}
+
+	return true;
+}
+
+bool WriteAt(int fd, const void *buffer, size_t size, uint64_t offset)
+{
+	const unsigned char *p = (const unsigned char *)buffer;
+
+#ifdef _WIN32
+	std::lock_guard<std::mutex> lock(fileio_mutex);
+
+	if (_lseeki64(fd, offset, SEEK_SET) == -1)
+		return false;
+#endif
+
+	while (size > 0)
+	{
+#ifdef _WIN32
+		ssize_t r = write(fd, p, size);
+#else
+		ssize_t r = pwrite(fd, p, size, offset);
+#endif
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += r;
+		size -= r;
+		offset += r;
+	}
+
+	return true;
+}
+
+/*
+ * CopyFileDataBuffered
+ * Portable fallback for CopyFileData().
+ */
+static bool CopyFileDataBuffered(int fd_in, uint64_t in_offset, int fd_out,
+								 uint64_t out_offset, uint64_t size)
+{
+	const size_t sizeof_copybuf = 256 * 1024;
+	thread_local std::vector<unsigned char> copybuf(sizeof_copybuf);
+
+	while (size > 0)
+	{
+		size_t size2 = (size >= sizeof_copybuf) ? sizeof_copybuf : size;
+
+		if (!ReadAt(fd_in, copybuf.data(), size2, in_offset))
+			return false;
+
+		if (!WriteAt(fd_out, copybuf.data(), size2, out_offset))
+			return false;
+
+		in_offset += size2;
+		out_offset += size2;
+		size -= size2;
+	}
+
+	return true;
+}
+
+#ifdef __linux__
+/*
+ * CloneFileData
+ * Shares as many blocks as possible between both files. Returns the number of
+ * bytes that have been cloned, which may be 0.
+ */
+static uint64_t CloneFileData(int fd_in, uint64_t in_offset, int fd_out,
+							  uint64_t out_offset, uint64_t size)
+{
+	struct stat st;
+	if (fstat(fd_out, &st) != 0 || st.st_blksize <= 0)
+		return 0;
+
+	uint64_t block_size = st.st_blksize;
+	if ((in_offset % block_size) || (out_offset % block_size))
+		return 0;
+
+	// Only whole blocks can be cloned. The rest needs to be copied.
+	uint64_t clone_size = size - (size % block_size);
+	if (clone_size == 0)
+		return 0;
+
+	struct file_clone_range range;
+	range.src_fd = fd_in;
+	range.src_offset = in_offset;
+	range.src_length = clone_size;
+	range.dest_offset = out_offset;
+
+	if (ioctl(fd_out, FICLONERANGE, &range) != 0)
+		return 0;
+
+	return clone_size;
+}
+#endif
+
+bool CopyFileData(int fd_in, uint64_t in_offset, int fd_out, uint64_t out_offset,
+				  uint64_t size)
+{
+#ifdef __linux__
+	uint64_t cloned = CloneFileData(fd_in, in_offset, fd_out, out_offset, size);
+	in_offset += cloned;
+	out_offset += cloned;
+	size -= cloned;
+
+	while (size > 0)
+	{
+		off64_t off_in = in_offset;
+		off64_t off_out = out_offset;
+		size_t size2 = (size >= (1U << 30)) ? (1U << 30) : size;
+		ssize_t r = copy_file_range(fd_in, &off_in, fd_out, &off_out, size2, 0);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// The kernel or the filesystem doesn't support it (or not between
+			// these two files). Copy the rest of the data manually.
+			break;
+		}
+		if (r == 0) // End of file
+			return false;
+
+		in_offset += r;
+		out_offset += r;
+		size -= r;
+	}
+
+	if (size == 0)
+		return true;
+#endif
+
+	return CopyFileDataBuffered(fd_in, in_offset, fd_out, out_offset, size);
+}
+
+bool CopyFileDataToStream(int fd_in, uint64_t in_offset, int fd_out, uint64_t size)
+{
+#ifdef __linux__
+	while (size > 0)
+	{
+		off_t off_in = in_offset;
+		size_t size2 = (size >= (1U << 30)) ? (1U << 30) : size;
+		ssize_t r = sendfile(fd_out, fd_in, &off_in, size2);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// Not supported between these two files. Copy the rest of the data
+			// manually.
+			break;
+		}
+		if (r == 0) // End of file
+			return false;
+
+		in_offset += r;
+		size -= r;
+	}
+
+	if (size == 0)
+		return true;
+#endif
+
+	const size_t sizeof_copybuf = 256 * 1024;
+	thread_local std::vector<unsigned char> copybuf(sizeof_copybuf);
+
+	while (size > 0)
+	{
+		size_t size2 = (size >= sizeof_copybuf) ? sizeof_copybuf : size;
+
+		if (!ReadAt(fd_in, copybuf.data(), size2, in_offset))
+			return false;
+
+		const unsigned char *p = copybuf.data();
+		size_t left = size2;
+		while (left > 0)
+		{
+			ssize_t r = write(fd_out, p, left);
+			if (r < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+
+			p += r;
+			left -= r;
+		}
+
+		in_offset += size2;
+		size -= size2;
+	}
+
+	return true;
+}
+
+uint64_t GetFileMtime(const struct stat &st)
+{
+#if defined(__APPLE__)
+	return (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return (uint64_t)st.st_mtime * 1000000000;
+#else
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+bool ScopedFd::Close(void)
+{
+	if (fd < 0)
+		return true;
+
+	int r = close(fd);
+	fd = -1;
+	return r == 0;
+}
+
+bool ScopedFile::Close(void)
+{
+	if (!f)
+		return true;
+
+	int r = fclose(f);
+	f = NULL;
+	return r == 0;
+}
@@ -0,0 +1,76 @@
+
+#pragma once
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Positional I/O helpers. They don't modify the file position of the
+// descriptor, so they can be used by several threads on the same descriptor at
+// the same time. They return false if not all the data could be transferred.
+bool ReadAt(int fd, void *buffer, size_t size, uint64_t offset);
+bool WriteAt(int fd, const void *buffer, size_t size, uint64_t offset);
+
+// Copies data between two descriptors without moving their file positions.
+// When the host supports it, the data doesn't go through user space. On Linux,
+// filesystems with reflink support (like btrfs or XFS) share the extents of
+// both files if the offsets are aligned to the block size of the filesystem.
+bool CopyFileData(int fd_in, uint64_t in_offset, int fd_out, uint64_t out_offset,
+				  uint64_t size);
+
+// Copies data from a file to a descriptor that may not be seekable, like a
+// pipe, at its current position.
+bool CopyFileDataToStream(int fd_in, uint64_t in_offset, int fd_out, uint64_t size);
+
+// Returns the modification time of a file in nanoseconds, or in seconds
+// multiplied by 1000000000 if the host doesn't provide more precision.
+uint64_t GetFileMtime(const struct stat &st);
+
+// Owners of a file descriptor and of a stdio file that close them when they go
+// out of scope. Fatal errors are thrown as exceptions, so this makes sure that
+// the files opened by an operation that fails (or by its worker threads) aren't
+// leaked by programs that use libndstool.
+class ScopedFd
+{
+public:
+	explicit ScopedFd(int fd) : fd(fd) {}
+	~ScopedFd() { Close(); }
+
+	ScopedFd(const ScopedFd &) = delete;
+	ScopedFd &operator=(const ScopedFd &) = delete;
+
+	int Get(void) const { return fd; }
+
+	// Gives up the ownership of the descriptor without closing it
+	int Release(void) { int r = fd; fd = -1; return r; }
+
+	// Returns false if close() fails, which may mean that data wasn't written
+	bool Close(void);
+
+private:
+	int fd;
+};
+
+class ScopedFile
+{
+public:
+	explicit ScopedFile(FILE *f) : f(f) {}
+	~ScopedFile() { Close(); }
+
+	ScopedFile(const ScopedFile &) = delete;
+	ScopedFile &operator=(const ScopedFile &) = delete;
+
+	FILE *Get(void) const { return f; }
+
+	// Returns false if fclose() fails, which may mean that data wasn't written
+	bool Close(void);
+
+private:
+	FILE *f;
+};
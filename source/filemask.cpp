@@ -0,0 +1,216 @@
+#include <string.h>
+
+#include "filemask.h"
+
+/*
+ * MatchChunk
+ * Compares a part of a string with a chunk of a mask that may contain '?'.
+ */
+static bool MatchChunk(const char *str, const std::string &chunk)
+{
+	for (size_t i = 0; i < chunk.size(); i++)
+	{
+		if ((chunk[i] != '?') && (chunk[i] != str[i]))
+			return false;
+	}
+	return true;
+}
+
+void FileMaskSet::Add(const char *mask)
+{
+	Mask m;
+	m.negate = (mask[0] == '!');
+	if (m.negate)
+		mask++;
+
+	// Masks without '/' only look at the name of the file
+	std::string pattern = mask;
+	if (pattern.find('/') == std::string::npos)
+		pattern = "**/" + pattern;
+	else if (pattern[0] == '/')
+		pattern.erase(0, 1);
+
+	// A trailing '/' or "**" selects everything inside the directory
+	if (!pattern.empty() && (pattern.back() == '/'))
+		pattern += "**";
+	if ((pattern == "**") || ((pattern.size() > 2) && (pattern.compare(pattern.size() - 3, 3, "/**") == 0)))
+		pattern += "/*";
+
+	m.any_dirs = false;
+	size_t group_start = 0;
+	size_t start = 0;
+	while (1)
+	{
+		size_t end = pattern.find('/', start);
+		if (end == std::string::npos)
+			end = pattern.size();
+
+		std::string str = pattern.substr(start, end - start);
+		if (str == "**")
+		{
+			m.any_dirs = true;
+			m.groups.push_back({ group_start, m.components.size() - group_start });
+			group_start = m.components.size();
+		}
+		else
+		{
+			Component c;
+			c.has_star = false;
+			c.chunks.push_back("");
+			for (char ch : str)
+			{
+				if (ch == '*')
+				{
+					if (!c.has_star || !c.chunks.back().empty())
+						c.chunks.push_back("");
+					c.has_star = true;
+				}
+				else
+				{
+					c.chunks.back() += ch;
+				}
+			}
+			m.components.push_back(c);
+		}
+
+		if (end == pattern.size())
+			break;
+		start = end + 1;
+	}
+	m.groups.push_back({ group_start, m.components.size() - group_start });
+
+	if (!m.negate)
+		has_include = true;
+
+	masks.push_back(m);
+}
+
+/*
+ * Component::Match
+ * The first and last chunks are compared with the start and end of the string.
+ * The chunks in the middle are searched from left to right, which always finds
+ * a match if there is one.
+ */
+bool FileMaskSet::Component::Match(const char *str, size_t length) const
+{
+	const std::string &first = chunks.front();
+
+	if (!has_star)
+		return (length == first.size()) && MatchChunk(str, first);
+
+	const std::string &last = chunks.back();
+	if (length < first.size() + last.size())
+		return false;
+	if (!MatchChunk(str, first) || !MatchChunk(str + length - last.size(), last))
+		return false;
+
+	size_t pos = first.size();
+	size_t end = length - last.size();
+	for (size_t i = 1; i + 1 < chunks.size(); i++)
+	{
+		const std::string &chunk = chunks[i];
+		while (1)
+		{
+			if (pos + chunk.size() > end)
+				return false;
+			if (MatchChunk(str + pos, chunk))
+				break;
+			pos++;
+		}
+		pos += chunk.size();
+	}
+
+	return true;
+}
+
+/*
+ * MatchGroup
+ * Compares a group of components of a mask with the path, starting at
+ * component "pos" of the path.
+ */
+bool FileMaskSet::MatchGroup(const Mask &mask, size_t group, const PathComponents &path, size_t pos)
+{
+	size_t first = mask.groups[group].first;
+	size_t count = mask.groups[group].second;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!mask.components[first + i].Match(path[pos + i].first, path[pos + i].second))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * MatchMask
+ * Same as Component::Match(), but with groups of components instead of chunks
+ * and "**" instead of '*'.
+ */
+bool FileMaskSet::MatchMask(const Mask &mask, const PathComponents &path)
+{
+	size_t first = mask.groups.front().second;
+
+	if (!mask.any_dirs)
+		return (path.size() == first) && MatchGroup(mask, 0, path, 0);
+
+	size_t last_group = mask.groups.size() - 1;
+	size_t last = mask.groups.back().second;
+	if (path.size() < first + last)
+		return false;
+	if (!MatchGroup(mask, 0, path, 0) || !MatchGroup(mask, last_group, path, path.size() - last))
+		return false;
+
+	size_t pos = first;
+	size_t end = path.size() - last;
+	for (size_t i = 1; i < last_group; i++)
+	{
+		size_t count = mask.groups[i].second;
+		while (1)
+		{
+			if (pos + count > end)
+				return false;
+			if (MatchGroup(mask, i, path, pos))
+				break;
+			pos++;
+		}
+		pos += count;
+	}
+
+	return true;
+}
+
+bool FileMaskSet::Match(const char *path) const
+{
+	if (masks.empty())
+		return true;
+
+	PathComponents components;
+	while (*path)
+	{
+		if (*path == '/')
+		{
+			path++;
+			continue;
+		}
+
+		size_t length = strcspn(path, "/");
+		components.push_back({ path, length });
+		path += length;
+	}
+
+	bool included = !has_include;
+	for (const Mask &mask : masks)
+	{
+		if (mask.negate)
+		{
+			if (MatchMask(mask, components))
+				return false;
+		}
+		else if (!included)
+		{
+			included = MatchMask(mask, components);
+		}
+	}
+
+	return included;
+}
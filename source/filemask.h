@@ -0,0 +1,62 @@
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Set of wildcard masks used to select NitroFS files (-w).
+//
+// '*' matches any number of characters and '?' matches one character, but
+// neither of them matches '/'. A mask that doesn't contain '/' is compared
+// against the name of the file only. Masks that contain '/' are compared
+// against the full path, starting at the root of the filesystem, and "**"
+// matches any number of directories ("**/*.bin", "data/**/a?.txt"). A mask
+// that starts with '!' excludes the files that match it.
+//
+// A file is selected if it matches any of the masks that aren't negated (or if
+// there are no masks of that kind), and it doesn't match any negated mask.
+//
+// Masks are compiled when they are added. Matching doesn't backtrack, so the
+// time it takes is proportional to the size of the path and masks.
+
+class FileMaskSet
+{
+public:
+	void Add(const char *mask);
+	bool Empty() const { return masks.empty(); }
+
+	// path is the full path of the file, starting with '/'
+	bool Match(const char *path) const;
+
+private:
+	// Part of a mask between two '/'. The pattern is split in the literal
+	// parts that are between '*' characters.
+	struct Component
+	{
+		bool has_star;
+		std::vector<std::string> chunks;	// first and last are anchored
+
+		bool Match(const char *str, size_t length) const;
+	};
+
+	// The components of a mask are split in groups at each "**". The first
+	// group is anchored at the start of the path and the last one at the end.
+	struct Mask
+	{
+		bool negate;
+		bool any_dirs;				// the mask contains "**"
+		std::vector<Component> components;
+		std::vector<std::pair<size_t, size_t>> groups;	// first component, count
+	};
+
+	std::vector<Mask> masks;
+	bool has_include = false;
+
+	typedef std::vector<std::pair<const char *, size_t>> PathComponents;
+
+	static bool MatchGroup(const Mask &mask, size_t group, const PathComponents &path, size_t pos);
+	static bool MatchMask(const Mask &mask, const PathComponents &path);
+};
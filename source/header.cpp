@@ -1,5 +1,9 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 #include "ndstool.h"
 #include "banner.h"
 #include "sha1.h"
@@ -8,6 +12,9 @@
 #include "log.h"
 #include "ndscreate.h"
 #include "utf16.h"
+#include "fileio.h"
+#include "parallel.h"
+#include "rsa.h"
 
 /*
  * Data
@@ -62,29 +69,57 @@ unsigned short CalcLogoCRC(Header &header)
 
 /*
  * DetectRomType
+ * Finds the type of a ROM from its header and its secure area, which is read
+ * from the descriptor. Returns false if the ROM is too small to contain it.
  */
-int DetectRomType()
+bool DetectRomType(int fd, Header &header, int &romType)
 {
-	if (fseek(fNDS, 0x4000, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek header offset (1)\n", __func__);
+	if (header.arm9_rom_offset < 0x4000)
+	{
+		romType = ROMTYPE_HOMEBREW;
+		return true;
+	}
 
 	unsigned int data[3];
-	if (fread(data, 1, sizeof(data), fNDS) != sizeof(data))
-		LogFatal("%s: Failed to read ROM type\n", __func__);
+	if (!ReadAt(fd, data, sizeof(data), 0x4000))
+		return false;
 
-	if (header.arm9_rom_offset < 0x4000) return ROMTYPE_HOMEBREW;
-	if (data[0] == 0x00000000 && data[1] == 0x00000000) return ROMTYPE_MULTIBOOT;
-	if (data[0] == 0xE7FFDEFF && data[1] == 0xE7FFDEFF) return ROMTYPE_NDSDUMPED;
+	if (data[0] == 0x00000000 && data[1] == 0x00000000)
+	{
+		romType = ROMTYPE_MULTIBOOT;
+		return true;
+	}
+	if (data[0] == 0xE7FFDEFF && data[1] == 0xE7FFDEFF)
+	{
+		romType = ROMTYPE_NDSDUMPED;
+		return true;
+	}
 
-	if (fseek(fNDS, 0x200, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek header offset (2)\n", __func__);
+	unsigned char buf[0x4000 - 0x200];
+	if (!ReadAt(fd, buf, sizeof(buf), 0x200))
+		return false;
 
-	for (int i=0x200; i<0x4000; i++)
+	romType = ROMTYPE_ENCRSECURE;
+	for (size_t i = 0; i < sizeof(buf); i++)
 	{
-		if (fgetc(fNDS))
-			return ROMTYPE_MASKROM;	// found something odd ;)
+		if (buf[i])
+		{
+			romType = ROMTYPE_MASKROM;	// found something odd ;)
+			break;
+		}
 	}
-	return ROMTYPE_ENCRSECURE;
+	return true;
+}
+
+/*
+ * DetectRomType
+ */
+int DetectRomType()
+{
+	int romType;
+	if (!DetectRomType(fileno(ctx->fNDS), ctx->header, romType))
+		LogFatal("%s: Failed to read ROM type\n", __func__);
+	return romType;
 }
 
 /*
@@ -92,11 +127,11 @@ int DetectRomType()
  */
 unsigned short CalcSecureAreaCRC()
 {
-	if (fseek(fNDS, 0x4000, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, 0x4000, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek secure area\n", __func__);
 
 	unsigned char data[0x4000];
-	if (fread(data, 1, 0x4000, fNDS) != 0x4000)
+	if (fread(data, 1, 0x4000, ctx->fNDS) != 0x4000)
 		LogFatal("%s: Failed to read data\n", __func__);
 
 	return CalcCrc16(data, 0x4000);
@@ -107,11 +142,11 @@ unsigned short CalcSecureAreaCRC()
  */
 unsigned short CalcSecurityDataCRC()
 {
-	if (fseek(fNDS, 0x1000, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, 0x1000, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek security data\n", __func__);
 
 	unsigned char data[0x2000];
-	if (fread(data, 1, 0x2000, fNDS) != 0x2000)
+	if (fread(data, 1, 0x2000, ctx->fNDS) != 0x2000)
 		LogFatal("%s: Failed to read data\n", __func__);
 
 	return CalcCrc16(data, 0x2000);
@@ -122,11 +157,11 @@ unsigned short CalcSecurityDataCRC()
  */
 unsigned short CalcSegment3CRC()
 {
-	if (fseek(fNDS, 0x3000, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, 0x3000, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek segment 3\n", __func__);
 
 	unsigned char data[0x1000];
-	if (fread(data, 1, 0x1000, fNDS) != 0x1000)
+	if (fread(data, 1, 0x1000, ctx->fNDS) != 0x1000)
 		LogFatal("%s: Failed to read data\n", __func__);
 
 	for (int i=0; i<0x1000; i+=2)	// swap bytes
@@ -136,44 +171,70 @@ unsigned short CalcSegment3CRC()
 	return CalcCcitt16(data, 0x1000);	// why would they use CRC16-CCITT ?
 }
 
+/*
+ * SignHeader
+ * Fills the RSA signature of a DSi header. If no private key has been provided
+ * with -rsakey, a dummy signature that no$gba accepts is used, which is just
+ * the padded SHA1 of the header.
+ */
+void SignHeader(Header &header)
+{
+	unsigned char block[sizeof(header.rsa_signature)];
+	memset(block, 0xFF, sizeof(block));
+	block[0x00] = 0;
+	block[0x01] = 1;
+	block[0x6B] = 0;
+	sha1(&block[0x6C], (const unsigned char*)&header, 0xE00);
+
+	if (!ctx->rsakeyfilename)
+	{
+		memcpy(header.rsa_signature, block, sizeof(block));
+		return;
+	}
+
+	RsaKey key;
+	if (!LoadRsaKey(ctx->rsakeyfilename, key))
+		LogFatal("Cannot load RSA key '%s'.\n", ctx->rsakeyfilename);
+
+	if ((key.modulus.size() != sizeof(block)) || key.private_exponent.empty())
+		LogFatal("%s: The RSA key must be a 1024-bit private key\n", __func__);
+
+	RsaPrivate(header.rsa_signature, block, key);
+}
+
 /*
  * FixHeaderChecksums
  */
 void FixHeaderChecksums(char *ndsfilename)
 {
-	fNDS = fopen(ndsfilename, "r+b");
-	if (!fNDS)
+	ctx->fNDS = fopen(ndsfilename, "r+b");
+	if (!ctx->fNDS)
 		LogFatal("Cannot open file '%s'.\n", ndsfilename);
 
-	unsigned int header_size = FullyReadHeader(fNDS, header);
+	unsigned int header_size = FullyReadHeader(ctx->fNDS, ctx->header);
 
-	header.secure_area_crc = CalcSecureAreaCRC();
-	header.logo_crc = CalcLogoCRC(header);
-	header.header_crc = CalcHeaderCRC(header);
+	ctx->header.secure_area_crc = CalcSecureAreaCRC();
+	ctx->header.logo_crc = CalcLogoCRC(ctx->header);
+	ctx->header.header_crc = CalcHeaderCRC(ctx->header);
 
-	if (header.unitcode & 2)
+	if (ctx->header.unitcode & 2)
 	{
-		Sha1Hmac(header.hmac_arm9, fNDS, header.arm9_rom_offset, header.arm9_size);
-		Sha1Hmac(header.hmac_arm7, fNDS, header.arm7_rom_offset, header.arm7_size);
-		Sha1Hmac(header.hmac_icon_title, fNDS, header.banner_offset, header.banner_size);
-		Sha1Hmac(header.hmac_arm9i, fNDS, header.dsi9_rom_offset, header.dsi9_size);
-		Sha1Hmac(header.hmac_arm7i, fNDS, header.dsi7_rom_offset, header.dsi7_size);
-		memset(header.rsa_signature, 0xFF, 0x80);
-
-		// Dummy signature for no$gba
-		header.rsa_signature[0x00] = 0;
-		header.rsa_signature[0x01] = 1;
-		header.rsa_signature[0x6B] = 0;
-		sha1(&header.rsa_signature[0x6C], (const unsigned char*)&header, 0xE00);
+		Sha1Hmac(ctx->header.hmac_arm9, ctx->fNDS, ctx->header.arm9_rom_offset, ctx->header.arm9_size);
+		Sha1Hmac(ctx->header.hmac_arm7, ctx->fNDS, ctx->header.arm7_rom_offset, ctx->header.arm7_size);
+		Sha1Hmac(ctx->header.hmac_icon_title, ctx->fNDS, ctx->header.banner_offset, ctx->header.banner_size);
+		Sha1Hmac(ctx->header.hmac_arm9i, ctx->fNDS, ctx->header.dsi9_rom_offset, ctx->header.dsi9_size);
+		Sha1Hmac(ctx->header.hmac_arm7i, ctx->fNDS, ctx->header.dsi7_rom_offset, ctx->header.dsi7_size);
+		SignHeader(ctx->header);
 	}
 
-	if (fseek(fNDS, 0, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, 0, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek ROM start\n", __func__);
 
-	if (fwrite(&header, header_size, 1, fNDS) != 1)
+	if (fwrite(&ctx->header, header_size, 1, ctx->fNDS) != 1)
 		LogFatal("%s: Failed to write header\n", __func__);
 
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
 }
 
 /*
@@ -351,7 +412,7 @@ void HeaderSha1(FILE *fNDS, unsigned char *header_sha1, int romType)
 	if (!memcmp(buf, "DS DOWNLOAD PLAY", 16))	// found?
 	{
 		sha1_hash(buf + 0x20, 0x160, &m_sha1);	// alternate header
-		if (verbose >= 2)
+		if (ctx->verbose >= 2)
 		{
 			printf("{ DS Download Play(TM) / Wireless MultiBoot header information:\n");
 			ShowHeaderInfo(*(Header *)(buf + 0x20), romType, 0x160);
@@ -371,89 +432,90 @@ void HeaderSha1(FILE *fNDS, unsigned char *header_sha1, int romType)
 	sha1_end(header_sha1, &m_sha1);
 }
 
+/*
+ * Sha1HashRange
+ * Hashes a range of a file with a buffer of fixed size, so that the memory used
+ * doesn't depend on the sizes in the header. The bytes inside the range
+ * [zero_start, zero_end) of the file are hashed as zeroes without reading
+ * them. Returns false if the range isn't inside the file.
+ */
+static bool Sha1HashRange(FILE *f, sha1_ctx *cx, uint64_t offset, uint64_t size,
+						  uint64_t zero_start = 0, uint64_t zero_end = 0)
+{
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0)
+		LogFatal("%s: Failed to get file size\n", __func__);
+
+	if (offset + size > (uint64_t)st.st_size)
+		return false;
+
+	unsigned char buf[0x10000];
+	uint64_t end = offset + size;
+	while (offset < end)
+	{
+		unsigned int len = std::min<uint64_t>(sizeof(buf), end - offset);
+
+		if ((offset >= zero_start) && (offset < zero_end))
+		{
+			// inside the zero range, up to its end
+			len = std::min<uint64_t>(len, zero_end - offset);
+			memset(buf, 0, len);
+		}
+		else
+		{
+			// up to the start of the zero range
+			if ((offset < zero_start) && (zero_start < zero_end))
+				len = std::min<uint64_t>(len, zero_start - offset);
+			if (!ReadAt(fileno(f), buf, len, offset))
+				LogFatal("%s: Failed to read data\n", __func__);
+		}
+
+		sha1_hash(buf, len, cx);
+		offset += len;
+	}
+
+	return true;
+}
+
 /*
  * Arm9Sha1Multiboot
  */
-void Arm9Sha1Multiboot(FILE *fNDS, unsigned char *arm9_sha1)
+bool Arm9Sha1Multiboot(FILE *fNDS, unsigned char *arm9_sha1)
 {
 	sha1_ctx m_sha1;
 	sha1_begin(&m_sha1);
-	if (fseek(fNDS, header.arm9_rom_offset, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek ARM9 ROM offset\n", __func__);
-
-	unsigned int len = header.arm9_size;
-	unsigned char *buf = new unsigned char [len];
-	if (fread(buf, 1, len, fNDS) != len)
-		LogFatal("%s: Failed to read ARM9 data\n", __func__);
-
-	//printf("%u\n", len);
-	sha1_hash(buf, len, &m_sha1);
-	delete [] buf;
+	if (!Sha1HashRange(fNDS, &m_sha1, ctx->header.arm9_rom_offset, ctx->header.arm9_size))
+		return false;
 	sha1_end(arm9_sha1, &m_sha1);
+	return true;
 }
 
 /*
  * Arm9Sha1ClearedOutArea
+ * Same as Arm9Sha1Multiboot, but the area 0x5000-0x7000 of the ROM is hashed as
+ * zeroes, because it gets cleared when the binary is loaded.
  */
-void Arm9Sha1ClearedOutArea(FILE *fNDS, unsigned char *arm9_sha1)
+bool Arm9Sha1ClearedOutArea(FILE *fNDS, unsigned char *arm9_sha1)
 {
 	sha1_ctx m_sha1;
 	sha1_begin(&m_sha1);
-	if (fseek(fNDS, header.arm9_rom_offset, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek ARM9 ROM offset\n", __func__);
-
-	unsigned int len = header.arm9_size;
-	unsigned char *buf = new unsigned char [len];
-
-	int len1 = (0x5000 - header.arm9_rom_offset);		// e.g. 0x5000 - 0x4000 = 0x1000
-	int len3 = header.arm9_size - (0x7000 - header.arm9_rom_offset);	// e.g. 0x10000 - (0x7000 - 0x4000) = 0xD000
-	int len2 = header.arm9_size - len1 - len3;			// e.g. 0x10000 - 0x1000 - 0xD000 = 0x2000
-
-	if (len1 > 0)
-	{
-		if (fread(buf, 1, len1, fNDS) != (size_t)len1)
-			LogFatal("%s: Failed to read area 1\n", __func__);
-	}
-	if (len2 > 0)
-	{
-		// gets cleared for security?
-		memset(buf + len1, 0, len2);
-		if (fseek(fNDS, len2, SEEK_CUR) == -1)
-			LogFatal("%s: Failed to seek len2 offset\n", __func__);
-	}
-	if (len3 > 0)
-	{
-		if (fread(buf + len1 + len2, 1, len3, fNDS) != (size_t)len3)
-			LogFatal("%s: Failed to read area 3\n", __func__);
-	}
-//	printf("%X %X %X\n", len1, len2, len3);
-
-//		memset(buf, 0, 0x800);		// clear "secure area" too
-
-	sha1_hash(buf, len, &m_sha1);
-	delete [] buf;
+	if (!Sha1HashRange(fNDS, &m_sha1, ctx->header.arm9_rom_offset, ctx->header.arm9_size, 0x5000, 0x7000))
+		return false;
 	sha1_end(arm9_sha1, &m_sha1);
+	return true;
 }
 
 /*
  * Arm7Sha1
  */
-void Arm7Sha1(FILE *fNDS, unsigned char *arm7_sha1)
+bool Arm7Sha1(FILE *fNDS, unsigned char *arm7_sha1)
 {
 	sha1_ctx m_sha1;
 	sha1_begin(&m_sha1);
-	if (fseek(fNDS, header.arm7_rom_offset, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek ARM7 ROM offset\n", __func__);
-
-	unsigned int len = header.arm7_size;
-	unsigned char *buf = new unsigned char [len];
-	if (fread(buf, 1, len, fNDS) != len)
-		LogFatal("%s: Failed to read ARM7 data\n", __func__);
-
-	//printf("%u\n", len);
-	sha1_hash(buf, len, &m_sha1);
-	delete [] buf;
+	if (!Sha1HashRange(fNDS, &m_sha1, ctx->header.arm7_rom_offset, ctx->header.arm7_size))
+		return false;
 	sha1_end(arm7_sha1, &m_sha1);
+	return true;
 }
 
 /*
@@ -503,25 +565,20 @@ char *strsepc(char **s, char d)
  */
 void ShowVerboseInfo(FILE *fNDS, Header &header, int romType)
 {
-	// calculate SHA1 of ARM7 binary
-	unsigned char arm7_sha1[SHA1_DIGEST_SIZE];
-	Arm7Sha1(fNDS, arm7_sha1);
-
-	// find signature data
+	// find signature data. It's after the end of the application, or in the
+	// last 136 bytes.
+	int fd = fileno(fNDS);
 	unsigned_int signature_id = 0;
-	if (fseek(fNDS, header.application_end_offset, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek signature ID (first try)\n", __func__);
-
-	if (fread(&signature_id, sizeof(signature_id), 1, fNDS) != 1)
-		LogFatal("%s: Failed to read signature ID (first try)\n", __func__);
-
-	if (signature_id != 0x00016361) // try again
+	uint64_t signature_pos = header.application_end_offset;
+	if (!ReadAt(fd, &signature_id, sizeof(signature_id), signature_pos) || (signature_id != 0x00016361))
 	{
-		if (fseek(fNDS, header.application_end_offset - 136, SEEK_SET) == -1)
-			LogFatal("%s: Failed to seek signature ID (second try)\n", __func__);
-
-		if (fread(&signature_id, sizeof(signature_id), 1, fNDS) != sizeof(signature_id))
-			LogFatal("%s: Failed to read signature ID (second try)\n", __func__);
+		signature_id = 0;
+		if (header.application_end_offset >= 136)
+		{
+			signature_pos = header.application_end_offset - 136;
+			if (!ReadAt(fd, &signature_id, sizeof(signature_id), signature_pos))
+				signature_id = 0;
+		}
 	}
 
 	if (signature_id == 0x00016361)
@@ -529,11 +586,11 @@ void ShowVerboseInfo(FILE *fNDS, Header &header, int romType)
 		printf("\n");
 
 		unsigned char signature[128];
-		if (fread(signature, 1, sizeof(signature), fNDS) != sizeof(signature))
+		if (!ReadAt(fd, signature, sizeof(signature), signature_pos + 4))
 			LogFatal("%s: Failed to read signature\n", __func__);
 
 		unsigned char sha_parts[3*SHA1_DIGEST_SIZE + 4];
-		if (fread(sha_parts + 3*SHA1_DIGEST_SIZE, 4, 1, fNDS) != 1) // some number
+		if (!ReadAt(fd, sha_parts + 3*SHA1_DIGEST_SIZE, 4, signature_pos + 4 + sizeof(signature))) // some number
 			LogFatal("%s: Failed to read SHA parts\n", __func__);
 
 		//printf("%08X\n", *(unsigned int *)(sha_parts + 3*SHA1_DIGEST_SIZE));
@@ -542,17 +599,20 @@ void ShowVerboseInfo(FILE *fNDS, Header &header, int romType)
 		HeaderSha1(fNDS, header_sha1, romType);
 		memcpy(sha_parts + 0*SHA1_DIGEST_SIZE, header_sha1, SHA1_DIGEST_SIZE);
 
-		unsigned char arm9_sha1[SHA1_DIGEST_SIZE];
+		unsigned char arm9_sha1[SHA1_DIGEST_SIZE] = { 0 };
+		bool arm9_ok;
 		if (romType == ROMTYPE_MULTIBOOT)
 		{
-			Arm9Sha1Multiboot(fNDS, arm9_sha1);
+			arm9_ok = Arm9Sha1Multiboot(fNDS, arm9_sha1);
 		}
 		else
 		{
-			Arm9Sha1ClearedOutArea(fNDS, arm9_sha1);
+			arm9_ok = Arm9Sha1ClearedOutArea(fNDS, arm9_sha1);
 		}
 		memcpy(sha_parts + 1*SHA1_DIGEST_SIZE, arm9_sha1, SHA1_DIGEST_SIZE);
 
+		unsigned char arm7_sha1[SHA1_DIGEST_SIZE] = { 0 };
+		bool arm7_ok = Arm7Sha1(fNDS, arm7_sha1);
 		memcpy(sha_parts + 2*SHA1_DIGEST_SIZE, arm7_sha1, SHA1_DIGEST_SIZE);
 
 		unsigned char sha_final[SHA1_DIGEST_SIZE];
@@ -582,8 +642,10 @@ void ShowVerboseInfo(FILE *fNDS, Header &header, int romType)
 			big_sha1.Get(sha1_from_sig, sizeof(sha1_from_sig));
 		}
 		
-		bool ok = (memcmp(sha_final, sha1_from_sig, SHA1_DIGEST_SIZE) == 0);
+		bool ok = arm9_ok && arm7_ok && (memcmp(sha_final, sha1_from_sig, SHA1_DIGEST_SIZE) == 0);
 		printf("DS Download Play(TM) / Wireless MultiBoot signature: %s\n", ok ? "OK" : "INVALID");
+		if (!arm9_ok) printf("ARM9 binary is outside of the ROM\n");
+		if (!arm7_ok) printf("ARM7 binary is outside of the ROM\n");
 		if (!ok)
 		{
 			printf("header hash:    \t"); for (int i=0; i<SHA1_DIGEST_SIZE; i++) printf("%02X", (sha_parts + 0*SHA1_DIGEST_SIZE)[i]); printf("\n");
@@ -596,18 +658,43 @@ void ShowVerboseInfo(FILE *fNDS, Header &header, int romType)
 
 	// CRC32
 	{
-		unsigned char *buf = new unsigned char [0x10000];
-		if (fseek(fNDS, 0, SEEK_SET) == -1)
-			LogFatal("%s: Failed to seek ROM start\n", __func__);
+		// The file is split in chunks that are processed in parallel. Their CRCs
+		// are calculated from 0 and then combined.
+		const uint64_t chunk_size = 4 * 1024 * 1024;
+
+		struct stat st;
+		if (fstat(fileno(fNDS), &st) != 0)
+			LogFatal("%s: Failed to get ROM size\n", __func__);
+
+		uint64_t file_size = st.st_size;
+		size_t chunk_count = (file_size + chunk_size - 1) / chunk_size;
+		std::vector<unsigned int> chunk_crcs(chunk_count);
+		std::atomic<bool> read_error(false);
+
+		ParallelFor(chunk_count, [&](size_t i)
+		{
+			thread_local std::vector<unsigned char> buf(chunk_size);
+
+			uint64_t offset = i * chunk_size;
+			unsigned int size = std::min(chunk_size, file_size - offset);
+			if (!ReadAt(fileno(fNDS), buf.data(), size, offset))
+			{
+				read_error = true;
+				return;
+			}
+			chunk_crcs[i] = CalcCrc32(buf.data(), size, 0);
+		});
+
+		if (read_error)
+			LogFatal("%s: Failed to read ROM\n", __func__);
 
-		unsigned long crc32 = ~0;
-		int r;
-		while ((r = fread(buf, 1, 0x10000, fNDS)) > 0)
+		unsigned int crc32 = ~0;
+		for (size_t i = 0; i < chunk_count; i++)
 		{
-			crc32 = CalcCrc32(buf, r, crc32);
+			uint64_t size = std::min(chunk_size, file_size - i * chunk_size);
+			crc32 = CrcCombine32(crc32, chunk_crcs[i], size, 0);
 		}
 		crc32 = ~crc32;
-		delete [] buf;
 
 		printf("\nFile CRC32:    \t%08X\n", (unsigned int)crc32);
 	}
@@ -653,27 +740,27 @@ unsigned int GetBannerSizeFromHeader(Header &header, unsigned short banner_versi
  */
 void ShowInfo(char *ndsfilename)
 {
-	fNDS = fopen(ndsfilename, "rb");
-	if (!fNDS)
+	ctx->fNDS = fopen(ndsfilename, "rb");
+	if (!ctx->fNDS)
 		LogFatal("Cannot open file '%s'.\n", ndsfilename);
 
-	FullyReadHeader(fNDS, header);
+	FullyReadHeader(ctx->fNDS, ctx->header);
 
 	int romType = DetectRomType();
 
 	printf("Header information:\n");
-	ShowHeaderInfo(header, romType);
+	ShowHeaderInfo(ctx->header, romType);
 
-	unsigned int bannersize = GetBannerSizeFromHeader(header, ExtractBannerVersion(fNDS, header.banner_offset));
+	unsigned int bannersize = GetBannerSizeFromHeader(ctx->header, ExtractBannerVersion(ctx->fNDS, ctx->header.banner_offset));
 
 	// banner info
-	if (header.banner_offset)
+	if (ctx->header.banner_offset)
 	{
 		Banner banner;
-		if (fseek(fNDS, header.banner_offset, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, ctx->header.banner_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek banner offset\n", __func__);
 
-		if (fread(&banner, 1, bannersize, fNDS))
+		if (fread(&banner, 1, bannersize, ctx->fNDS))
 		{
 			printf("\n");
 			for (int slot = 0; slot < NUM_VERSION_CRCS; slot++)
@@ -737,18 +824,18 @@ void ShowInfo(char *ndsfilename)
 	}
 
 	// ARM9 footer
-	if (fseek(fNDS, header.arm9_rom_offset + header.arm9_size, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, ctx->header.arm9_rom_offset + ctx->header.arm9_size, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek ARM9 footer\n", __func__);
 
 	unsigned_int nitrocode;
-	if (fread(&nitrocode, sizeof(nitrocode), 1, fNDS) && (nitrocode == 0xDEC00621))
+	if (fread(&nitrocode, sizeof(nitrocode), 1, ctx->fNDS) && (nitrocode == 0xDEC00621))
 	{
 		printf("\n");
 		printf("ARM9 footer found.\n");
 		unsigned_int x;
-		if (fread(&x, sizeof(x), 1, fNDS) != 1)
+		if (fread(&x, sizeof(x), 1, ctx->fNDS) != 1)
 			LogFatal("%s: Failed to read header\n", __func__);
-		if (fread(&x, sizeof(x), 1, fNDS) != 1)
+		if (fread(&x, sizeof(x), 1, ctx->fNDS) != 1)
 			LogFatal("%s: Failed to read header\n", __func__);
 	}
 
@@ -763,10 +850,11 @@ void ShowInfo(char *ndsfilename)
 	}
 
 	// more information
-	if (verbose >= 1)
+	if (ctx->verbose >= 1)
 	{
-		ShowVerboseInfo(fNDS, header, romType);
+		ShowVerboseInfo(ctx->fNDS, ctx->header, romType);
 	}
 
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
 }
@@ -166,8 +166,10 @@ unsigned int FullyReadHeader(FILE *fNDS, Header &header);
 unsigned int GetBannerSizeFromHeader(Header &header, unsigned short banner_version);
 unsigned short CalcHeaderCRC(Header &header);
 unsigned short CalcLogoCRC(Header &header);
+void SignHeader(Header &header);
 void FixHeaderChecksums(char *ndsfilename);
 void ShowInfo(char *ndsfilename);
 int HashAndCompareWithList(char *filename, unsigned char sha1[]);
 int DetectRomType();
+bool DetectRomType(int fd, Header &header, int &romType);
 unsigned short CalcSecureAreaCRC();
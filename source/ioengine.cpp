@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "ioengine.h"
+
+#ifndef __linux__
+
+bool IoUringExtractFiles(int fd_rom, const std::vector<IoCopyRequest> &requests)
+{
+	(void)fd_rom;
+	(void)requests;
+	return false;
+}
+
+bool IoUringInsertFiles(int fd_rom, const std::vector<IoCopyRequest> &requests)
+{
+	(void)fd_rom;
+	(void)requests;
+	return false;
+}
+
+#else
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ndscontext.h"
+#include "sha1.h"
+
+/*
+ * IoRing
+ * Minimal io_uring wrapper that uses the system calls directly, so that
+ * liburing isn't needed.
+ */
+struct IoRing
+{
+	int fd = -1;
+
+	void *sq_ptr = MAP_FAILED;
+	void *cq_ptr = MAP_FAILED;
+	size_t sq_len = 0;
+	size_t cq_len = 0;
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+	size_t sqes_len = 0;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;	// SQEs that haven't been submitted yet
+	unsigned int sq_submitted;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	bool Init(unsigned int entries, unsigned int files);
+	~IoRing();
+
+	struct io_uring_sqe *GetSqe(void);
+	void Submit(unsigned int wait_nr);
+	bool Peek(struct io_uring_cqe &cqe);
+};
+
+/*
+ * IoRing::Init
+ * Returns false if io_uring can't be used. "files" is the number of direct
+ * descriptors to register.
+ */
+bool IoRing::Init(unsigned int entries, unsigned int files)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return false;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = std::max(sq_len, cq_len);
+
+	sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		return false;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq_ptr = sq_ptr;
+	}
+	else
+	{
+		cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					  fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			return false;
+	}
+
+	sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+									   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+
+	unsigned char *sq = (unsigned char *)sq_ptr;
+	sq_head = (unsigned int *)(sq + p.sq_off.head);
+	sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	sq_array = (unsigned int *)(sq + p.sq_off.array);
+	sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	sq_entries = p.sq_entries;
+	sq_local_tail = sq_submitted = *sq_tail;
+
+	unsigned char *cq = (unsigned char *)cq_ptr;
+	cq_head = (unsigned int *)(cq + p.cq_off.head);
+	cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// Opening and closing direct descriptors was added in Linux 5.15, in the
+	// same release as IORING_OP_LINKAT, so that operation is used to detect it.
+	const unsigned int required_ops[] = {
+		IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE,
+		IORING_OP_LINKAT
+	};
+
+	size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	std::vector<unsigned char> probe_buf(probe_size, 0);
+	struct io_uring_probe *probe = (struct io_uring_probe *)probe_buf.data();
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+		return false;
+
+	for (unsigned int op : required_ops)
+	{
+		if ((op > probe->last_op) || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+			return false;
+	}
+
+	// Empty slots for the direct descriptors
+	std::vector<int> fds(files, -1);
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds.data(), files) < 0)
+		return false;
+
+	return true;
+}
+
+IoRing::~IoRing()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_len);
+	if ((cq_ptr != MAP_FAILED) && (cq_ptr != sq_ptr))
+		munmap(cq_ptr, cq_len);
+	if (sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_len);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * IoRing::GetSqe
+ * The caller must make sure that there is enough space in the ring.
+ */
+struct io_uring_sqe *IoRing::GetSqe(void)
+{
+	unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sq_local_tail - head >= sq_entries)
+		LogFatal("%s: Submission queue is full\n", __func__);
+
+	unsigned int index = sq_local_tail & sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	sq_local_tail++;
+	return sqe;
+}
+
+/*
+ * IoRing::Submit
+ * Submits all pending SQEs and waits until there are wait_nr completions.
+ */
+void IoRing::Submit(unsigned int wait_nr)
+{
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+	while (1)
+	{
+		unsigned int to_submit = sq_local_tail - sq_submitted;
+		unsigned int flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+		long r = syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags, NULL, 0);
+		if (r < 0)
+		{
+			if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+				continue;
+			LogFatal("%s: io_uring_enter() failed: %s\n", __func__, strerror(errno));
+		}
+
+		sq_submitted += r;
+		if (sq_submitted == sq_local_tail)
+			return;
+	}
+}
+
+/*
+ * IoRing::Peek
+ * Gets the next completion, if there is any.
+ */
+bool IoRing::Peek(struct io_uring_cqe &cqe)
+{
+	unsigned int head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	cqe = cqes[head & cq_mask];
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Operations done for each file. They are stored in the user data of the SQEs
+// together with the index of the slot.
+enum { OP_OPEN, OP_READ, OP_WRITE, OP_CLOSE, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = { "open", "read", "write", "close" };
+
+/*
+ * IoSlot
+ * State of a file that is being copied. Each slot uses the direct descriptor
+ * with the same index.
+ */
+struct IoSlot
+{
+	size_t request;
+	unsigned int pending;		// operations that haven't completed yet
+	int error;					// first error reported by an operation
+	int error_op;
+	bool written;				// the data has been written to the ROM
+	std::vector<unsigned char> buffer;
+};
+
+/*
+ * PrepareOp
+ */
+static struct io_uring_sqe *PrepareOp(IoRing &ring, IoSlot *slots, unsigned int slot,
+									  int op, unsigned int opcode, bool link)
+{
+	struct io_uring_sqe *sqe = ring.GetSqe();
+	sqe->opcode = opcode;
+	sqe->user_data = (uint64_t)slot * OP_COUNT + op;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+
+	slots[slot].pending++;
+	return sqe;
+}
+
+/*
+ * StartExtract
+ * Reads the data from the ROM and writes it to a new file.
+ */
+static void StartExtract(IoRing &ring, IoSlot *slots, unsigned int slot, int fd_rom,
+						 const IoCopyRequest &req)
+{
+	struct io_uring_sqe *sqe = PrepareOp(ring, slots, slot, OP_READ, IORING_OP_READ, true);
+	sqe->fd = fd_rom;
+	sqe->addr = (uint64_t)(uintptr_t)slots[slot].buffer.data();
+	sqe->len = req.size;
+	sqe->off = req.offset;
+
+	sqe = PrepareOp(ring, slots, slot, OP_OPEN, IORING_OP_OPENAT, true);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)req.path;
+	sqe->len = 0666;
+	sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	sqe->file_index = slot + 1;
+
+	sqe = PrepareOp(ring, slots, slot, OP_WRITE, IORING_OP_WRITE, true);
+	sqe->fd = slot;
+	sqe->flags |= IOSQE_FIXED_FILE;
+	sqe->addr = (uint64_t)(uintptr_t)slots[slot].buffer.data();
+	sqe->len = req.size;
+	sqe->off = 0;
+
+	sqe = PrepareOp(ring, slots, slot, OP_CLOSE, IORING_OP_CLOSE, false);
+	sqe->file_index = slot + 1;
+}
+
+/*
+ * StartInsert
+ * Reads a file of the host PC. The data is written to the ROM by
+ * FinishInsert() when all of it has been read.
+ */
+static void StartInsert(IoRing &ring, IoSlot *slots, unsigned int slot, const IoCopyRequest &req)
+{
+	struct io_uring_sqe *sqe = PrepareOp(ring, slots, slot, OP_OPEN, IORING_OP_OPENAT, true);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)req.path;
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = slot + 1;
+
+	sqe = PrepareOp(ring, slots, slot, OP_READ, IORING_OP_READ, true);
+	sqe->fd = slot;
+	sqe->flags |= IOSQE_FIXED_FILE;
+	sqe->addr = (uint64_t)(uintptr_t)slots[slot].buffer.data();
+	sqe->len = req.size;
+	sqe->off = 0;
+
+	sqe = PrepareOp(ring, slots, slot, OP_CLOSE, IORING_OP_CLOSE, false);
+	sqe->file_index = slot + 1;
+}
+
+/*
+ * FinishInsert
+ */
+static void FinishInsert(IoRing &ring, IoSlot *slots, unsigned int slot, int fd_rom,
+						 const IoCopyRequest &req)
+{
+	IoSlot &s = slots[slot];
+
+	if (req.sha1)
+		sha1(req.sha1, s.buffer.data(), req.size);
+
+	struct io_uring_sqe *sqe = PrepareOp(ring, slots, slot, OP_WRITE, IORING_OP_WRITE, false);
+	sqe->fd = fd_rom;
+	sqe->addr = (uint64_t)(uintptr_t)s.buffer.data();
+	sqe->len = req.size;
+	sqe->off = req.offset;
+}
+
+/*
+ * CopyFiles
+ * Runs the operations of all requests, io_queue_depth files at a time.
+ */
+static bool CopyFiles(int fd_rom, const std::vector<IoCopyRequest> &requests, bool insert)
+{
+	unsigned int depth = (ctx->io_queue_depth > 0) ? ctx->io_queue_depth : 1;
+	if (depth > requests.size())
+		depth = requests.size();
+	if (depth == 0)
+		return true;
+
+	// The buffers are destroyed after the ring, so the kernel never uses them
+	// after they have been freed
+	std::vector<IoSlot> slots(depth);
+
+	IoRing ring;
+	if (!ring.Init(depth * OP_COUNT, depth))
+		return false;
+
+	std::vector<unsigned int> free_slots;
+	for (unsigned int i = 0; i < depth; i++)
+	{
+		slots[i].buffer.resize(IO_URING_MAX_FILE_SIZE);
+		free_slots.push_back(depth - 1 - i);
+	}
+
+	size_t next = 0;
+	unsigned int active = 0;
+
+	// After an error no more requests are started, but the ones in progress
+	// are allowed to finish so that their buffers and files aren't in use when
+	// the error is reported.
+	const IoSlot *failed = NULL;
+
+	while ((!failed && (next < requests.size())) || (active > 0))
+	{
+		while (!failed && (next < requests.size()) && !free_slots.empty())
+		{
+			unsigned int slot = free_slots.back();
+			free_slots.pop_back();
+
+			IoSlot &s = slots[slot];
+			s.request = next++;
+			s.pending = 0;
+			s.error = 0;
+			s.written = false;
+
+			if (insert)
+				StartInsert(ring, slots.data(), slot, requests[s.request]);
+			else
+				StartExtract(ring, slots.data(), slot, fd_rom, requests[s.request]);
+			active++;
+		}
+
+		ring.Submit(1);
+
+		struct io_uring_cqe cqe;
+		while (ring.Peek(cqe))
+		{
+			unsigned int slot = cqe.user_data / OP_COUNT;
+			int op = cqe.user_data % OP_COUNT;
+			IoSlot &s = slots[slot];
+			const IoCopyRequest &req = requests[s.request];
+
+			// Operations that follow a failed one are cancelled. Only the
+			// first real error is reported.
+			bool ok;
+			if ((op == OP_READ) || (op == OP_WRITE))
+				ok = (cqe.res >= 0) && ((unsigned int)cqe.res == req.size);
+			else
+				ok = (cqe.res >= 0);
+
+			if (!ok && ((s.error == 0) || (s.error == ECANCELED)))
+			{
+				s.error = (cqe.res < 0) ? -cqe.res : EIO;
+				s.error_op = op;
+			}
+
+			if (--s.pending > 0)
+				continue;
+
+			if ((s.error == 0) && insert && !s.written)
+			{
+				FinishInsert(ring, slots.data(), slot, fd_rom, req);
+				s.written = true;
+				continue;
+			}
+
+			if ((s.error != 0) && !failed)
+				failed = &s;
+
+			free_slots.push_back(slot);
+			active--;
+		}
+	}
+
+	if (failed)
+	{
+		LogFatal("%s: Failed to %s '%s': %s\n", __func__, op_names[failed->error_op],
+				 requests[failed->request].path, strerror(failed->error));
+	}
+
+	return true;
+}
+
+bool IoUringExtractFiles(int fd_rom, const std::vector<IoCopyRequest> &requests)
+{
+	return CopyFiles(fd_rom, requests, false);
+}
+
+bool IoUringInsertFiles(int fd_rom, const std::vector<IoCopyRequest> &requests)
+{
+	return CopyFiles(fd_rom, requests, true);
+}
+
+#endif
@@ -0,0 +1,32 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+// I/O engines used to copy NitroFS files between the host PC and the ROM.
+//
+// The POSIX engine copies each file with open()/CopyFileData()/close() from
+// the pool of worker threads. The io_uring engine (Linux only) submits the
+// open, read, write and close operations of many small files at the same time
+// to the kernel, so that they don't cost one system call each. Files bigger
+// than IO_URING_MAX_FILE_SIZE always use the POSIX engine.
+
+enum { IO_ENGINE_POSIX, IO_ENGINE_URING };
+
+#define IO_URING_MAX_FILE_SIZE	(64 * 1024)
+
+struct IoCopyRequest
+{
+	const char *path;		// file in the host PC
+	uint64_t offset;		// offset of the file in the ROM
+	unsigned int size;
+	unsigned char *sha1;	// if not NULL, the hash of the file is stored here
+};
+
+// They return false if io_uring isn't available. In that case nothing has been
+// copied, and the files have to be copied with the POSIX engine. Any other
+// error is fatal.
+bool IoUringExtractFiles(int fd_rom, const std::vector<IoCopyRequest> &requests);
+bool IoUringInsertFiles(int fd_rom, const std::vector<IoCopyRequest> &requests);
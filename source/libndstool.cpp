@@ -0,0 +1,232 @@
+#include <functional>
+
+#include "ndstool.h"
+#include "catalog.h"
+#include "libndstool.h"
+#include "log.h"
+#include "ndscreate.h"
+#include "ndsextract.h"
+#include "scan.h"
+#include "tar.h"
+#include "verify.h"
+
+/*
+ * RunOperation
+ * Runs an operation with the context as the current one. Fatal errors stop the
+ * operation, and the files that it has left open are closed.
+ */
+static bool RunOperation(NdsContext &context, const std::function<bool(void)> &func)
+{
+	NdsContextScope scope(context);
+
+	context.error.clear();
+
+	try
+	{
+		return func();
+	}
+	catch (const FatalError &e)
+	{
+		context.error = e.what();
+	}
+
+	if (context.fNDS)
+	{
+		fclose(context.fNDS);
+		context.fNDS = NULL;
+	}
+
+	delete context.extract_tar;
+	context.extract_tar = NULL;
+
+	DigestEnd();
+
+	return false;
+}
+
+/*
+ * CheckNdsFilename
+ */
+static void CheckNdsFilename(void)
+{
+	if (ctx->ndsfilename == NULL)
+		LogFatal("No NDS file provided\n");
+}
+
+/*
+ * ReadHeaderAndBannerSize
+ * Reads the header of the ROM and the size of its banner into the context.
+ * Returns the size of the header.
+ */
+static unsigned int ReadHeaderAndBannerSize(void)
+{
+	ctx->fNDS = fopen(ctx->ndsfilename, "rb");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'.\n", ctx->ndsfilename);
+
+	unsigned int headersize = FullyReadHeader(ctx->fNDS, ctx->header);
+	ctx->bannersize = GetBannerSizeFromHeader(ctx->header, ExtractBannerVersion(ctx->fNDS, ctx->header.banner_offset));
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
+
+	return headersize;
+}
+
+/*
+ * CheckCreateOptions
+ */
+static void CheckCreateOptions(void)
+{
+	if (ctx->gamecode)
+	{
+		if (strlen(ctx->gamecode) != 4)
+		{
+			LogFatal("Game code must be 4 characters!\n");
+		}
+		for (int i=0; i<4; i++) if ((ctx->gamecode[i] >= 'a') && (ctx->gamecode[i] <= 'z'))
+		{
+			LogWarning("Gamecode contains lowercase characters.\n");
+			break;
+		}
+		if (ctx->gamecode[0] == 'A')
+		{
+			LogWarning("Gamecode starts with 'A', which might be used for another commercial product.\n");
+		}
+	}
+	if (ctx->makercode && (strlen(ctx->makercode) != 2))
+	{
+		LogFatal("Maker code must be 2 characters!\n");
+	}
+	if (ctx->title && (strlen(ctx->title) > 12))
+	{
+		LogFatal("Title can be no more than 12 characters!\n");
+	}
+	if (ctx->romversion > 255)
+	{
+		LogFatal("romversion can only be 0 - 255!\n");
+	}
+	if (!ctx->bannertext[1])
+		ctx->bannertext[1] = "";
+}
+
+bool NdsShowInfo(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		ShowInfo(ctx->ndsfilename);
+		return true;
+	});
+}
+
+bool NdsFixHeaderChecksums(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		FixHeaderChecksums(ctx->ndsfilename);
+		return true;
+	});
+}
+
+bool NdsFixBannerCRC(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		ReadHeaderAndBannerSize();
+		FixBannerCRC(ctx->ndsfilename, ctx->header.banner_offset, ctx->bannersize);
+		return true;
+	});
+}
+
+bool NdsVerify(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		return VerifyRom(ctx->ndsfilename);
+	});
+}
+
+bool NdsScan(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		return ScanRoms();
+	});
+}
+
+bool NdsCatalog(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		return CatalogCommand();
+	});
+}
+
+bool NdsListFiles(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		ExtractFiles(ctx->ndsfilename, NULL); // List mode
+		return true;
+	});
+}
+
+bool NdsExtract(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		unsigned int headersize = ReadHeaderAndBannerSize();
+
+		if (ctx->tarfilename) ExtractTarBegin(ctx->tarfilename);
+
+		if (ctx->arm9filename) Extract(ctx->arm9filename, true, 0x20, true, 0x2C, true);
+		if (ctx->arm7filename) Extract(ctx->arm7filename, true, 0x30, true, 0x3C);
+		if (ctx->header.unitcode & 2) {
+			if (ctx->arm9ifilename) Extract(ctx->arm9ifilename, true, 0x1C0, true, 0x1CC, true);
+			if (ctx->arm7ifilename) Extract(ctx->arm7ifilename, true, 0x1D0, true, 0x1DC);
+		}
+		if (ctx->bannerfilename) {
+			if (ctx->bannertype == BANNER_BINARY)
+				Extract(ctx->bannerfilename, true, 0x68, false, ctx->bannersize);
+			else if (ctx->bannertype == BANNER_IMAGE && ctx->tarfilename)
+				LogWarning("Banner images can't be written to tar archives.\n");
+			else if (ctx->bannertype == BANNER_IMAGE)
+				IconToRasterImage();
+		}
+		if (ctx->headerfilename_or_size) Extract(ctx->headerfilename_or_size, false, 0x0, false, headersize);
+		if (ctx->logofilename) Extract(ctx->logofilename, false, 0xC0, false, 156);	// *** bin only
+		if (ctx->arm9ovltablefilename) Extract(ctx->arm9ovltablefilename, true, 0x50, true, 0x54);
+		if (ctx->arm7ovltablefilename) Extract(ctx->arm7ovltablefilename, true, 0x58, true, 0x5C);
+		if (ctx->overlaydir) ExtractOverlayFiles();
+		if (ctx->filerootdirs_num > 0) ExtractFiles(ctx->ndsfilename, ctx->filerootdirs[0]);
+		if (ctx->tarfilename) ExtractTarEnd();
+		return true;
+	});
+}
+
+bool NdsExtractFiles(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		for (int i=0; i<ctx->extractfile_num; i++)
+			ExtractSingleFile(ctx->ndsfilename, ctx->extractfile_names[i], ctx->extractfile_outputs[i]);
+		return true;
+	});
+}
+
+bool NdsCreate(NdsContext &context)
+{
+	return RunOperation(context, []()
+	{
+		CheckNdsFilename();
+		CheckCreateOptions();
+		Create();
+		return true;
+	});
+}
@@ -0,0 +1,34 @@
+
+#pragma once
+
+#include "ndscontext.h"
+
+// Interface of libndstool, the library with the operations of ndstool.
+//
+// Each operation works with the options and the ROM (ndsfilename) of the
+// context passed to it, and it only uses that context, so different ROMs can be
+// processed at the same time from several threads, each one with its own
+// context. A context can be used for several operations on the same ROM, one at
+// a time, like the actions of the command line tool.
+//
+// They return false if the operation fails. If the reason is an error, its
+// message is stored in the error field of the context, and it's also printed
+// to the log output of the context. The operations that check ROMs (verify,
+// scan and catalog) can also return false because a check has failed, and the
+// error message is empty in that case.
+
+bool NdsShowInfo(NdsContext &context);
+bool NdsFixHeaderChecksums(NdsContext &context);
+bool NdsFixBannerCRC(NdsContext &context);
+bool NdsVerify(NdsContext &context);
+bool NdsScan(NdsContext &context);
+bool NdsCatalog(NdsContext &context);
+bool NdsListFiles(NdsContext &context);
+
+// It extracts the files whose filenames are set in the context, like -x
+bool NdsExtract(NdsContext &context);
+
+// It extracts the NitroFS files in extractfile_names, like -xf
+bool NdsExtractFiles(NdsContext &context);
+
+bool NdsCreate(NdsContext &context);
@@ -3,19 +3,35 @@
 #include <stdlib.h>
 
 #include "log.h"
+#include "ndscontext.h"
+
+void LogSetOutput(FILE *f)
+{
+    ctx->log_output = f;
+}
 
 void LogMessage(log_level_t level, const char *msg, ...)
 {
+    FILE *f = (ctx && ctx->log_output) ? ctx->log_output : stdout;
+
     if (level == LOG_LEVEL_WARNING)
-        printf("WARNING: ");
+        fprintf(f, "WARNING: ");
     else if (level == LOG_LEVEL_FATAL)
-        printf("FATAL: ");
+        fprintf(f, "FATAL: ");
 
     va_list args;
     va_start(args, msg);
-    vprintf(msg, args);
+    vfprintf(f, msg, args);
     va_end(args);
 
     if (level == LOG_LEVEL_FATAL)
-        exit(EXIT_FAILURE);
+    {
+        char text[1024];
+
+        va_start(args, msg);
+        vsnprintf(text, sizeof(text), msg, args);
+        va_end(args);
+
+        throw FatalError(text);
+    }
 }
@@ -1,6 +1,10 @@
 
 #pragma once
 
+#include <stdio.h>
+
+#include <stdexcept>
+
 typedef enum {
     LOG_LEVEL_VERBOSE,
     LOG_LEVEL_INFO,
@@ -8,8 +12,20 @@ typedef enum {
     LOG_LEVEL_FATAL,
 } log_level_t;
 
+// Fatal messages throw a FatalError after being printed, so that only the
+// operation that has failed is aborted, not the whole program. The message of
+// the exception is the text of the message.
+struct FatalError : public std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
 void LogMessage(log_level_t level, const char *msg, ...);
 
+// Messages are printed to stdout by default. They need to be sent somewhere else
+// when stdout is used for file data. The output is part of the current context.
+void LogSetOutput(FILE *f);
+
 #define LogVerbose(m, ...)  LogMessage(LOG_LEVEL_VERBOSE, m __VA_OPT__(,) __VA_ARGS__)
 #define LogInfo(m, ...)     LogMessage(LOG_LEVEL_INFO, m __VA_OPT__(,) __VA_ARGS__)
 #define LogWarning(m, ...)  LogMessage(LOG_LEVEL_WARNING, m __VA_OPT__(,) __VA_ARGS__)
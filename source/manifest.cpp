@@ -0,0 +1,280 @@
+#include <inttypes.h>
+
+#include "fileio.h"
+#include "manifest.h"
+#include "ndstool.h"
+
+#define MANIFEST_MAGIC	"ndstool-manifest 1"
+
+std::string GetManifestFilename(const char *ndsfilename)
+{
+	return std::string(ndsfilename) + ".manifest";
+}
+
+std::string DigestToString(const unsigned char digest[SHA1_DIGEST_SIZE])
+{
+	char str[SHA1_DIGEST_SIZE * 2 + 1];
+	for (int i = 0; i < SHA1_DIGEST_SIZE; i++)
+		sprintf(str + i * 2, "%02x", digest[i]);
+	return str;
+}
+
+/*
+ * StringToDigest
+ */
+static bool StringToDigest(const std::string &str, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+	if (str.size() != SHA1_DIGEST_SIZE * 2)
+		return false;
+
+	for (int i = 0; i < SHA1_DIGEST_SIZE; i++)
+	{
+		unsigned int value;
+		if (sscanf(str.c_str() + i * 2, "%2x", &value) != 1)
+			return false;
+		digest[i] = value;
+	}
+
+	return true;
+}
+
+std::string Escape(const std::string &str)
+{
+	std::string out;
+	for (char c : str)
+	{
+		if (c == '\\')
+			out += "\\\\";
+		else if (c == '\t')
+			out += "\\t";
+		else if (c == '\n')
+			out += "\\n";
+		else
+			out += c;
+	}
+	return out;
+}
+
+std::string Unescape(const std::string &str)
+{
+	std::string out;
+	for (size_t i = 0; i < str.size(); i++)
+	{
+		char c = str[i];
+		if ((c == '\\') && (i + 1 < str.size()))
+		{
+			c = str[++i];
+			if (c == 't')
+				c = '\t';
+			else if (c == 'n')
+				c = '\n';
+		}
+		out += c;
+	}
+	return out;
+}
+
+/*
+ * AddOption
+ */
+static void AddOption(std::string &str, const char *name, const char *value)
+{
+	str += name;
+	str += '\t';
+	str += value ? Escape(value) : "(none)";
+	str += '\n';
+}
+
+static void AddOption(std::string &str, const char *name, unsigned int value)
+{
+	char buf[16];
+	sprintf(buf, "0x%X", value);
+	AddOption(str, name, buf);
+}
+
+/*
+ * AddInputFile
+ * Adds the name of a file and the information required to detect changes.
+ */
+static void AddInputFile(std::string &str, const char *name, const char *path)
+{
+	AddOption(str, name, path);
+
+	struct stat st;
+	if (path && (stat(path, &st) == 0))
+	{
+		char buf[64];
+		sprintf(buf, "%" PRIu64 "\t%" PRIu64 "\n", (uint64_t)st.st_size, GetFileMtime(st));
+		str += buf;
+	}
+}
+
+std::string GetOptionsHash(void)
+{
+	std::string str = "ndstool " VERSION_STRING "\n";
+
+	AddInputFile(str, "arm9", ctx->arm9filename);
+	AddInputFile(str, "arm7", ctx->arm7filename);
+	AddInputFile(str, "arm9i", ctx->arm9ifilename);
+	AddInputFile(str, "arm7i", ctx->arm7ifilename);
+	AddInputFile(str, "arm9ovltable", ctx->arm9ovltablefilename);
+	AddInputFile(str, "arm7ovltable", ctx->arm7ovltablefilename);
+	AddInputFile(str, "banner", ctx->bannerfilename);
+	AddInputFile(str, "banneranim", ctx->banneranimfilename);
+	AddInputFile(str, "logo", ctx->logofilename);
+	AddInputFile(str, "header", ctx->headerfilename_or_size);
+	AddInputFile(str, "rsakey", ctx->rsakeyfilename);
+
+	AddOption(str, "bannertype", ctx->bannertype);
+	// It is written to the header even if the ROM has no banner
+	AddOption(str, "bannersize", ctx->bannersize);
+	for (int i = 0; i < MAX_BANNER_TITLE_COUNT; i++)
+		AddOption(str, "bannertext", ctx->bannertext[i]);
+	AddOption(str, "title", ctx->title);
+	AddOption(str, "gamecode", ctx->gamecode);
+	AddOption(str, "makercode", ctx->makercode);
+	AddOption(str, "romversion", ctx->romversion);
+	AddOption(str, "latency", (ctx->latency_1 << 16) | ctx->latency_2);
+	AddOption(str, "latency1", (ctx->latency1_1 << 16) | ctx->latency1_2);
+	AddOption(str, "arm9ram", ctx->arm9RamAddress);
+	AddOption(str, "arm7ram", ctx->arm7RamAddress);
+	AddOption(str, "arm9entry", ctx->arm9Entry);
+	AddOption(str, "arm7entry", ctx->arm7Entry);
+	AddOption(str, "unitcode", ctx->unitCode);
+	AddOption(str, "tidhigh", ctx->titleidHigh);
+	AddOption(str, "scfgextmask", ctx->scfgExtMask);
+	AddOption(str, "accesscontrol", ctx->accessControl);
+	AddOption(str, "appflags", ctx->appFlags);
+	AddOption(str, "arm7wrammap", ctx->mbkArm7WramMapAddress);
+	AddOption(str, "loadme", ctx->loadmeEnabled);
+	AddOption(str, "filealignment", ctx->file_alignment);
+	AddOption(str, "dedup", ctx->dedup_files);
+	AddOption(str, "overlaydir", ctx->overlaydir);
+	for (int i = 0; i < ctx->filerootdirs_num; i++)
+		AddOption(str, "rootdir", ctx->filerootdirs[i]);
+
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	sha1(digest, (const unsigned char *)str.data(), str.size());
+	return DigestToString(digest);
+}
+
+std::vector<std::string> SplitLine(const std::string &line)
+{
+	std::vector<std::string> fields;
+	size_t start = 0;
+	while (1)
+	{
+		size_t end = line.find('\t', start);
+		if (end == std::string::npos)
+		{
+			fields.push_back(line.substr(start));
+			return fields;
+		}
+		fields.push_back(line.substr(start, end - start));
+		start = end + 1;
+	}
+}
+
+bool LoadManifest(const char *filename, Manifest &manifest)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	std::string data;
+	char buf[4096];
+	size_t size;
+	while ((size = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, size);
+	fclose(f);
+
+	manifest = Manifest();
+
+	size_t start = 0;
+	bool first = true;
+	while (start < data.size())
+	{
+		size_t end = data.find('\n', start);
+		if (end == std::string::npos)
+			return false; // Truncated file
+
+		std::string line = data.substr(start, end - start);
+		start = end + 1;
+
+		if (first)
+		{
+			if (line != MANIFEST_MAGIC)
+				return false;
+			first = false;
+			continue;
+		}
+
+		std::vector<std::string> fields = SplitLine(line);
+
+		if ((fields[0] == "options") && (fields.size() == 2))
+		{
+			manifest.options = fields[1];
+		}
+		else if ((fields[0] == "tree") && (fields.size() == 2))
+		{
+			manifest.tree = fields[1];
+		}
+		else if ((fields[0] == "rom") && (fields.size() == 3))
+		{
+			manifest.rom_size = strtoull(fields[1].c_str(), 0, 0);
+			manifest.rom_mtime = strtoull(fields[2].c_str(), 0, 0);
+		}
+		else if ((fields[0] == "file") && (fields.size() == 8))
+		{
+			// Files are stored in order, so the ID is only used as a check
+			if (strtoul(fields[1].c_str(), 0, 0) != manifest.files.size())
+				return false;
+
+			ManifestFile file;
+			file.top = strtoul(fields[2].c_str(), 0, 0);
+			file.bottom = strtoul(fields[3].c_str(), 0, 0);
+			file.mtime = strtoull(fields[4].c_str(), 0, 0);
+			if (!StringToDigest(fields[5], file.sha1))
+				return false;
+			file.nitro_path = Unescape(fields[6]);
+			file.fs_path = Unescape(fields[7]);
+
+			if (file.bottom < file.top)
+				return false;
+
+			manifest.files.push_back(file);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return !first;
+}
+
+bool SaveManifest(const char *filename, const Manifest &manifest)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	fprintf(f, MANIFEST_MAGIC "\n");
+	fprintf(f, "options\t%s\n", manifest.options.c_str());
+	fprintf(f, "tree\t%s\n", manifest.tree.c_str());
+	fprintf(f, "rom\t%" PRIu64 "\t%" PRIu64 "\n", manifest.rom_size, manifest.rom_mtime);
+
+	for (size_t i = 0; i < manifest.files.size(); i++)
+	{
+		const ManifestFile &file = manifest.files[i];
+		fprintf(f, "file\t%zu\t0x%X\t0x%X\t%" PRIu64 "\t%s\t%s\t%s\n", i,
+				file.top, file.bottom, file.mtime, DigestToString(file.sha1).c_str(),
+				Escape(file.nitro_path).c_str(), Escape(file.fs_path).c_str());
+	}
+
+	bool ok = (ferror(f) == 0);
+	if (fclose(f) != 0)
+		ok = false;
+
+	return ok;
+}
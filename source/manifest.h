@@ -0,0 +1,49 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "sha1.h"
+
+// Build manifest. When a ROM is created with -inc it's saved next to the ROM as
+// "file.nds.manifest". The next build with -inc uses it to find out which
+// NitroFS files have changed and where they are stored in the ROM.
+
+struct ManifestFile
+{
+	std::string nitro_path;		// path of the file in NitroFS
+	std::string fs_path;		// full path to the file in the host PC
+	unsigned int top;			// FAT entry of the file
+	unsigned int bottom;
+	uint64_t mtime;				// modification time of the host file
+	unsigned char sha1[SHA1_DIGEST_SIZE];	// hash of the contents of the file
+};
+
+struct Manifest
+{
+	std::string options;		// hash of the options and all non-NitroFS inputs
+	std::string tree;			// hash of the NitroFS directory structure
+	uint64_t rom_size = 0;		// size and modification time of the ROM built
+	uint64_t rom_mtime = 0;		// by ndstool
+	std::vector<ManifestFile> files;	// indexed by file ID
+};
+
+std::string GetManifestFilename(const char *ndsfilename);
+
+// Hash of all the options used to create a ROM and all the input files that
+// aren't part of NitroFS. If it changes, the ROM needs to be rebuilt.
+std::string GetOptionsHash(void);
+
+std::string DigestToString(const unsigned char digest[SHA1_DIGEST_SIZE]);
+
+// Helpers for files made of tab-separated lines. Paths are escaped so that they
+// can contain tabs, newlines and backslashes.
+std::string Escape(const std::string &str);
+std::string Unescape(const std::string &str);
+std::vector<std::string> SplitLine(const std::string &line);
+
+bool LoadManifest(const char *filename, Manifest &manifest);
+bool SaveManifest(const char *filename, const Manifest &manifest);
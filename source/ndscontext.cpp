@@ -0,0 +1,11 @@
+#include <string.h>
+
+#include "ndscontext.h"
+
+thread_local NdsContext *ctx = NULL;
+
+NdsContext::NdsContext()
+{
+	// The fields of the header don't have default values
+	memset((void *)&header, 0, sizeof(header));
+}
@@ -0,0 +1,185 @@
+
+#pragma once
+
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "little.h"
+#include "banner.h"
+#include "digest.h"
+#include "filemask.h"
+#include "header.h"
+#include "ioengine.h"
+#include "manifest.h"
+#include "ndscreate.h"
+#include "ndstree.h"
+
+#define MAX_FILEROOTDIRS	32
+
+#define MAX_EXTRACTFILES	64
+
+class TarWriter;
+
+enum { SCAN_FORMAT_JSON, SCAN_FORMAT_CSV };
+
+// All the state of an operation on a ROM: the options, the ROM that is open,
+// the NitroFS tree and the intermediate data of the create, extract and verify
+// operations. Nothing is shared between contexts, so several ROMs can be
+// processed at the same time from different threads, each one with its own
+// context.
+//
+// The code of ndstool accesses the context of the current operation with the
+// "ctx" pointer. It's set by NdsContextScope, and the worker threads started by
+// ParallelFor() inherit the context of the thread that started them.
+struct NdsContext
+{
+	NdsContext();
+
+	// Options
+
+	int verbose = 0;
+
+	char *ndsfilename = 0;
+	char *arm7filename = 0;
+	char *arm9filename = 0;
+	char *arm7ifilename = 0;
+	char *arm9ifilename = 0;
+
+	int filerootdirs_num = 0;
+	char *filerootdirs[MAX_FILEROOTDIRS] = {};
+
+	FileMaskSet filemasks;
+
+	char *extractfile_names[MAX_EXTRACTFILES] = {};
+	char *extractfile_outputs[MAX_EXTRACTFILES] = {};
+	int extractfile_num = 0;
+
+	char *overlaydir = 0;
+	char *arm7ovltablefilename = 0;
+	char *arm9ovltablefilename = 0;
+	const char *bannerfilename = 0;
+	const char *banneranimfilename = 0;
+	const char *bannertext[MAX_BANNER_TITLE_COUNT] = {};
+	int bannertype = 0;
+	unsigned int file_alignment = 0x200;
+	bool incremental_build = false;
+	bool dedup_files = false;
+	char *headerfilename_or_size = 0;
+	char *logofilename = 0;
+	char *rsakeyfilename = 0;
+	char *scancachefilename = 0;
+	char *tarfilename = 0;
+	char *title = 0;
+	char *makercode = 0;
+	char *gamecode = 0;
+	int latency_1 = 0;
+	int latency_2 = 24;
+	int latency1_1 = 2296;
+	int latency1_2 = 24;
+	unsigned int romversion = 0;
+	bool loadmeEnabled = false;
+
+	unsigned int arm9RamAddress = 0;
+	unsigned int arm7RamAddress = 0;
+	unsigned int arm9Entry = 0;
+	unsigned int arm7Entry = 0;
+	int unitCode = -1;
+
+	// By default declare DSi-compatible games as DSiware. There is no way to
+	// create a DSi cartridge that works on regular unmodified consoles because
+	// they would need to be signed. However, some people install DSi ROMs in
+	// DSi NAND, where the DSiware ID makes more sense. Homebrew loaders
+	// generally ignore this value, but some of them require the DSiware ID to
+	// provide the device list to the application when it boots.
+	//unsigned int titleidHigh = 0x00030000; // DSi-enhanced gamecard
+	unsigned int titleidHigh = 0x00030004; // DSiware
+
+	unsigned int scfgExtMask = 0x80040407; // enable access to everything
+	unsigned int accessControl = 0x00000138;
+	unsigned int mbkArm7WramMapAddress = 0;
+	unsigned int appFlags = 0x01;
+
+	unsigned int num_threads = 0;		// 0 means "one per CPU"
+	int io_engine = IO_ENGINE_POSIX;
+	unsigned int io_queue_depth = 64;	// number of files copied at the same time
+
+	std::vector<const char *> scanpaths;	// ROMs or directories to walk
+	int scan_format = SCAN_FORMAT_JSON;
+	bool scan_hashes = false;				// CRC32 and SHA1 of each ROM
+
+	const char *catalogfilename = 0;
+	const char *catalog_command = 0;
+	std::vector<const char *> catalog_args;
+
+	// Messages are printed to stdout if it's NULL
+	FILE *log_output = 0;
+
+	// Message of the error that stopped the last operation, if any
+	std::string error;
+
+	// ROM that is being processed
+
+	FILE *fNDS = 0;
+	Header header;
+	unsigned int bannersize = 0x840;
+
+	// NitroFS tree
+
+	unsigned int _entry_start = 0;		// current position in name entry table
+	unsigned int file_top = 0;			// current position to write new file to
+	unsigned int free_dir_id = 0xF000;	// incremented in ReadDirectory
+	unsigned int directory_count = 0;	// incremented in ReadDirectory
+	unsigned int file_count = 0;		// incremented in ReadDirectory
+	unsigned int total_name_size = 0;	// incremented in ReadDirectory
+	unsigned int file_end = 0;			// end of all file data. updated in PlanFile
+	unsigned int free_file_id = 0;		// incremented in PlanDirectory
+
+	TreeArena tree_arena;
+
+	// Create
+
+	unsigned int overlay_files = 0;
+
+	std::vector<FileCopyJob> copy_jobs;
+	std::vector<unsigned char> fnt_data;
+	std::vector<unsigned char> fat_data;
+
+	// Manifest of the ROM that is being built. Only used with -inc.
+	Manifest build_manifest;
+
+	std::unordered_map<std::string, std::string> dedup_keys;	// host path -> key
+	std::unordered_map<std::string, DedupRange> dedup_ranges;	// key -> first copy
+	unsigned int dedup_count = 0;
+	unsigned int dedup_bytes_saved = 0;
+
+	FILE *digest_file = 0;
+	DigestRegion digest_regions[DIGEST_REGION_COUNT] = {};
+
+	// Extract
+
+	TarWriter *extract_tar = 0;
+
+	// Verify
+
+	bool verify_ok = false;
+	std::vector<std::string> verify_results;
+};
+
+extern thread_local NdsContext *ctx;
+
+// Makes a context the current one of this thread until the scope ends.
+class NdsContextScope
+{
+public:
+	NdsContextScope(NdsContext &context) : previous(ctx) { ctx = &context; }
+	~NdsContextScope() { ctx = previous; }
+
+	NdsContextScope(const NdsContextScope &) = delete;
+	NdsContextScope &operator=(const NdsContextScope &) = delete;
+
+private:
+	NdsContext *previous;
+};
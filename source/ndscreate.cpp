@@ -1,6 +1,9 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 
 #include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <time.h>
 #include <unistd.h>
@@ -15,6 +18,12 @@
 #include "elf.h"
 #include "sha1.h"
 #include "crc.h"
+#include "digest.h"
+#include "fileio.h"
+#include "ioengine.h"
+#include "manifest.h"
+#include "parallel.h"
+#include "scancache.h"
 
 static const long arm9_align = 0x1FF;
 static const long arm7_min = 0x8000;
@@ -25,8 +34,6 @@ static const long banner_align = 0x1FF;
 static const long file_align = 0x1FF;	// 0x3 0x1FF
 static const long sector_align = 0x3FF;
 
-unsigned int overlay_files = 0;
-
 unsigned char romcontrol[] = { 0x00,0x60,0x58,0x00,0xF8,0x08,0x18,0x00 };
 
 const unsigned char nintendo_logo[] =
@@ -51,14 +58,36 @@ const unsigned char hmac_sha1_key[] =
 	0x32,0x67,0x8D,0xFE,0xCA,0x83,0x64,0x98,0xAC,0xFD,0x3E,0x37,0x87,0x46,0x58,0x24,
 };
 
-void Sha1Hmac(u8 output[20], FILE* f, unsigned int pos, unsigned int size)
+/*
+ * Sha1HmacBegin
+ */
+void Sha1HmacBegin(sha1_ctx cx[1])
 {
-	sha1_ctx cx[1];
-	u8 readbuf[4096];
 	u8 keypad[0x40];
 	for (int i = 0; i < 0x40; i ++) keypad[i] = hmac_sha1_key[i]^0x36;
 	sha1_begin(cx);
 	sha1_hash(keypad, 0x40, cx);
+}
+
+/*
+ * Sha1HmacEnd
+ */
+void Sha1HmacEnd(u8 output[20], sha1_ctx cx[1])
+{
+	u8 keypad[0x40];
+	sha1_end(output, cx);
+	for (int i = 0; i < 0x40; i ++) keypad[i] = hmac_sha1_key[i]^0x5c;
+	sha1_begin(cx);
+	sha1_hash(keypad, 0x40, cx);
+	sha1_hash(output, 20, cx);
+	sha1_end(output, cx);
+}
+
+void Sha1Hmac(u8 output[20], FILE* f, unsigned int pos, unsigned int size)
+{
+	sha1_ctx cx[1];
+	u8 readbuf[4096];
+	Sha1HmacBegin(cx);
 
 	long tmp = ftell(f);
 	if (tmp < 0)
@@ -76,12 +105,7 @@ void Sha1Hmac(u8 output[20], FILE* f, unsigned int pos, unsigned int size)
 		sha1_hash(readbuf, rdbytes, cx);
 		size -= rdbytes;
 	}
-	sha1_end(output, cx);
-	for (int i = 0; i < 0x40; i ++) keypad[i] = hmac_sha1_key[i]^0x5c;
-	sha1_begin(cx);
-	sha1_hash(keypad, 0x40, cx);
-	sha1_hash(output, 20, cx);
-	sha1_end(output, cx);
+	Sha1HmacEnd(output, cx);
 
 	if (fseek(f, tmp, SEEK_SET) == -1)
 		LogFatal("%s: Failed to restore previous position\n", __func__);
@@ -118,7 +142,8 @@ bool HasElfHeader(char *filename)
  */
 int CopyFromBin(const char *binFilename, unsigned int *size = 0, unsigned int *size_without_footer = 0)
 {
-	FILE *fi = fopen(binFilename, "rb");
+	ScopedFile file(fopen(binFilename, "rb"));
+	FILE *fi = file.Get();
 	if (!fi)
 		LogFatal("Cannot open file '%s'.\n", binFilename);
 
@@ -128,7 +153,7 @@ int CopyFromBin(const char *binFilename, unsigned int *size = 0, unsigned int *s
 	{
 		size_t bytesread = fread(buffer, 1, sizeof(buffer), fi);
 		if (bytesread == 0) break;
-		if (fwrite(buffer, 1, bytesread, fNDS) != bytesread)
+		if (RomWrite(buffer, bytesread, ctx->fNDS) != bytesread)
 			LogFatal("%s: Failed to write data\n");
 
 		_size += bytesread;
@@ -151,15 +176,54 @@ int CopyFromBin(const char *binFilename, unsigned int *size = 0, unsigned int *s
 			*size_without_footer = _size;
 	}
 
-	fclose(fi);
 	return 0;
 }
 
+/*
+ * Filesystem layout
+ *
+ * NitroFS files are added in two steps. First, the layout of the filesystem is
+ * planned: the FNT and FAT are built in memory and every file gets its final
+ * offset in the ROM. Then, the contents of the files are copied to their final
+ * location by a pool of threads. The FNT and FAT are written at the end.
+ *
+ * With -dedup, files with identical contents are only stored once. Files are
+ * identified by the SHA1 of their contents followed by their size.
+ */
+
+/*
+ * FntWrite
+ * Writes data to the FNT that is being built in memory.
+ */
+static void FntWrite(unsigned int offset, const void *data, size_t size)
+{
+	if (offset + size > ctx->fnt_data.size())
+		ctx->fnt_data.resize(offset + size);
+
+	memcpy(ctx->fnt_data.data() + offset, data, size);
+}
+
+/*
+ * GetHostFileInfo
+ */
+static void GetHostFileInfo(const char *path, unsigned int *size, uint64_t *mtime)
+{
+	struct stat st;
+	if (stat(path, &st))
+		LogFatal("Cannot open file '%s'.\n", path);
+
+	*size = st.st_size;
+	*mtime = GetFileMtime(st);
+}
+
 // If fs_path is provided, it will be used as the full path of the file in the
-// filesystem of the host. If it isn't, it will be formed from the other
-// arguments as "rootdir + prefix + entry_name".
-static void AddFile(const char *fs_path, const char *rootdir, const char *prefix,
-					const char *entry_name, unsigned int file_id)
+// filesystem of the host and size and mtime must be the size and modification
+// time of the file. If it isn't, it will be formed from the other arguments as
+// "rootdir + prefix + entry_name" and the size and modification time will be
+// read from the filesystem of the host.
+static void PlanFile(const char *fs_path, const char *rootdir, const char *prefix,
+					 const char *entry_name, unsigned int file_id, unsigned int size,
+					 uint64_t mtime)
 {
 	// Make filename
 	char strbuf[MAXPATHLEN];
@@ -173,194 +237,740 @@ static void AddFile(const char *fs_path, const char *rootdir, const char *prefix
 		strcpy(strbuf, rootdir);
 		strcat(strbuf, prefix);
 		strcat(strbuf, entry_name);
-	}
 
-	file_top = (file_top + file_align) &~ file_align;
-	if (fseek(fNDS, file_top, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek file offset\n", __func__);
+		GetHostFileInfo(strbuf, &size, &mtime);
+	}
 
-	FILE *fi = fopen(strbuf, "rb");
-	if (!fi)
-		LogFatal("Cannot open file '%s'.\n", strbuf);
+	// If the same contents have already been added, point to them
+	const std::string *dedup_key = NULL;
+	const DedupRange *dedup_range = NULL;
+	if (ctx->dedup_files)
+	{
+		auto key = ctx->dedup_keys.find(strbuf);
+		if (key != ctx->dedup_keys.end())
+		{
+			dedup_key = &key->second;
 
-	if (fseek(fi, 0, SEEK_END) == -1)
-		LogFatal("%s: Failed to seek file end\n", __func__);
+			auto range = ctx->dedup_ranges.find(*dedup_key);
+			if (range != ctx->dedup_ranges.end())
+				dedup_range = &range->second;
+		}
+	}
 
-	long position = ftell(fi);
-	if (position < 0)
-		LogFatal("%s: Failed to get file size\n", __func__);
+	unsigned int data_top;
+	unsigned int data_bottom;
 
-	unsigned int size = position;
+	if (dedup_range)
+	{
+		data_top = dedup_range->top;
+		data_bottom = dedup_range->bottom;
+	}
+	else
+	{
+		unsigned int payload_align = ctx->file_alignment - 1;
+		ctx->file_top = (ctx->file_top + payload_align) &~ payload_align;
 
-	unsigned int file_bottom = file_top + size;
-	if (fseek(fi, 0, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek file start\n", __func__);
+		data_top = ctx->file_top;
+		data_bottom = ctx->file_top + size;
+	}
 
 	// print
-	if (verbose)
+	if (ctx->verbose)
 	{
-		printf("%5u 0x%08X 0x%08X %9u %s%s\n", file_id, file_top, file_bottom, size, prefix, entry_name);
+		printf("%5u 0x%08X 0x%08X %9u %s%s\n", file_id, data_top, data_bottom, size, prefix, entry_name);
 	}
 
-	// write data
-	unsigned int sizeof_copybuf = 256*1024;
-	unsigned char *copybuf = new unsigned char [sizeof_copybuf];
-	while (size > 0)
+	unsigned char *sha1_out = NULL;
+	if (ctx->incremental_build)
 	{
-		unsigned int size2 = (size >= sizeof_copybuf) ? sizeof_copybuf : size;
-
-		if (fread(copybuf, 1, size2, fi) != size2)
-			LogFatal("%s: Failed to read file data\n", __func__);
-
-		if (fwrite(copybuf, 1, size2, fNDS) != size2)
-			LogFatal("%s: Failed to write file data\n", __func__);
-
-		size -= size2;
+		ManifestFile &mf = ctx->build_manifest.files[file_id];
+		mf.nitro_path = std::string(prefix) + entry_name;
+		mf.fs_path = strbuf;
+		mf.top = data_top;
+		mf.bottom = data_bottom;
+		mf.mtime = mtime;
+
+		if (dedup_key)
+		{
+			// The hash is already known
+			memcpy(mf.sha1, dedup_key->data(), SHA1_DIGEST_SIZE);
+		}
+		else
+		{
+			sha1(mf.sha1, NULL, 0); // Only used if the file is empty
+			sha1_out = mf.sha1;
+		}
 	}
-	delete [] copybuf;
-	fclose(fi);
 
-	long new_position = ftell(fNDS);
-	if (new_position < 0)
-		LogFatal("%s: Failed to get current position\n", __func__);
+	// FAT entry
+	unsigned_int top = data_top;
+	unsigned_int bottom = data_bottom;
+	memcpy(ctx->fat_data.data() + 8*file_id, &top, sizeof(top));
+	memcpy(ctx->fat_data.data() + 8*file_id + 4, &bottom, sizeof(bottom));
 
-	size_t real_file_end = new_position;
-	if (real_file_end > file_end)
-		file_end = real_file_end;
+	if (dedup_range)
+	{
+		// There is nothing to copy
+		ctx->dedup_count++;
+		ctx->dedup_bytes_saved += size;
+		return;
+	}
 
-	// write fat
-	if (fseek(fNDS, header.fat_offset + 8*file_id, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek FAT offset\n", __func__);
+	if (dedup_key)
+		ctx->dedup_ranges[*dedup_key] = { data_top, data_bottom };
 
-	unsigned_int top = file_top;
-	if (fwrite(&top, 1, sizeof(top), fNDS) != sizeof(top))
-		LogFatal("%s: Failed to write FAT top offset\n", __func__);
+	if (size > 0)
+	{
+		ctx->copy_jobs.push_back({ strbuf, data_top, size, file_id, sha1_out });
+		DigestTouch(data_top, size);
+	}
 
-	unsigned_int bottom = file_bottom;
-	if (fwrite(&bottom, 1, sizeof(bottom), fNDS) != sizeof(bottom))
-		LogFatal("%s: Failed to write FAT bottom offset\n", __func__);
+	if (data_bottom > ctx->file_end)
+		ctx->file_end = data_bottom;
 
-	file_top = file_bottom;
+	ctx->file_top = data_bottom;
 }
 
 /*
- * AddDirectory
- * Walks the tree and adds files to NDS
+ * PlanDirectory
+ * Walks the tree, adds the directory to the FNT and plans the location of all
+ * files.
  */
-void AddDirectory(TreeNode *node, const char *prefix, unsigned int this_dir_id, unsigned int _parent_id)
+void PlanDirectory(TreeDirectory *dir, const char *prefix, unsigned int this_dir_id, unsigned int _parent_id)
 {
-	// skip dummy node
-	node = node->next;
-
-	if (verbose) printf("%s\n", prefix);
+	if (ctx->verbose) printf("%s\n", prefix);
 
-	// write directory info
-	if (fseek(fNDS, header.fnt_offset + 8*(this_dir_id & 0xFFF), SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek FNT start offset\n", __func__);
+	// directory info
+	unsigned int dir_offset = 8*(this_dir_id & 0xFFF);
 
-	unsigned_int entry_start = _entry_start;	// reference location of entry name
-	if (fwrite(&entry_start, 1, sizeof(entry_start), fNDS) != sizeof(entry_start))
-		LogFatal("%s: Failed to write FNT start offset\n", __func__);
+	unsigned_int entry_start = ctx->_entry_start;	// reference location of entry name
+	FntWrite(dir_offset + 0, &entry_start, sizeof(entry_start));
 
-	unsigned int _top_file_id = free_file_id;
+	unsigned int _top_file_id = ctx->free_file_id;
 	unsigned_short top_file_id = _top_file_id;	// file ID of top entry
-	if (fwrite(&top_file_id, 1, sizeof(top_file_id), fNDS) != sizeof(top_file_id))
-		LogFatal("%s: Failed to write ID of top entry\n", __func__);
+	FntWrite(dir_offset + 4, &top_file_id, sizeof(top_file_id));
 
 	unsigned_short parent_id = _parent_id;	// ID of parent directory or directory count (root)
-	if (fwrite(&parent_id, 1, sizeof(parent_id), fNDS) != sizeof(parent_id))
-		LogFatal("%s: Failed to write ID of parent directory\n", __func__);
-
-	//printf("dir %X file_id %u +\n", this_dir_id, (int)top_file_id);
+	FntWrite(dir_offset + 6, &parent_id, sizeof(parent_id));
 
 	// directory entrynames
 	{
-		// start of directory entrynames
-		if (fseek(fNDS, header.fnt_offset + _entry_start, SEEK_SET) == -1)
-			LogFatal("%s: Failed to seek first directory entry\n", __func__);
-
 		// write filenames
-		for (TreeNode *t=node; t; t=t->next)
+		for (TreeNode &t : dir->children)
 		{
-			if (!t->directory)
+			if (!t.directory)
 			{
-				size_t namelen = strlen(t->name);
+				size_t namelen = t.name_length;
 
 				// Bit 7 cleared means this is a file
-				if (fputc(namelen, fNDS) == EOF)
-					LogFatal("%s: Failed to write file name length\n", __func__);
-				_entry_start += 1;
+				unsigned char type_len = namelen;
+				FntWrite(ctx->_entry_start, &type_len, 1);
+				ctx->_entry_start += 1;
 
-				if (fwrite(t->name, 1, namelen, fNDS) != namelen)
-					LogFatal("%s: Failed to write file name\n", __func__);
-				_entry_start += namelen;
+				FntWrite(ctx->_entry_start, t.Name(), namelen);
+				ctx->_entry_start += namelen;
 
-				//printf("[ %s -> %u ]\n", t->name, free_file_id);
-
-				free_file_id++;
+				ctx->free_file_id++;
 			}
 		}
 
 		// write directorynames
-		for (TreeNode *t=node; t; t=t->next)
+		for (TreeNode &t : dir->children)
 		{
-			if (t->directory)
+			if (t.directory)
 			{
-				//printf("*entry %s\n", t->name);
-				size_t namelen = strlen(t->name);
-
-				// Bit 7 set means this is a file
-				if (fputc(namelen | (1 << 7), fNDS) == EOF)
-					LogFatal("%s: Failed to write directory name length\n", __func__);
-				_entry_start += 1;
+				size_t namelen = t.name_length;
 
-				if (fwrite(t->name, 1, namelen, fNDS) != namelen)
-					LogFatal("%s: Failed to write directory name\n", __func__);
-				_entry_start += namelen;
+				// Bit 7 set means this is a directory
+				unsigned char type_len = namelen | (1 << 7);
+				FntWrite(ctx->_entry_start, &type_len, 1);
+				ctx->_entry_start += 1;
 
-				//printf("[ %s -> %X ]\n", t->name, t->dir_id);
+				FntWrite(ctx->_entry_start, t.Name(), namelen);
+				ctx->_entry_start += namelen;
 
-				unsigned_short _dir_id_tmp = t->dir_id;
-				if (fwrite(&_dir_id_tmp, 1, sizeof(_dir_id_tmp), fNDS) != sizeof(_dir_id_tmp))
-					LogFatal("%s: Failed to write directory ID\n", __func__);
-				_entry_start += sizeof(_dir_id_tmp);
+				unsigned_short _dir_id_tmp = t.dir_id;
+				FntWrite(ctx->_entry_start, &_dir_id_tmp, sizeof(_dir_id_tmp));
+				ctx->_entry_start += sizeof(_dir_id_tmp);
 			}
 		}
 
 		// end of directory entrynames
-		if (fputc(0, fNDS) == EOF)
-			LogFatal("%s: Failed to write end of directory list\n", __func__);
-		_entry_start += 1;
+		unsigned char end = 0;
+		FntWrite(ctx->_entry_start, &end, 1);
+		ctx->_entry_start += 1;
 	}
 
 	// add files
 	unsigned int local_file_id = _top_file_id;
-	for (TreeNode *t=node; t; t=t->next)
+	for (TreeNode &t : dir->children)
 	{
-		//printf("*2* %s\n", t->name);
-
-		if (!t->directory)
+		if (!t.directory)
 		{
-			AddFile(t->fs_path, NULL, prefix, t->name, local_file_id++);
+			PlanFile(t.Path().c_str(), NULL, prefix, t.Name(), local_file_id++, t.size, t.mtime);
 		}
 	}
 
 	// add subdirectories
-	for (TreeNode *t=node; t; t=t->next)
+	for (TreeNode &t : dir->children)
 	{
-		//printf("*2* %s\n", t->name);
-
-		if (t->directory)
+		if (t.directory)
 		{
 			char strbuf[MAXPATHLEN];
 			strcpy(strbuf, prefix);
-			strcat(strbuf, t->name);
+			strcat(strbuf, t.Name());
 			strcat(strbuf, "/");
-			AddDirectory(t->directory, strbuf, t->dir_id, this_dir_id);
+			PlanDirectory(t.directory, strbuf, t.dir_id, this_dir_id);
 		}
 	}
 }
 
+/*
+ * HashFileData
+ * Calculates the SHA1 of the first "size" bytes of a file. If fd_out isn't -1,
+ * the data is also copied to fd_out at the specified offset.
+ */
+static bool HashFileData(int fd_in, uint64_t size, unsigned char *digest,
+						 int fd_out, uint64_t out_offset)
+{
+	const size_t sizeof_hashbuf = 256 * 1024;
+	thread_local std::vector<unsigned char> hashbuf(sizeof_hashbuf);
+
+	sha1_ctx cx[1];
+	sha1_begin(cx);
+
+	uint64_t in_offset = 0;
+	while (size > 0)
+	{
+		size_t size2 = (size >= sizeof_hashbuf) ? sizeof_hashbuf : size;
+
+		if (!ReadAt(fd_in, hashbuf.data(), size2, in_offset))
+			return false;
+
+		sha1_hash(hashbuf.data(), size2, cx);
+
+		if (fd_out != -1)
+		{
+			if (!WriteAt(fd_out, hashbuf.data(), size2, out_offset + in_offset))
+				return false;
+		}
+
+		in_offset += size2;
+		size -= size2;
+	}
+
+	sha1_end(digest, cx);
+	return true;
+}
+
+/*
+ * CopyFile
+ * Copies the contents of one file to its planned location in the ROM.
+ */
+static void CopyFile(int fd, const FileCopyJob &job)
+{
+	ScopedFd fd_in(open(job.fs_path.c_str(), O_RDONLY | O_BINARY));
+	if (fd_in.Get() < 0)
+		LogFatal("Cannot open file '%s'.\n", job.fs_path.c_str());
+
+	bool ok;
+	if (job.sha1)
+		ok = HashFileData(fd_in.Get(), job.size, job.sha1, fd, job.top);
+	else
+		ok = CopyFileData(fd_in.Get(), 0, fd, job.top, job.size);
+
+	if (!ok)
+		LogFatal("%s: Failed to copy data of '%s'\n", __func__, job.fs_path.c_str());
+}
+
+/*
+ * CopyFiles
+ * Copies the contents of all planned files to the ROM.
+ */
+static void CopyFiles(void)
+{
+	// Everything written with stdio so far must be in the file before writing
+	// to it directly.
+	if (fflush(ctx->fNDS) != 0)
+		LogFatal("%s: Failed to flush ROM file\n", __func__);
+
+	int fd = fileno(ctx->fNDS);
+	std::vector<const FileCopyJob *> posix_jobs;
+	bool uring_done = false;
+
+	// With the io_uring engine, small files are copied by it
+	if (ctx->io_engine == IO_ENGINE_URING)
+	{
+		std::vector<IoCopyRequest> requests;
+		for (const FileCopyJob &job : ctx->copy_jobs)
+		{
+			if (job.size <= IO_URING_MAX_FILE_SIZE)
+				requests.push_back({ job.fs_path.c_str(), job.top, job.size, job.sha1 });
+			else
+				posix_jobs.push_back(&job);
+		}
+
+		uring_done = IoUringInsertFiles(fd, requests);
+		if (!uring_done)
+			LogWarning("io_uring isn't available, using the POSIX engine.\n");
+	}
+
+	if (!uring_done)
+	{
+		posix_jobs.clear();
+		for (const FileCopyJob &job : ctx->copy_jobs)
+			posix_jobs.push_back(&job);
+	}
+
+	ParallelFor(posix_jobs.size(), [&](size_t i)
+	{
+		CopyFile(fd, *posix_jobs[i]);
+	});
+
+	ctx->copy_jobs.clear();
+}
+
+/*
+ * CollectFiles
+ */
+static void CollectFiles(TreeDirectory *dir, std::vector<TreeNode *> &files)
+{
+	for (TreeNode &t : dir->children)
+	{
+		if (t.directory)
+			CollectFiles(t.directory, files);
+		else
+			files.push_back(&t);
+	}
+}
+
+/*
+ * HashDuplicateCandidates
+ * Only files with the same size as other files can have the same contents, so
+ * they are the only ones that need to be hashed to find duplicates.
+ */
+static void HashDuplicateCandidates(TreeDirectory *filetree)
+{
+	std::vector<TreeNode *> files;
+	CollectFiles(filetree, files);
+
+	std::unordered_map<unsigned int, unsigned int> files_per_size;
+	for (TreeNode *t : files)
+		files_per_size[t->size]++;
+
+	std::vector<TreeNode *> candidates;
+	for (TreeNode *t : files)
+	{
+		if ((t->size > 0) && (files_per_size[t->size] > 1))
+			candidates.push_back(t);
+	}
+
+	std::vector<std::string> keys(candidates.size());
+
+	ParallelFor(candidates.size(), [&](size_t i)
+	{
+		TreeNode *t = candidates[i];
+
+		std::string fs_path = t->Path();
+		ScopedFd fd_in(open(fs_path.c_str(), O_RDONLY | O_BINARY));
+		if (fd_in.Get() < 0)
+			LogFatal("Cannot open file '%s'.\n", fs_path.c_str());
+
+		unsigned char digest[SHA1_DIGEST_SIZE];
+		if (!HashFileData(fd_in.Get(), t->size, digest, -1, 0))
+			LogFatal("%s: Failed to read '%s'\n", __func__, fs_path.c_str());
+
+		keys[i].assign((const char *)digest, SHA1_DIGEST_SIZE);
+		keys[i].append((const char *)&t->size, sizeof(t->size));
+	});
+
+	for (size_t i = 0; i < candidates.size(); i++)
+		ctx->dedup_keys[candidates[i]->Path()] = keys[i];
+}
+
+/*
+ * ScanFileSystem
+ * Reads the directory structure of all NitroFS root directories.
+ */
+static TreeDirectory *ScanFileSystem(void)
+{
+	ctx->free_dir_id = 0xF001;		// 0xF000 is the root directory
+	ctx->directory_count = 1;
+	ctx->file_count = 0;
+	ctx->total_name_size = 0;
+
+	ctx->tree_arena.Clear();
+
+	ScanCache cache;
+	if (ctx->scancachefilename)
+		LoadScanCache(ctx->scancachefilename, cache);
+
+	TreeDirectory *filetree = ctx->tree_arena.NewDirectory();	// root directory 0xF000
+	for (int i = 0; i < ctx->filerootdirs_num; i++)
+		ReadDirectory(filetree, ctx->filerootdirs[i], ctx->scancachefilename ? &cache : NULL);
+
+	if (ctx->scancachefilename)
+	{
+		if (!SaveScanCache(ctx->scancachefilename, cache))
+			LogFatal("%s: Failed to save scan cache '%s'\n", __func__, ctx->scancachefilename);
+
+		if (ctx->verbose)
+			printf("Scan cache: %zu of %zu directories reused.\n", cache.reused, cache.new_dirs.size());
+	}
+
+	filetree->Sort();
+
+	return filetree;
+}
+
+/*
+ * HashTree
+ * Hashes the names of all directories and files, and the host files they come
+ * from. Files are visited in the same order as PlanDirectory() assigns them
+ * IDs, and they are added to "files" if it isn't NULL.
+ */
+static void HashTree(TreeDirectory *dir, const std::string &prefix, sha1_ctx cx[1],
+					 std::vector<TreeNode *> *files)
+{
+	std::string str = "D\t" + prefix + "\n";
+	sha1_hash((const unsigned char *)str.data(), str.size(), cx);
+
+	for (TreeNode &t : dir->children)
+	{
+		if (!t.directory)
+		{
+			str = "F\t" + prefix + t.Name() + "\t" + t.Path() + "\n";
+			sha1_hash((const unsigned char *)str.data(), str.size(), cx);
+
+			if (files)
+				files->push_back(&t);
+		}
+	}
+
+	for (TreeNode &t : dir->children)
+	{
+		if (t.directory)
+			HashTree(t.directory, prefix + t.Name() + "/", cx, files);
+	}
+}
+
+/*
+ * GetTreeHash
+ */
+static std::string GetTreeHash(TreeDirectory *filetree, std::vector<TreeNode *> *files)
+{
+	sha1_ctx cx[1];
+	sha1_begin(cx);
+	HashTree(filetree, "/", cx, files);
+
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	sha1_end(digest, cx);
+	return DigestToString(digest);
+}
+
+/*
+ * CalcDeviceCapacity
+ */
+static unsigned char CalcDeviceCapacity(unsigned int romsize)
+{
+	romsize |= romsize >> 16; romsize |= romsize >> 8;
+	romsize |= romsize >> 4; romsize |= romsize >> 2;
+	romsize |= romsize >> 1; romsize++;
+	if (romsize <= 128*1024) romsize = 128*1024;
+	int devcap = -18;
+	unsigned int x = romsize;
+	while (x != 0) { x >>= 1; devcap++; }
+	return (devcap < 0) ? 0 : devcap;
+}
+
+/*
+ * SaveBuildManifest
+ */
+static void SaveBuildManifest(const char *manifestfilename, const std::string &options_hash)
+{
+	struct stat st;
+	if (stat(ctx->ndsfilename, &st))
+		LogFatal("Cannot get stat of '%s'.\n", ctx->ndsfilename);
+
+	ctx->build_manifest.options = options_hash;
+	ctx->build_manifest.rom_size = st.st_size;
+	ctx->build_manifest.rom_mtime = GetFileMtime(st);
+
+	if (!SaveManifest(manifestfilename, ctx->build_manifest))
+		LogWarning("Failed to write manifest '%s'.\n", manifestfilename);
+}
+
+/*
+ * IncrementalBuildFailed
+ */
+static bool IncrementalBuildFailed(const char *reason)
+{
+	printf("Incremental build not possible (%s). Rebuilding ROM.\n", reason);
+	return false;
+}
+
+/*
+ * UpdateIncremental
+ * Updates a ROM built previously with -inc. Only the NitroFS files that have
+ * changed since the last build are copied. Files are overwritten in place if
+ * they fit in the space they used before, or they are moved to the end of the
+ * ROM if they don't. Returns false if the ROM needs to be built from scratch.
+ */
+static bool UpdateIncremental(const char *manifestfilename, const std::string &options_hash)
+{
+	Manifest manifest;
+	if (!LoadManifest(manifestfilename, manifest))
+		return IncrementalBuildFailed("no valid manifest");
+
+	if (manifest.options != options_hash)
+		return IncrementalBuildFailed("options or binaries changed");
+
+	struct stat st;
+	if (stat(ctx->ndsfilename, &st) || ((uint64_t)st.st_size != manifest.rom_size) ||
+		(GetFileMtime(st) != manifest.rom_mtime))
+		return IncrementalBuildFailed("ROM modified after the last build");
+
+	TreeDirectory *filetree = ScanFileSystem();
+	std::vector<TreeNode *> tree_files;
+	if ((GetTreeHash(filetree, &tree_files) != manifest.tree) ||
+		(tree_files.size() > manifest.files.size()))
+		return IncrementalBuildFailed("files added, removed or renamed");
+
+	// Get the current size and modification time of all files. Overlay files
+	// come first, and they are the ones that aren't in the tree.
+	unsigned int num_files = manifest.files.size();
+	unsigned int num_overlays = num_files - tree_files.size();
+	std::vector<unsigned int> sizes(num_files);
+	std::vector<uint64_t> mtimes(num_files);
+
+	for (unsigned int i = 0; i < num_files; i++)
+	{
+		if (i < num_overlays)
+		{
+			GetHostFileInfo(manifest.files[i].fs_path.c_str(), &sizes[i], &mtimes[i]);
+		}
+		else
+		{
+			sizes[i] = tree_files[i - num_overlays]->size;
+			mtimes[i] = tree_files[i - num_overlays]->mtime;
+		}
+	}
+
+	// Files with a new modification time but the same size are hashed to see
+	// if they have really changed.
+	std::vector<unsigned char> changed(num_files, false);
+	ParallelFor(num_files, [&](size_t i)
+	{
+		ManifestFile &mf = manifest.files[i];
+		if (mtimes[i] == mf.mtime)
+		{
+			changed[i] = (sizes[i] != mf.bottom - mf.top);
+			return;
+		}
+
+		if (sizes[i] != mf.bottom - mf.top)
+		{
+			changed[i] = true;
+			return;
+		}
+
+		ScopedFd fd_in(open(mf.fs_path.c_str(), O_RDONLY | O_BINARY));
+		if (fd_in.Get() < 0)
+			LogFatal("Cannot open file '%s'.\n", mf.fs_path.c_str());
+
+		unsigned char digest[SHA1_DIGEST_SIZE];
+		if (!HashFileData(fd_in.Get(), sizes[i], digest, -1, 0))
+			LogFatal("%s: Failed to read '%s'\n", __func__, mf.fs_path.c_str());
+
+		changed[i] = (memcmp(digest, mf.sha1, SHA1_DIGEST_SIZE) != 0);
+		mf.mtime = mtimes[i];
+	});
+
+	ctx->fNDS = fopen(ctx->ndsfilename, "rb+");
+	if (!ctx->fNDS)
+		return IncrementalBuildFailed("can't open ROM");
+
+	FullyReadHeader(ctx->fNDS, ctx->header);
+
+	// Check that the FAT of the ROM matches the manifest
+	std::vector<unsigned_int> fat(2 * num_files);
+	if ((ctx->header.fat_size != 8 * num_files) ||
+		(fseek(ctx->fNDS, ctx->header.fat_offset, SEEK_SET) == -1) ||
+		(fread(fat.data(), 8, num_files, ctx->fNDS) != num_files))
+	{
+		fclose(ctx->fNDS);
+		ctx->fNDS = NULL;
+		return IncrementalBuildFailed("FAT doesn't match manifest");
+	}
+
+	for (unsigned int i = 0; i < num_files; i++)
+	{
+		if ((fat[i * 2] != manifest.files[i].top) || (fat[i * 2 + 1] != manifest.files[i].bottom))
+		{
+			fclose(ctx->fNDS);
+			ctx->fNDS = NULL;
+			return IncrementalBuildFailed("FAT doesn't match manifest");
+		}
+	}
+
+	// Find the space available for each file. It goes until the start of the
+	// next file, or until the end of the NitroFS data for the last file. Files
+	// that share their space with non-empty files can't be overwritten.
+	std::vector<unsigned int> order(num_files);
+	for (unsigned int i = 0; i < num_files; i++)
+		order[i] = i;
+
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b)
+	{
+		return manifest.files[a].top < manifest.files[b].top;
+	});
+
+	unsigned int app_end = ctx->header.application_end_offset;
+	std::vector<unsigned int> limits(num_files);
+	std::vector<bool> shared(num_files, false);
+
+	for (unsigned int k = 0; k < num_files; )
+	{
+		unsigned int top = manifest.files[order[k]].top;
+		unsigned int end = k;
+		unsigned int non_empty = 0;
+		while ((end < num_files) && (manifest.files[order[end]].top == top))
+		{
+			const ManifestFile &mf = manifest.files[order[end]];
+			if (mf.bottom > mf.top)
+				non_empty++;
+			end++;
+		}
+
+		unsigned int limit = (end < num_files) ? manifest.files[order[end]].top : app_end;
+
+		for (; k < end; k++)
+		{
+			const ManifestFile &mf = manifest.files[order[k]];
+			unsigned int others = non_empty - ((mf.bottom > mf.top) ? 1 : 0);
+			shared[order[k]] = (others > 0);
+			limits[order[k]] = (others > 0) ? top : limit;
+		}
+	}
+
+	// Files can only be moved to the end of the ROM if there is nothing after
+	// the NitroFS data, which means that this isn't a DSi ROM.
+	bool can_relocate = !(ctx->header.unitcode & 2) && ((uint64_t)st.st_size == app_end);
+
+	unsigned int new_app_end = app_end;
+	std::vector<std::pair<unsigned int, unsigned int>> unused; // offset, size
+	std::vector<unsigned int> updated;
+
+	for (unsigned int i = 0; i < num_files; i++)
+	{
+		if (!changed[i])
+			continue;
+
+		updated.push_back(i);
+
+		ManifestFile &mf = manifest.files[i];
+		unsigned int old_top = mf.top;
+		unsigned int old_bottom = mf.bottom;
+		unsigned int size = sizes[i];
+
+		if (size > limits[i] - old_top)
+		{
+			if (!can_relocate)
+			{
+				fclose(ctx->fNDS);
+				ctx->fNDS = NULL;
+				return IncrementalBuildFailed("a file doesn't fit in its old location");
+			}
+
+			unsigned int payload_align = ctx->file_alignment - 1;
+			mf.top = (new_app_end + payload_align) &~ payload_align;
+			new_app_end = (mf.top + size + 3) &~ 3;
+
+			if (!shared[i])
+				unused.push_back({ old_top, old_bottom - old_top });
+		}
+		else if (!shared[i] && (size < old_bottom - old_top))
+		{
+			// The data of shared files is still used by the other files, even
+			// if this one has become smaller or empty
+			unused.push_back({ old_top + size, old_bottom - old_top - size });
+		}
+
+		mf.bottom = mf.top + size;
+		mf.mtime = mtimes[i];
+		sha1(mf.sha1, NULL, 0); // Only used if the file is empty
+
+		if (size > 0)
+			ctx->copy_jobs.push_back({ mf.fs_path, mf.top, size, i, mf.sha1 });
+	}
+
+	if (updated.size() > 0)
+	{
+		if (ctx->verbose)
+		{
+			for (unsigned int i : updated)
+			{
+				const ManifestFile &mf = manifest.files[i];
+				printf("%5u 0x%08X 0x%08X %9u %s\n", i, mf.top, mf.bottom,
+					   mf.bottom - mf.top, mf.nitro_path.c_str());
+			}
+		}
+
+		// Go back to the start of the file so that the stream can be used
+		// for writing after reading from it.
+		if (fseek(ctx->fNDS, 0, SEEK_SET) == -1)
+			LogFatal("%s: Failed to seek ROM start\n", __func__);
+
+		CopyFiles();
+
+		int fd = fileno(ctx->fNDS);
+
+		// Clear the space that isn't used anymore
+		static const unsigned char zeroes[4096] = { 0 };
+		for (auto &u : unused)
+		{
+			for (unsigned int offset = 0; offset < u.second; offset += sizeof(zeroes))
+			{
+				unsigned int size = std::min<unsigned int>(u.second - offset, sizeof(zeroes));
+				if (!WriteAt(fd, zeroes, size, u.first + offset))
+					LogFatal("%s: Failed to clear unused space\n", __func__);
+			}
+		}
+
+		// Update the FAT entries of the files that have changed
+		for (unsigned int i : updated)
+		{
+			const ManifestFile &mf = manifest.files[i];
+			unsigned_int entry[2] = { mf.top, mf.bottom };
+			if (!WriteAt(fd, entry, sizeof(entry), ctx->header.fat_offset + 8 * i))
+				LogFatal("%s: Failed to write FAT entry\n", __func__);
+		}
+
+		// Files have been added to the end of the ROM
+		if (new_app_end != app_end)
+		{
+			if (ftruncate(fd, new_app_end) != 0)
+				LogFatal("%s: Failed to resize ROM\n", __func__);
+
+			ctx->header.application_end_offset = new_app_end;
+			ctx->header.devicecap = CalcDeviceCapacity(new_app_end);
+			ctx->header.header_crc = CalcHeaderCRC(ctx->header);
+
+			if (!WriteAt(fd, &ctx->header, 0x200, 0))
+				LogFatal("%s: Failed to write header\n", __func__);
+		}
+	}
+
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
+
+	printf("Incremental build: %zu of %u files updated.\n", updated.size(), num_files);
+
+	// Save the new state of the ROM
+	ctx->build_manifest = manifest;
+	return true;
+}
+
 /*
  * GetDefaultArm7
  * Retrieves the path to the default homebrew ARM7 component
@@ -374,52 +984,103 @@ void GetDefaultArm7(char* buffer, size_t size)
 	snprintf(buffer, size, "%s/sys/default_arm7/arm7.elf", blocksds_path);
 }
 
+/*
+ * ResetCreateState
+ * Clears what a previous build with the same context has left in it.
+ */
+static void ResetCreateState(void)
+{
+	ctx->_entry_start = 0;
+	ctx->file_top = 0;
+	ctx->file_end = 0;
+	ctx->free_file_id = 0;
+
+	ctx->overlay_files = 0;
+
+	ctx->copy_jobs.clear();
+	ctx->fnt_data.clear();
+	ctx->fat_data.clear();
+
+	ctx->build_manifest = Manifest();
+
+	ctx->dedup_keys.clear();
+	ctx->dedup_ranges.clear();
+	ctx->dedup_count = 0;
+	ctx->dedup_bytes_saved = 0;
+}
+
 /*
  * Create
  */
 void Create()
 {
-	if (!arm9filename)
+	if (!ctx->arm9filename)
 		LogFatal("ARM9 binary file required.\n");
 
+	ResetCreateState();
+
+	// The default ARM7 binary is only used for this build. The option is
+	// restored when it ends, even if it fails.
+	struct Arm7Option
+	{
+		char *filename;
+		~Arm7Option() { ctx->arm7filename = filename; }
+	} arm7_option = { ctx->arm7filename };
+
 	char arm7PathName[MAXPATHLEN];
-	if (!arm7filename) {
+	if (!ctx->arm7filename) {
 		GetDefaultArm7(arm7PathName, sizeof(arm7PathName));
-		arm7filename = arm7PathName;
+		ctx->arm7filename = arm7PathName;
 	}
 
-	bool is_arm9_elf = HasElfExtension(arm9filename) || HasElfHeader(arm9filename);
-	bool is_arm7_elf = HasElfExtension(arm7filename) || HasElfHeader(arm7filename);
+	bool is_arm9_elf = HasElfExtension(ctx->arm9filename) || HasElfHeader(ctx->arm9filename);
+	bool is_arm7_elf = HasElfExtension(ctx->arm7filename) || HasElfHeader(ctx->arm7filename);
 	bool is_both_elf = is_arm9_elf && is_arm7_elf;
 
-	fNDS = fopen(ndsfilename, "wb+");
-	if (!fNDS)
-		LogFatal("Cannot open file '%s'.\n", ndsfilename);
+	std::string manifestfilename;
+	std::string options_hash;
+	if (ctx->incremental_build)
+	{
+		manifestfilename = GetManifestFilename(ctx->ndsfilename);
+		options_hash = GetOptionsHash();
+
+		if (UpdateIncremental(manifestfilename.c_str(), options_hash))
+		{
+			SaveBuildManifest(manifestfilename.c_str(), options_hash);
+			return;
+		}
+	}
+
+	ctx->fNDS = fopen(ctx->ndsfilename, "wb+");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'.\n", ctx->ndsfilename);
+
+	DigestBegin(ctx->fNDS);
 
 	bool bSecureSyscalls = false;
-	char *headerfilename = (headerfilename_or_size && (strtoul(headerfilename_or_size,0,0) == 0)) ? headerfilename_or_size : 0;
-	u32 headersize = headerfilename_or_size ? strtoul(headerfilename_or_size,0,0) : (is_both_elf ? 0x4000 : 0x200);
+	char *headerfilename = (ctx->headerfilename_or_size && (strtoul(ctx->headerfilename_or_size,0,0) == 0)) ? ctx->headerfilename_or_size : 0;
+	u32 headersize = ctx->headerfilename_or_size ? strtoul(ctx->headerfilename_or_size,0,0) : (is_both_elf ? 0x4000 : 0x200);
 
 	// The LoadMe stub is used in two cases:
 	//
 	// - for loading .nds images placed in the GBA slot address space via PassMe,
 	// - for loading .nds images in ancient homebrew loaders, such as MoonShell 2.
-	loadmeEnabled &= !title;
+	ctx->loadmeEnabled &= !ctx->title;
 
 	// Write initial header data
 	if (headerfilename)
 	{
 		// header template
-		FILE *fi = fopen(headerfilename, "rb");
-		if (!fi)
+		ScopedFile fi(fopen(headerfilename, "rb"));
+		if (!fi.Get())
 			LogFatal("Cannot open file '%s'.\n", headerfilename);
 
-		if (fread(&header, 1, 0x200, fi) != 0x200)
+		if (fread(&ctx->header, 1, 0x200, fi.Get()) != 0x200)
 			LogFatal("%s: Failed to read header data\n", __func__);
 
-		fclose(fi);
+		fi.Close();
 
-		if ((header.arm9_ram_address + 0x800 == header.arm9_entry_address) || (header.rom_header_size > 0x200))
+		if ((ctx->header.arm9_ram_address + 0x800 == ctx->header.arm9_entry_address) || (ctx->header.rom_header_size > 0x200))
 		{
 			bSecureSyscalls = true;
 		}
@@ -427,71 +1088,74 @@ void Create()
 	else
 	{
 		// Reset all header fields to 0
-		header = {};
+		ctx->header = {};
 
 		// Set header default values
-		memcpy(header.gamecode, "####", 4);
+		memcpy(ctx->header.gamecode, "####", 4);
 
-		if (arm9RamAddress + 0x800 == arm9Entry)
+		if (ctx->arm9RamAddress + 0x800 == ctx->arm9Entry)
 		{
 			bSecureSyscalls = true;
 		}
 		
-		if (!loadmeEnabled && !title)
+		if (!ctx->loadmeEnabled && !ctx->title)
 		{
-			memcpy(header.title, "HOMEBREW", 8);
+			memcpy(ctx->header.title, "HOMEBREW", 8);
 		}
 
-		header.rom_control_info1 = 1<<22 | latency_2<<16 | 1<<14 | 1<<13 | latency_1;	// ROM control info 1
-		header.rom_control_info2 = latency1_2<<16 | latency1_1;	// ROM control info 2
-		header.rom_control_info3 = 0x051E;	// ROM control info 3
+		ctx->header.rom_control_info1 = 1<<22 | ctx->latency_2<<16 | 1<<14 | 1<<13 | ctx->latency_1;	// ROM control info 1
+		ctx->header.rom_control_info2 = ctx->latency1_2<<16 | ctx->latency1_1;	// ROM control info 2
+		ctx->header.rom_control_info3 = 0x051E;	// ROM control info 3
 	}
 
-	if (headersize) header.rom_header_size = headersize;
-	if (header.rom_header_size == 0) header.rom_header_size = bSecureSyscalls ? 0x4000 : 0x200;
+	if (headersize) ctx->header.rom_header_size = headersize;
+	if (ctx->header.rom_header_size == 0) ctx->header.rom_header_size = bSecureSyscalls ? 0x4000 : 0x200;
 
 	// For NDS-only images, enable autostart flag
-	if (header.rom_header_size < 0x1000)
+	if (ctx->header.rom_header_size < 0x1000)
 	{
-		header.reserved2 = 0x04;
+		ctx->header.reserved2 = 0x04;
 	}
 
+	// The HMACs are only needed if this can become a DSi ROM
+	bool track_hmacs = ctx->header.rom_header_size > 0x200 && is_both_elf;
+
 	// Write logo data
-	if (logofilename)
+	if (ctx->logofilename)
 	{
-		if (IsRasterImageExtensionFilename(logofilename))
+		if (IsRasterImageExtensionFilename(ctx->logofilename))
 		{
 			RasterImage raster;
-			if (!raster.loadFile(logofilename)) exit(1);
-			if (!LogoConvert(raster, header.logo)) exit(1);
+			if (!raster.loadFile(ctx->logofilename))
+				LogFatal("Cannot load logo '%s'.\n", ctx->logofilename);
+			if (!LogoConvert(raster, ctx->header.logo))
+				LogFatal("Invalid logo '%s'.\n", ctx->logofilename);
 		}
 		else
 		{
-			FILE *fi = fopen(logofilename, "rb");
-			if (!fi)
-				LogFatal("Cannot open file '%s'.\n", logofilename);
+			ScopedFile fi(fopen(ctx->logofilename, "rb"));
+			if (!fi.Get())
+				LogFatal("Cannot open file '%s'.\n", ctx->logofilename);
 
-			if (fread(&header.logo, 1, 156, fi) != 156)
+			if (fread(&ctx->header.logo, 1, 156, fi.Get()) != 156)
 				LogFatal("%s: Failed to write logo data\n", __func__);
-
-			fclose(fi);
 		}
 	}
 	else
 	{
-		memcpy(((unsigned char *)&header.logo), nintendo_logo, sizeof(nintendo_logo));
+		memcpy(((unsigned char *)&ctx->header.logo), nintendo_logo, sizeof(nintendo_logo));
 	}
 
 	// Write LoadMe stub, if enabled
-	if (loadmeEnabled)
+	if (ctx->loadmeEnabled)
 	{
 		// - For DSi hybrid images, store the LoadMe stub in the debug parameters area. This area is not
 		//   validated, and the only situations in which it is used are ones where the LoadMe stub is not
 		//   necessary.
 		// - For NDS only images, store the LoadMe stub in the logo header area.
 
-		u32 loadmeStubLocation = header.rom_header_size >= 0x1000 ? 0xE00 : 0xC0;
-		int loadmeStubMaxSize = header.rom_header_size >= 0x1000 ? 0x180 : 0x9C;
+		u32 loadmeStubLocation = ctx->header.rom_header_size >= 0x1000 ? 0xE00 : 0xC0;
+		int loadmeStubMaxSize = ctx->header.rom_header_size >= 0x1000 ? 0x180 : 0x9C;
 		u32 loadmeStubLocationOffset = 0x14;
 
 		if (loadme_size > loadmeStubMaxSize)
@@ -505,151 +1169,158 @@ void Create()
 			LogFatal("loadme stub location error\n");
 		}
 
-		memset(((unsigned char *) &header) + loadmeStubLocation, 0, loadmeStubMaxSize);
-		memcpy(((unsigned char *) &header) + loadmeStubLocation, loadme, loadme_size);		// self-contained NDS loader for *Me GBA cartridge boot
+		memset(((unsigned char *) &ctx->header) + loadmeStubLocation, 0, loadmeStubMaxSize);
+		memcpy(((unsigned char *) &ctx->header) + loadmeStubLocation, loadme, loadme_size);		// self-contained NDS loader for *Me GBA cartridge boot
 
 		// Write stub offset to fixed area in stub code
-		*(unsigned_int *)(((unsigned char *)&header) + loadmeStubLocation + loadmeStubLocationOffset) = loadmeStubLocation;
+		*(unsigned_int *)(((unsigned char *)&ctx->header) + loadmeStubLocation + loadmeStubLocationOffset) = loadmeStubLocation;
 
 		// Emit branch opcode at the beginning of header (0x8000000 for PassMe)
-		*(unsigned_int *)((unsigned char *)&header.title) = 0xEA000000 | (((loadmeStubLocation - 8) >> 2) & 0xFFFFFF);
+		*(unsigned_int *)((unsigned char *)&ctx->header.title) = 0xEA000000 | (((loadmeStubLocation - 8) >> 2) & 0xFFFFFF);
 
 		// Warning: NO$GBA expects the LoadMe stub to be at 0xC0 if the GBA headers are present
 		if (loadmeStubLocation == 0xC0)
 		{
 			// Allow GBA cartridge SRAM backup
-			memcpy((void *)&header.offset_0xA0, "SRAM_V110", 9);
+			memcpy((void *)&ctx->header.offset_0xA0, "SRAM_V110", 9);
 
 			// Automatically start with FlashMe, make it look more like a GBA rom
-			memcpy((void *)&header.offset_0xAC, "PASS01\x96", 7);
+			memcpy((void *)&ctx->header.offset_0xAC, "PASS01\x96", 7);
 		}
 	}
 
 	// Override default title/game/maker codes. They don't need to be NUL-terminated.
-	if (title)
+	if (ctx->title)
 	{
-		size_t len = strlen(title);
-		if (len > sizeof(header.title))
-			len = sizeof(header.title);
-		memcpy(header.title, title, len);
+		size_t len = strlen(ctx->title);
+		if (len > sizeof(ctx->header.title))
+			len = sizeof(ctx->header.title);
+		memcpy(ctx->header.title, ctx->title, len);
 	}
-	if (gamecode)
+	if (ctx->gamecode)
 	{
-		size_t len = strlen(gamecode);
-		if (len > sizeof(header.gamecode))
-			len = sizeof(header.gamecode);
-		memcpy(header.gamecode, gamecode, len);
+		size_t len = strlen(ctx->gamecode);
+		if (len > sizeof(ctx->header.gamecode))
+			len = sizeof(ctx->header.gamecode);
+		memcpy(ctx->header.gamecode, ctx->gamecode, len);
 	}
-	if (makercode)
+	if (ctx->makercode)
 	{
-		size_t len = strlen(makercode);
-		if (len > sizeof(header.makercode))
-			len = sizeof(header.makercode);
-		memcpy(header.makercode, makercode, len);
+		size_t len = strlen(ctx->makercode);
+		if (len > sizeof(ctx->header.makercode))
+			len = sizeof(ctx->header.makercode);
+		memcpy(ctx->header.makercode, ctx->makercode, len);
 	}
-	header.romversion = (romversion & 0xff);
+	ctx->header.romversion = (ctx->romversion & 0xff);
 
 	// --------------------------
 
-	if (fseek(fNDS, header.rom_header_size, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, ctx->header.rom_header_size, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek ROM header size offset\n", __func__);
 
 	// ARM9 binary
 	{
-		long position = ftell(fNDS);
+		long position = ftell(ctx->fNDS);
 		if (position < 0)
 			LogFatal("%s: Failed to get position of ARM9 binary\n", __func__);
 
-		header.arm9_rom_offset = (position + arm9_align) &~ arm9_align;
+		ctx->header.arm9_rom_offset = (position + arm9_align) &~ arm9_align;
+
+		if (ctx->header.arm9_rom_offset < 0x8000)
+			DigestRegionStart(DIGEST_SECURE_AREA_CRC, ctx->header.arm9_rom_offset, 0x8000);
+		if (track_hmacs)
+			DigestRegionStart(DIGEST_HMAC_ARM9, ctx->header.arm9_rom_offset);
 
-		if (fseek(fNDS, header.arm9_rom_offset, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, ctx->header.arm9_rom_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek position of ARM9 ROM offset\n", __func__);
 
-		unsigned int entry_address = arm9Entry ? arm9Entry : (unsigned int)header.arm9_entry_address;		// template
-		unsigned int ram_address = arm9RamAddress ? arm9RamAddress : (unsigned int)header.arm9_ram_address;		// template
+		unsigned int entry_address = ctx->arm9Entry ? ctx->arm9Entry : (unsigned int)ctx->header.arm9_entry_address;		// template
+		unsigned int ram_address = ctx->arm9RamAddress ? ctx->arm9RamAddress : (unsigned int)ctx->header.arm9_ram_address;		// template
 		if (!ram_address && entry_address) ram_address = entry_address;
 		if (!entry_address && ram_address) entry_address = ram_address;
 		if (!ram_address) { ram_address = entry_address = 0x02000000; }
 
 		// add dummy area for secure syscalls
-		header.arm9_size = 0;
+		ctx->header.arm9_size = 0;
 		if (bSecureSyscalls)
 		{
 			unsigned_int x;
-			FILE *fARM9 = fopen(arm9filename, "rb");
-			if (fARM9)
+			ScopedFile fARM9(fopen(ctx->arm9filename, "rb"));
+			if (fARM9.Get())
 			{
-				if (fread(&x, sizeof(x), 1, fARM9) != 1)
+				if (fread(&x, sizeof(x), 1, fARM9.Get()) != 1)
 					LogFatal("%s: Failed to read ARM9 binary\n", __func__);
 
-				fclose(fARM9);
+				fARM9.Close();
 
 				if (x != 0xE7FFDEFF)	// not already exist?
 				{
 					x = 0xE7FFDEFF;
 					for (int i=0; i<0x800/4; i++)
 					{
-						if (fwrite(&x, sizeof(x), 1, fNDS) != 1)
+						if (RomWrite(&x, sizeof(x), ctx->fNDS) != sizeof(x))
 							LogFatal("%s: Failed to write ARM9 binary\n", __func__);
 					}
-					header.arm9_size = 0x800;
+					ctx->header.arm9_size = 0x800;
 				}
 			}
 		}
 
 		unsigned int size = 0;
 		if (is_arm9_elf)
-			CopyFromElf(arm9filename, &entry_address, &ram_address, &size, NULL, false);
+			CopyFromElf(ctx->arm9filename, &entry_address, &ram_address, &size, NULL, false);
 		else
-			CopyFromBin(arm9filename, 0, &size);
-		header.arm9_entry_address = entry_address;
-		header.arm9_ram_address = ram_address;
-		header.arm9_size = header.arm9_size + ((size + 3) &~ 3);
+			CopyFromBin(ctx->arm9filename, 0, &size);
+		ctx->header.arm9_entry_address = entry_address;
+		ctx->header.arm9_ram_address = ram_address;
+		ctx->header.arm9_size = ctx->header.arm9_size + ((size + 3) &~ 3);
 
-		if (header.rom_header_size > 0x200 && (entry_address - ram_address) == 0x800 && header.arm9_size < 0x4000)
+		if (ctx->header.rom_header_size > 0x200 && (entry_address - ram_address) == 0x800 && ctx->header.arm9_size < 0x4000)
 		{
 			// Pad the arm9 binary to 16kb
-			unsigned int needed_padding = 0x4000 - header.arm9_size;
-			header.arm9_size = 0x4000;
+			unsigned int needed_padding = 0x4000 - ctx->header.arm9_size;
+			ctx->header.arm9_size = 0x4000;
 
-			if (fseek(fNDS, needed_padding-1, SEEK_CUR) == -1)
+			if (fseek(ctx->fNDS, needed_padding-1, SEEK_CUR) == -1)
 				LogFatal("%s: Failed to seek end of ARM9 padding\n", __func__);
 
 			// Writing a byte will fill the bytes we have skipped with fseek()
-			if (fputc(0, fNDS) == EOF)
+			if (RomPutc(0, ctx->fNDS) == EOF)
 				LogFatal("%s: Failed to write ARM9 padding\n", __func__);
 		}
+
+		DigestRegionSetEnd(DIGEST_HMAC_ARM9, ctx->header.arm9_rom_offset + ctx->header.arm9_size);
 	}
 
 	// ARM9 overlay table
-	if (arm9ovltablefilename)
+	if (ctx->arm9ovltablefilename)
 	{
 		unsigned_int x1 = 0xDEC00621; // 0x2106c0de magic
-		if (fwrite(&x1, sizeof(x1), 1, fNDS) != 1)
+		if (RomWrite(&x1, sizeof(x1), ctx->fNDS) != sizeof(x1))
 			LogFatal("%s: Failed to write overlay value 1\n", __func__);
 
 		unsigned_int x2 = 0x00000AD8; // ???
-		if (fwrite(&x2, sizeof(x2), 1, fNDS) != 1)
+		if (RomWrite(&x2, sizeof(x2), ctx->fNDS) != sizeof(x2))
 			LogFatal("%s: Failed to write overlay value 2\n", __func__);
 
 		unsigned_int x3 = 0x00000000; // ???
-		if (fwrite(&x3, sizeof(x3), 1, fNDS) != 1)
+		if (RomWrite(&x3, sizeof(x3), ctx->fNDS) != sizeof(x3))
 			LogFatal("%s: Failed to write overlay value 3\n", __func__);
 
-		long position = ftell(fNDS);
+		long position = ftell(ctx->fNDS);
 		if (position < 0)
 			LogFatal("%s: Failed to get position of ARM9 overlay table\n", __func__);
 
-		header.arm9_overlay_offset = position; // do not align
+		ctx->header.arm9_overlay_offset = position; // do not align
 
-		if (fseek(fNDS, header.arm9_overlay_offset, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, ctx->header.arm9_overlay_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek ARM9 overlay offset\n", __func__);
 
 		unsigned int size = 0;
-		CopyFromBin(arm9ovltablefilename, &size);
-		header.arm9_overlay_size = size;
-		overlay_files += size / sizeof(OverlayEntry);
-		if (!size) header.arm9_overlay_offset = 0;
+		CopyFromBin(ctx->arm9ovltablefilename, &size);
+		ctx->header.arm9_overlay_size = size;
+		ctx->overlay_files += size / sizeof(OverlayEntry);
+		if (!size) ctx->header.arm9_overlay_offset = 0;
 	}
 
 	// COULD BE HERE: ARM9 overlay files, no padding before or between. end is padded with 0xFF's and then followed by ARM7 binary
@@ -657,20 +1328,23 @@ void Create()
 
 	// ARM7 binary
 	{
-		long position = ftell(fNDS);
+		long position = ftell(ctx->fNDS);
 		if (position < 0)
 			LogFatal("%s: Failed to get position of ARM7 binary\n", __func__);
 
-		header.arm7_rom_offset = std::max((position + arm7_align) &~ arm7_align, arm7_min);
+		ctx->header.arm7_rom_offset = std::max((position + arm7_align) &~ arm7_align, arm7_min);
 
-		if (fseek(fNDS, header.arm7_rom_offset, SEEK_SET) == -1)
+		if (track_hmacs)
+			DigestRegionStart(DIGEST_HMAC_ARM7, ctx->header.arm7_rom_offset);
+
+		if (fseek(ctx->fNDS, ctx->header.arm7_rom_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek ARM7 ROM offset\n", __func__);
 	}
 
 	// if (arm7filename)
 	{
-		unsigned int entry_address = arm7Entry ? arm7Entry : (unsigned int)header.arm7_entry_address;		// template
-		unsigned int ram_address = arm7RamAddress ? arm7RamAddress : (unsigned int)header.arm7_ram_address;		// template
+		unsigned int entry_address = ctx->arm7Entry ? ctx->arm7Entry : (unsigned int)ctx->header.arm7_entry_address;		// template
+		unsigned int ram_address = ctx->arm7RamAddress ? ctx->arm7RamAddress : (unsigned int)ctx->header.arm7_ram_address;		// template
 		if (!ram_address && entry_address) ram_address = entry_address;
 		if (!entry_address && ram_address) entry_address = ram_address;
 		if (!ram_address) { ram_address = entry_address = 0x037f8000; }
@@ -678,38 +1352,40 @@ void Create()
 		unsigned int size = 0;
 
 		if (is_arm7_elf)
-			CopyFromElf(arm7filename, &entry_address, &ram_address, &size, NULL, false);
+			CopyFromElf(ctx->arm7filename, &entry_address, &ram_address, &size, NULL, false);
 		else
-			CopyFromBin(arm7filename, &size);
+			CopyFromBin(ctx->arm7filename, &size);
+
+		ctx->header.arm7_entry_address = entry_address;
+		ctx->header.arm7_ram_address = ram_address;
+		ctx->header.arm7_size = ((size + 3) &~ 3);
 
-		header.arm7_entry_address = entry_address;
-		header.arm7_ram_address = ram_address;
-		header.arm7_size = ((size + 3) &~ 3);
+		DigestRegionSetEnd(DIGEST_HMAC_ARM7, ctx->header.arm7_rom_offset + ctx->header.arm7_size);
 	}
 
 	// ARM7 overlay table
-	if (arm7ovltablefilename)
+	if (ctx->arm7ovltablefilename)
 	{
-		long position = ftell(fNDS);
+		long position = ftell(ctx->fNDS);
 		if (position < 0)
 			LogFatal("%s: Failed to get position of ARM7 overlay table\n", __func__);
 
-		header.arm7_overlay_offset = position; // do not align
+		ctx->header.arm7_overlay_offset = position; // do not align
 
-		if (fseek(fNDS, header.arm7_overlay_offset, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, ctx->header.arm7_overlay_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek ARM7 overlay offset\n", __func__);
 
 		unsigned int size = 0;
-		CopyFromBin(arm7ovltablefilename, &size);
-		header.arm7_overlay_size = size;
-		overlay_files += size / sizeof(OverlayEntry);
-		if (!size) header.arm7_overlay_offset = 0;
+		CopyFromBin(ctx->arm7ovltablefilename, &size);
+		ctx->header.arm7_overlay_size = size;
+		ctx->overlay_files += size / sizeof(OverlayEntry);
+		if (!size) ctx->header.arm7_overlay_offset = 0;
 	}
 
 	// COULD BE HERE: probably ARM7 overlay files, just like for ARM9
 	//
 
-	if (overlay_files && !overlaydir)
+	if (ctx->overlay_files && !ctx->overlaydir)
 	{
 		LogFatal("Overlay directory required!.\n");
 	}
@@ -718,39 +1394,29 @@ void Create()
 	//if ((filerootdirs_num > 0) || overlaydir)
 	{
 		// read directory structure
-		free_file_id = overlay_files;
-		free_dir_id++;
-		directory_count++;
-		TreeNode *filetree;
-		if (filerootdirs_num == 0)
-		{
-			filetree = new TreeNode();		// dummy root node 0xF000
-		}
-		else
-		{
-			filetree = new TreeNode();
-			for (int i = 0; i < filerootdirs_num; i++)
-				ReadDirectory(filetree, filerootdirs[i]);
-		}
+		ctx->free_file_id = ctx->overlay_files;
+		TreeDirectory *filetree = ScanFileSystem();
+		if (ctx->dedup_files)
+			HashDuplicateCandidates(filetree);
 
-		long fnt_position = ftell(fNDS);
+		long fnt_position = ftell(ctx->fNDS);
 		if (fnt_position < 0)
 			LogFatal("%s: Failed to get position of FNT data\n", __func__);
 
 		// calculate offsets required for FNT and FAT
-		_entry_start = 8*directory_count;		// names come after directory structs
-		header.fnt_offset = (fnt_position + fnt_align) &~ fnt_align;
-		header.fnt_size =
-			_entry_start +		// directory structs
-			total_name_size +	// total number of name characters for dirs and files
-			directory_count*4 +	// directory: name length (1), dir id (2), end-character (1)
-			file_count*1 +		// files: name length (1)
+		ctx->_entry_start = 8*ctx->directory_count;		// names come after directory structs
+		ctx->header.fnt_offset = (fnt_position + fnt_align) &~ fnt_align;
+		ctx->header.fnt_size =
+			ctx->_entry_start +		// directory structs
+			ctx->total_name_size +	// total number of name characters for dirs and files
+			ctx->directory_count*4 +	// directory: name length (1), dir id (2), end-character (1)
+			ctx->file_count*1 +		// files: name length (1)
 			- 3;				// root directory only has an end-character
-		file_count += overlay_files;		// didn't take overlay files into FNT size, but have to be calculated into FAT size
-		header.fat_offset = (header.fnt_offset + header.fnt_size + fat_align) &~ fat_align;
-		header.fat_size = file_count * 8;		// each entry contains top & bottom offset
+		ctx->file_count += ctx->overlay_files;		// didn't take overlay files into FNT size, but have to be calculated into FAT size
+		ctx->header.fat_offset = (ctx->header.fnt_offset + ctx->header.fnt_size + fat_align) &~ fat_align;
+		ctx->header.fat_size = ctx->file_count * 8;		// each entry contains top & bottom offset
 
-		size_t fat_end_offset = header.fat_offset + header.fat_size;
+		size_t fat_end_offset = ctx->header.fat_offset + ctx->header.fat_size;
 
 		// The NitroFS library needs a magic value at a known location to verify that it can read
 		// data correctly using official DS card commands (this isn't required when reading from
@@ -758,9 +1424,9 @@ void Create()
 		//
 		// A safe place for this value is right after the FAT table because any homebrew that uses
 		// NitroFS needs at least a valid FAT table.
-		if (file_count > 0)
+		if (ctx->file_count > 0)
 		{
-			if (fseek(fNDS, fat_end_offset, SEEK_SET) == -1)
+			if (fseek(ctx->fNDS, fat_end_offset, SEEK_SET) == -1)
 				LogFatal("%s: Failed to seek FAT end offset\n", __func__);
 
 			const size_t nitrofs_magic_size = 8;
@@ -768,7 +1434,7 @@ void Create()
 				'N', 'i', 't', 'r', 'o', 'F', 'S', '!'
 			};
 
-			if (fwrite(&magic, 1, nitrofs_magic_size, fNDS) != nitrofs_magic_size)
+			if (RomWrite(&magic, nitrofs_magic_size, ctx->fNDS) != nitrofs_magic_size)
 				LogFatal("%s: Failed to write NitroFS magic string\n", __func__);
 
 			fat_end_offset += nitrofs_magic_size;
@@ -776,228 +1442,272 @@ void Create()
 
 		// banner after FNT/FAT
 		{
-			header.banner_offset = (fat_end_offset + banner_align) &~ banner_align;
-			if (fseek(fNDS, header.banner_offset, SEEK_SET) == -1)
+			ctx->header.banner_offset = (fat_end_offset + banner_align) &~ banner_align;
+			if (fseek(ctx->fNDS, ctx->header.banner_offset, SEEK_SET) == -1)
 				LogFatal("%s: Failed to seek banner offset\n", __func__);
 
-			if (bannertype == BANNER_IMAGE)
+			if (track_hmacs)
+				DigestRegionStart(DIGEST_HMAC_ICON_TITLE, ctx->header.banner_offset);
+
+			if (ctx->bannertype == BANNER_IMAGE)
 			{
-				const char * Ext = bannerfilename == NULL ? NULL : strrchr(bannerfilename, '.');
+				const char * Ext = ctx->bannerfilename == NULL ? NULL : strrchr(ctx->bannerfilename, '.');
 				if (Ext)
 				{
-					if (!IsRasterImageExtensionFilename(bannerfilename))
+					if (!IsRasterImageExtensionFilename(ctx->bannerfilename))
 					{
-						if (bannerfilename != NULL)
+						if (ctx->bannerfilename != NULL)
 						{
 							LogWarning("Unrecognized banner icon image extension: \"%s\"\n",
-									bannerfilename);
-							bannerfilename = NULL;
+									ctx->bannerfilename);
+							ctx->bannerfilename = NULL;
 						}
 					}
-					if (!IsRasterImageExtensionFilename(banneranimfilename))
+					if (!IsRasterImageExtensionFilename(ctx->banneranimfilename))
 					{
-						if (banneranimfilename != NULL)
+						if (ctx->banneranimfilename != NULL)
 						{
 							LogWarning("Unrecognized banner animated icon image extension: \"%s\"\n",
-									banneranimfilename);
-							banneranimfilename = NULL;
+									ctx->banneranimfilename);
+							ctx->banneranimfilename = NULL;
 						}
 					}
 					IconFromRasterImage();
 				}
 			}
-			else if (bannertype == BANNER_BINARY && bannerfilename)
+			else if (ctx->bannertype == BANNER_BINARY && ctx->bannerfilename)
 			{
-				CopyFromBin(bannerfilename, &bannersize);
+				CopyFromBin(ctx->bannerfilename, &ctx->bannersize);
 			}
 			else
 			{
-				header.banner_offset = 0;
-				header.banner_size = 0;
+				ctx->header.banner_offset = 0;
+				ctx->header.banner_size = 0;
 			}
 
-			header.banner_size = bannersize;
+			ctx->header.banner_size = ctx->bannersize;
 
-			if (header.banner_offset)
-				file_top = header.banner_offset + header.banner_size;
+			DigestRegionSetEnd(DIGEST_HMAC_ICON_TITLE, ctx->header.banner_offset + ctx->header.banner_size);
+
+			if (ctx->header.banner_offset)
+				ctx->file_top = ctx->header.banner_offset + ctx->header.banner_size;
 			else
-				file_top = fat_end_offset;
+				ctx->file_top = fat_end_offset;
 		}
 
-		file_end = file_top;	// no file data as yet
+		ctx->file_end = ctx->file_top;	// no file data as yet
+
+		ctx->fnt_data.assign(ctx->header.fnt_size, 0);
+		ctx->fat_data.assign(ctx->header.fat_size, 0);
+
+		if (ctx->incremental_build)
+		{
+			ctx->build_manifest.tree = GetTreeHash(filetree, NULL);
+			ctx->build_manifest.files.assign(ctx->file_count, ManifestFile());
+		}
 
 		// add (hidden) overlay files
-		for (unsigned int i=0; i<overlay_files; i++)
+		for (unsigned int i=0; i<ctx->overlay_files; i++)
 		{
 			char s[32]; sprintf(s, OVERLAY_FMT, i/*free_file_id*/);
-			AddFile(NULL, overlaydir, "/", s, i/*free_file_id*/);
+			PlanFile(NULL, ctx->overlaydir, "/", s, i/*free_file_id*/, 0, 0);
 			//free_file_id++;		// incremented up to overlay_files
 		}
 
 		// add all other (visible) files
-		AddDirectory(filetree, "/", 0xF000, directory_count);
-		if (fseek(fNDS, file_end, SEEK_SET) == -1)
+		PlanDirectory(filetree, "/", 0xF000, ctx->directory_count);
+
+		// copy file data to the locations assigned to them
+		CopyFiles();
+
+		// write FNT and FAT
+		if (fseek(ctx->fNDS, ctx->header.fnt_offset, SEEK_SET) == -1)
+			LogFatal("%s: Failed to seek FNT offset\n", __func__);
+
+		if (RomWrite(ctx->fnt_data.data(), ctx->fnt_data.size(), ctx->fNDS) != ctx->fnt_data.size())
+			LogFatal("%s: Failed to write FNT\n", __func__);
+
+		if (ctx->fat_data.size() > 0)
+		{
+			if (fseek(ctx->fNDS, ctx->header.fat_offset, SEEK_SET) == -1)
+				LogFatal("%s: Failed to seek FAT offset\n", __func__);
+
+			if (RomWrite(ctx->fat_data.data(), ctx->fat_data.size(), ctx->fNDS) != ctx->fat_data.size())
+				LogFatal("%s: Failed to write FAT\n", __func__);
+		}
+
+		if (fseek(ctx->fNDS, ctx->file_end, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek end of written files\n", __func__);
 
-		if (verbose)
+		if (ctx->verbose)
 		{
-			printf("%u directories.\n", directory_count);
-			printf("%u normal files.\n", file_count - overlay_files);
-			printf("%u overlay files.\n", overlay_files);
+			printf("%u directories.\n", ctx->directory_count);
+			printf("%u normal files.\n", ctx->file_count - ctx->overlay_files);
+			printf("%u overlay files.\n", ctx->overlay_files);
+			if (ctx->dedup_files)
+				printf("%u duplicated files (%u bytes saved).\n", ctx->dedup_count, ctx->dedup_bytes_saved);
 		}
 	}
 
 	// --------------------------
 
 	// align file size
-	unsigned int newfilesize = file_end;	//ftell(fNDS);
+	unsigned int newfilesize = ctx->file_end;	//ftell(fNDS);
 	newfilesize = (newfilesize + 3) & ~3;	// align to 4 bytes
-	header.application_end_offset = newfilesize;
-	if (newfilesize != file_end)
+	ctx->header.application_end_offset = newfilesize;
+	if (newfilesize != ctx->file_end)
 	{
-		if (fseek(fNDS, newfilesize-1, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, newfilesize-1, SEEK_SET) == -1)
 			LogFatal("%s: Failed to align pointer to start DSi sections\n", __func__);
-		if (fputc(0, fNDS) == EOF)
+		if (RomPutc(0, ctx->fNDS) == EOF)
 			LogFatal("%s: Failed to write padding start DSi sections\n", __func__);
 	}
 
 	// DSi sections
-	if (header.rom_header_size > 0x200 && is_both_elf)
+	if (ctx->header.rom_header_size > 0x200 && is_both_elf)
 	{
 		int sections = 2;
 
 		// DSi ARM9 binary
 		{
-			long arm9_dsi_position = ftell(fNDS);
+			long arm9_dsi_position = ftell(ctx->fNDS);
 			if (arm9_dsi_position < 0)
 				LogFatal("%s: Failed to get position of DSi ARM9 binary\n", __func__);
 
-			header.dsi9_rom_offset = (arm9_dsi_position + sector_align) &~ sector_align;
+			ctx->header.dsi9_rom_offset = (arm9_dsi_position + sector_align) &~ sector_align;
 
-			if (fseek(fNDS, header.dsi9_rom_offset, SEEK_SET) == -1)
+			if (fseek(ctx->fNDS, ctx->header.dsi9_rom_offset, SEEK_SET) == -1)
 				LogFatal("%s: Failed to seek position of DSi ARM9 ROM offset\n", __func__);
 
+			DigestRegionStart(DIGEST_HMAC_ARM9I, ctx->header.dsi9_rom_offset);
+
 			unsigned int ram_address = 0;
 			unsigned int size = 0;
-			CopyFromElf(arm9filename, NULL, &ram_address, &size, NULL, true);
+			CopyFromElf(ctx->arm9filename, NULL, &ram_address, &size, NULL, true);
 			if (!size)
 			{
 				sections--;
-				ram_address = (header.arm9_ram_address + header.arm9_size + 3) &~ 3;
+				ram_address = (ctx->header.arm9_ram_address + ctx->header.arm9_size + 3) &~ 3;
 				if (0x2400000 > ram_address)
 					ram_address = 0x2400000;
 				size = 0x200;
 
-				if (fwrite("----DSi9----", 1, 12, fNDS) != 12)
+				if (RomWrite("----DSi9----", 12, ctx->fNDS) != 12)
 					LogFatal("%s: Failed to write placeholder DSi ARM9 data\n", __func__);
 
-				if (fseek(fNDS, header.dsi9_rom_offset+size-1, SEEK_SET) == -1)
+				if (fseek(ctx->fNDS, ctx->header.dsi9_rom_offset+size-1, SEEK_SET) == -1)
 					LogFatal("%s: Failed to seek DSi ARM9 padding\n", __func__);
 
-				if (fputc(0, fNDS) == EOF)
+				if (RomPutc(0, ctx->fNDS) == EOF)
 					LogFatal("%s: Failed to write DSi ARM9 padding\n", __func__);
 			}
-			header.dsi9_ram_address = ram_address;
-			header.dsi9_size = ((size + 3) &~ 3);
+			ctx->header.dsi9_ram_address = ram_address;
+			ctx->header.dsi9_size = ((size + 3) &~ 3);
+
+			DigestRegionSetEnd(DIGEST_HMAC_ARM9I, ctx->header.dsi9_rom_offset + ctx->header.dsi9_size);
 		}
 
 		// DSi ARM7 binary
 		{
-			long arm7_dsi_position = ftell(fNDS);
+			long arm7_dsi_position = ftell(ctx->fNDS);
 			if (arm7_dsi_position < 0)
 				LogFatal("%s: Failed to get position of DSi ARM7 binary\n", __func__);
 
-			header.dsi7_rom_offset = (arm7_dsi_position + arm7_align) &~ arm7_align;
+			ctx->header.dsi7_rom_offset = (arm7_dsi_position + arm7_align) &~ arm7_align;
 
-			if (fseek(fNDS, header.dsi7_rom_offset, SEEK_SET) == -1)
+			if (fseek(ctx->fNDS, ctx->header.dsi7_rom_offset, SEEK_SET) == -1)
 				LogFatal("%s: Failed to seek position of DSi ARM7 ROM offset\n", __func__);
 
+			DigestRegionStart(DIGEST_HMAC_ARM7I, ctx->header.dsi7_rom_offset);
+
 			unsigned int ram_address = 0;
 			unsigned int size = 0;
-			CopyFromElf(arm7filename, NULL, &ram_address, &size, &mbkArm7WramMapAddress, true);
+			CopyFromElf(ctx->arm7filename, NULL, &ram_address, &size, &ctx->mbkArm7WramMapAddress, true);
 			if (!size)
 			{
 				sections--;
 				ram_address = 0x2E80000;
 				size = 0x200;
 
-				if (fwrite("----DSi7----", 1, 12, fNDS) != 12)
+				if (RomWrite("----DSi7----", 12, ctx->fNDS) != 12)
 					LogFatal("%s: Failed to write placeholder DSi ARM7 data\n", __func__);
 
-				if (fseek(fNDS, header.dsi7_rom_offset+size-1, SEEK_SET) == -1)
+				if (fseek(ctx->fNDS, ctx->header.dsi7_rom_offset+size-1, SEEK_SET) == -1)
 					LogFatal("%s: Failed to seek DSi ARM7 padding\n", __func__);
 
-				if (fputc(0, fNDS) == EOF)
+				if (RomPutc(0, ctx->fNDS) == EOF)
 					LogFatal("%s: Failed to write DSi ARM7 padding\n", __func__);
 			}
-			header.dsi7_ram_address = ram_address;
-			header.dsi7_size = ((size + 3) &~ 3);
+			ctx->header.dsi7_ram_address = ram_address;
+			ctx->header.dsi7_size = ((size + 3) &~ 3);
+
+			DigestRegionSetEnd(DIGEST_HMAC_ARM7I, ctx->header.dsi7_rom_offset + ctx->header.dsi7_size);
 		}
 
 		if (sections)
 		{
 			// This is a DSi-aware application. If the user has specified a unit
 			// code use it.
-			if (unitCode == -1)
-				header.unitcode = 2;
+			if (ctx->unitCode == -1)
+				ctx->header.unitcode = 2;
 			else
-				header.unitcode = unitCode;
+				ctx->header.unitcode = ctx->unitCode;
 
 			// Flag as DSi exclusive if ARM9 is too big
-			if (header.arm9_size > 0x3BFE00)
+			if (ctx->header.arm9_size > 0x3BFE00)
 			{
-				header.unitcode |= 1;
+				ctx->header.unitcode |= 1;
 				LogWarning("ARM9 binary is too big for NDS. Marking ROM as DSi-only\n");
 			}
 
 			// Move ARM7 out of the way if it overlaps with ARM9
-			unsigned int arm9_end = header.arm9_ram_address+header.arm9_size;
-			if (header.arm7_ram_address < arm9_end)
+			unsigned int arm9_end = ctx->header.arm9_ram_address+ctx->header.arm9_size;
+			if (ctx->header.arm7_ram_address < arm9_end)
 			{
 				unsigned int new_arm7_addr = (arm9_end + 3) &~ 3;
-				header.arm7_entry_address = header.arm7_entry_address + new_arm7_addr - header.arm7_ram_address;
-				header.arm7_ram_address = new_arm7_addr;
-				header.unitcode |= 1;
+				ctx->header.arm7_entry_address = ctx->header.arm7_entry_address + new_arm7_addr - ctx->header.arm7_ram_address;
+				ctx->header.arm7_ram_address = new_arm7_addr;
+				ctx->header.unitcode |= 1;
 
 				// Move ARM9i out of the way if it overlaps with ARM7
-				unsigned int arm7_end = header.arm7_ram_address+header.arm7_size;
-				if (header.dsi9_ram_address < arm7_end)
-					header.dsi9_ram_address = (arm7_end + 3) &~ 3;
+				unsigned int arm7_end = ctx->header.arm7_ram_address+ctx->header.arm7_size;
+				if (ctx->header.dsi9_ram_address < arm7_end)
+					ctx->header.dsi9_ram_address = (arm7_end + 3) &~ 3;
 			}
 		}
 		else
 		{
 			// Undo DSi section copy, keep this a NDS-only image
-			if (fseek(fNDS, newfilesize, SEEK_SET) == -1)
+			if (fseek(ctx->fNDS, newfilesize, SEEK_SET) == -1)
 				LogFatal("%s: Failed to seek DS-only ROM header\n", __func__);
 
-			if (ftruncate(fileno(fNDS), newfilesize) != 0)
+			if (ftruncate(fileno(ctx->fNDS), newfilesize) != 0)
 				LogFatal("%s: Failed to truncate header for DS-only ROM\n", __func__);
 		}
 	}
 
 	// Set flags in DSi extended header
-	if (header.unitcode & 2)
+	if (ctx->header.unitcode & 2)
 	{
-		long position = ftell(fNDS);
+		long position = ftell(ctx->fNDS);
 		if (position < 1)
 			LogFatal("%s: Failed to get position of extended DSi header\n", __func__);
 
-		newfilesize = std::max(position, static_cast<long>(header.banner_offset + 0x23c0));
+		newfilesize = std::max(position, static_cast<long>(ctx->header.banner_offset + 0x23c0));
 		newfilesize = (newfilesize + file_align) & ~file_align;
-		header.total_rom_size = newfilesize;
+		ctx->header.total_rom_size = newfilesize;
 
 		if (newfilesize != position)
 		{
-			if (fseek(fNDS, newfilesize-1, SEEK_SET) == -1)
+			if (fseek(ctx->fNDS, newfilesize-1, SEEK_SET) == -1)
 				LogFatal("%s: Failed to set padding position for DSi extended header\n", __func__);
 
-			if (fputc(0, fNDS) == EOF)
+			if (RomPutc(0, ctx->fNDS) == EOF)
 				LogFatal("%s: Failed to write padding for DSi extended header\n", __func__);
 		}
 
-		header.dsi_flags = 0x01;
-		header.rom_control_info3 = 0x051E;
+		ctx->header.dsi_flags = 0x01;
+		ctx->header.rom_control_info3 = 0x051E;
 
 		static const u8 global_mbk[5][4] =
 		{
@@ -1008,71 +1718,66 @@ void Create()
 			{0x90, 0x94, 0x98, 0x9C},
 		};
 
-		memcpy(header.global_mbk_setting, global_mbk, sizeof(header.global_mbk_setting));
-		header.arm9_mbk_setting[0] = 0x00000000;
-		header.arm9_mbk_setting[1] = 0x07C03740;
-		header.arm9_mbk_setting[2] = 0x07403700;
-		if (mbkArm7WramMapAddress != 0) {
+		memcpy(ctx->header.global_mbk_setting, global_mbk, sizeof(ctx->header.global_mbk_setting));
+		ctx->header.arm9_mbk_setting[0] = 0x00000000;
+		ctx->header.arm9_mbk_setting[1] = 0x07C03740;
+		ctx->header.arm9_mbk_setting[2] = 0x07403700;
+		if (ctx->mbkArm7WramMapAddress != 0) {
 			// Configure 256KB WRAM_A starting at the specified RAM address
-			unsigned int mbk_offset = (mbkArm7WramMapAddress - 0x03000000) / 0x10000;
-			header.arm7_mbk_setting[0] = (mbk_offset << 4) | (0x3 << 12) | ((mbk_offset + 4) << 20);
+			unsigned int mbk_offset = (ctx->mbkArm7WramMapAddress - 0x03000000) / 0x10000;
+			ctx->header.arm7_mbk_setting[0] = (mbk_offset << 4) | (0x3 << 12) | ((mbk_offset + 4) << 20);
 		} else {
 			// Set correct MBK settings for WRAM_A (starts at 0x3000000 in card apps, 0x37C0000 otherwise)
-			header.arm7_mbk_setting[0] = (header.unitcode & 1) ? 0x080037C0 : 0x00403000;
+			ctx->header.arm7_mbk_setting[0] = (ctx->header.unitcode & 1) ? 0x080037C0 : 0x00403000;
 		}
-		header.arm7_mbk_setting[1] = 0x07C03740;
-		header.arm7_mbk_setting[2] = 0x07403700;
-		header.mbk9_wramcnt_setting = (0x03<<24) | 0x00000F;
-
-		header.region_flags = 0xFFFFFFFF;
-		header.access_control = accessControl;
-		header.scfg_ext_mask = scfgExtMask;
-		header.appflags = appFlags;
-		header.device_list_ram_address = 0x02FFDC00;
-		header.offset_0x20C = 0x00010000;
-		header.tid_low  = header.gamecode[3] | (header.gamecode[2]<<8) | (header.gamecode[1]<<16) | (header.gamecode[0]<<24);
-		header.tid_high = titleidHigh;
-		memset(header.age_ratings, 0x80, sizeof(header.age_ratings));
-
-		Sha1Hmac(header.hmac_arm9, fNDS, header.arm9_rom_offset, header.arm9_size);
-		Sha1Hmac(header.hmac_arm7, fNDS, header.arm7_rom_offset, header.arm7_size);
-		Sha1Hmac(header.hmac_icon_title, fNDS, header.banner_offset, header.banner_size);
-		Sha1Hmac(header.hmac_arm9i, fNDS, header.dsi9_rom_offset, header.dsi9_size);
-		Sha1Hmac(header.hmac_arm7i, fNDS, header.dsi7_rom_offset, header.dsi7_size);
-		memset(header.rsa_signature, 0xFF, 0x80);
+		ctx->header.arm7_mbk_setting[1] = 0x07C03740;
+		ctx->header.arm7_mbk_setting[2] = 0x07403700;
+		ctx->header.mbk9_wramcnt_setting = (0x03<<24) | 0x00000F;
+
+		ctx->header.region_flags = 0xFFFFFFFF;
+		ctx->header.access_control = ctx->accessControl;
+		ctx->header.scfg_ext_mask = ctx->scfgExtMask;
+		ctx->header.appflags = ctx->appFlags;
+		ctx->header.device_list_ram_address = 0x02FFDC00;
+		ctx->header.offset_0x20C = 0x00010000;
+		ctx->header.tid_low  = ctx->header.gamecode[3] | (ctx->header.gamecode[2]<<8) | (ctx->header.gamecode[1]<<16) | (ctx->header.gamecode[0]<<24);
+		ctx->header.tid_high = ctx->titleidHigh;
+		memset(ctx->header.age_ratings, 0x80, sizeof(ctx->header.age_ratings));
+
+		DigestGetHmac(DIGEST_HMAC_ARM9, ctx->header.hmac_arm9, ctx->header.arm9_rom_offset, ctx->header.arm9_size);
+		DigestGetHmac(DIGEST_HMAC_ARM7, ctx->header.hmac_arm7, ctx->header.arm7_rom_offset, ctx->header.arm7_size);
+		DigestGetHmac(DIGEST_HMAC_ICON_TITLE, ctx->header.hmac_icon_title, ctx->header.banner_offset, ctx->header.banner_size);
+		DigestGetHmac(DIGEST_HMAC_ARM9I, ctx->header.hmac_arm9i, ctx->header.dsi9_rom_offset, ctx->header.dsi9_size);
+		DigestGetHmac(DIGEST_HMAC_ARM7I, ctx->header.hmac_arm7i, ctx->header.dsi7_rom_offset, ctx->header.dsi7_size);
+		memset(ctx->header.rsa_signature, 0xFF, 0x80);
 	}
 
 	// calculate device capacity
-	newfilesize |= newfilesize >> 16; newfilesize |= newfilesize >> 8;
-	newfilesize |= newfilesize >> 4; newfilesize |= newfilesize >> 2;
-	newfilesize |= newfilesize >> 1; newfilesize++;
-	if (newfilesize <= 128*1024) newfilesize = 128*1024;
-	int devcap = -18;
-	unsigned int x = newfilesize;
-	while (x != 0) { x >>= 1; devcap++; }
-	header.devicecap = (devcap < 0) ? 0 : devcap;
+	ctx->header.devicecap = CalcDeviceCapacity(newfilesize);
 
 	// fix up header CRCs and write header
-	header.logo_crc = CalcLogoCRC(header);
+	ctx->header.logo_crc = CalcLogoCRC(ctx->header);
 
-	if (header.arm9_rom_offset < 0x8000) header.secure_area_crc = FCalcCrc16(fNDS, header.arm9_rom_offset, 0x8000 - header.arm9_rom_offset);
+	if (ctx->header.arm9_rom_offset < 0x8000) ctx->header.secure_area_crc = DigestGetCrc16(DIGEST_SECURE_AREA_CRC, ctx->header.arm9_rom_offset, 0x8000 - ctx->header.arm9_rom_offset);
 
-	header.header_crc = CalcHeaderCRC(header);
+	DigestEnd();
 
-	if (header.unitcode & 2)
+	ctx->header.header_crc = CalcHeaderCRC(ctx->header);
+
+	if (ctx->header.unitcode & 2)
 	{
-		// Dummy signature for no$gba
-		header.rsa_signature[0x00] = 0;
-		header.rsa_signature[0x01] = 1;
-		header.rsa_signature[0x6B] = 0;
-		sha1(&header.rsa_signature[0x6C], (const unsigned char*)&header, 0xE00);
+		SignHeader(ctx->header);
 	}
 
-	if (fseek(fNDS, 0, SEEK_SET) == -1)
+	if (fseek(ctx->fNDS, 0, SEEK_SET) == -1)
 		LogFatal("%s: Failed to seek beginning of the ROM\n", __func__);
 
-	if (fwrite(&header, (header.unitcode & 2) ? 0x1000 : 0x200, 1, fNDS) != 1)
+	if (fwrite(&ctx->header, (ctx->header.unitcode & 2) ? 0x1000 : 0x200, 1, ctx->fNDS) != 1)
 		LogFatal("%s: Failed to write header\n", __func__);
 
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
+
+	if (ctx->incremental_build)
+		SaveBuildManifest(manifestfilename.c_str(), options_hash);
 }
@@ -1,7 +1,27 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 
 #pragma once
+#include <string>
+
 #include "ndstree.h"
+#include "sha1.h"
+
+struct FileCopyJob
+{
+	std::string fs_path;	// full path to the file in the host PC
+	unsigned int top;		// offset of the file in the ROM
+	unsigned int size;		// size of the file
+	unsigned int file_id;	// file ID of the file
+	unsigned char *sha1;	// if not NULL, the hash of the file is stored here
+};
+
+struct DedupRange
+{
+	unsigned int top;		// location of the first copy of the file
+	unsigned int bottom;
+};
 
 void Create();
 void Sha1Hmac(u8 output[20], FILE* f, unsigned int pos, unsigned int size);
+void Sha1HmacBegin(sha1_ctx cx[1]);
+void Sha1HmacEnd(u8 output[20], sha1_ctx cx[1]);
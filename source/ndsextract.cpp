@@ -1,11 +1,20 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 
 #include <errno.h>
+#include <unistd.h>
 
+#include <string>
+#include <vector>
+
+#include "fileio.h"
+#include "ioengine.h"
 #include "log.h"
 #include "ndsextract.h"
 #include "ndstool.h"
+#include "nitrofs.h"
 #include "overlay.h"
+#include "parallel.h"
+#include "tar.h"
 
 /*
  * MkDir
@@ -23,203 +32,169 @@ void MkDir(const char *name)
 	}
 }
 
+// File that has to be written by WriteFiles()
+struct ExtractJob
+{
+	std::string filename;
+	unsigned int top;
+	unsigned int size;
+};
+
 /*
- * ExtractFile
- * if rootdir==0 nothing will be written
+ * CreateDirectory
  */
-void ExtractFile(const char *rootdir, const char *prefix, const char *entry_name, unsigned int file_id)
+static void CreateDirectory(const char *name)
 {
-	long save_filepos = ftell(fNDS);
-	if (save_filepos == -1)
-		LogFatal("%s: Failed to get position\n", __func__);
+	if (ctx->extract_tar)
+		ctx->extract_tar->AddDirectory(name);
+	else
+		MkDir(name);
+}
 
+/*
+ * ExtractFile
+ * if rootdir==0 nothing will be written. Otherwise, the file is added to the
+ * list of jobs.
+ */
+void ExtractFile(const NitroFsIndex &index, const char *rootdir, const char *prefix, const char *entry_name, unsigned int file_id,
+				 std::vector<ExtractJob> &jobs)
+{
 	// read FAT data
-	if (fseek(fNDS, header.fat_offset + 8*file_id, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek file\n", __func__);
-
-	unsigned_int top;
-	if (fread(&top, 1, sizeof(top), fNDS) != sizeof(top))
-		LogFatal("%s: Failed to read filesystem data\n", __func__);
-
-	unsigned_int bottom;
-	if (fread(&bottom, 1, sizeof(bottom), fNDS) != sizeof(bottom))
-		LogFatal("%s: Failed to read bottom\n", __func__);
+	unsigned int top, bottom;
+	if (!index.GetFileRange(file_id, top, bottom))
+		LogFatal("File %u: Invalid file ID.\n", file_id);
 
 	unsigned int size = bottom - top;
-	if (size > (1U << (17 + header.devicecap)))
+	if (size > (1U << (17 + ctx->header.devicecap)))
 	{
 		LogFatal("File %u: Size is too big. FAT offset 0x%X contains invalid data.\n",
-				file_id, header.fat_offset + 8*file_id);
+				file_id, ctx->header.fat_offset + 8*file_id);
 	}
 
 	// print file info
-	if (!rootdir || verbose)
+	if (!rootdir || ctx->verbose)
 	{
-		printf("%5u 0x%08X 0x%08X %9u %s%s\n", file_id, (int)top, (int)bottom, size, prefix, entry_name);
+		printf("%5u 0x%08X 0x%08X %9u %s%s\n", file_id, top, bottom, size, prefix, entry_name);
 	}
 
 	// extract file
 	if (rootdir)
 	{
-		// make filename
-		char filename[MAXPATHLEN];
-		strcpy(filename, rootdir);
-		strcat(filename, prefix);
-		strcat(filename, entry_name);
-
-		if (fseek(fNDS, top, SEEK_SET) == -1)
-			LogFatal("%s: Failed to seek top of file\n", __func__);
-
-		FILE *fo = fopen(filename, "wb");
-		if (!fo)
-			LogFatal("%s: Cannot create file '%s'\n", __func__, filename);
+		ExtractJob job;
+		job.filename = rootdir;
+		job.filename += prefix;
+		job.filename += entry_name;
+		job.top = top;
+		job.size = size;
+		jobs.push_back(job);
+	}
+}
 
-		while (size > 0)
-		{
-			unsigned char copybuf[1024];
-			unsigned int size2 = (size >= sizeof(copybuf)) ? sizeof(copybuf) : size;
-			if (fread(copybuf, 1, size2, fNDS) != size2)
-				LogFatal("%s: Failed to read data\n", __func__);
-			if (fwrite(copybuf, 1, size2, fo) != size2)
-				LogFatal("%s: Failed to write data\n", __func__);
-			size -= size2;
-		}
+/*
+ * WriteFile
+ */
+static void WriteFile(int fd_in, const ExtractJob &job)
+{
+	ScopedFd fd_out(open(job.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666));
+	if (fd_out.Get() < 0)
+		LogFatal("%s: Cannot create file '%s'\n", __func__, job.filename.c_str());
 
-		fclose(fo);
-	}
+	if (!CopyFileData(fd_in, job.top, fd_out.Get(), 0, job.size))
+		LogFatal("%s: Failed to copy data\n", __func__);
 
-	if (fseek(fNDS, save_filepos, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek file position\n", __func__);
+	if (!fd_out.Close())
+		LogFatal("%s: Failed to write '%s'\n", __func__, job.filename.c_str());
 }
 
 /*
- * MatchName
+ * WriteFiles
+ * The directories of the files must exist already. The files are written by
+ * several threads at the same time, all of them reading from fNDS. With the
+ * io_uring engine, small files are written by it instead.
  */
-bool MatchName(char *name, char *mask, int level=0)
+void WriteFiles(const std::vector<ExtractJob> &jobs)
 {
-	char *a = name;
-	char *b = mask;
-	//for (int i=0; i<level; i++) printf("  "); printf("matching a='%s' b='%s'\n", a, b);
-	while (1)
+	int fd_in = fileno(ctx->fNDS);
+
+	// Archives are written sequentially
+	if (ctx->extract_tar)
 	{
-		//for (int i=0; i<level; i++) printf("a=%s b=%s\n", a, b);
-		if (*b == '*')
+		for (const ExtractJob &job : jobs)
+			ctx->extract_tar->AddFile(job.filename.c_str(), fd_in, job.top, job.size);
+		return;
+	}
+
+	std::vector<const ExtractJob *> posix_jobs;
+	bool uring_done = false;
+
+	if (ctx->io_engine == IO_ENGINE_URING)
+	{
+		std::vector<IoCopyRequest> requests;
+		for (const ExtractJob &job : jobs)
 		{
-			while (*b == '*') b++;
-	//for (int i=0; i<level; i++) printf("  "); printf("* '%s' '%s'\n", a, b);
-			bool match = false;
-			char *a2 = a;
-			do
-			{
-				if (MatchName(a2, b, level+1)) { a = a2; match = true; break; }
-			} while (*a2++);
-			if (!match) return false;
-			//for (int i=0; i<level; i++) printf("  "); printf("matched a='%s' b='%s'\n", a, b);
+			if (job.size <= IO_URING_MAX_FILE_SIZE)
+				requests.push_back({ job.filename.c_str(), job.top, job.size, NULL });
+			else
+				posix_jobs.push_back(&job);
 		}
-		//for (int i=0; i<level; i++) printf("  "); printf("a=%s b=%s\n", a, b);
-		if (!*a && !*b) return true;
-		if (*a && !*b) return false;
-		if (!*a && *b) return false;
-		if (*b != '?' && *a != *b) return false;
-		a++; b++;
+
+		uring_done = IoUringExtractFiles(fd_in, requests);
+		if (!uring_done)
+			LogWarning("io_uring isn't available, using the POSIX engine.\n");
 	}
+
+	if (!uring_done)
+	{
+		posix_jobs.clear();
+		for (const ExtractJob &job : jobs)
+			posix_jobs.push_back(&job);
+	}
+
+	ParallelFor(posix_jobs.size(), [&](size_t i)
+	{
+		WriteFile(fd_in, *posix_jobs[i]);
+	});
 }
 
 /*
- * ExtractDirectory
+ * ExtractDirectories
  * filerootdir can be 0 for just listing files
  */
-void ExtractDirectory(const char *filerootdir, const char *prefix, unsigned int dir_id)
+void ExtractDirectories(const NitroFsIndex &index, const char *filerootdir)
 {
 	char strbuf[MAXPATHLEN];
-	long save_filepos = ftell(fNDS);
-	if (save_filepos == -1)
-		LogFatal("%s: Failed to get position\n", __func__);
-
-	if (fseek(fNDS, header.fnt_offset + 8*(dir_id & 0xFFF), SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek directory info\n", __func__);
+	std::vector<ExtractJob> jobs;
 
-	unsigned_int entry_start;	// reference location of entry name
-	if (fread(&entry_start, 1, sizeof(entry_start), fNDS) != sizeof(entry_start))
-		LogFatal("%s: Failed to read entry start ID\n", __func__);
-
-	unsigned_short top_file_id;	// file ID of top entry
-	if (fread(&top_file_id, 1, sizeof(top_file_id), fNDS) != sizeof(top_file_id))
-		LogFatal("%s: Failed to read top file ID\n", __func__);
-
-	unsigned_short parent_id;	// ID of parent directory or directory count (root)
-	if (fread(&parent_id, 1, sizeof(parent_id), fNDS) != sizeof(parent_id))
-		LogFatal("%s: Failed to read parent ID\n", __func__);
-
-	if (fseek(fNDS, header.fnt_offset + entry_start, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek directory start\n", __func__);
-
-	// print directory name
-	//printf("%04X ", dir_id);
-	if (!filerootdir || verbose)
+	// Directories are created and the files are printed in order. The files
+	// are written at the end.
+	for (const NitroFsEntry &entry : index.entries)
 	{
-		printf("%s\n", prefix);
-	}
-
-	for (unsigned int file_id=top_file_id; ; file_id++)
-	{
-		unsigned char entry_type_name_length;
-		if (fread(&entry_type_name_length, 1, sizeof(entry_type_name_length), fNDS) != sizeof(entry_type_name_length))
-			LogFatal("%s: Failed to read entry type name length\n", __func__);
-
-		unsigned int name_length = entry_type_name_length & 127;
-		bool entry_type_directory = (entry_type_name_length & 128) ? true : false;
-		if (name_length == 0) break;
-	
-		char entry_name[128];
-		memset(entry_name, 0, 128);
-		size_t entry_type_name_size = entry_type_name_length & 127;
-		if (fread(entry_name, 1, entry_type_name_size, fNDS) != entry_type_name_size)
-			LogFatal("%s: Failed to read entry type name\n", __func__);
-
-		if (entry_type_directory)
+		if (entry.is_dir)
 		{
-			unsigned_short dir_id;
-			if (fread(&dir_id, 1, sizeof(dir_id), fNDS) != sizeof(dir_id))
-				LogFatal("%s: Failed to read directory ID\n", __func__);
+			// print directory name
+			if (!filerootdir || ctx->verbose)
+			{
+				printf("%s\n", entry.path.c_str());
+			}
 
-			if (filerootdir)
+			if (filerootdir && (entry.parent != NITROFS_NO_PARENT))
 			{
 				strcpy(strbuf, filerootdir);
-				strcat(strbuf, prefix);
-				strcat(strbuf, entry_name);
-				MkDir(strbuf);
+				strcat(strbuf, entry.path.c_str());
+				CreateDirectory(strbuf);
 			}
-
-			strcpy(strbuf, prefix);
-			strcat(strbuf, entry_name);
-			strcat(strbuf, "/");
-			ExtractDirectory(filerootdir, strbuf, dir_id);
 		}
 		else
 		{
-			if (1)
+			if (ctx->filemasks.Match(entry.path.c_str()))
 			{
-				bool match = (filemask_num == 0);
-				for (int i=0; i<filemask_num; i++)
-				{
-					//printf("%s %s\n", entry_name, filemasks[i]);
-					if (MatchName(entry_name, filemasks[i])) { match = true; break; }
-				}
-
-				//if (!directorycreated)
-				//{
-				//}
-				
-				//printf("%d\n", match);
-
-				if (match) ExtractFile(filerootdir, prefix, entry_name, file_id);
+				std::string prefix = entry.path.substr(0, entry.name_offset);
+				ExtractFile(index, filerootdir, prefix.c_str(), entry.Name(), entry.id, jobs);
 			}
 		}
 	}
 
-	if (fseek(fNDS, save_filepos, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek previous file position\n", __func__);
+	WriteFiles(jobs);
 }
 
 /*
@@ -227,41 +202,101 @@ void ExtractDirectory(const char *filerootdir, const char *prefix, unsigned int
  */
 void ExtractFiles(const char *ndsfilename, const char *filerootdir)
 {
-	fNDS = fopen(ndsfilename, "rb");
-	if (!fNDS)
+	ctx->fNDS = fopen(ndsfilename, "rb");
+	if (!ctx->fNDS)
 		LogFatal("Cannot open file '%s'.\n", ndsfilename);
 
-	if (fread(&header, 512, 1, fNDS) != 1)
+	if (fread(&ctx->header, 512, 1, ctx->fNDS) != 1)
 		LogFatal("%s: Failed to read header\n", __func__);
 
 	if (filerootdir)
-		MkDir(filerootdir);
+		CreateDirectory(filerootdir);
 
-	ExtractDirectory(filerootdir, "/", 0xF000); // list or extract
+	NitroFsIndex index;
+	index.Load(fileno(ctx->fNDS), ctx->header);
+	ExtractDirectories(index, filerootdir); // list or extract
 
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
+}
+
+/*
+ * ExtractSingleFile
+ * name is a NitroFS path or a file ID. The file is written to stdout if
+ * outfilename is "-".
+ */
+void ExtractSingleFile(const char *ndsfilename, const char *name, const char *outfilename)
+{
+	ctx->fNDS = fopen(ndsfilename, "rb");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'.\n", ndsfilename);
+
+	if (fread(&ctx->header, 512, 1, ctx->fNDS) != 1)
+		LogFatal("%s: Failed to read header\n", __func__);
+
+	char *end;
+	unsigned int file_id = strtoul(name, &end, 0);
+	if ((*name < '0') || (*name > '9') || (*end != '\0'))
+	{
+		if (!NitroFsFindFile(fileno(ctx->fNDS), ctx->header, name, file_id))
+			LogFatal("File '%s' not found.\n", name);
+	}
+
+	unsigned int top, bottom;
+	if (!NitroFsReadFat(fileno(ctx->fNDS), ctx->header, file_id, top, bottom))
+		LogFatal("File %u: Invalid file ID.\n", file_id);
+
+	unsigned int size = bottom - top;
+	if (size > (1U << (17 + ctx->header.devicecap)))
+	{
+		LogFatal("File %u: Size is too big. FAT offset 0x%X contains invalid data.\n",
+				file_id, ctx->header.fat_offset + 8*file_id);
+	}
+
+	if (strcmp(outfilename, "-") == 0)
+	{
+		fflush(stdout);
+		if (!CopyFileDataToStream(fileno(ctx->fNDS), top, fileno(stdout), size))
+			LogFatal("%s: Failed to copy data\n", __func__);
+	}
+	else
+	{
+		if (ctx->verbose)
+			printf("%5u 0x%08X 0x%08X %9u %s\n", file_id, top, bottom, size, name);
+
+		ScopedFile fo(fopen(outfilename, "wb"));
+		if (!fo.Get())
+			LogFatal("%s: Cannot create file '%s'\n", __func__, outfilename);
+
+		if (!CopyFileData(fileno(ctx->fNDS), top, fileno(fo.Get()), 0, size))
+			LogFatal("%s: Failed to copy data\n", __func__);
+	}
+
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
 }
 
 /*
  * ExtractOverlayFiles2
  */
- void ExtractOverlayFiles2(unsigned int overlay_offset, unsigned int overlay_size)
+ void ExtractOverlayFiles2(const NitroFsIndex &index, unsigned int overlay_offset, unsigned int overlay_size,
+						   std::vector<ExtractJob> &jobs)
  {
  	OverlayEntry overlayEntry;
 
 	if (overlay_size)
 	{
-		if (fseek(fNDS, overlay_offset, SEEK_SET) == -1)
+		if (fseek(ctx->fNDS, overlay_offset, SEEK_SET) == -1)
 			LogFatal("%s: Failed to seek overlay offset\n", __func__);
 
 		for (unsigned int i=0; i<overlay_size; i+=sizeof(OverlayEntry))
 		{
-			if (fread(&overlayEntry, 1, sizeof(overlayEntry), fNDS) != sizeof(overlayEntry))
+			if (fread(&overlayEntry, 1, sizeof(overlayEntry), ctx->fNDS) != sizeof(overlayEntry))
 				LogFatal("%s: Failed to read overlay entry\n", __func__);
 
 			int file_id = overlayEntry.id;
 			char s[32]; sprintf(s, OVERLAY_FMT, file_id);
-			ExtractFile(overlaydir, "/", s, file_id);
+			ExtractFile(index, ctx->overlaydir, "/", s, file_id, jobs);
 		}
 	}
 }
@@ -272,22 +307,28 @@ void ExtractFiles(const char *ndsfilename, const char *filerootdir)
  */
 void ExtractOverlayFiles()
 {
-	fNDS = fopen(ndsfilename, "rb");
-	if (!fNDS)
-		LogFatal("Cannot open file '%s'.\n", ndsfilename);
+	ctx->fNDS = fopen(ctx->ndsfilename, "rb");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'.\n", ctx->ndsfilename);
 
-	if (fread(&header, 512, 1, fNDS) != 1)
+	if (fread(&ctx->header, 512, 1, ctx->fNDS) != 1)
 		LogFatal("%s: Failed to read header\n", __func__);
 
-	if (overlaydir)
+	if (ctx->overlaydir)
 	{
-		MkDir(overlaydir);
+		CreateDirectory(ctx->overlaydir);
 	}
 
-	ExtractOverlayFiles2(header.arm9_overlay_offset, header.arm9_overlay_size);
-	ExtractOverlayFiles2(header.arm7_overlay_offset, header.arm7_overlay_size);
+	// Overlays aren't in the FNT, which may not even exist
+	NitroFsIndex index;
+	index.LoadFat(fileno(ctx->fNDS), ctx->header);
+	std::vector<ExtractJob> jobs;
+	ExtractOverlayFiles2(index, ctx->header.arm9_overlay_offset, ctx->header.arm9_overlay_size, jobs);
+	ExtractOverlayFiles2(index, ctx->header.arm7_overlay_offset, ctx->header.arm7_overlay_size, jobs);
+	WriteFiles(jobs);
 
-	fclose(fNDS);
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
 }
 
 /*
@@ -295,38 +336,52 @@ void ExtractOverlayFiles()
  */
 void Extract(const char *outfilename, bool indirect_offset, unsigned int offset, bool indirect_size, unsigned size, bool with_footer)
 {
-	fNDS = fopen(ndsfilename, "rb");
-	if (!fNDS)
-		LogFatal("Cannot open file '%s'\n", ndsfilename);
+	ctx->fNDS = fopen(ctx->ndsfilename, "rb");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'\n", ctx->ndsfilename);
 
-	if (fread(&header, 512, 1, fNDS) != 1)
+	if (fread(&ctx->header, 512, 1, ctx->fNDS) != 1)
 		LogFatal("%s: Failed to read header\n", __func__);
 
-	if (indirect_offset) offset = *((unsigned_int *)&header + offset/4);
-	if (indirect_size) size = *((unsigned_int *)&header + size/4);
+	if (indirect_offset) offset = *((unsigned_int *)&ctx->header + offset/4);
+	if (indirect_size) size = *((unsigned_int *)&ctx->header + size/4);
 
-	if (fseek(fNDS, offset, SEEK_SET) == -1)
-		LogFatal("%s: Failed to seek file offset\n", __func__);
+	if (ctx->extract_tar)
+	{
+		// The footer is right after the data, so it's added to the same entry
+		if (with_footer)
+		{
+			unsigned_int nitrocode;
+			if (!ReadAt(fileno(ctx->fNDS), &nitrocode, sizeof(nitrocode), offset + size))
+				LogFatal("%s: Failed to read nitrocode\n", __func__);
+			if (nitrocode == 0xDEC00621)
+				size += 12;
+		}
 
-	FILE *fo = fopen(outfilename, "wb");
+		ctx->extract_tar->AddFile(outfilename, fileno(ctx->fNDS), offset, size);
+		fclose(ctx->fNDS);
+		ctx->fNDS = NULL;
+		return;
+	}
+
+	ScopedFile file(fopen(outfilename, "wb"));
+	FILE *fo = file.Get();
 	if (!fo)
 		LogFatal("Cannot create file '%s'.\n", outfilename);
 
-	unsigned char copybuf[1024];
-	while (size > 0)
-	{
-		unsigned int size2 = (size >= sizeof(copybuf)) ? sizeof(copybuf) : size;
-		if (fread(copybuf, 1, size2, fNDS) != size2)
-			LogFatal("%s: Failed to read buffer\n", __func__);
-		if (fwrite(copybuf, 1, size2, fo) != size2)
-			LogFatal("%s: Failed to read buffer\n", __func__);
-		size -= size2;
-	}
+	if (!CopyFileData(fileno(ctx->fNDS), offset, fileno(fo), 0, size))
+		LogFatal("%s: Failed to copy data\n", __func__);
 
 	if (with_footer)
 	{
+		// CopyFileData() doesn't move the file positions
+		if (fseek(ctx->fNDS, offset + size, SEEK_SET) == -1)
+			LogFatal("%s: Failed to seek footer\n", __func__);
+		if (fseek(fo, size, SEEK_SET) == -1)
+			LogFatal("%s: Failed to seek end of file\n", __func__);
+
 		unsigned_int nitrocode;
-		if (fread(&nitrocode, sizeof(nitrocode), 1, fNDS) != 1)
+		if (fread(&nitrocode, sizeof(nitrocode), 1, ctx->fNDS) != 1)
 			LogFatal("%s: Failed to read nitrocode\n", __func__);
 
 		if (nitrocode == 0xDEC00621)
@@ -336,12 +391,39 @@ void Extract(const char *outfilename, bool indirect_offset, unsigned int offset,
 			{
 				if (fwrite(&nitrocode, sizeof(nitrocode), 1, fo) != 1)
 					LogFatal("%s: Failed to write data\n", __func__);
-				if (fread(&nitrocode, sizeof(nitrocode), 1, fNDS) != 1) // next field
+				if (fread(&nitrocode, sizeof(nitrocode), 1, ctx->fNDS) != 1) // next field
 					LogFatal("%s: Failed to read data\n", __func__);
 			}
 		}
 	}
 
-	fclose(fo);
-	fclose(fNDS);
+	file.Close();
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
+}
+
+/*
+ * ExtractTarBegin
+ * All files extracted until ExtractTarEnd() is called are written to a tar
+ * archive, or to stdout if tarfilename is "-".
+ */
+void ExtractTarBegin(const char *tarfilename)
+{
+	uint64_t mtime = 0;
+	struct stat st;
+	if (stat(ctx->ndsfilename, &st) == 0)
+		mtime = GetFileMtime(st) / 1000000000;
+
+	ctx->extract_tar = new TarWriter;
+	ctx->extract_tar->Open(tarfilename, mtime);
+}
+
+/*
+ * ExtractTarEnd
+ */
+void ExtractTarEnd()
+{
+	ctx->extract_tar->Close();
+	delete ctx->extract_tar;
+	ctx->extract_tar = NULL;
 }
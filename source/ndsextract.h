@@ -3,5 +3,8 @@
 #pragma once
 
 void ExtractFiles(const char *ndsfilename, const char *filerootdir);
+void ExtractSingleFile(const char *ndsfilename, const char *name, const char *outfilename);
 void ExtractOverlayFiles();
 void Extract(const char *outfilename, bool indirect_offset, unsigned int offset, bool indirect_size, unsigned size, bool with_footer = false);
+void ExtractTarBegin(const char *tarfilename);
+void ExtractTarEnd();
@@ -8,70 +8,9 @@
 #include <unistd.h>
 
 #include "ndstool.h"
-#include "sha1.h"
-#include "ndscreate.h"
-#include "ndsextract.h"
-#include "banner.h"
+#include "libndstool.h"
 #include "log.h"
 
-int verbose = 0;
-Header header;
-FILE *fNDS = 0;
-
-char *filemasks[MAX_FILEMASKS];
-int filemask_num = 0;
-
-char *ndsfilename = 0;
-char *arm7filename = 0;
-char *arm9filename = 0;
-char *arm7ifilename = 0;
-char *arm9ifilename = 0;
-
-int filerootdirs_num = 0;
-char *filerootdirs[MAX_FILEROOTDIRS];
-
-char *overlaydir = 0;
-char *arm7ovltablefilename = 0;
-char *arm9ovltablefilename = 0;
-const char *bannerfilename = 0;
-const char *banneranimfilename = 0;
-const char *bannertext[MAX_BANNER_TITLE_COUNT] = {0};
-unsigned int bannersize = 0x840;
-char *headerfilename_or_size = 0;
-char *logofilename = 0;
-char *title = 0;
-char *makercode = 0;
-char *gamecode = 0;
-char *vhdfilename = 0;
-char *sramfilename = 0;
-int latency_1 = 0;
-int latency_2 = 24;
-int latency1_1 = 2296;
-int latency1_2 = 24;
-unsigned int romversion = 0;
-bool loadmeEnabled = false;
-
-int bannertype = 0;
-unsigned int arm9RamAddress = 0;
-unsigned int arm7RamAddress = 0;
-unsigned int arm9Entry = 0;
-unsigned int arm7Entry = 0;
-int unitCode = -1;
-
-// By default declare DSi-compatible games as DSiware. There is no way to create
-// a DSi cartridge that works on regular unmodified consoles because they would
-// need to be signed. However, some people install DSi ROMs in DSi NAND, where
-// the DSiware ID makes more sense. Homebrew loaders generally ignore this
-// value, but some of them require the DSiware ID to provide the device list to
-// the application when it boots.
-//unsigned int titleidHigh = 0x00030000; // DSi-enhanced gamecard
-unsigned int titleidHigh = 0x00030004; // DSiware
-
-unsigned int scfgExtMask = 0x80040407; // enable access to everything
-unsigned int accessControl = 0x00000138;
-unsigned int mbkArm7WramMapAddress = 0;
-unsigned int appFlags = 0x01;
-
 void Title()
 {
 	printf("Nintendo DS rom tool (" VERSION_STRING ")\nby Rafael Vuijk, Dave Murphy, Alexei Karpenko\n");
@@ -114,11 +53,22 @@ ArgInfo arguments[] =
 	{"i",   0, "Show information:\n-i [file.nds]\nHeader information."},
 	{"fh",  0, "Fix header checksums\n-fh [file.nds]\nYou only need this after manual editing."},
 	{"fb",  0, "Fix banner CRC\n-fb [file.nds]\nYou only need this after manual editing."},
+	{"verify", 0, "Verify\n-verify [file.nds]\nChecks all CRCs, HMACs and signatures of the ROM in one pass. Prints one line per field: name, OK/FAIL/SKIP/INFO, expected and actual value, separated by tabs. The exit code is 1 if any check fails."},
+	{"scan", 0, "Scan ROMs\n-scan file.nds|directory...\nPrints the header and banner information of many ROMs, one record per ROM. Directories are searched for .nds, .dsi and .srl files."},
+	{"fmt", 1, "  Scan output format\n-fmt json|csv\nJSON lines or CSV with a header row. Default: json."},
+	{"hash", 0, "  Scan hashes\n-hash\nAdds the CRC32 and SHA1 of each ROM. The whole ROM is read."},
+	{"catalog", 2, "ROM catalog\n-catalog file command [args]\nKeeps an index of a ROM collection, with hashes and header information. Commands:\nupdate file.nds|directory... (only new or modified ROMs are read)\ngamecode code\nhash crc32|sha1"},
 	{"l",   0, "List files:\n-l [file.nds]\nGive a list of contained files."},
 	{"c",   0, "Create\n-c [file.nds]"},
+	{"inc", 0, "  Incremental build\n-inc\nSaves a manifest next to the ROM (file.nds.manifest). If it already exists, only the NitroFS files that have changed are updated."},
 	{"x",   0, "Extract\n-x [file.nds]"},
+	{"tar", 1, "  Extract to tar archive\n-tar file.tar|-\nWrites the files extracted with -x to a tar archive, or to stdout, instead of to disk. Banners can only be extracted as binaries (-t)."},
+	{"xf",  2, "Extract single file\n-xf path|id file|-\nExtracts a NitroFS file, given its path or file ID, to a file or to stdout. Only the directories in the path are read. It can be used several times."},
 	{"v",   0, "  Show more info\n-v\nShow filenames and more header info"},
 	{"vv",  0, "  Show more info\n-vv\nShow even more information than -v"},
+	{"j",   1, "  Worker threads\n-j threads\nNumber of threads used to copy files. Default: one per CPU."},
+	{"io",  1, "  I/O engine\n-io posix|uring\nEngine used to copy NitroFS files. uring (Linux only) copies many small files with few system calls. Default: posix."},
+	{"qd",  1, "  I/O queue depth\n-qd depth\nNumber of files copied at the same time by the uring engine. Default: 64."},
 	{"9",   1, "  ARM9 executable\n-9 file.bin"},
 	{"9i",  1, "  ARM9i executable\n-9i file.bin"},
 	{"7",   1, "  ARM7 executable\n-7 file.bin"},
@@ -127,6 +77,9 @@ ArgInfo arguments[] =
 	{"y7",  1, "  ARM7 overlay table\n-y7 file.bin"},
 	{"d",   1, "  NitroFS root folder\n-d directory1 <directory2> ...\nAll directories are combined in the root of the filesystem"},
 	{"y",   1, "  Overlay files\n-y directory"},
+	{"sc",  1, "  Scan cache\n-sc file\nSaves the directory structure of the NitroFS root folders in a file. Folders that haven't changed are taken from it in the next build instead of being read again."},
+	{"dedup", 0, "  Deduplicate files\n-dedup\nFiles with identical contents are only stored once in the ROM."},
+	{"fa",  1, "  NitroFS file alignment\n-fa alignment\nAlignment of files in the ROM. Default: 0x200. Use 0x1000 so that filesystems with reflink support can share the file data with the ROM."},
 	{"b",   1, "  Banner icon/text\n-b file.[bmp|gif|png] \"text;text;text\"\nThe three lines are shown at different sizes."},
 	{"ba",  1, "  Banner animated icon\n-ba file.[bmp|gif|png]"},
 	{"bi",  1, "  Banner static icon\n-bi file.[bmp|gif|png]"},
@@ -142,13 +95,14 @@ ArgInfo arguments[] =
 	{"r7",  1, "  ARM7 RAM address\n-r7 address"},
 	{"e9",  1, "  ARM9 RAM entry\n-e9 address"},
 	{"e7",  1, "  ARM7 RAM entry\n-e7 address"},
-	{"w",   0, "  Wildcard filemask(s)\n-w [filemask]...\n* and ? are wildcard characters."},
+	{"w",   0, "  Wildcard filemask(s)\n-w [filemask]...\n* and ? are wildcard characters. Masks with / are matched against the full path, where ** matches any number of folders. Masks that start with ! exclude files."},
 	{"u",   1, "  DSi high title ID\n-u tidhigh  (32-bit hex)"},
 	{"uc",  1, "  DSi unit code\n-uc unitcode (0 = DS-only, 2 = DS or DSi, 3 = DSi-only)"},
 	{"z",   1, "  ARM7 SCFG EXT mask\n-z scfgmask (32-bit hex)"},
 	{"a",   1, "  DSi access flags\n-a accessflags (32-bit hex)"},
 	{"p",   1, "  DSi application flags\n-p appflags (8-bit hex)"},
 	{"q",      1, "  DSi ARM7 WRAM_A map address\n -m address (32-bit hex)"},
+	{"rsakey", 1, "  DSi header RSA key\n-rsakey key.txt\nSigns the DSi header with a 1024-bit private key, as printed by \"openssl rsa -text -noout\". By default a dummy signature is used."},
 	{"nopass", 0, "  Disable PassMe loader patch\n -nopass  This is the default setting"},
 	{"pass",   0, "  Enable PassMe loader patch\n  -pass    May break compatibility with some loaders"},
 	{NULL,  0, NULL} // Marker of end of list
@@ -193,12 +147,17 @@ enum {
 	ACTION_SHOWINFO,
 	ACTION_FIXHEADERCHECKSUMS,
 	ACTION_FIXBANNERCRC,
+	ACTION_VERIFY,
+	ACTION_SCAN,
+	ACTION_CATALOG,
 	ACTION_LISTFILES,
 	ACTION_EXTRACT,
+	ACTION_EXTRACTFILES,
 	ACTION_CREATE,
 };
 
 int main(int argc, char *argv[])
+try
 {
 	if (argc < 2)
 	{
@@ -206,6 +165,11 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	// The context is also the current one while the arguments are parsed, so
+	// that errors are reported like the errors of the actions
+	NdsContext context;
+	NdsContextScope scope(context);
+
 	int num_actions = 0;
 	int actions[MAX_ACTIONS];
 
@@ -230,9 +194,9 @@ int main(int argc, char *argv[])
 		{
 			// This is a positional argument. There is only one positional
 			// argument supported.
-			if (ndsfilename == NULL)
+			if (context.ndsfilename == NULL)
 			{
-				ndsfilename = arg;
+				context.ndsfilename = arg;
 				continue;
 			}
 
@@ -243,31 +207,80 @@ int main(int argc, char *argv[])
 		{
 			ADDACTION(ACTION_SHOWINFO);
 			if (argc > a && argv[a][0] != '-')
-				ndsfilename = argv[a++];
+				context.ndsfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-fh") == 0) // Fix header checksums
 		{
 			ADDACTION(ACTION_FIXHEADERCHECKSUMS);
 			if (argc > a && argv[a][0] != '-')
-				ndsfilename = argv[a++];
+				context.ndsfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-fb") == 0) // Fix banner CRC
 		{
 			ADDACTION(ACTION_FIXBANNERCRC);
 			if (argc > a && argv[a][0] != '-')
-				ndsfilename = argv[a++];
+				context.ndsfilename = argv[a++];
+		}
+		else if (strcmp(arg, "-verify") == 0) // Verify checksums
+		{
+			ADDACTION(ACTION_VERIFY);
+			if (argc > a && argv[a][0] != '-')
+				context.ndsfilename = argv[a++];
+		}
+		else if (strcmp(arg, "-scan") == 0) // Scan ROMs
+		{
+			ADDACTION(ACTION_SCAN);
+			while ((argc > a) && (argv[a][0] != '-'))
+				context.scanpaths.push_back(argv[a++]);
+		}
+		else if (strcmp(arg, "-fmt") == 0) // Scan output format
+		{
+			const char *format = argv[a++];
+			if (strcmp(format, "json") == 0)
+				context.scan_format = SCAN_FORMAT_JSON;
+			else if (strcmp(format, "csv") == 0)
+				context.scan_format = SCAN_FORMAT_CSV;
+			else
+				LogFatal("Invalid value for '-fmt' (must be json or csv): %s\n", format);
+		}
+		else if (strcmp(arg, "-hash") == 0) // Scan hashes
+		{
+			context.scan_hashes = true;
+		}
+		else if (strcmp(arg, "-catalog") == 0) // ROM catalog
+		{
+			ADDACTION(ACTION_CATALOG);
+			context.catalogfilename = argv[a++];
+			context.catalog_command = argv[a++];
+			while ((argc > a) && (argv[a][0] != '-'))
+				context.catalog_args.push_back(argv[a++]);
 		}
 		else if (strcmp(arg, "-l") == 0) // List files
 		{
 			ADDACTION(ACTION_LISTFILES);
 			if (argc > a && argv[a][0] != '-')
-				ndsfilename = argv[a++];
+				context.ndsfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-x") == 0) // Extract
 		{
 			ADDACTION(ACTION_EXTRACT);
 			if (argc > a && argv[a][0] != '-')
-				ndsfilename = argv[a++];
+				context.ndsfilename = argv[a++];
+		}
+		else if (strcmp(arg, "-tar") == 0) // Extract to tar archive
+		{
+			context.tarfilename = argv[a++];
+		}
+		else if (strcmp(arg, "-xf") == 0) // Extract single files
+		{
+			if (context.extractfile_num == MAX_EXTRACTFILES)
+				LogFatal("Too many files to extract\n");
+
+			if (context.extractfile_num == 0)
+				ADDACTION(ACTION_EXTRACTFILES);
+
+			context.extractfile_names[context.extractfile_num] = argv[a++];
+			context.extractfile_outputs[context.extractfile_num++] = argv[a++];
 		}
 		else if (strcmp(arg, "-w") == 0) // Wildcard filemasks
 		{
@@ -281,17 +294,18 @@ int main(int argc, char *argv[])
 				if (argv[a][0] == '-')
 					break;
 
-				if (filemask_num == MAX_FILEMASKS)
-					LogFatal("Too many file masks\n");
-
-				filemasks[filemask_num++] = argv[a++];
+				context.filemasks.Add(argv[a++]);
 			}
 		}
 		else if (strcmp(arg, "-c") == 0) // Create
 		{
 			ADDACTION(ACTION_CREATE);
 			if (argc > a && argv[a][0] != '-')
-				ndsfilename = argv[a++];
+				context.ndsfilename = argv[a++];
+		}
+		else if (strcmp(arg, "-inc") == 0) // Incremental build
+		{
+			context.incremental_build = true;
 		}
 		else if (strcmp(arg, "-d") == 0) // File root directory
 		{
@@ -305,36 +319,52 @@ int main(int argc, char *argv[])
 				if (argv[a][0] == '-')
 					break;
 
-				if (filerootdirs_num == MAX_FILEROOTDIRS)
+				if (context.filerootdirs_num == MAX_FILEROOTDIRS)
 					LogFatal("Too many root directories");
 
-				filerootdirs[filerootdirs_num++] = argv[a++];
+				context.filerootdirs[context.filerootdirs_num++] = argv[a++];
 			}
 		}
+		else if (strcmp(arg, "-sc") == 0) // NitroFS scan cache
+		{
+			context.scancachefilename = argv[a++];
+		}
+		else if (strcmp(arg, "-dedup") == 0) // Deduplicate NitroFS files
+		{
+			context.dedup_files = true;
+		}
+		else if (strcmp(arg, "-fa") == 0) // NitroFS file alignment
+		{
+			context.file_alignment = strtoul(argv[a++], 0, 0);
+
+			// Files need to be at least word-aligned
+			if ((context.file_alignment < 4) || (context.file_alignment & (context.file_alignment - 1)))
+				LogFatal("Invalid value for '-fa' (must be a power of 2, 4 or bigger): %u\n", context.file_alignment);
+		}
 		else if (strcmp(arg, "-7i") == 0) // ARM7i filename
 		{
-			arm7ifilename = argv[a++];
+			context.arm7ifilename = argv[a++];
 		}
 		else if (strcmp(arg, "-7") == 0) // ARM7 filename
 		{
-			arm7filename = argv[a++];
+			context.arm7filename = argv[a++];
 		}
 		else if (strcmp(arg, "-9i") == 0) // ARM9i filename
 		{
-			arm9ifilename = argv[a++];
+			context.arm9ifilename = argv[a++];
 		}
 		else if (strcmp(arg, "-9") == 0) // ARM9 filename
 		{
-			arm9filename = argv[a++];
+			context.arm9filename = argv[a++];
 		}
 		else if (strcmp(arg, "-t") == 0)
 		{
-			bannertype = BANNER_BINARY;
-			bannerfilename = argv[a++];
+			context.bannertype = BANNER_BINARY;
+			context.bannerfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-bt") == 0)
 		{
-			bannertype = BANNER_IMAGE;
+			context.bannertype = BANNER_IMAGE;
 
 			unsigned int text_idx = strtoul(argv[a++], 0, 0);
 
@@ -348,63 +378,67 @@ int main(int argc, char *argv[])
 						MAX_BANNER_TITLE_COUNT - 1);
 			}
 
-			bannertext[text_idx] = argv[a++];
+			context.bannertext[text_idx] = argv[a++];
 		}
 		else if (strcmp(arg, "-bi") == 0)
 		{
-			bannertype = BANNER_IMAGE;
-			bannerfilename = argv[a++];
+			context.bannertype = BANNER_IMAGE;
+			context.bannerfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-ba") == 0)
 		{
-			bannertype = BANNER_IMAGE;
-			banneranimfilename = argv[a++];
+			context.bannertype = BANNER_IMAGE;
+			context.banneranimfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-b") == 0)
 		{
-			bannertype = BANNER_IMAGE;
+			context.bannertype = BANNER_IMAGE;
 
-			bannerfilename = argv[a++];
+			context.bannerfilename = argv[a++];
 
 			if (argc > a && argv[a][0] != '-')
-				bannertext[1] = argv[a++];
+				context.bannertext[1] = argv[a++];
 		}
 		else if (strcmp(arg, "-o") == 0)
 		{
-			logofilename = argv[a++];
+			context.logofilename = argv[a++];
 		}
 		else if (strcmp(arg, "-h") == 0) // Load header or header size
 		{
-			headerfilename_or_size = argv[a++];
+			context.headerfilename_or_size = argv[a++];
 		}
 		else if (strcmp(arg, "-u") == 0) // DSi title ID high word
 		{
-			titleidHigh = strtoul(argv[a++], 0, 16);
+			context.titleidHigh = strtoul(argv[a++], 0, 16);
 		}
 		else if (strcmp(arg, "-uc") == 0) // DS unit code
 		{
 			// Valid unit codes are 0 (DS-only), 2 (DS and DSi supported) and 3
 			// (DSi-only).
-			unitCode = strtoul(argv[a++], 0, 10);
+			context.unitCode = strtoul(argv[a++], 0, 10);
 
-			if ((unitCode == 1) || (unitCode > 3))
-				LogFatal("Invalid value for '-uc' (must be 0, 2 or 3): %u\n", unitCode);
+			if ((context.unitCode == 1) || (context.unitCode > 3))
+				LogFatal("Invalid value for '-uc' (must be 0, 2 or 3): %u\n", context.unitCode);
 		}
 		else if (strcmp(arg, "-z") == 0) // SCFG access flags
 		{
-			scfgExtMask = strtoul(argv[a++], 0, 16);
+			context.scfgExtMask = strtoul(argv[a++], 0, 16);
 		}
 		else if (strcmp(arg, "-a") == 0) // DSi access control flags
 		{
-			accessControl = strtoul(argv[a++], 0, 16);
+			context.accessControl = strtoul(argv[a++], 0, 16);
 		}
 		else if (strcmp(arg, "-p") == 0) // DSi application flags
 		{
-			appFlags = strtoul(argv[a++], 0, 16) & 0xFF;
+			context.appFlags = strtoul(argv[a++], 0, 16) & 0xFF;
 		}
 		else if (strcmp(arg, "-q") == 0) // DSi ARM7 WRAM_A map address
 		{
-			mbkArm7WramMapAddress = strtoul(argv[a++], 0, 16);
+			context.mbkArm7WramMapAddress = strtoul(argv[a++], 0, 16);
+		}
+		else if (strcmp(arg, "-rsakey") == 0) // DSi header RSA private key
+		{
+			context.rsakeyfilename = argv[a++];
 		}
 		else if (strcmp(arg, "-V") == 0) // Version string
 		{
@@ -413,75 +447,96 @@ int main(int argc, char *argv[])
 		}
 		else if (strcmp(arg, "-v") == 0) // Verbose
 		{
-			verbose = 1;
+			context.verbose = 1;
 		}
 		else if (strcmp(arg, "-vv") == 0) // More verbose
 		{
-			verbose = 2;
+			context.verbose = 2;
+		}
+		else if (strcmp(arg, "-j") == 0) // Number of worker threads
+		{
+			context.num_threads = strtoul(argv[a++], 0, 0);
+		}
+		else if (strcmp(arg, "-io") == 0) // I/O engine
+		{
+			const char *engine = argv[a++];
+			if (strcmp(engine, "posix") == 0)
+				context.io_engine = IO_ENGINE_POSIX;
+			else if (strcmp(engine, "uring") == 0)
+				context.io_engine = IO_ENGINE_URING;
+			else
+				LogFatal("Invalid value for '-io' (must be posix or uring): %s\n", engine);
+		}
+		else if (strcmp(arg, "-qd") == 0) // I/O queue depth
+		{
+			context.io_queue_depth = strtoul(argv[a++], 0, 0);
+
+			if ((context.io_queue_depth == 0) || (context.io_queue_depth > 4096))
+				LogFatal("Invalid value for '-qd' (must be between 1 and 4096): %u\n", context.io_queue_depth);
 		}
 		else if (strcmp(arg, "-n") == 0) // Latency
 		{
-			latency_1 = strtoul(argv[a++], 0, 0);
-			latency_2 = strtoul(argv[a++], 0, 0);
+			context.latency_1 = strtoul(argv[a++], 0, 0);
+			context.latency_2 = strtoul(argv[a++], 0, 0);
 		}
 		else if (strcmp(arg, "-n1") == 0) // Latency
 		{
-			latency1_1 = strtoul(argv[a++], 0, 0);
-			latency1_2 = strtoul(argv[a++], 0, 0);
+			context.latency1_1 = strtoul(argv[a++], 0, 0);
+			context.latency1_2 = strtoul(argv[a++], 0, 0);
 		}
 		else if (strcmp(arg, "-r7") == 0) // ARM7 RAM address
 		{
-			arm7RamAddress = strtoul(argv[a++], 0, 0);
+			context.arm7RamAddress = strtoul(argv[a++], 0, 0);
 		}
 		else if (strcmp(arg, "-r9") == 0) // ARM9 RAM address
 		{
-			arm9RamAddress = strtoul(argv[a++], 0, 0);
+			context.arm9RamAddress = strtoul(argv[a++], 0, 0);
 		}
 		else if (strcmp(arg, "-e7") == 0) // ARM7 entrypoint
 		{
-			arm7Entry = strtoul(argv[a++], 0, 0);
+			context.arm7Entry = strtoul(argv[a++], 0, 0);
 		}
 		else if (strcmp(arg, "-e9") == 0) // ARM9 entrypoint
 		{
-			arm9Entry = strtoul(argv[a++], 0, 0);
+			context.arm9Entry = strtoul(argv[a++], 0, 0);
 		}
 		else if (strcmp(arg, "-m") == 0) // Maker code
 		{
-			makercode = argv[a++];
+			context.makercode = argv[a++];
 		}
 		else if (strcmp(arg, "-g") == 0) // Game code
 		{
-			gamecode = argv[a++];
+			context.gamecode = argv[a++];
 			if (argc > a && argv[a][0] != '-')
 			{
-				makercode = argv[a++];
+				context.makercode = argv[a++];
 				if (argc > a && argv[a][0] != '-')
 				{
-					title = argv[a++];
+					context.title = argv[a++];
 					if (argc > a && argv[a][0] != '-')
-						romversion = strtoul(argv[a++], 0, 0);
+						context.romversion = strtoul(argv[a++], 0, 0);
 				}
 			}
 		}
 		else if (strcmp(arg, "-y7") == 0) // ARM7 overlay table file
 		{
-			arm7ovltablefilename = argv[a++];
+			context.arm7ovltablefilename = argv[a++];
 		}
 		else if (strcmp(arg, "-y9") == 0) // ARM9 overlay table file
 		{
-			arm9ovltablefilename = argv[a++];
+			context.arm9ovltablefilename = argv[a++];
 		}
 		else if (strcmp(arg, "-y") == 0) // Overlay table directory
 		{
-			overlaydir = argv[a++];
+			context.overlaydir = argv[a++];
 		}
 		else if (strcmp(arg, "-nopass") == 0) // Disable LoadMe patch
 		{
-			loadmeEnabled = false; // This is the default setting
+			context.loadmeEnabled = false; // This is the default setting
 		}
 		else if (strcmp(arg, "-pass") == 0) // Enable LoadMe patch
 		{
-			loadmeEnabled = true;
+			context.loadmeEnabled = true;
 		}
 		else if (strcmp(arg, "-?") == 0) // Global help
 		{
@@ -494,115 +549,100 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	Title();
-
-	/*
-	 * sanity checks
-	 */
-
-	if (gamecode)
+	// Don't mix messages or lists of files with the data of files written to
+	// stdout, or with the results of -verify, -scan and -catalog
+	bool data_to_stdout = (context.tarfilename && (strcmp(context.tarfilename, "-") == 0));
+	for (int i=0; i<context.extractfile_num; i++)
 	{
-		if (strlen(gamecode) != 4)
-		{
-			LogFatal("Game code must be 4 characters!\n");
-		}
-		for (int i=0; i<4; i++) if ((gamecode[i] >= 'a') && (gamecode[i] <= 'z'))
-		{
-			LogWarning("Gamecode contains lowercase characters.\n");
-			break;
-		}
-		if (gamecode[0] == 'A')
-		{
-			LogWarning("Gamecode starts with 'A', which might be used for another commercial product.\n");
-		}
+		if (strcmp(context.extractfile_outputs[i], "-") == 0)
+			data_to_stdout = true;
 	}
-	if (makercode && (strlen(makercode) != 2))
+	for (int i=0; i<num_actions; i++)
 	{
-		LogFatal("Maker code must be 2 characters!\n");
+		if ((actions[i] == ACTION_VERIFY) || (actions[i] == ACTION_SCAN) || (actions[i] == ACTION_CATALOG))
+			data_to_stdout = true;
 	}
-	if (title && (strlen(title) > 12))
+
+	if (data_to_stdout)
 	{
-		LogFatal("Title can be no more than 12 characters!\n");
+		context.log_output = stderr;
+		context.verbose = 0;
 	}
-	if (romversion > 255)
+	else
 	{
-		LogFatal("romversion can only be 0 - 255!\n");
+		Title();
 	}
-	if (!bannertext[1])
-		bannertext[1] = "";
 
 	/*
 	 * perform actions
 	 */
 
-	if ((num_actions > 0) && (ndsfilename == NULL))
+	for (int i=0; i<num_actions; i++)
 	{
-		LogFatal("No NDS file provided\n");
+		if ((actions[i] != ACTION_SCAN) && (actions[i] != ACTION_CATALOG) && (context.ndsfilename == NULL))
+			LogFatal("No NDS file provided\n");
 	}
 
 	int status = 0;
 	for (int i=0; i<num_actions; i++)
 	{
+		bool ok = true;
+
 		switch (actions[i])
 		{
 			case ACTION_SHOWINFO:
-				ShowInfo(ndsfilename);
+				ok = NdsShowInfo(context);
 				break;
 
 			case ACTION_FIXHEADERCHECKSUMS:
-				FixHeaderChecksums(ndsfilename);
+				ok = NdsFixHeaderChecksums(context);
 				break;
 
 			case ACTION_FIXBANNERCRC:
-				fNDS = fopen(ndsfilename, "rb");
-				if (!fNDS)
-					LogFatal("Cannot open file '%s'.\n", ndsfilename);
-
-				FullyReadHeader(fNDS, header);
-				bannersize = GetBannerSizeFromHeader(header, ExtractBannerVersion(fNDS, header.banner_offset));
-				fclose(fNDS);
-				FixBannerCRC(ndsfilename, header.banner_offset, bannersize);
+				ok = NdsFixBannerCRC(context);
 				break;
 
-			case ACTION_EXTRACT: {
-				fNDS = fopen(ndsfilename, "rb");
-				if (!fNDS)
-					LogFatal("Cannot open file '%s'.\n", ndsfilename);
+			case ACTION_VERIFY:
+				ok = NdsVerify(context);
+				break;
 
-				unsigned int headersize = FullyReadHeader(fNDS, header);
-				bannersize = GetBannerSizeFromHeader(header, ExtractBannerVersion(fNDS, header.banner_offset));
-				fclose(fNDS);
+			case ACTION_SCAN:
+				ok = NdsScan(context);
+				break;
 
-				if (arm9filename) Extract(arm9filename, true, 0x20, true, 0x2C, true);
-				if (arm7filename) Extract(arm7filename, true, 0x30, true, 0x3C);
-				if (header.unitcode & 2) {
-					if (arm9ifilename) Extract(arm9ifilename, true, 0x1C0, true, 0x1CC, true);
-					if (arm7ifilename) Extract(arm7ifilename, true, 0x1D0, true, 0x1DC);
-				}
-				if (bannerfilename) {
-					if (bannertype == BANNER_BINARY)
-						Extract(bannerfilename, true, 0x68, false, bannersize);
-					else if (bannertype == BANNER_IMAGE)
-						IconToRasterImage();
-				}
-				if (headerfilename_or_size) Extract(headerfilename_or_size, false, 0x0, false, headersize);
-				if (logofilename) Extract(logofilename, false, 0xC0, false, 156);	// *** bin only
-				if (arm9ovltablefilename) Extract(arm9ovltablefilename, true, 0x50, true, 0x54);
-				if (arm7ovltablefilename) Extract(arm7ovltablefilename, true, 0x58, true, 0x5C);
-				if (overlaydir) ExtractOverlayFiles();
-				if (filerootdirs_num > 0) ExtractFiles(ndsfilename, filerootdirs[0]);
+			case ACTION_CATALOG:
+				ok = NdsCatalog(context);
+				break;
+
+			case ACTION_EXTRACT:
+				ok = NdsExtract(context);
+				break;
+
+			case ACTION_EXTRACTFILES:
+				ok = NdsExtractFiles(context);
 				break;
-			}
 
 			case ACTION_CREATE:
-				Create();
+				ok = NdsCreate(context);
 				break;
 
 			case ACTION_LISTFILES:
-				ExtractFiles(ndsfilename, NULL); // List mode
+				ok = NdsListFiles(context);
 				break;
 		}
+
+		// Errors stop the remaining actions. Checks that fail only change the
+		// exit code.
+		if (!ok && !context.error.empty())
+			return 1;
+		if (!ok)
+			status = -1;
 	}
 
 	return (status < 0) ? 1 : 0;
 }
+catch (const FatalError &)
+{
+	// Errors in the arguments
+	return 1;
+}
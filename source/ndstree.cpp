@@ -1,117 +1,338 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 
+#include <memory>
+
+#include "fileio.h"
 #include "log.h"
 #include "ndstool.h"
 #include "ndstree.h"
+#include "parallel.h"
+#include "scancache.h"
+
+uint32_t TreeArena::AddString(const char *str, size_t length)
+{
+	size_t offset = strings.size();
+	if (offset + length + 1 > UINT32_MAX)
+		LogFatal("%s: Too many file names\n", __func__);
+
+	strings.append(str, length);
+	strings.push_back('\0');
+	return offset;
+}
+
+// The strings of the tree are stored in the arena of the current context
+const char *TreeNode::Name() const
+{
+	return ctx->tree_arena.String(name_offset);
+}
+
+std::string TreeNode::Path() const
+{
+	std::string path = ctx->tree_arena.String(host_dir);
+	path += '/';
+	path.append(Name(), name_length);
+	return path;
+}
+
+TreeNode *TreeDirectory::New(uint32_t host_dir, const char *name)
+{
+	size_t length = strlen(name);
+
+	children.emplace_back();
+	TreeNode *node = &children.back();
+	node->name_offset = ctx->tree_arena.AddString(name, length);
+	node->name_length = length;
+	node->host_dir = host_dir;
+
+	if (indexed)
+		index.emplace(name, children.size() - 1);
+
+	return node;
+}
 
 /*
- * Variables
+ * HostEntry
+ * Entry of a directory of the host PC, as returned by ScanHostDirectory().
  */
-unsigned int _entry_start;			// current position in name entry table
-unsigned int file_top;				// current position to write new file to
-unsigned int free_dir_id = 0xF000;	// incremented in ReadDirectory
-unsigned int directory_count = 0;	// incremented in ReadDirectory
-unsigned int file_count = 0;		// incremented in ReadDirectory
-unsigned int total_name_size = 0;	// incremented in ReadDirectory
-unsigned int file_end = 0;			// end of all file data. updated in AddFile
-unsigned int free_file_id = 0;		// incremented in AddDirectory
+struct HostEntry
+{
+	uint32_t name;				// offset of the name in HostDirectory::names
+	bool is_dir;
+	unsigned int size;			// files only
+	uint64_t mtime;				// files only
+	size_t subdir;				// directories only, index in the list of scanned directories
+};
+
+struct HostDirectory
+{
+	std::string path;
+	std::vector<HostEntry> entries;	// in the order returned by readdir()
+	std::string names;				// NUL-terminated names of all entries
+	bool cacheable = false;			// ino and mtime are valid
+	bool from_cache = false;		// the entries come from the scan cache
+	uint64_t ino = 0;
+	uint64_t mtime = 0;
+
+	const char *Name(const HostEntry &entry) const
+	{
+		return names.data() + entry.name;
+	}
+};
 
 /*
- * ReadDirectory
- * Read directory tree into memory structure
- * returns first (dummy) node
+ * AddHostEntry
+ * Adds an entry to a scanned directory. Unless it's known to be a directory,
+ * it's stat'ed relative to the open directory, so the path doesn't need to be
+ * resolved every time.
+ */
+static void AddHostEntry(HostDirectory &hd, int dfd, const char *name, bool is_dir)
+{
+	HostEntry entry;
+	entry.name = hd.names.size();
+	entry.is_dir = is_dir;
+	entry.size = 0;
+	entry.mtime = 0;
+	entry.subdir = 0;
+
+	if (!entry.is_dir)
+	{
+		struct stat st;
+#ifdef _WIN32
+		(void)dfd;
+		int r = stat((hd.path + "/" + name).c_str(), &st);
+#else
+		int r = fstatat(dfd, name, &st, 0);
+#endif
+		if (r != 0)
+			LogFatal("Cannot get stat of '%s/%s'.\n", hd.path.c_str(), name);
+
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+			LogFatal("'%s/%s' is not a file or directory!\n", hd.path.c_str(), name);
+
+		entry.is_dir = S_ISDIR(st.st_mode);
+		entry.size = st.st_size;
+		entry.mtime = GetFileMtime(st);
+	}
+
+	hd.names.append(name);
+	hd.names.push_back('\0');
+	hd.entries.push_back(entry);
+}
+
+/*
+ * ScanHostDirectory
+ * Reads the entries of one directory of the host PC. Directories reported as
+ * such by readdir() don't need to be stat'ed. If the directory hasn't changed
+ * since it was saved in the scan cache, the names of the entries are taken from
+ * the cache instead.
  */
-TreeNode *ReadDirectory(TreeNode *node, char *path)
+static void ScanHostDirectory(HostDirectory &hd, const ScanCache *cache)
 {
-	TreeNode *first = node;
+	// AddHostEntry() can throw a FatalError, so the directory is always
+	// closed by its owner when this function returns.
+#ifdef _WIN32
+	ScopedFd dir_fd(-1);
+#else
+	ScopedFd dir_fd(open(hd.path.c_str(), O_RDONLY | O_DIRECTORY));
+	if (dir_fd.Get() < 0)
+		LogFatal("Cannot open directory '%s'.\n", hd.path.c_str());
+#endif
+	int dfd = dir_fd.Get();
 
-	// Start adding nodes from the end of the list
-	while (node->next)
-		node = node->next;
+	const ScanCacheDir *cached = NULL;
+	if (cache)
+	{
+		struct stat st;
+#ifdef _WIN32
+		int r = stat(hd.path.c_str(), &st);
+#else
+		int r = fstat(dfd, &st);
+#endif
+		if (r == 0)
+		{
+			hd.cacheable = true;
+			hd.ino = st.st_ino;
+			hd.mtime = GetFileMtime(st);
 
-	//printf("%s\n", path);
+			auto it = cache->old_dirs.find(hd.path);
+			if ((it != cache->old_dirs.end()) && (it->second.ino == hd.ino) &&
+				(it->second.mtime == hd.mtime))
+				cached = &it->second;
+		}
+	}
+
+	if (cached)
+	{
+		hd.from_cache = true;
+		for (const ScanCacheEntry &entry : cached->entries)
+			AddHostEntry(hd, dfd, entry.name.c_str(), entry.is_dir);
+		return;
+	}
 
-	DIR *dir = opendir(path);
-	if (!dir)
-		LogFatal("Cannot open directory '%s'.\n", path);
+#ifdef _WIN32
+	DIR *dir = opendir(hd.path.c_str());
+#else
+	// The descriptor belongs to the DIR stream if it can be created
+	DIR *dir = fdopendir(dfd);
+	if (dir)
+		dir_fd.Release();
+#endif
+	std::unique_ptr<DIR, int (*)(DIR *)> hostdir(dir, closedir);
+	if (!hostdir)
+		LogFatal("Cannot open directory '%s'.\n", hd.path.c_str());
 
 	struct dirent *de;
-	while ((de = readdir(dir)))
+	while ((de = readdir(hostdir.get())))
 	{
 		// Exclude all directories starting with .
 		if (!strncmp(de->d_name, ".", 1))
 			continue;
 
-		char strbuf[MAXPATHLEN];
-		strcpy(strbuf, path);
-		strcat(strbuf, "/");
-		strcat(strbuf, de->d_name);
-		//printf("%s\n", strbuf);
+		// DT_UNKNOWN and symbolic links need to be stat'ed
+		bool is_dir = false;
+#ifdef DT_DIR
+		is_dir = (de->d_type == DT_DIR);
+#endif
+		AddHostEntry(hd, dfd, de->d_name, is_dir);
+	}
+}
 
-		struct stat st;
-		if (stat(strbuf, &st))
-			LogFatal("Cannot get stat of '%s'.\n", strbuf);
+/*
+ * ScanHostTree
+ * Reads a directory of the host PC and all its subdirectories. The directories
+ * of each level of the tree are read in parallel. The first directory of the
+ * list is the root.
+ */
+static void ScanHostTree(const char *path, std::vector<HostDirectory> &dirs, ScanCache *cache)
+{
+	dirs.clear();
+	dirs.push_back(HostDirectory());
+	dirs[0].path = path;
 
-		//if (S_ISDIR(st.st_mode) && !subdirs) continue;		// skip subdirectories
+	size_t level_start = 0;
+	while (level_start < dirs.size())
+	{
+		size_t level_end = dirs.size();
 
-		total_name_size += strlen(de->d_name);
+		ParallelFor(level_end - level_start, [&](size_t i)
+		{
+			ScanHostDirectory(dirs[level_start + i], cache);
+		});
 
-		if (S_ISDIR(st.st_mode))
+		// Queue the subdirectories for the next level. Indices are used because
+		// the vector is reallocated while it grows.
+		for (size_t i = level_start; i < level_end; i++)
+		{
+			if (cache && dirs[i].cacheable)
+			{
+				ScanCacheDir &cd = cache->new_dirs[dirs[i].path];
+				cd.ino = dirs[i].ino;
+				cd.mtime = dirs[i].mtime;
+				cd.entries.clear();
+				for (const HostEntry &entry : dirs[i].entries)
+					cd.entries.push_back({ dirs[i].Name(entry), entry.is_dir });
+
+				if (dirs[i].from_cache)
+					cache->reused++;
+			}
+
+			for (size_t j = 0; j < dirs[i].entries.size(); j++)
+			{
+				if (!dirs[i].entries[j].is_dir)
+					continue;
+
+				HostDirectory sub;
+				sub.path = dirs[i].path + "/" + dirs[i].Name(dirs[i].entries[j]);
+				dirs[i].entries[j].subdir = dirs.size();
+				dirs.push_back(std::move(sub));
+			}
+		}
+
+		level_start = level_end;
+	}
+}
+
+/*
+ * MergeHostDirectory
+ * Adds the entries of a scanned directory to a directory of the tree. This is
+ * done in readdir() order, depth first, so that directory IDs are the same as
+ * if the directories had been read one by one.
+ */
+static void MergeHostDirectory(TreeDirectory *dir, std::vector<HostDirectory> &dirs, size_t index)
+{
+	// Names are unique inside one host directory. They only need to be checked
+	// if entries from other root directories have been added already.
+	bool merging = !dir->children.empty();
+
+	HostDirectory &hd = dirs[index];
+	uint32_t host_dir = ctx->tree_arena.AddString(hd.path.c_str(), hd.path.size());
+
+	for (HostEntry &entry : hd.entries)
+	{
+		const char *name = hd.Name(entry);
+		ctx->total_name_size += strlen(name);
+
+		TreeNode *found = merging ? dir->Find(name) : NULL;
+
+		if (entry.is_dir)
 		{
 			// Check if this directory is already in one of the nodes. If it's
 			// there, open the directory node and add new files. If not, create
 			// a new directory node.
-			TreeNode *found = first->Find(de->d_name);
-			bool dir_found = false;
 			if (found)
 			{
 				if (found->directory)
 				{
 					// There is a directory with the same name, we can combine
 					// the files in both.
-					dir_found = true;
+					MergeHostDirectory(found->directory, dirs, entry.subdir);
 				}
 				else
 				{
 					// There is a file with the same name, so we can't create
 					// this directory.
-					LogFatal("Trying to create directory but a file with the same name already exists: %s\n", strbuf);
+					LogFatal("Trying to create directory but a file with the same name already exists: %s/%s\n",
+							 hd.path.c_str(), name);
 				}
 			}
-
-			if (dir_found)
-			{
-				// Add more files to the old list
-				ReadDirectory(found->directory, strbuf);
-			}
 			else
 			{
-				node = node->New(strbuf, de->d_name, true);
-				node->dir_id = free_dir_id++;
-				directory_count++;
-				node->directory = ReadDirectory(new TreeNode(), strbuf);
+				TreeDirectory *subdir = ctx->tree_arena.NewDirectory();
+				TreeNode *node = dir->New(host_dir, name);
+				node->dir_id = ctx->free_dir_id++;
+				node->directory = subdir;
+				ctx->directory_count++;
+				MergeHostDirectory(subdir, dirs, entry.subdir);
 			}
 		}
-		else if (S_ISREG(st.st_mode))
+		else
 		{
 			// Check if there's already a file or directory with the same name
-			TreeNode *found = first->Find(de->d_name);
 			if (found)
 			{
-				LogFatal("Trying to create file but an entry with the same name already exists: %s\n", strbuf);
+				LogFatal("Trying to create file but an entry with the same name already exists: %s/%s\n",
+						 hd.path.c_str(), name);
 			}
 
-			node = node->New(strbuf, de->d_name, false);
-			file_count++;
-		}
-		else
-		{
-			LogFatal("'%s' is not a file or directory!\n", strbuf);
+			TreeNode *node = dir->New(host_dir, name);
+			node->size = entry.size;
+			node->mtime = entry.mtime;
+			ctx->file_count++;
 		}
 	}
-	closedir(dir);
 
-	while (node->prev)
-		node = node->prev;	// return first
-	return node;
+	// The entries aren't needed anymore
+	std::vector<HostEntry>().swap(hd.entries);
+	std::string().swap(hd.names);
+}
+
+/*
+ * ReadDirectory
+ * Read directory tree into memory structure
+ */
+void ReadDirectory(TreeDirectory *dir, char *path, ScanCache *cache)
+{
+	std::vector<HostDirectory> dirs;
+	ScanHostTree(path, dirs, cache);
+	MergeHostDirectory(dir, dirs, 0);
 }
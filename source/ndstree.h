@@ -2,7 +2,16 @@
 
 #pragma once
 
-inline int cmp(char *a, bool a_isdir, char *b, bool b_isdir)
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+inline int cmp(const char *a, bool a_isdir, const char *b, bool b_isdir)
 {
 	(void)a_isdir;
 	(void)b_isdir;
@@ -13,79 +22,118 @@ inline int cmp(char *a, bool a_isdir, char *b, bool b_isdir)
 	return strcmp(a, b);
 }
 
+struct TreeDirectory;
+
 struct TreeNode
 {
 	unsigned int dir_id;		// directory ID in case of directory entry
-	char *fs_path;				// full path to the file or directory in the host PC
-	char *name;					// file or directory name
-	TreeNode *directory;		// nonzero indicates directory. first directory node is a dummy
-	TreeNode *prev, *next;		// linked list
+	uint32_t name_offset;		// file or directory name, in the string pool
+	uint32_t name_length;
+	uint32_t host_dir;			// path to the directory in the host PC that contains
+								// this entry, in the string pool
+	unsigned int size;			// size of the file in bytes
+	uint64_t mtime;				// modification time of the file
+	TreeDirectory *directory;	// nonzero indicates directory
 
 	TreeNode()
 	{
 		dir_id = 0;
-		fs_path = (char *)"";
-		name = (char *)"";
+		name_offset = name_length = host_dir = 0;
+		size = 0;
+		mtime = 0;
 		directory = 0;
-		prev = next = 0;
 	}
 
-	// new entry in same directory
-	TreeNode *New(char *fs_path, char *name, bool isdir)
-	{
-		TreeNode *newNode = new TreeNode();
-		newNode->fs_path = strdup(fs_path);
-		newNode->name = strdup(name);
+	const char *Name() const;
+	std::string Path() const;	// full path to the file or directory in the host PC
+};
 
-		TreeNode *node = this;
+struct TreeDirectory
+{
+	// Entries of the directory. They are added in the order they are found, and
+	// sorted by Sort() when the whole tree has been read.
+	std::vector<TreeNode> children;
 
-		if (cmp(name, isdir, node->name, node->dir_id) < 0)	// prev
-		{
-			while (cmp(name, isdir, node->name, node->dir_id) < 0)
-			{
-				if (node->prev)
-					node = node->prev;
-				else
-					break;		// insert after dummy node
-			}
-		}
-		else
+	// Index of the children by name. It's only built if an entry needs to be
+	// looked up by name, which only happens when several root directories are
+	// combined.
+	std::unordered_map<std::string, size_t> index;
+	bool indexed = false;
+
+	// new entry in this directory
+	TreeNode *New(uint32_t host_dir, const char *name);
+
+	// This looks for any entry called like the provided name inside this
+	// directory.
+	TreeNode *Find(const char *name)
+	{
+		if (!indexed)
 		{
-			while (node->next && (cmp(name, isdir, node->next->name, node->next->dir_id) >= 0))
-			{
-				node = node->next;
-			}
+			for (size_t i = 0; i < children.size(); i++)
+				index.emplace(children[i].Name(), i);
+			indexed = true;
 		}
 
-		// insert after current node
-		newNode->prev = node;
-		newNode->next = node->next;
-		if (node->next) node->next->prev = newNode;
-		node->next = newNode;
+		auto it = index.find(name);
+		if (it == index.end())
+			return NULL;
 
-		return newNode;
+		return &children[it->second];
 	}
 
-	// This looks for any entry called like the provided name inside the
-	// directory this node belongs to.
-	TreeNode *Find(const char *name)
+	// Sorts the entries of this directory and all subdirectories in the order
+	// they are stored in the FNT.
+	void Sort()
 	{
-		TreeNode *node = this;
+		std::sort(children.begin(), children.end(),
+			[](const TreeNode &a, const TreeNode &b)
+			{
+				return cmp(a.Name(), a.directory != 0, b.Name(), b.directory != 0) < 0;
+			});
 
-		// Start from the start of the linked list
-		while (node->prev)
-			node = node->prev;
+		index.clear();
+		indexed = false;
 
-		while (1)
+		for (TreeNode &t : children)
 		{
-			if (strcmp(name, node->name) == 0)
-				return node;
-
-			node = node->next;
-			if (node == NULL)
-				return NULL;
+			if (t.directory)
+				t.directory->Sort();
 		}
 	}
 };
 
-TreeNode *ReadDirectory(TreeNode *node, char *path);
+// Owner of all the directories and strings of the tree. Strings are stored
+// NUL-terminated in a single pool and referenced by offset, so they stay valid
+// when the pool grows. Clear() frees the whole tree.
+struct TreeArena
+{
+	std::string strings;
+	std::deque<TreeDirectory> directories;
+
+	uint32_t AddString(const char *str, size_t length);
+
+	const char *String(uint32_t offset) const
+	{
+		return strings.data() + offset;
+	}
+
+	TreeDirectory *NewDirectory()
+	{
+		directories.emplace_back();
+		return &directories.back();
+	}
+
+	void Clear()
+	{
+		std::string().swap(strings);
+		std::deque<TreeDirectory>().swap(directories);
+	}
+};
+
+struct ScanCache;
+
+// Reads a directory of the host PC into a directory of the tree. If the tree
+// directory isn't empty, the entries are combined. Directories are assigned
+// their IDs in the order they are found. If a scan cache is provided, it's used
+// to skip reading directories that haven't changed, and it's updated.
+void ReadDirectory(TreeDirectory *dir, char *path, ScanCache *cache = NULL);
@@ -0,0 +1,285 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "fileio.h"
+#include "log.h"
+#include "ndstool.h"
+#include "nitrofs.h"
+
+/*
+ * ReadLittle
+ * Reads a little endian value from the FNT or the FAT.
+ */
+template <typename T>
+static unsigned int ReadLittle(const std::vector<unsigned char> &data, size_t offset)
+{
+	T value;
+	memcpy(&value, &data[offset], sizeof(value));
+	return value;
+}
+
+/*
+ * NitroFsIndex::LoadFat
+ */
+void NitroFsIndex::LoadFat(int fd, Header &header)
+{
+	entries.clear();
+	paths.clear();
+
+	fat.resize(header.fat_size & ~7U);
+	if (!ReadAt(fd, fat.data(), fat.size(), header.fat_offset))
+		LogFatal("%s: Failed to read FAT\n", __func__);
+}
+
+/*
+ * NitroFsIndex::Load
+ */
+void NitroFsIndex::Load(int fd, Header &header)
+{
+	LoadFat(fd, header);
+
+	fnt.resize(header.fnt_size);
+	if (!ReadAt(fd, fnt.data(), fnt.size(), header.fnt_offset))
+		LogFatal("%s: Failed to read FNT\n", __func__);
+
+	// The parent ID of the root directory is the number of directories
+	if (fnt.size() < 8)
+		LogFatal("%s: FNT is too small\n", __func__);
+	ctx->directory_count = ReadLittle<unsigned_short>(fnt, 6);
+	if ((ctx->directory_count == 0) || (ctx->directory_count > 0x1000) || (ctx->directory_count * 8 > fnt.size()))
+		LogFatal("%s: Invalid directory count: %u\n", __func__, ctx->directory_count);
+
+	visited.assign(ctx->directory_count, false);
+	AddDirectory("/", 1, 0xF000, NITROFS_NO_PARENT);
+	visited.clear();
+}
+
+/*
+ * NitroFsIndex::AddDirectory
+ * Adds the entry of a directory followed by all its contents.
+ */
+void NitroFsIndex::AddDirectory(const std::string &path, uint32_t name_offset,
+								unsigned int dir_id, uint32_t parent)
+{
+	unsigned int dir_index = dir_id & 0xFFF;
+	if (dir_index >= ctx->directory_count)
+		LogFatal("%s: Invalid directory ID: 0x%X\n", __func__, dir_id);
+	if (visited[dir_index])
+		LogFatal("%s: Directory 0x%X is referenced more than once\n", __func__, dir_id);
+	visited[dir_index] = true;
+
+	uint32_t self = entries.size();
+	NitroFsEntry dir;
+	dir.path = path;
+	dir.name_offset = name_offset;
+	dir.parent = parent;
+	dir.id = dir_id;
+	dir.top = dir.bottom = 0;
+	dir.is_dir = true;
+	entries.push_back(dir);
+
+	// Paths of directories are looked up without the trailing '/'
+	paths[(path.size() > 1) ? path.substr(0, path.size() - 1) : path] = self;
+
+	size_t pos = ReadLittle<unsigned_int>(fnt, dir_index * 8);	// reference location of entry name
+	unsigned int file_id = ReadLittle<unsigned_short>(fnt, dir_index * 8 + 4);
+
+	while (1)
+	{
+		if (pos >= fnt.size())
+			LogFatal("%s: Directory 0x%X goes past the end of the FNT\n", __func__, dir_id);
+
+		unsigned char entry_type_name_length = fnt[pos++];
+		unsigned int name_length = entry_type_name_length & 127;
+		bool entry_type_directory = (entry_type_name_length & 128) ? true : false;
+		if (name_length == 0) break;
+
+		size_t entry_size = name_length + (entry_type_directory ? 2 : 0);
+		if (pos + entry_size > fnt.size())
+			LogFatal("%s: Directory 0x%X goes past the end of the FNT\n", __func__, dir_id);
+
+		std::string entry_path = path;
+		entry_path.append((const char *)&fnt[pos], name_length);
+		pos += name_length;
+
+		if (entry_type_directory)
+		{
+			unsigned int subdir_id = ReadLittle<unsigned_short>(fnt, pos);
+			pos += 2;
+
+			entry_path += '/';
+			AddDirectory(entry_path, path.size(), subdir_id, self);
+		}
+		else
+		{
+			NitroFsEntry file;
+			if (!GetFileRange(file_id, file.top, file.bottom))
+				LogFatal("%s: Invalid file ID: %u\n", __func__, file_id);
+
+			file.path = entry_path;
+			file.name_offset = path.size();
+			file.parent = self;
+			file.id = file_id;
+			file.is_dir = false;
+
+			paths[entry_path] = entries.size();
+			entries.push_back(file);
+			file_id++;
+		}
+	}
+}
+
+/*
+ * NitroFsIndex::Find
+ */
+const NitroFsEntry *NitroFsIndex::Find(const std::string &path) const
+{
+	auto it = ((path.size() > 1) && (path.back() == '/'))
+			? paths.find(path.substr(0, path.size() - 1))
+			: paths.find(path);
+
+	if (it == paths.end())
+		return NULL;
+
+	return &entries[it->second];
+}
+
+/*
+ * NitroFsIndex::GetFileRange
+ */
+bool NitroFsIndex::GetFileRange(unsigned int file_id, unsigned int &top, unsigned int &bottom) const
+{
+	if (file_id >= FileCount())
+		return false;
+
+	top = ReadLittle<unsigned_int>(fat, file_id * 8);
+	bottom = ReadLittle<unsigned_int>(fat, file_id * 8 + 4);
+	return true;
+}
+
+/*
+ * FntReader
+ * Reads the FNT sequentially in small blocks.
+ */
+struct FntReader
+{
+	int fd;
+	unsigned int fnt_offset;
+	unsigned int fnt_size;
+	unsigned int pos;			// offset in the FNT of the next byte
+	unsigned int buf_start;		// offset in the FNT of the buffer
+	unsigned int buf_size;
+	unsigned char buf[1024];
+
+	FntReader(int fd, Header &header)
+	{
+		this->fd = fd;
+		fnt_offset = header.fnt_offset;
+		fnt_size = header.fnt_size;
+		pos = buf_start = buf_size = 0;
+	}
+
+	bool Read(void *out, unsigned int size)
+	{
+		if ((pos > fnt_size) || (size > fnt_size - pos))
+			return false;
+
+		if ((pos < buf_start) || (pos + size > buf_start + buf_size))
+		{
+			buf_start = pos;
+			buf_size = std::min<unsigned int>(sizeof(buf), fnt_size - pos);
+			if (!ReadAt(fd, buf, buf_size, fnt_offset + buf_start))
+				return false;
+		}
+
+		memcpy(out, buf + (pos - buf_start), size);
+		pos += size;
+		return true;
+	}
+};
+
+bool NitroFsFindFile(int fd, Header &header, const char *path, unsigned int &file_id)
+{
+	FntReader fnt(fd, header);
+	unsigned int dir_id = 0xF000;
+
+	while (1)
+	{
+		// Get the next component of the path
+		while (*path == '/')
+			path++;
+
+		size_t length = strcspn(path, "/");
+		if ((length == 0) || (length > 127))
+			return false;
+
+		bool last = (path[length] == '\0');
+
+		unsigned_int entry_start;
+		unsigned_short top_file_id;
+		fnt.pos = (dir_id & 0xFFF) * 8;
+		if (!fnt.Read(&entry_start, sizeof(entry_start)) || !fnt.Read(&top_file_id, sizeof(top_file_id)))
+			return false;
+
+		fnt.pos = entry_start;
+		unsigned int id = top_file_id;
+		bool found = false;
+
+		while (!found)
+		{
+			unsigned char entry_type_name_length;
+			if (!fnt.Read(&entry_type_name_length, 1))
+				return false;
+
+			unsigned int name_length = entry_type_name_length & 127;
+			bool entry_type_directory = (entry_type_name_length & 128) ? true : false;
+			if (name_length == 0)
+				return false;
+
+			char entry_name[128];
+			if (!fnt.Read(entry_name, name_length))
+				return false;
+
+			bool match = (name_length == length) && (memcmp(entry_name, path, length) == 0);
+
+			if (entry_type_directory)
+			{
+				unsigned_short subdir_id;
+				if (!fnt.Read(&subdir_id, sizeof(subdir_id)))
+					return false;
+
+				if (match && !last)
+				{
+					dir_id = subdir_id;
+					found = true;
+				}
+			}
+			else
+			{
+				if (match && last)
+				{
+					file_id = id;
+					return true;
+				}
+				id++;
+			}
+		}
+
+		path += length;
+	}
+}
+
+bool NitroFsReadFat(int fd, Header &header, unsigned int file_id, unsigned int &top, unsigned int &bottom)
+{
+	if (file_id >= header.fat_size / 8)
+		return false;
+
+	unsigned_int entry[2];
+	if (!ReadAt(fd, entry, sizeof(entry), header.fat_offset + 8 * file_id))
+		return false;
+
+	top = entry[0];
+	bottom = entry[1];
+	return true;
+}
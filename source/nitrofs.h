@@ -0,0 +1,72 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Header;
+
+// Index of the NitroFS filesystem of a ROM. The FNT and the FAT are read with
+// one read each, and the whole tree is parsed into a flat array of entries, in
+// the same order as the FNT is traversed. All offsets and IDs of the FNT are
+// checked while it is parsed. The FAT entries are stored as they are found in
+// the ROM, so their sizes have to be checked before using them.
+
+#define NITROFS_NO_PARENT	0xFFFFFFFF
+
+struct NitroFsEntry
+{
+	std::string path;		// full path, directories end with '/'
+	uint32_t name_offset;	// offset of the name of the entry in the path
+	uint32_t parent;		// index of the parent directory entry
+	unsigned int id;		// file ID, or directory ID (0xF000 and up)
+	unsigned int top;		// start of the file in the ROM
+	unsigned int bottom;	// end of the file in the ROM
+	bool is_dir;
+
+	const char *Name() const { return path.c_str() + name_offset; }
+	unsigned int Size() const { return bottom - top; }
+};
+
+class NitroFsIndex
+{
+public:
+	std::vector<NitroFsEntry> entries;
+
+	// Reads the FNT and FAT of the ROM from a file descriptor.
+	void Load(int fd, Header &header);
+
+	// Only reads the FAT, for ROMs that may not have a FNT. Only
+	// GetFileRange() can be used after this.
+	void LoadFat(int fd, Header &header);
+
+	// Returns NULL if there isn't any file or directory with this path. The
+	// trailing '/' of directories is optional.
+	const NitroFsEntry *Find(const std::string &path) const;
+
+	// Gets the FAT entry of a file. Files that aren't in the FNT, like
+	// overlays, can be found here too. Returns false if the ID isn't valid.
+	bool GetFileRange(unsigned int file_id, unsigned int &top, unsigned int &bottom) const;
+
+	unsigned int FileCount() const { return fat.size() / 8; }
+
+private:
+	std::vector<unsigned char> fnt;
+	std::vector<unsigned char> fat;
+	std::vector<bool> visited;			// directories already added
+	unsigned int directory_count;
+	std::unordered_map<std::string, size_t> paths;
+
+	void AddDirectory(const std::string &path, uint32_t name_offset,
+					  unsigned int dir_id, uint32_t parent);
+};
+
+// Functions that only read the parts of the FNT and the FAT that they need, for
+// when only a few files of a ROM are required. NitroFsFindFile() only reads the
+// directories that are in the path. They return false if the file isn't found
+// or the tables aren't valid.
+bool NitroFsFindFile(int fd, Header &header, const char *path, unsigned int &file_id);
+bool NitroFsReadFat(int fd, Header &header, unsigned int file_id, unsigned int &top, unsigned int &bottom);
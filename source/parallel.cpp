@@ -0,0 +1,72 @@
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ndscontext.h"
+#include "parallel.h"
+
+unsigned int GetThreadCount(void)
+{
+	if (ctx->num_threads > 0)
+		return ctx->num_threads;
+
+	unsigned int cpus = std::thread::hardware_concurrency();
+	return (cpus > 0) ? cpus : 1;
+}
+
+void ParallelFor(size_t count, const std::function<void(size_t)> &func)
+{
+	size_t threads = GetThreadCount();
+	if (threads > count)
+		threads = count;
+
+	if (threads <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	std::atomic<size_t> next_job(0);
+
+	// The first error stops all workers, and it's thrown again when they have
+	// finished
+	std::mutex error_mutex;
+	std::exception_ptr error;
+
+	NdsContext *context = ctx;
+
+	auto worker = [&]()
+	{
+		NdsContextScope scope(*context);
+
+		try
+		{
+			size_t i;
+			while ((i = next_job++) < count)
+				func(i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if (!error)
+				error = std::current_exception();
+			next_job = count;
+		}
+	};
+
+	// The calling thread works as one of the workers
+	std::vector<std::thread> pool;
+	for (size_t i = 1; i < threads; i++)
+		pool.emplace_back(worker);
+
+	worker();
+
+	for (auto &t : pool)
+		t.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
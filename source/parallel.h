@@ -0,0 +1,15 @@
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+
+// Number of threads to use for parallel jobs, from the current context
+unsigned int GetThreadCount(void);
+
+// Calls func(0) to func(count - 1) from a pool of worker threads. The order in
+// which the jobs are run isn't defined. It returns when all jobs are done. The
+// workers use the context of the calling thread. If a job throws an exception,
+// no more jobs are started, and it's thrown again once the workers finish.
+void ParallelFor(size_t count, const std::function<void(size_t)> &func);
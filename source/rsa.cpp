@@ -0,0 +1,141 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "bigint.h"
+#include "log.h"
+#include "rsa.h"
+
+/*
+ * StripLeadingZeroes
+ */
+static void StripLeadingZeroes(std::vector<unsigned char> &number)
+{
+	size_t zeroes = 0;
+	while ((zeroes < number.size()) && (number[zeroes] == 0))
+		zeroes++;
+	number.erase(number.begin(), number.begin() + zeroes);
+}
+
+/*
+ * ParseInlineNumber
+ * Parses numbers like "65537 (0x10001)", which OpenSSL prints in the same line
+ * as their name when they are small.
+ */
+static std::vector<unsigned char> ParseInlineNumber(const char *str)
+{
+	unsigned long long value = strtoull(str, 0, 10);
+
+	std::vector<unsigned char> number;
+	for (int i = 7; i >= 0; i--)
+		number.push_back(value >> (8 * i));
+	return number;
+}
+
+bool LoadRsaKey(const char *filename, RsaKey &key)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return false;
+
+	key = RsaKey();
+
+	std::vector<unsigned char> *section = NULL;
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		if (isspace((unsigned char)line[0]))
+		{
+			// Continuation of a number: "    00:c3:5f:..."
+			if (!section)
+				continue;
+
+			for (char *p = line; *p; )
+			{
+				if (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]))
+				{
+					char byte[3] = { p[0], p[1], 0 };
+					section->push_back(strtoul(byte, 0, 16));
+					p += 2;
+				}
+				else
+				{
+					p++;
+				}
+			}
+			continue;
+		}
+
+		section = NULL;
+
+		char *colon = strchr(line, ':');
+		if (!colon)
+			continue;
+
+		std::string name(line, colon - line);
+		for (char &c : name)
+			c = tolower((unsigned char)c);
+
+		std::vector<unsigned char> *number = NULL;
+		if (name == "modulus")
+			number = &key.modulus;
+		else if ((name == "publicexponent") || (name == "exponent"))
+			number = &key.public_exponent;
+		else if (name == "privateexponent")
+			number = &key.private_exponent;
+
+		if (!number)
+			continue;
+
+		const char *rest = colon + 1;
+		while (isspace((unsigned char)*rest))
+			rest++;
+
+		if (*rest)
+			*number = ParseInlineNumber(rest);
+		else
+			section = number;
+	}
+
+	fclose(f);
+
+	StripLeadingZeroes(key.modulus);
+	StripLeadingZeroes(key.public_exponent);
+	StripLeadingZeroes(key.private_exponent);
+
+	return !key.modulus.empty() && !key.public_exponent.empty();
+}
+
+/*
+ * RsaOperation
+ */
+static void RsaOperation(unsigned char *out, const unsigned char *in,
+						 const std::vector<unsigned char> &exponent,
+						 const std::vector<unsigned char> &modulus)
+{
+	if (modulus.size() * 8 > BIGINT_MAX_BITS)
+		LogFatal("%s: RSA keys bigger than %d bits aren't supported\n", __func__, BIGINT_MAX_BITS);
+
+	BigInt n, e, m, result;
+	n.Set(in, modulus.size());
+	e.Set(exponent.data(), exponent.size());
+	m.Set(modulus.data(), modulus.size());
+	result.PowMod(n, e, m);
+	result.Get(out, modulus.size());
+}
+
+void RsaPublic(unsigned char *out, const unsigned char *in, const RsaKey &key)
+{
+	RsaOperation(out, in, key.public_exponent, key.modulus);
+}
+
+void RsaPrivate(unsigned char *out, const unsigned char *in, const RsaKey &key)
+{
+	if (key.private_exponent.empty())
+		LogFatal("%s: A private key is required\n", __func__);
+
+	RsaOperation(out, in, key.private_exponent, key.modulus);
+}
@@ -0,0 +1,23 @@
+
+#pragma once
+
+#include <vector>
+
+// RSA keys. All numbers are big endian, like the keys and signatures stored in
+// ROM headers.
+
+struct RsaKey
+{
+	std::vector<unsigned char> modulus;
+	std::vector<unsigned char> public_exponent;
+	std::vector<unsigned char> private_exponent;	// empty for public keys
+};
+
+// Loads a key from the text output of "openssl rsa -text -noout" (private
+// keys) or "openssl rsa -pubin -text -noout" (public keys).
+bool LoadRsaKey(const char *filename, RsaKey &key);
+
+// Raw RSA operations, without padding. The input and output are as big as the
+// modulus. RsaPrivate() needs a private key.
+void RsaPublic(unsigned char *out, const unsigned char *in, const RsaKey &key);
+void RsaPrivate(unsigned char *out, const unsigned char *in, const RsaKey &key);
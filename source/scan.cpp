@@ -0,0 +1,551 @@
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ndstool.h"
+#include "banner.h"
+#include "crc.h"
+#include "fileio.h"
+#include "log.h"
+#include "parallel.h"
+#include "scan.h"
+#include "sha1.h"
+#include "utf16.h"
+
+// Number of ROMs processed before printing their records
+#define SCAN_BATCH_SIZE		256
+
+enum { FIELD_STRING, FIELD_NUMBER, FIELD_BOOL };
+
+struct ScanField
+{
+	const char *name;
+	std::string value;
+	int type;
+};
+
+/*
+ * ScanRecord
+ * Fields of a ROM, in the order they are printed.
+ */
+struct ScanRecord
+{
+	std::vector<ScanField> fields;
+
+	void Add(const char *name, const std::string &value)
+	{
+		fields.push_back({ name, value, FIELD_STRING });
+	}
+	void AddNumber(const char *name, uint64_t value)
+	{
+		fields.push_back({ name, std::to_string(value), FIELD_NUMBER });
+	}
+	void AddBool(const char *name, bool value)
+	{
+		fields.push_back({ name, value ? "true" : "false", FIELD_BOOL });
+	}
+};
+
+static const char *bannerFieldNames[] = {
+	"title_japanese", "title_english", "title_french", "title_german",
+	"title_italian", "title_spanish", "title_chinese", "title_korean"
+};
+
+std::string HeaderString(const char *text, size_t size)
+{
+	std::string str;
+	for (size_t i = 0; (i < size) && text[i]; i++)
+		str += ((text[i] >= 0x20) && (text[i] < 0x7F)) ? text[i] : '?';
+	return str;
+}
+
+/*
+ * RomTypeName
+ */
+static const char *RomTypeName(int romType)
+{
+	switch (romType)
+	{
+		case ROMTYPE_HOMEBREW: return "homebrew";
+		case ROMTYPE_MULTIBOOT: return "multiboot";
+		case ROMTYPE_NDSDUMPED: return "decrypted";
+		case ROMTYPE_ENCRSECURE: return "encrypted";
+		case ROMTYPE_MASKROM: return "mask ROM";
+		default: return "";
+	}
+}
+
+/*
+ * AddFields
+ * Adds all the fields of a ROM except for the path and the error. The same
+ * fields are always added, so that CSV records have the same columns.
+ */
+static void AddFields(ScanRecord &r, ScanInfo &info)
+{
+	Header &h = info.header;
+
+	r.AddNumber("file_size", info.file_size);
+	r.Add("title", HeaderString(h.title, sizeof(h.title)));
+	r.Add("gamecode", HeaderString(h.gamecode, sizeof(h.gamecode)));
+
+	const char *country = "";
+	for (int i = 0; i < NumCountries; i++)
+	{
+		if (countries[i].countrycode == h.gamecode[3])
+		{
+			country = countries[i].name;
+			break;
+		}
+	}
+	r.Add("country", country);
+
+	r.Add("makercode", HeaderString(h.makercode, sizeof(h.makercode)));
+	const char *maker = "";
+	for (int i = 0; i < NumMakers; i++)
+	{
+		if ((makers[i].makercode[0] == h.makercode[0]) && (makers[i].makercode[1] == h.makercode[1]))
+		{
+			maker = makers[i].name;
+			break;
+		}
+	}
+	r.Add("maker", maker);
+
+	r.Add("rom_type", RomTypeName(info.romType));
+
+	r.AddNumber("unitcode", h.unitcode);
+	r.AddNumber("devicetype", h.devicetype);
+	r.AddNumber("devicecap", h.devicecap);
+	r.AddNumber("dsi_flags", h.dsi_flags);
+	r.AddNumber("nds_region", h.nds_region);
+	r.AddNumber("romversion", h.romversion);
+	r.AddNumber("arm9_rom_offset", h.arm9_rom_offset);
+	r.AddNumber("arm9_entry_address", h.arm9_entry_address);
+	r.AddNumber("arm9_ram_address", h.arm9_ram_address);
+	r.AddNumber("arm9_size", h.arm9_size);
+	r.AddNumber("arm7_rom_offset", h.arm7_rom_offset);
+	r.AddNumber("arm7_entry_address", h.arm7_entry_address);
+	r.AddNumber("arm7_ram_address", h.arm7_ram_address);
+	r.AddNumber("arm7_size", h.arm7_size);
+	r.AddNumber("fnt_offset", h.fnt_offset);
+	r.AddNumber("fnt_size", h.fnt_size);
+	r.AddNumber("fat_offset", h.fat_offset);
+	r.AddNumber("fat_size", h.fat_size);
+	r.AddNumber("arm9_overlay_offset", h.arm9_overlay_offset);
+	r.AddNumber("arm9_overlay_size", h.arm9_overlay_size);
+	r.AddNumber("arm7_overlay_offset", h.arm7_overlay_offset);
+	r.AddNumber("arm7_overlay_size", h.arm7_overlay_size);
+	r.AddNumber("rom_control_info1", h.rom_control_info1);
+	r.AddNumber("rom_control_info2", h.rom_control_info2);
+	r.AddNumber("rom_control_info3", h.rom_control_info3);
+	r.AddNumber("banner_offset", h.banner_offset);
+	r.AddNumber("secure_area_crc", h.secure_area_crc);
+	r.AddNumber("application_end_offset", h.application_end_offset);
+	r.AddNumber("rom_header_size", h.rom_header_size);
+	r.AddNumber("logo_crc", h.logo_crc);
+	r.AddBool("logo_crc_ok", CalcLogoCRC(h) == h.logo_crc);
+	r.AddNumber("header_crc", h.header_crc);
+	r.AddBool("header_crc_ok", CalcHeaderCRC(h) == h.header_crc);
+	r.AddNumber("debug_rom_offset", h.debug_rom_offset);
+	r.AddNumber("debug_size", h.debug_size);
+	r.AddNumber("debug_ram_address", h.debug_ram_address);
+
+	// DSi fields. They are 0 for DS ROMs.
+	r.AddNumber("region_flags", h.region_flags);
+	r.AddNumber("access_control", h.access_control);
+	r.AddNumber("scfg_ext_mask", h.scfg_ext_mask);
+	r.AddNumber("appflags", h.appflags);
+	r.AddNumber("dsi9_rom_offset", h.dsi9_rom_offset);
+	r.AddNumber("dsi9_ram_address", h.dsi9_ram_address);
+	r.AddNumber("dsi9_size", h.dsi9_size);
+	r.AddNumber("dsi7_rom_offset", h.dsi7_rom_offset);
+	r.AddNumber("dsi7_ram_address", h.dsi7_ram_address);
+	r.AddNumber("dsi7_size", h.dsi7_size);
+	r.AddNumber("banner_size", h.banner_size);
+	r.AddNumber("total_rom_size", h.total_rom_size);
+	r.AddNumber("tid_low", h.tid_low);
+	r.AddNumber("tid_high", h.tid_high);
+	r.AddNumber("public_sav_size", h.public_sav_size);
+	r.AddNumber("private_sav_size", h.private_sav_size);
+
+	// Banner
+	int languages = info.bannersize ? GetBannerLanguageCount(info.banner.version) : 0;
+	r.AddNumber("banner_version", info.bannersize ? (unsigned short)info.banner.version : 0);
+	for (int i = 0; i < 8; i++)
+	{
+		std::string text;
+		if (i < languages)
+			text = utf16_convert_to_utf8(info.banner.title[i], BANNER_TITLE_LENGTH);
+		r.Add(bannerFieldNames[i], text);
+	}
+
+	if (ctx->scan_hashes)
+	{
+		char buf[16];
+		sprintf(buf, "%08X", info.crc32);
+		r.Add("crc32", buf);
+
+		std::string sha1;
+		for (int i = 0; i < SHA1_DIGEST_SIZE; i++)
+		{
+			sprintf(buf, "%02X", info.sha1[i]);
+			sha1 += buf;
+		}
+		r.Add("sha1", sha1);
+	}
+}
+
+const char *ReadRomInfo(int fd, ScanInfo &info, bool hashes)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return "failed to get file size";
+	info.file_size = st.st_size;
+
+	Header &header = info.header;
+	if (!ReadAt(fd, &header, 0x200, 0))
+		return "file too small for a header";
+
+	if ((header.unitcode & 2) && !ReadAt(fd, &header, sizeof(header), 0))
+		return "file too small for a DSi header";
+
+	if (!DetectRomType(fd, header, info.romType))
+		return "file too small for a secure area";
+
+	// The banner is optional, so a banner that can't be read isn't an error
+	info.bannersize = 0;
+	unsigned short version;
+	if (header.banner_offset && ReadAt(fd, &version, sizeof(version), header.banner_offset))
+	{
+		unsigned int bannersize = GetBannerSizeFromHeader(header, version);
+		if ((bannersize <= sizeof(Banner)) && ReadAt(fd, &info.banner, bannersize, header.banner_offset))
+		{
+			info.bannersize = bannersize;
+		}
+	}
+
+	if (hashes)
+	{
+		thread_local std::vector<unsigned char> buf(1024 * 1024);
+
+		unsigned int crc32 = ~0;
+		sha1_ctx cx[1];
+		sha1_begin(cx);
+
+		for (uint64_t offset = 0; offset < info.file_size; )
+		{
+			unsigned int size = std::min<uint64_t>(buf.size(), info.file_size - offset);
+			if (!ReadAt(fd, buf.data(), size, offset))
+				return "failed to read data";
+
+			crc32 = CalcCrc32(buf.data(), size, crc32);
+			sha1_hash(buf.data(), size, cx);
+			offset += size;
+		}
+
+		info.crc32 = ~crc32;
+		sha1_end(info.sha1, cx);
+	}
+
+	return NULL;
+}
+
+/*
+ * ScanRom
+ */
+static bool ScanRom(const std::string &path, ScanRecord &record)
+{
+	record.Add("path", path);
+
+	const char *error = NULL;
+	ScanInfo info;
+	memset((void *)&info, 0, sizeof(info));
+
+	int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+	if (fd < 0)
+		error = strerror(errno);
+	else
+		error = ReadRomInfo(fd, info, ctx->scan_hashes);
+
+	if (fd >= 0)
+		close(fd);
+
+	record.Add("error", error ? error : "");
+	if (!error)
+		AddFields(record, info);
+
+	return error == NULL;
+}
+
+/*
+ * Utf8SequenceLength
+ * Returns the length of the valid UTF-8 sequence at the start of a string, or 0
+ * if it isn't valid (overlong forms and surrogates aren't valid).
+ */
+static size_t Utf8SequenceLength(const unsigned char *p, size_t left)
+{
+	size_t length;
+	unsigned int min;
+	unsigned int code;
+
+	if (p[0] < 0x80)
+		return 1;
+	else if ((p[0] & 0xE0) == 0xC0)
+		length = 2, min = 0x80, code = p[0] & 0x1F;
+	else if ((p[0] & 0xF0) == 0xE0)
+		length = 3, min = 0x800, code = p[0] & 0x0F;
+	else if ((p[0] & 0xF8) == 0xF0)
+		length = 4, min = 0x10000, code = p[0] & 0x07;
+	else
+		return 0;
+
+	if (length > left)
+		return 0;
+
+	for (size_t i = 1; i < length; i++)
+	{
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+		code = (code << 6) | (p[i] & 0x3F);
+	}
+
+	if ((code < min) || (code > 0x10FFFF) || ((code >= 0xD800) && (code <= 0xDFFF)))
+		return 0;
+
+	return length;
+}
+
+/*
+ * JsonString
+ * Bytes that aren't valid UTF-8, like the ones of file names in other
+ * encodings, are replaced by U+FFFD so that the output is always valid JSON.
+ */
+static std::string JsonString(const std::string &str)
+{
+	std::string out = "\"";
+	const unsigned char *p = (const unsigned char *)str.data();
+	size_t left = str.size();
+	while (left > 0)
+	{
+		size_t length = Utf8SequenceLength(p, left);
+		if (length == 0)
+		{
+			out += "\\uFFFD";
+			p++;
+			left--;
+			continue;
+		}
+		if (length > 1)
+		{
+			out.append((const char *)p, length);
+			p += length;
+			left -= length;
+			continue;
+		}
+
+		unsigned char c = *p++;
+		left--;
+
+		if (c == '"')
+			out += "\\\"";
+		else if (c == '\\')
+			out += "\\\\";
+		else if (c == '\n')
+			out += "\\n";
+		else if (c < 0x20)
+		{
+			char buf[8];
+			sprintf(buf, "\\u%04X", c);
+			out += buf;
+		}
+		else
+			out += c;
+	}
+	return out + "\"";
+}
+
+/*
+ * CsvString
+ */
+static std::string CsvString(const std::string &str)
+{
+	if (str.find_first_of(",\"\r\n") == std::string::npos)
+		return str;
+
+	std::string out = "\"";
+	for (char c : str)
+	{
+		if (c == '"')
+			out += '"';
+		out += c;
+	}
+	return out + "\"";
+}
+
+/*
+ * FormatRecord
+ * Records of ROMs that couldn't be read only have the path and the error. In
+ * CSV format, the rest of the columns are left empty.
+ */
+static std::string FormatRecord(const ScanRecord &record, size_t columns)
+{
+	std::string line;
+
+	if (ctx->scan_format == SCAN_FORMAT_CSV)
+	{
+		for (size_t i = 0; i < columns; i++)
+		{
+			if (i)
+				line += ',';
+			if (i < record.fields.size())
+				line += CsvString(record.fields[i].value);
+		}
+	}
+	else
+	{
+		line = "{";
+		for (size_t i = 0; i < record.fields.size(); i++)
+		{
+			const ScanField &field = record.fields[i];
+			if (i)
+				line += ", ";
+			line += JsonString(field.name) + ": ";
+			line += (field.type == FIELD_STRING) ? JsonString(field.value) : field.value;
+		}
+		line += "}";
+	}
+
+	return line + "\n";
+}
+
+/*
+ * IsRomFilename
+ */
+static bool IsRomFilename(const char *name)
+{
+	const char *p = strrchr(name, '.');
+	if (!p)
+		return false;
+	return !strcasecmp(p, ".nds") || !strcasecmp(p, ".dsi") || !strcasecmp(p, ".srl");
+}
+
+/*
+ * FindRoms
+ * Adds the ROMs of a directory and its subdirectories, sorted by name.
+ * Symbolic links are followed, but directories that have already been visited
+ * (by following a link to a parent directory, for example) are skipped.
+ */
+static void FindRoms(const std::string &dirname, std::vector<std::string> &roms,
+					 std::set<std::pair<dev_t, ino_t>> &visited)
+{
+#ifndef _WIN32
+	// There are no inode numbers (nor symbolic links) on Windows
+	struct stat dir_st;
+	if ((stat(dirname.c_str(), &dir_st) != 0) ||
+		!visited.insert({ dir_st.st_dev, dir_st.st_ino }).second)
+		return;
+#endif
+
+	DIR *dir = opendir(dirname.c_str());
+	if (!dir)
+	{
+		LogWarning("Cannot open directory '%s'.\n", dirname.c_str());
+		return;
+	}
+
+	std::vector<std::string> names;
+	struct dirent *de;
+	while ((de = readdir(dir)))
+	{
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			names.push_back(de->d_name);
+	}
+	closedir(dir);
+
+	std::sort(names.begin(), names.end());
+
+	for (const std::string &name : names)
+	{
+		std::string path = dirname + "/" + name;
+
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			FindRoms(path, roms, visited);
+		else if (S_ISREG(st.st_mode) && IsRomFilename(name.c_str()))
+			roms.push_back(path);
+	}
+}
+
+void FindRomFiles(const std::vector<const char *> &paths, std::vector<std::string> &roms)
+{
+	std::set<std::pair<dev_t, ino_t>> visited;
+
+	for (const char *path : paths)
+	{
+		struct stat st;
+		if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode))
+		{
+			std::string dirname = path;
+			while ((dirname.size() > 1) && (dirname.back() == '/'))
+				dirname.pop_back();
+			FindRoms(dirname, roms, visited);
+		}
+		else
+		{
+			roms.push_back(path);
+		}
+	}
+}
+
+bool ScanRoms(void)
+{
+	std::vector<std::string> roms;
+	FindRomFiles(ctx->scanpaths, roms);
+
+	size_t columns = 0;
+	if (ctx->scan_format == SCAN_FORMAT_CSV)
+	{
+		// The column names are taken from a record of an empty ROM
+		ScanRecord names;
+		ScanInfo info;
+		memset((void *)&info, 0, sizeof(info));
+		names.Add("path", "");
+		names.Add("error", "");
+		AddFields(names, info);
+
+		columns = names.fields.size();
+		for (ScanField &field : names.fields)
+			field.value = field.name;
+		fputs(FormatRecord(names, columns).c_str(), stdout);
+	}
+
+	std::atomic<bool> ok(true);
+	for (size_t start = 0; start < roms.size(); start += SCAN_BATCH_SIZE)
+	{
+		size_t count = std::min<size_t>(SCAN_BATCH_SIZE, roms.size() - start);
+		std::vector<std::string> lines(count);
+
+		ParallelFor(count, [&](size_t i)
+		{
+			ScanRecord record;
+			if (!ScanRom(roms[start + i], record))
+				ok = false;
+			lines[i] = FormatRecord(record, columns);
+		});
+
+		for (const std::string &line : lines)
+			fputs(line.c_str(), stdout);
+	}
+
+	return ok;
+}
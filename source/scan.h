@@ -0,0 +1,48 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "ndstool.h"
+#include "banner.h"
+#include "sha1.h"
+
+// Batch information scanner. It prints one record per ROM with the fields of
+// the header, the decoded country and maker, the ROM type and the titles of
+// the banner, as JSON lines or CSV. Only the header, the banner and a few bytes
+// of the secure area of each ROM are read, unless hashes are requested. ROMs
+// are processed by the pool of worker threads, but the records are printed in
+// the same order as the paths.
+
+// Directories are searched recursively for .nds, .dsi and .srl files. It
+// returns false if any ROM couldn't be read. Those ROMs still get a record,
+// with the reason in the "error" field.
+bool ScanRoms(void);
+
+// Data of a ROM, as read by ReadRomInfo()
+struct ScanInfo
+{
+	uint64_t file_size;
+	Header header;				// only the first 0x200 bytes for DS ROMs
+	int romType;
+	Banner banner;
+	unsigned int bannersize;	// 0 if there isn't any banner
+	unsigned int crc32;			// whole file, only if hashes were requested
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+};
+
+// Reads the header, the ROM type and the banner of a ROM. ScanInfo must be
+// cleared before calling it. It returns an error message, or NULL if the ROM
+// could be read.
+const char *ReadRomInfo(int fd, ScanInfo &info, bool hashes);
+
+// Adds the files in the list to the ROM list. Directories are replaced by the
+// ROMs inside them and their subdirectories, sorted by name.
+void FindRomFiles(const std::vector<const char *> &paths, std::vector<std::string> &roms);
+
+// Converts a text field of the header. Characters that aren't printable ASCII
+// are replaced by '?'.
+std::string HeaderString(const char *text, size_t size);
@@ -0,0 +1,101 @@
+#include <inttypes.h>
+#include <time.h>
+
+#include "manifest.h"
+#include "scancache.h"
+
+#define SCANCACHE_MAGIC	"ndstool-scancache 1"
+
+// Directories modified this close to the start of the scan could be modified
+// again without changing their modification time, if the filesystem doesn't
+// have enough precision. They aren't saved in the cache.
+#define SCANCACHE_MARGIN	(2 * (uint64_t)1000000000)
+
+void LoadScanCache(const char *filename, ScanCache &cache)
+{
+	cache = ScanCache();
+	cache.scan_time = (uint64_t)time(NULL) * 1000000000;
+
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return;
+
+	std::string data;
+	char buf[65536];
+	size_t size;
+	while ((size = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, size);
+	fclose(f);
+
+	std::unordered_map<std::string, ScanCacheDir> dirs;
+	ScanCacheDir *dir = NULL;
+
+	size_t start = 0;
+	bool first = true;
+	while (start < data.size())
+	{
+		size_t end = data.find('\n', start);
+		if (end == std::string::npos)
+			return; // Truncated file
+
+		std::string line = data.substr(start, end - start);
+		start = end + 1;
+
+		if (first)
+		{
+			if (line != SCANCACHE_MAGIC)
+				return;
+			first = false;
+			continue;
+		}
+
+		std::vector<std::string> fields = SplitLine(line);
+
+		if ((fields[0] == "dir") && (fields.size() == 4))
+		{
+			ScanCacheDir &d = dirs[Unescape(fields[3])];
+			d.ino = strtoull(fields[1].c_str(), 0, 0);
+			d.mtime = strtoull(fields[2].c_str(), 0, 0);
+			d.entries.clear();
+			dir = &d;
+		}
+		else if (((fields[0] == "d") || (fields[0] == "f")) && (fields.size() == 2) && dir)
+		{
+			dir->entries.push_back({ Unescape(fields[1]), fields[0] == "d" });
+		}
+		else
+		{
+			return;
+		}
+	}
+
+	cache.old_dirs.swap(dirs);
+}
+
+bool SaveScanCache(const char *filename, const ScanCache &cache)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	fprintf(f, SCANCACHE_MAGIC "\n");
+
+	for (const auto &it : cache.new_dirs)
+	{
+		const ScanCacheDir &dir = it.second;
+		if (dir.mtime + SCANCACHE_MARGIN > cache.scan_time)
+			continue;
+
+		fprintf(f, "dir\t%" PRIu64 "\t%" PRIu64 "\t%s\n", dir.ino, dir.mtime,
+				Escape(it.first).c_str());
+
+		for (const ScanCacheEntry &entry : dir.entries)
+			fprintf(f, "%s\t%s\n", entry.is_dir ? "d" : "f", Escape(entry.name).c_str());
+	}
+
+	bool ok = (ferror(f) == 0);
+	if (fclose(f) != 0)
+		ok = false;
+
+	return ok;
+}
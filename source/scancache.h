@@ -0,0 +1,40 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Cache of the NitroFS directory scan, saved with -sc. For each directory of
+// the host PC it stores its inode and modification time and the names of its
+// entries. If they haven't changed in the next build, the directory doesn't
+// need to be read again. The sizes and modification times of files aren't
+// cached: modifying a file doesn't change the modification time of its
+// directory, so files are always stat'ed.
+
+struct ScanCacheEntry
+{
+	std::string name;
+	bool is_dir;
+};
+
+struct ScanCacheDir
+{
+	uint64_t ino;
+	uint64_t mtime;
+	std::vector<ScanCacheEntry> entries;
+};
+
+struct ScanCache
+{
+	uint64_t scan_time = 0;		// time when the scan started, in nanoseconds
+	std::unordered_map<std::string, ScanCacheDir> old_dirs;	// loaded from the file
+	std::unordered_map<std::string, ScanCacheDir> new_dirs;	// found in this scan
+	size_t reused = 0;			// number of directories that haven't been read
+};
+
+// The cache is empty if the file doesn't exist or it can't be used.
+void LoadScanCache(const char *filename, ScanCache &cache);
+bool SaveScanCache(const char *filename, const ScanCache &cache);
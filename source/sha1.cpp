@@ -1,6 +1,12 @@
 // SPDX-FileNotice: Modified from the original version by the BlocksDS project, starting from 2023.
 
 #include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA1_X86
+#include <immintrin.h>
+#endif
+
 #include "sha1.h"
 
 #define SHA_LITTLE_ENDIAN   1234 /* byte 0 is least significant (i386) */
@@ -42,6 +48,16 @@
 #define parity(x,y,z)   ((x) ^ (y) ^ (z))
 #define maj(x,y,z)      (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
 
+#define K0  0x5a827999
+#define K1  0x6ed9eba1
+#define K2  0x8f1bbcdc
+#define K3  0xca62c1d6
+
+/* load a 32-bit word stored in big-endian order                */
+
+#define load_b32(p) \
+    (((sha1_32t)(p)[0] << 24) | ((sha1_32t)(p)[1] << 16) | ((sha1_32t)(p)[2] << 8) | (sha1_32t)(p)[3])
+
 /* A normal version as set out in the FIPS. This version uses   */
 /* partial loop unrolling and is optimised for the Pentium 4    */
 
@@ -49,49 +65,242 @@
     t = a; a = rotl32(a,5) + f(b,c,d) + e + k + w[i]; \
     e = d; d = c; c = rotl32(b, 30); b = t
 
-void sha1_compile(sha1_ctx ctx[1])
+static void sha1_compile_generic(sha1_32t hash[5], const unsigned char *data, size_t blocks)
 {   sha1_32t    w[80], i, a, b, c, d, e, t;
 
-    /* note that words are compiled from the buffer into 32-bit */
-    /* words in big-endian order so an order reversal is needed */
-    /* here on little endian machines                           */
-    for(i = 0; i < SHA1_BLOCK_SIZE / 4; ++i)
-        w[i] = swap_b32(ctx->wbuf[i]);
+    for( ; blocks > 0; --blocks, data += SHA1_BLOCK_SIZE)
+    {
+        /* words are compiled from the buffer into 32-bit words */
+        /* in big-endian order                                  */
+        for(i = 0; i < SHA1_BLOCK_SIZE / 4; ++i)
+            w[i] = load_b32(data + 4 * i);
+
+        for(i = SHA1_BLOCK_SIZE / 4; i < 80; ++i)
+            w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        a = hash[0];
+        b = hash[1];
+        c = hash[2];
+        d = hash[3];
+        e = hash[4];
+
+        for(i = 0; i < 20; ++i)
+        {
+            rnd(ch, K0);
+        }
+
+        for(i = 20; i < 40; ++i)
+        {
+            rnd(parity, K1);
+        }
+
+        for(i = 40; i < 60; ++i)
+        {
+            rnd(maj, K2);
+        }
+
+        for(i = 60; i < 80; ++i)
+        {
+            rnd(parity, K3);
+        }
+
+        hash[0] += a;
+        hash[1] += b;
+        hash[2] += c;
+        hash[3] += d;
+        hash[4] += e;
+    }
+}
+
+#if defined(SHA1_X86)
+
+/* Version that uses the SHA extensions. Each group of 4 rounds */
+/* is done by one SHA1RNDS4 instruction, and the message words  */
+/* for the following groups are calculated at the same time     */
+
+#define shani_group(g, ecur, eoth)                                          \
+    if((g) < 4)                                                             \
+        msg[(g)] = _mm_shuffle_epi8(                                        \
+            _mm_loadu_si128((const __m128i *)(data + 16 * (g))), bswap);    \
+    if((g) == 0)                                                            \
+        ecur = _mm_add_epi32(ecur, msg[0]);                                 \
+    else                                                                    \
+        ecur = _mm_sha1nexte_epu32(ecur, msg[(g) % 4]);                     \
+    eoth = abcd;                                                            \
+    if((g) >= 3 && (g) <= 18)                                               \
+        msg[((g) + 1) % 4] = _mm_sha1msg2_epu32(msg[((g) + 1) % 4], msg[(g) % 4]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, ecur, (g) / 5);                        \
+    if((g) >= 1 && (g) <= 16)                                               \
+        msg[((g) + 3) % 4] = _mm_sha1msg1_epu32(msg[((g) + 3) % 4], msg[(g) % 4]); \
+    if((g) >= 2 && (g) <= 17)                                               \
+        msg[((g) + 2) % 4] = _mm_xor_si128(msg[((g) + 2) % 4], msg[(g) % 4])
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_compile_shani(sha1_32t hash[5], const unsigned char *data, size_t blocks)
+{   const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1, msg[4];
+
+    /* the state is kept with a in the highest word             */
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)hash), 0x1b);
+    e0 = _mm_set_epi32(hash[4], 0, 0, 0);
+
+    for( ; blocks > 0; --blocks, data += SHA1_BLOCK_SIZE)
+    {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        shani_group( 0, e0, e1); shani_group( 1, e1, e0);
+        shani_group( 2, e0, e1); shani_group( 3, e1, e0);
+        shani_group( 4, e0, e1); shani_group( 5, e1, e0);
+        shani_group( 6, e0, e1); shani_group( 7, e1, e0);
+        shani_group( 8, e0, e1); shani_group( 9, e1, e0);
+        shani_group(10, e0, e1); shani_group(11, e1, e0);
+        shani_group(12, e0, e1); shani_group(13, e1, e0);
+        shani_group(14, e0, e1); shani_group(15, e1, e0);
+        shani_group(16, e0, e1); shani_group(17, e1, e0);
+        shani_group(18, e0, e1); shani_group(19, e1, e0);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)hash, _mm_shuffle_epi32(abcd, 0x1b));
+    hash[4] = _mm_extract_epi32(e0, 3);
+}
+
+/* Version that calculates the message schedule (with the round */
+/* constants already added) of two blocks at the same time with */
+/* AVX2, one block in each 128-bit lane. The rounds are done    */
+/* with scalar code, as they can't be done in parallel          */
+
+#define rnd_wk(f)   \
+    t = a; a = rotl32(a,5) + f(b,c,d) + e + wk[i]; \
+    e = d; d = c; c = rotl32(b, 30); b = t
 
-    for(i = SHA1_BLOCK_SIZE / 4; i < 80; ++i)
-        w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+static void sha1_rounds_wk(sha1_32t hash[5], const sha1_32t wk[80])
+{   sha1_32t    i, a, b, c, d, e, t;
 
-    a = ctx->hash[0];
-    b = ctx->hash[1];
-    c = ctx->hash[2];
-    d = ctx->hash[3];
-    e = ctx->hash[4];
+    a = hash[0];
+    b = hash[1];
+    c = hash[2];
+    d = hash[3];
+    e = hash[4];
 
     for(i = 0; i < 20; ++i)
     {
-        rnd(ch, 0x5a827999);    
+        rnd_wk(ch);
     }
 
     for(i = 20; i < 40; ++i)
     {
-        rnd(parity, 0x6ed9eba1);
+        rnd_wk(parity);
     }
 
     for(i = 40; i < 60; ++i)
     {
-        rnd(maj, 0x8f1bbcdc);
+        rnd_wk(maj);
     }
 
     for(i = 60; i < 80; ++i)
     {
-        rnd(parity, 0xca62c1d6);
+        rnd_wk(parity);
     }
 
-    ctx->hash[0] += a; 
-    ctx->hash[1] += b; 
-    ctx->hash[2] += c; 
-    ctx->hash[3] += d; 
-    ctx->hash[4] += e;
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotl1_avx2(__m256i x)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, 1), _mm256_srli_epi32(x, 31));
+}
+
+__attribute__((target("avx2")))
+static void sha1_schedule_avx2(const unsigned char *block0, const unsigned char *block1,
+                               sha1_32t wk0[80], sha1_32t wk1[80])
+{   const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                            0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m256i w[20], k;
+    int j;
+
+    for(j = 0; j < 4; ++j)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(block0 + 16 * j));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(block1 + 16 * j));
+        w[j] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), bswap);
+    }
+
+    /* w[i + 3] depends on w[i], so it's calculated without it  */
+    /* first and fixed when w[i] is known                       */
+    for(j = 4; j < 20; ++j)
+    {
+        __m256i t = _mm256_xor_si256(w[j - 4], _mm256_alignr_epi8(w[j - 3], w[j - 4], 8));
+        t = _mm256_xor_si256(t, w[j - 2]);
+        t = _mm256_xor_si256(t, _mm256_srli_si256(w[j - 1], 4));
+        t = rotl1_avx2(t);
+        w[j] = _mm256_xor_si256(t, rotl1_avx2(_mm256_slli_si256(t, 12)));
+    }
+
+    for(j = 0; j < 20; ++j)
+    {
+        k = _mm256_set1_epi32(j < 5 ? K0 : j < 10 ? K1 : j < 15 ? K2 : K3);
+        __m256i v = _mm256_add_epi32(w[j], k);
+        _mm_storeu_si128((__m128i *)(wk0 + 4 * j), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)(wk1 + 4 * j), _mm256_extracti128_si256(v, 1));
+    }
+}
+
+static void sha1_compile_avx2(sha1_32t hash[5], const unsigned char *data, size_t blocks)
+{   sha1_32t wk[2][80];
+
+    while(blocks > 0)
+    {
+        /* with an odd number of blocks, the last one goes in both lanes */
+        const unsigned char *next = (blocks >= 2) ? data + SHA1_BLOCK_SIZE : data;
+
+        sha1_schedule_avx2(data, next, wk[0], wk[1]);
+        sha1_rounds_wk(hash, wk[0]);
+        if(blocks >= 2)
+        {
+            sha1_rounds_wk(hash, wk[1]);
+            data += SHA1_BLOCK_SIZE;
+            --blocks;
+        }
+        data += SHA1_BLOCK_SIZE;
+        --blocks;
+    }
+}
+
+#endif
+
+/* process whole blocks with the best version for this CPU      */
+
+typedef void (*sha1_compile_fn)(sha1_32t hash[5], const unsigned char *data, size_t blocks);
+
+static sha1_compile_fn sha1_select(void)
+{
+#if defined(SHA1_X86)
+    if(__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        return sha1_compile_shani;
+    if(__builtin_cpu_supports("avx2"))
+        return sha1_compile_avx2;
+#endif
+    return sha1_compile_generic;
+}
+
+static void sha1_compile_blocks(sha1_32t hash[5], const unsigned char *data, size_t blocks)
+{
+    static const sha1_compile_fn compile = sha1_select();
+    compile(hash, data, blocks);
+}
+
+void sha1_compile(sha1_ctx ctx[1])
+{
+    sha1_compile_blocks(ctx->hash, (const unsigned char *)ctx->wbuf, 1);
 }
 
 void sha1_begin(sha1_ctx ctx[1])
@@ -105,23 +314,32 @@ void sha1_begin(sha1_ctx ctx[1])
 }
 
 /* SHA1 hash data in an array of bytes into hash buffer and call the        */
-/* hash_compile function as required.                                       */
+/* hash_compile function as required. Whole blocks are hashed directly from */
+/* the data, without copying them to the buffer first.                      */
 
 void sha1_hash(const unsigned char data[], unsigned int len, sha1_ctx ctx[1])
 {   sha1_32t pos = (sha1_32t)(ctx->count[0] & SHA1_MASK), 
              space = SHA1_BLOCK_SIZE - pos;
     const unsigned char *sp = data;
+    size_t blocks;
 
     if((ctx->count[0] += len) < len)
         ++(ctx->count[1]);
 
-    while(len >= space)     /* tranfer whole blocks while possible  */
+    if(pos && len >= space) /* complete the block in the buffer */
     {
         memcpy(((unsigned char*)ctx->wbuf) + pos, sp, space);
-        sp += space; len -= space; space = SHA1_BLOCK_SIZE; pos = 0; 
+        sp += space; len -= space; pos = 0;
         sha1_compile(ctx);
     }
 
+    blocks = len / SHA1_BLOCK_SIZE;
+    if(blocks)
+    {
+        sha1_compile_blocks(ctx->hash, sp, blocks);
+        sp += blocks * SHA1_BLOCK_SIZE; len -= blocks * SHA1_BLOCK_SIZE;
+    }
+
     memcpy(((unsigned char*)ctx->wbuf) + pos, sp, len);
 }
 
@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "fileio.h"
+#include "log.h"
+#include "tar.h"
+
+#define TAR_BLOCK_SIZE	512
+
+struct TarHeader
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char type;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "Invalid tar header size");
+
+/*
+ * SetOctal
+ * Writes a number in octal, padded with zeroes and followed by a NUL.
+ */
+static void SetOctal(char *field, size_t size, uint64_t value)
+{
+	field[size - 1] = '\0';
+	for (int i = size - 2; i >= 0; i--)
+	{
+		field[i] = '0' + (value & 7);
+		value >>= 3;
+	}
+}
+
+// The file is only closed here if Close() hasn't been called because of an error
+TarWriter::~TarWriter()
+{
+	if ((fd >= 0) && !is_stdout)
+		close(fd);
+}
+
+void TarWriter::Open(const char *filename, uint64_t mtime)
+{
+	this->mtime = mtime;
+
+	if (strcmp(filename, "-") == 0)
+	{
+		fflush(stdout);
+		fd = fileno(stdout);
+		is_stdout = true;
+	}
+	else
+	{
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+		if (fd < 0)
+			LogFatal("Cannot create file '%s'.\n", filename);
+	}
+}
+
+void TarWriter::Close()
+{
+	// The end of the archive is marked by two empty blocks
+	static const unsigned char zeroes[TAR_BLOCK_SIZE * 2] = { 0 };
+	Write(zeroes, sizeof(zeroes));
+
+	if (!is_stdout && (close(fd) != 0))
+		LogFatal("%s: Failed to write tar file\n", __func__);
+
+	fd = -1;
+}
+
+/*
+ * Write
+ */
+void TarWriter::Write(const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	while (size > 0)
+	{
+		ssize_t r = write(fd, p, size);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LogFatal("%s: Failed to write tar file: %s\n", __func__, strerror(errno));
+		}
+
+		p += r;
+		size -= r;
+	}
+}
+
+/*
+ * WritePadding
+ * Pads the data of an entry of the specified size to a whole block.
+ */
+void TarWriter::WritePadding(uint64_t size)
+{
+	static const unsigned char zeroes[TAR_BLOCK_SIZE] = { 0 };
+	size_t padding = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+	Write(zeroes, padding);
+}
+
+/*
+ * FindPrefixSplit
+ * Returns the position of the '/' that splits a long name in the prefix and
+ * the name fields of the header, or npos if there isn't any. The last
+ * character is ignored so that the name field is never left empty by the '/'
+ * at the end of the names of directories.
+ */
+static size_t FindPrefixSplit(const std::string &name)
+{
+	if (name.size() < 2)
+		return std::string::npos;
+
+	return name.rfind('/', std::min<size_t>(sizeof(TarHeader::prefix), name.size() - 2));
+}
+
+/*
+ * WriteHeader
+ * The name must fit in the header.
+ */
+void TarWriter::WriteHeader(const std::string &name, char type, uint64_t size)
+{
+	TarHeader h;
+	memset(&h, 0, sizeof(h));
+
+	// Names longer than 100 characters are split in a prefix and a name
+	if (name.size() > sizeof(h.name))
+	{
+		size_t split = FindPrefixSplit(name);
+		memcpy(h.prefix, name.data(), split);
+		memcpy(h.name, name.data() + split + 1, name.size() - split - 1);
+	}
+	else
+	{
+		memcpy(h.name, name.data(), name.size());
+	}
+
+	SetOctal(h.mode, sizeof(h.mode), (type == '5') ? 0755 : 0644);
+	SetOctal(h.uid, sizeof(h.uid), 0);
+	SetOctal(h.gid, sizeof(h.gid), 0);
+	SetOctal(h.size, sizeof(h.size), size);
+	SetOctal(h.mtime, sizeof(h.mtime), mtime);
+	h.type = type;
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+
+	// The checksum is calculated with the checksum field filled with spaces
+	memset(h.checksum, ' ', sizeof(h.checksum));
+	unsigned int checksum = 0;
+	for (size_t i = 0; i < sizeof(h); i++)
+		checksum += ((unsigned char *)&h)[i];
+	SetOctal(h.checksum, sizeof(h.checksum) - 1, checksum);
+
+	Write(&h, sizeof(h));
+}
+
+/*
+ * FitsInHeader
+ */
+static bool FitsInHeader(const std::string &name)
+{
+	if (name.size() <= 100)
+		return true;
+
+	// The prefix can't be longer than 155 characters and the name can't be
+	// longer than 100 characters.
+	size_t split = FindPrefixSplit(name);
+	return (split != std::string::npos) && (split > 0) && (name.size() - split - 1 <= 100);
+}
+
+/*
+ * AddEntry
+ */
+void TarWriter::AddEntry(std::string name, char type, uint64_t size)
+{
+	while (1)
+	{
+		if (name.compare(0, 1, "/") == 0)
+			name.erase(0, 1);
+		else if (name.compare(0, 2, "./") == 0)
+			name.erase(0, 2);
+		else
+			break;
+	}
+
+	// Directories end with exactly one '/', whatever the caller has passed
+	while ((name.size() > 1) && (name.back() == '/'))
+		name.pop_back();
+
+	if (type == '5')
+		name += '/';
+
+	if (!FitsInHeader(name))
+	{
+		// pax extended header with the full name. Each record is
+		// "<length> path=<name>\n", and the length includes itself.
+		std::string record = " path=" + name + "\n";
+		size_t length = record.size() + 1;
+		while (std::to_string(length).size() + record.size() != length)
+			length++;
+		record = std::to_string(length) + record;
+
+		WriteHeader("PaxHeader", 'x', record.size());
+		Write(record.data(), record.size());
+		WritePadding(record.size());
+
+		// The ustar header keeps a truncated version of the name
+		name = name.substr(name.size() - 100);
+		if (name[0] == '/')
+			name.erase(0, 1);
+	}
+
+	WriteHeader(name, type, size);
+}
+
+void TarWriter::AddDirectory(const char *name)
+{
+	AddEntry(name, '5', 0);
+}
+
+void TarWriter::AddFile(const char *name, int fd_in, uint64_t offset, uint64_t size)
+{
+	AddEntry(name, '0', size);
+
+	if (!CopyFileDataToStream(fd_in, offset, fd, size))
+		LogFatal("%s: Failed to copy data of '%s'\n", __func__, name);
+
+	WritePadding(size);
+}
@@ -0,0 +1,33 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+// Writes a POSIX tar archive (ustar, with pax headers for long names) as a
+// stream, so it can be written to a pipe. The data of the files is copied
+// directly from ranges of other files.
+class TarWriter
+{
+public:
+	~TarWriter();
+
+	// "-" writes the archive to stdout. Any error is fatal.
+	void Open(const char *filename, uint64_t mtime);
+	void Close();
+
+	// Leading "/" and "./" are removed from the names
+	void AddDirectory(const char *name);
+	void AddFile(const char *name, int fd_in, uint64_t offset, uint64_t size);
+
+private:
+	int fd = -1;
+	bool is_stdout = false;
+	uint64_t mtime = 0;			// in seconds
+
+	void AddEntry(std::string name, char type, uint64_t size);
+	void WriteHeader(const std::string &name, char type, uint64_t size);
+	void Write(const void *data, size_t size);
+	void WritePadding(uint64_t size);
+};
@@ -5,8 +5,11 @@
 #include <cstring>
 #include <iconv.h>
 #include <locale.h>
+#include <mutex>
 #include "utf16.h"
 
+// iconv descriptors can't be used by several threads at the same time
+static std::mutex iconv_utf16_mutex;
 static bool iconv_utf16_initialized = false;
 static iconv_t iconv_utf16_from_system;
 static iconv_t iconv_utf16_to_system;
@@ -30,6 +33,7 @@ static void utf16_iconv_init(void) {
 }
 
 bool utf16_convert_from_system(const char *in, size_t in_len, unsigned_short *out, size_t out_len) {
+	std::lock_guard<std::mutex> lock(iconv_utf16_mutex);
 	utf16_iconv_init();
 	if (in_len == 0) in_len = strlen(in) + 1;
 
@@ -37,8 +41,49 @@ bool utf16_convert_from_system(const char *in, size_t in_len, unsigned_short *ou
 }
 
 bool utf16_convert_to_system(unsigned_short *in, size_t in_len, char *out, size_t out_len) {
+	std::lock_guard<std::mutex> lock(iconv_utf16_mutex);
 	utf16_iconv_init();
 	if (in_len == 0) in_len = (utf16_wstrlen(in) + 1) * 2;
 
 	return iconv(iconv_utf16_to_system, (char**)&in, &in_len, (char**)&out, &out_len) != (size_t) -1;
 }
+
+static void utf8_append(std::string &out, unsigned int c) {
+	if (c < 0x80) {
+		out += (char)c;
+	} else if (c < 0x800) {
+		out += (char)(0xC0 | (c >> 6));
+		out += (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x10000) {
+		out += (char)(0xE0 | (c >> 12));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	} else {
+		out += (char)(0xF0 | (c >> 18));
+		out += (char)(0x80 | ((c >> 12) & 0x3F));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+}
+
+std::string utf16_convert_to_utf8(unsigned_short *in, size_t in_len) {
+	std::string out;
+
+	for (size_t i = 0; i < in_len; i++) {
+		unsigned int c = in[i];
+		if (c == 0) break;
+
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < in_len) {
+			unsigned int c2 = in[i + 1];
+			if (c2 >= 0xDC00 && c2 < 0xE000) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+				i++;
+			}
+		}
+		if (c >= 0xD800 && c < 0xE000) c = 0xFFFD;
+
+		utf8_append(out, c);
+	}
+
+	return out;
+}
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <string>
+
 #include "little.h"
 
 /**
@@ -23,3 +25,14 @@ bool utf16_convert_from_system(const char *in, size_t in_len, unsigned_short *ou
  * @return True if successful.
  */
 bool utf16_convert_to_system(unsigned_short *in, size_t in_len, char *out, size_t out_len);
+
+/**
+ * @brief Convert from UTF-16 to UTF-8. Unlike the functions above it doesn't
+ * depend on the system locale, and it can be used from several threads at the
+ * same time. Unpaired surrogates are replaced by U+FFFD.
+ * @param in Input buffer.
+ * @param in_len Maximum number of characters to convert. It stops at the first
+ * NUL character.
+ * @return The UTF-8 string.
+ */
+std::string utf16_convert_to_utf8(unsigned_short *in, size_t in_len);
@@ -0,0 +1,465 @@
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "ndstool.h"
+#include "bigint.h"
+#include "crc.h"
+#include "fileio.h"
+#include "log.h"
+#include "ndscreate.h"
+#include "parallel.h"
+#include "sha1.h"
+#include "verify.h"
+
+extern unsigned char publicKeyNintendo[128];
+
+enum { REGION_CRC16, REGION_SHA1, REGION_HMAC };
+
+#define RESULT_NEW	((size_t)-1)
+
+/*
+ * VerifyRegion
+ * Range of the ROM that is hashed as it's read. Bytes inside the zero range
+ * are hashed as if they were zeroes.
+ */
+struct VerifyRegion
+{
+	const char *field;
+	int type;
+	uint64_t start;
+	uint64_t end;
+	uint64_t zero_start;
+	uint64_t zero_end;
+	const unsigned char *expected;	// for HMACs
+	size_t result;					// line of the results
+
+	unsigned short crc;
+	sha1_ctx cx[1];
+	unsigned char digest[SHA1_DIGEST_SIZE];
+
+	VerifyRegion(const char *field, int type, uint64_t start, uint64_t size)
+	{
+		this->field = field;
+		this->type = type;
+		this->start = start;
+		this->end = start + size;
+		zero_start = zero_end = 0;
+		expected = NULL;
+		result = RESULT_NEW;
+
+		crc = (unsigned short)~0;
+		if (type == REGION_HMAC)
+			Sha1HmacBegin(cx);
+		else
+			sha1_begin(cx);
+	}
+
+	void Hash(const unsigned char *data, size_t size);
+	void HashZeroes(size_t size);
+	void Feed(const unsigned char *data, uint64_t offset, size_t size);
+	void Finish();
+};
+
+void VerifyRegion::Hash(const unsigned char *data, size_t size)
+{
+	if (type == REGION_CRC16)
+		crc = CalcCrc16((unsigned char *)data, size, crc);
+	else
+		sha1_hash(data, size, cx);
+}
+
+void VerifyRegion::HashZeroes(size_t size)
+{
+	static const unsigned char zeroes[4096] = { 0 };
+
+	while (size > 0)
+	{
+		size_t size2 = std::min(size, sizeof(zeroes));
+		Hash(zeroes, size2);
+		size -= size2;
+	}
+}
+
+/*
+ * VerifyRegion::Feed
+ * Hashes the part of the region that is inside a block of data read from the
+ * ROM at the specified offset.
+ */
+void VerifyRegion::Feed(const unsigned char *data, uint64_t offset, size_t size)
+{
+	uint64_t lo = std::max(start, offset);
+	uint64_t hi = std::min(end, offset + size);
+	if (lo >= hi)
+		return;
+
+	if ((zero_start >= hi) || (zero_end <= lo))
+	{
+		Hash(data + (lo - offset), hi - lo);
+		return;
+	}
+
+	uint64_t z_lo = std::max(zero_start, lo);
+	uint64_t z_hi = std::min(zero_end, hi);
+	Hash(data + (lo - offset), z_lo - lo);
+	HashZeroes(z_hi - z_lo);
+	Hash(data + (z_hi - offset), hi - z_hi);
+}
+
+void VerifyRegion::Finish()
+{
+	if (type == REGION_HMAC)
+		Sha1HmacEnd(digest, cx);
+	else if (type == REGION_SHA1)
+		sha1_end(digest, cx);
+}
+
+/*
+ * HexString
+ */
+static std::string HexString(const unsigned char *data, size_t size)
+{
+	std::string str;
+	char buf[4];
+	for (size_t i = 0; i < size; i++)
+	{
+		sprintf(buf, "%02X", data[i]);
+		str += buf;
+	}
+	return str;
+}
+
+/*
+ * Crc16String
+ */
+static std::string Crc16String(unsigned short crc)
+{
+	char buf[8];
+	sprintf(buf, "0x%04X", crc);
+	return buf;
+}
+
+/*
+ * Report
+ * Adds a line to the results. Checks that are done after reading the ROM store
+ * their result in a line reserved with ReserveResult(), so that the lines are
+ * always printed in the same order.
+ */
+static void Report(const char *field, const char *result, const std::string &expected,
+				   const std::string &actual, size_t index = RESULT_NEW)
+{
+	if (strcmp(result, "FAIL") == 0)
+		ctx->verify_ok = false;
+
+	std::string line = std::string(field) + "\t" + result + "\t"
+					 + (expected.empty() ? "-" : expected) + "\t"
+					 + (actual.empty() ? "-" : actual) + "\n";
+	if (index == RESULT_NEW)
+		ctx->verify_results.push_back(line);
+	else
+		ctx->verify_results[index] = line;
+}
+
+static void ReportCompare(const char *field, const std::string &expected, const std::string &actual,
+						  size_t index = RESULT_NEW)
+{
+	Report(field, (expected == actual) ? "OK" : "FAIL", expected, actual, index);
+}
+
+static size_t ReserveResult()
+{
+	ctx->verify_results.push_back("");
+	return ctx->verify_results.size() - 1;
+}
+
+bool VerifyRom(const char *ndsfilename)
+{
+	ctx->fNDS = fopen(ndsfilename, "rb");
+	if (!ctx->fNDS)
+		LogFatal("Cannot open file '%s'.\n", ndsfilename);
+
+	int fd = fileno(ctx->fNDS);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		LogFatal("%s: Failed to get ROM size\n", __func__);
+	uint64_t file_size = st.st_size;
+
+	FullyReadHeader(ctx->fNDS, ctx->header);
+	int romType = (ctx->header.arm9_rom_offset < 0x4000) ? ROMTYPE_HOMEBREW : DetectRomType();
+
+	ctx->verify_ok = true;
+	ctx->verify_results.clear();
+
+	// Regions that are hashed while the ROM is read. Regions that go past the
+	// end of the file fail without being read.
+	std::vector<VerifyRegion> regions;
+	regions.reserve(16);
+	auto AddRegion = [&](const char *field, int type, uint64_t start, uint64_t size) -> VerifyRegion *
+	{
+		if (start + size > file_size)
+		{
+			Report(field, "FAIL", "", "out_of_bounds");
+			return NULL;
+		}
+		regions.emplace_back(field, type, start, size);
+		regions.back().result = ReserveResult();
+		return &regions.back();
+	};
+
+	// Header and logo
+	ReportCompare("header_crc", Crc16String(ctx->header.header_crc), Crc16String(CalcHeaderCRC(ctx->header)));
+	ReportCompare("logo_crc", Crc16String(ctx->header.logo_crc), Crc16String(CalcLogoCRC(ctx->header)));
+
+	if ((romType == ROMTYPE_HOMEBREW) || (romType == ROMTYPE_NDSDUMPED))
+		Report("secure_area_crc", "SKIP", Crc16String(ctx->header.secure_area_crc), "");
+	else
+		AddRegion("secure_area_crc", REGION_CRC16, 0x4000, 0x4000);
+
+	// Banner. It's small, so it's read directly.
+	{
+		Banner banner;
+		unsigned short version = 0;
+		unsigned int bannersize = 0;
+
+		if (ctx->header.banner_offset && ReadAt(fd, &version, sizeof(version), ctx->header.banner_offset))
+		{
+			bannersize = GetBannerSizeFromHeader(ctx->header, version);
+			if ((bannersize > sizeof(banner)) || !ReadAt(fd, &banner, bannersize, ctx->header.banner_offset))
+				bannersize = 0;
+		}
+
+		for (int slot = 0; slot < NUM_VERSION_CRCS; slot++)
+		{
+			char field[32];
+			sprintf(field, "banner_crc%d", slot);
+
+			unsigned short min_version = GetBannerMinVersionForCRCSlot(slot);
+			if (!ctx->header.banner_offset || (min_version == BAD_MIN_VERSION_CRC) || (version < min_version))
+				Report(field, "SKIP", "", "");
+			else if (bannersize == 0)
+				Report(field, "FAIL", "", "out_of_bounds");
+			else
+				ReportCompare(field, Crc16String(banner.crc[slot]), Crc16String(CalcBannerCRC(banner, slot, bannersize)));
+		}
+	}
+
+	// DSi HMACs
+	const char *hmac_fields[] = {
+		"hmac_arm9", "hmac_arm7", "hmac_icon_title", "hmac_arm9i", "hmac_arm7i"
+	};
+	if (ctx->header.unitcode & 2)
+	{
+		struct { uint64_t start, size; const unsigned char *expected; } hmacs[] = {
+			{ ctx->header.arm9_rom_offset, ctx->header.arm9_size, ctx->header.hmac_arm9 },
+			{ ctx->header.arm7_rom_offset, ctx->header.arm7_size, ctx->header.hmac_arm7 },
+			{ ctx->header.banner_offset, ctx->header.banner_size, ctx->header.hmac_icon_title },
+			{ ctx->header.dsi9_rom_offset, ctx->header.dsi9_size, ctx->header.hmac_arm9i },
+			{ ctx->header.dsi7_rom_offset, ctx->header.dsi7_size, ctx->header.hmac_arm7i },
+		};
+		for (int i = 0; i < 5; i++)
+		{
+			// An offset of 0 means that there isn't any data to check
+			if (hmacs[i].start == 0)
+			{
+				Report(hmac_fields[i], "SKIP", "", "");
+				continue;
+			}
+
+			VerifyRegion *r = AddRegion(hmac_fields[i], REGION_HMAC, hmacs[i].start, hmacs[i].size);
+			if (r)
+				r->expected = hmacs[i].expected;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < 5; i++)
+			Report(hmac_fields[i], "SKIP", "", "");
+	}
+
+	// DS Download Play signature. It's the signature of the SHA1 of the header,
+	// the SHA1s of the ARM9 and ARM7 binaries and 4 more bytes.
+	unsigned char signature[128];
+	unsigned char sha_parts[3*SHA1_DIGEST_SIZE + 4];
+	bool has_signature = false;
+	{
+		unsigned_int signature_id = 0;
+		uint64_t pos = ctx->header.application_end_offset;
+		if (!ReadAt(fd, &signature_id, sizeof(signature_id), pos) || (signature_id != 0x00016361))
+		{
+			pos = (uint64_t)ctx->header.application_end_offset - 136;
+			if (!ReadAt(fd, &signature_id, sizeof(signature_id), pos))
+				signature_id = 0;
+		}
+
+		if ((signature_id == 0x00016361)
+			&& ReadAt(fd, signature, sizeof(signature), pos + 4)
+			&& ReadAt(fd, sha_parts + 3*SHA1_DIGEST_SIZE, 4, pos + 4 + sizeof(signature)))
+		{
+			has_signature = true;
+		}
+	}
+
+	size_t signature_result = RESULT_NEW;
+	if (has_signature)
+	{
+		// The header may be the alternate header of DS Download Play
+		unsigned char buf[32 + 0x160];
+		if (ReadAt(fd, buf, sizeof(buf), 0x200) && !memcmp(buf, "DS DOWNLOAD PLAY", 16))
+			sha1(sha_parts, buf + 0x20, 0x160);
+		else
+			sha1(sha_parts, (unsigned char *)&ctx->header, 0x160);
+
+		uint64_t arm9_end = (uint64_t)ctx->header.arm9_rom_offset + ctx->header.arm9_size;
+		uint64_t arm7_end = (uint64_t)ctx->header.arm7_rom_offset + ctx->header.arm7_size;
+		if ((arm9_end > file_size) || (arm7_end > file_size))
+		{
+			Report("multiboot_signature", "FAIL", "", "out_of_bounds");
+			has_signature = false;
+		}
+		else
+		{
+			VerifyRegion *arm9 = AddRegion("multiboot_signature", REGION_SHA1, ctx->header.arm9_rom_offset, ctx->header.arm9_size);
+			if (romType != ROMTYPE_MULTIBOOT)
+			{
+				// This area is cleared when the binary is loaded
+				arm9->zero_start = 0x5000;
+				arm9->zero_end = 0x7000;
+			}
+			AddRegion("multiboot_signature", REGION_SHA1, ctx->header.arm7_rom_offset, ctx->header.arm7_size);
+
+			// Both regions reserve a line, but only one result is printed
+			signature_result = arm9->result;
+			ctx->verify_results.pop_back();
+		}
+	}
+	else
+	{
+		Report("multiboot_signature", "SKIP", "", "");
+	}
+
+	// Whole file
+	size_t crc32_result = ReserveResult();
+	regions.emplace_back("file_sha1", REGION_SHA1, 0, file_size);
+	regions.back().result = ReserveResult();
+
+	// The file is read in chunks. Each chunk is hashed by all the regions it
+	// belongs to, in parallel, while the next chunk is read.
+	const size_t chunk_size = 4 * 1024 * 1024;
+	std::vector<unsigned char> buffers[2];
+	buffers[0].resize(chunk_size);
+	buffers[1].resize(chunk_size);
+
+	size_t chunk_count = (file_size + chunk_size - 1) / chunk_size;
+	std::vector<unsigned int> chunk_crcs(chunk_count);
+	std::atomic<bool> read_error(false);
+
+	auto ReadChunk = [&](size_t i)
+	{
+		uint64_t offset = (uint64_t)i * chunk_size;
+		size_t size = std::min<uint64_t>(chunk_size, file_size - offset);
+		if (!ReadAt(fd, buffers[i & 1].data(), size, offset))
+			read_error = true;
+	};
+
+	if (chunk_count > 0)
+		ReadChunk(0);
+
+	for (size_t c = 0; (c < chunk_count) && !read_error; c++)
+	{
+		uint64_t offset = (uint64_t)c * chunk_size;
+		size_t size = std::min<uint64_t>(chunk_size, file_size - offset);
+		const unsigned char *data = buffers[c & 1].data();
+
+		std::vector<VerifyRegion *> active;
+		for (VerifyRegion &r : regions)
+		{
+			if ((r.start < offset + size) && (r.end > offset))
+				active.push_back(&r);
+		}
+
+		// Job 0 reads the next chunk, job 1 calculates the CRC32 of this one
+		ParallelFor(active.size() + 2, [&](size_t i)
+		{
+			if (i == 0)
+			{
+				if (c + 1 < chunk_count)
+					ReadChunk(c + 1);
+			}
+			else if (i == 1)
+			{
+				chunk_crcs[c] = CalcCrc32((unsigned char *)data, size, 0);
+			}
+			else
+			{
+				active[i - 2]->Feed(data, offset, size);
+			}
+		});
+	}
+
+	if (read_error)
+		LogFatal("%s: Failed to read ROM\n", __func__);
+
+	unsigned int crc32 = ~0;
+	for (size_t c = 0; c < chunk_count; c++)
+	{
+		uint64_t size = std::min<uint64_t>(chunk_size, file_size - (uint64_t)c * chunk_size);
+		crc32 = CrcCombine32(crc32, chunk_crcs[c], size, 0);
+	}
+	crc32 = ~crc32;
+
+	int sha_part = 1;
+	for (VerifyRegion &r : regions)
+	{
+		r.Finish();
+
+		if (r.type == REGION_CRC16)
+		{
+			ReportCompare(r.field, Crc16String(ctx->header.secure_area_crc), Crc16String(r.crc), r.result);
+		}
+		else if (r.type == REGION_HMAC)
+		{
+			ReportCompare(r.field, HexString(r.expected, SHA1_DIGEST_SIZE),
+						  HexString(r.digest, SHA1_DIGEST_SIZE), r.result);
+		}
+		else if (strcmp(r.field, "multiboot_signature") == 0)
+		{
+			memcpy(sha_parts + sha_part * SHA1_DIGEST_SIZE, r.digest, SHA1_DIGEST_SIZE);
+			sha_part++;
+		}
+	}
+
+	if (has_signature)
+	{
+		unsigned char sha_final[SHA1_DIGEST_SIZE];
+		sha1(sha_final, sha_parts, sizeof(sha_parts));
+
+		BigInt _signature, _publicKey, _sha1_from_sig;
+		_signature.Set(signature, sizeof(signature));
+		_publicKey.Set(publicKeyNintendo, sizeof(publicKeyNintendo));
+		_sha1_from_sig.PowMod(_signature, _publicKey);
+
+		unsigned char sha1_from_sig[SHA1_DIGEST_SIZE];
+		_sha1_from_sig.Get(sha1_from_sig, sizeof(sha1_from_sig));
+
+		ReportCompare("multiboot_signature", HexString(sha1_from_sig, SHA1_DIGEST_SIZE),
+					  HexString(sha_final, SHA1_DIGEST_SIZE), signature_result);
+	}
+
+	char buf[16];
+	sprintf(buf, "%08X", crc32);
+	Report("file_crc32", "INFO", "", buf, crc32_result);
+	Report("file_sha1", "INFO", "", HexString(regions.back().digest, SHA1_DIGEST_SIZE),
+		   regions.back().result);
+
+	fclose(ctx->fNDS);
+	ctx->fNDS = NULL;
+
+	for (const std::string &line : ctx->verify_results)
+		fputs(line.c_str(), stdout);
+
+	return ctx->verify_ok;
+}
@@ -0,0 +1,14 @@
+
+#pragma once
+
+// Checks the checksums, hashes and signatures of a ROM: the CRCs of the header,
+// logo, secure area and banner, the DSi HMACs and the DS Download Play
+// signature. The CRC32 and SHA1 of the whole file are printed too.
+//
+// The ROM is read once, from start to end. The regions covered by each check
+// are hashed in parallel as the data is read.
+//
+// Each result is printed as a line with four fields separated by tabs: the name
+// of the field, the result (OK, FAIL, SKIP or INFO), the expected value and the
+// calculated value. It returns false if any check fails.
+bool VerifyRom(const char *ndsfilename);
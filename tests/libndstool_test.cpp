@@ -0,0 +1,496 @@
+// Tests of libndstool. They build small ROMs in a temporary directory and use
+// the library functions directly, like other programs that use libndstool.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "elf.h"
+#include "libndstool.h"
+#include "little.h"
+#include "overlay.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static std::string tmpdir;
+
+// Log output of the contexts, the messages of ndstool aren't checked
+static FILE *log_null;
+
+/*
+ * Path
+ * Returns the path of a file in the temporary directory of the tests.
+ */
+static std::string Path(const std::string &name)
+{
+	return tmpdir + "/" + name;
+}
+
+/*
+ * Arg
+ * The options of a context aren't const, so they need their own copy.
+ */
+static char *Arg(const std::string &s)
+{
+	static std::vector<std::vector<char>> args;
+	args.emplace_back(s.begin(), s.end());
+	args.back().push_back('\0');
+	return args.back().data();
+}
+
+/*
+ * WriteFile
+ */
+static void WriteFile(const std::string &path, const void *data, size_t size)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f || (fwrite(data, 1, size, f) != size) || (fclose(f) != 0))
+	{
+		printf("Failed to write '%s'\n", path.c_str());
+		exit(1);
+	}
+}
+
+/*
+ * WriteFile
+ * Writes a file filled with a byte value.
+ */
+static void WriteFile(const std::string &path, size_t size, unsigned char value)
+{
+	std::vector<unsigned char> data(size, value);
+	WriteFile(path, data.data(), data.size());
+}
+
+/*
+ * ReadFile
+ */
+static std::vector<unsigned char> ReadFile(const std::string &path)
+{
+	std::vector<unsigned char> data;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return data;
+
+	unsigned char buffer[4096];
+	size_t r;
+	while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		data.insert(data.end(), buffer, buffer + r);
+
+	fclose(f);
+	return data;
+}
+
+/*
+ * CaptureStdout
+ * Runs a function with stdout redirected to a file, so that the reports that
+ * ndstool prints don't get mixed with the results of the tests, and returns
+ * what it has printed.
+ */
+static std::string CaptureStdout(const std::function<void(void)> &func)
+{
+	std::string path = Path("stdout.txt");
+
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if ((saved < 0) || (fd < 0) || (dup2(fd, STDOUT_FILENO) < 0))
+	{
+		printf("Failed to redirect stdout\n");
+		exit(1);
+	}
+	close(fd);
+
+	func();
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	std::vector<unsigned char> data = ReadFile(path);
+	return std::string(data.begin(), data.end());
+}
+
+/*
+ * CountOpenFiles
+ * Returns the number of file descriptors of the process, or -1 if the host
+ * can't tell.
+ */
+static int CountOpenFiles(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+
+	int count = 0;
+	while (readdir(dir))
+		count++;
+
+	closedir(dir);
+	return count;
+}
+
+/*
+ * MakeInputs
+ * Creates the binaries, an ARM9 overlay table with two overlays and a NitroFS
+ * directory for the ROMs built by the tests.
+ */
+static void MakeInputs(void)
+{
+	WriteFile(Path("arm9.bin"), 0x1000, 0x99);
+	WriteFile(Path("arm7.bin"), 0x800, 0x77);
+
+	OverlayEntry table[2] = {};
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		table[i].id = i;
+		table[i].ram_address = 0x02100000;
+		table[i].ram_size = 0x100;
+		table[i].file_id = i;
+	}
+	WriteFile(Path("y9.bin"), table, sizeof(table));
+
+	mkdir(Path("ovl").c_str(), 0777);
+	WriteFile(Path("ovl/overlay_0000.bin"), 0x100, 0xA0);
+	WriteFile(Path("ovl/overlay_0001.bin"), 0x100, 0xA1);
+
+	mkdir(Path("fs").c_str(), 0777);
+	mkdir(Path("fs/dir").c_str(), 0777);
+	WriteFile(Path("fs/a.bin"), 0x300, 0x01);
+	WriteFile(Path("fs/dir/b.bin"), 0x300, 0x01);
+}
+
+/*
+ * SetCreateOptions
+ */
+static void SetCreateOptions(NdsContext &context, const std::string &ndsfilename)
+{
+	context.ndsfilename = Arg(ndsfilename);
+	context.arm9filename = Arg(Path("arm9.bin"));
+	context.arm7filename = Arg(Path("arm7.bin"));
+	context.arm9ovltablefilename = Arg(Path("y9.bin"));
+	context.overlaydir = Arg(Path("ovl"));
+	context.filerootdirs[context.filerootdirs_num++] = Arg(Path("fs"));
+}
+
+/*
+ * TestCreateTwice
+ * A context can be used to build the same ROM several times, and the result
+ * doesn't depend on the builds that were done before.
+ */
+static void TestCreateTwice(void)
+{
+	NdsContext context;
+	SetCreateOptions(context, Path("twice.nds"));
+	context.dedup_files = true;
+	context.log_output = log_null;
+
+	CHECK(NdsCreate(context));
+	CHECK(context.error.empty());
+	std::vector<unsigned char> first = ReadFile(Path("twice.nds"));
+
+	CHECK(NdsCreate(context));
+	CHECK(context.error.empty());
+	std::vector<unsigned char> second = ReadFile(Path("twice.nds"));
+
+	CHECK(!first.empty());
+	CHECK(first == second);
+
+	bool verified = false;
+	std::string report = CaptureStdout([&]() { verified = NdsVerify(context); });
+	CHECK(verified);
+	CHECK(report.find("header_crc") != std::string::npos);
+}
+
+/*
+ * TestIncrementalDedup
+ * Files that share their data with duplicates can change in incremental
+ * builds without affecting the data of the other copies.
+ */
+static void TestIncrementalDedup(void)
+{
+	mkdir(Path("dupfs").c_str(), 0777);
+	for (int i = 0; i < 8; i++)
+		WriteFile(Path("dupfs/copy" + std::to_string(i) + ".bin"), 0x400, 0x5A);
+
+	NdsContext context;
+	SetCreateOptions(context, Path("dup.nds"));
+	context.filerootdirs[0] = Arg(Path("dupfs"));
+	context.dedup_files = true;
+	context.incremental_build = true;
+	context.log_output = log_null;
+
+	CaptureStdout([&]() { CHECK(NdsCreate(context)); });
+
+	// One copy becomes empty and another one smaller
+	WriteFile(Path("dupfs/copy3.bin"), "", 0);
+	WriteFile(Path("dupfs/copy5.bin"), 0x200, 0x5A);
+
+	std::string output = CaptureStdout([&]() { CHECK(NdsCreate(context)); });
+	CHECK(output.find("Incremental build: 2 of") != std::string::npos);
+
+	NdsContext extract;
+	extract.ndsfilename = Arg(Path("dup.nds"));
+	extract.filerootdirs[extract.filerootdirs_num++] = Arg(Path("dupout"));
+	extract.log_output = log_null;
+	CHECK(NdsExtract(extract));
+
+	for (int i = 0; i < 8; i++)
+	{
+		std::string name = "copy" + std::to_string(i) + ".bin";
+		CHECK(ReadFile(Path("dupout/" + name)) == ReadFile(Path("dupfs/" + name)));
+	}
+}
+
+/*
+ * TestFailedCreate
+ * A failed operation reports the error and closes the files it has opened,
+ * and the context can be used again afterwards.
+ */
+static void TestFailedCreate(void)
+{
+	NdsContext context;
+	SetCreateOptions(context, Path("failed.nds"));
+	context.overlaydir = Arg(Path("missing"));
+	context.log_output = log_null;
+
+	int open_files = CountOpenFiles();
+
+	CHECK(!NdsCreate(context));
+	CHECK(!context.error.empty());
+	CHECK(context.fNDS == NULL);
+	CHECK(CountOpenFiles() == open_files);
+
+	// An ELF file that is only partially valid fails while it's being read
+	Elf32_Ehdr header = {};
+	memcpy(header.e_ident, ELF_MAGIC, 4);
+	header.e_type = ET_EXEC;
+	header.e_machine = EM_ARM;
+	header.e_version = EV_CURRENT;
+	header.e_ehsize = sizeof(header);
+	header.e_phoff = sizeof(header);
+	header.e_phnum = 4;
+	WriteFile(Path("bad.elf"), &header, sizeof(header));
+
+	context.overlaydir = Arg(Path("ovl"));
+	context.arm9filename = Arg(Path("bad.elf"));
+	CHECK(!NdsCreate(context));
+	CHECK(!context.error.empty());
+	CHECK(CountOpenFiles() == open_files);
+
+	context.arm9filename = Arg(Path("arm9.bin"));
+
+	// A NitroFS directory with an entry that can't be stat'ed fails while it's
+	// being scanned by the worker threads
+	mkdir(Path("brokenfs").c_str(), 0777);
+	WriteFile(Path("brokenfs/file.bin"), 0x10, 0x01);
+	CHECK(symlink("missing", Path("brokenfs/link.bin").c_str()) == 0);
+	context.filerootdirs[0] = Arg(Path("brokenfs"));
+	CHECK(!NdsCreate(context));
+	CHECK(!context.error.empty());
+	CHECK(CountOpenFiles() == open_files);
+
+	context.filerootdirs[0] = Arg(Path("fs"));
+	CHECK(NdsCreate(context));
+	CHECK(context.error.empty());
+}
+
+/*
+ * TestOverlaysWithoutFnt
+ * Overlays are found with the FAT only, so they can be extracted from ROMs
+ * that don't have a FNT.
+ */
+static void TestOverlaysWithoutFnt(void)
+{
+	NdsContext context;
+	SetCreateOptions(context, Path("nofnt.nds"));
+	context.log_output = log_null;
+	CHECK(NdsCreate(context));
+
+	// Remove the FNT from the header
+	std::vector<unsigned char> rom = ReadFile(Path("nofnt.nds"));
+	CHECK(rom.size() > 0x200);
+	if (rom.size() <= 0x200)
+		return;
+	memset(&rom[0x40], 0, 8);
+	WriteFile(Path("nofnt.nds"), rom.data(), rom.size());
+
+	NdsContext extract;
+	extract.ndsfilename = Arg(Path("nofnt.nds"));
+	extract.overlaydir = Arg(Path("nofnt_ovl"));
+	extract.log_output = log_null;
+	CHECK(NdsExtract(extract));
+	CHECK(extract.error.empty());
+
+	CHECK(ReadFile(Path("nofnt_ovl/overlay_0000.bin")) == ReadFile(Path("ovl/overlay_0000.bin")));
+	CHECK(ReadFile(Path("nofnt_ovl/overlay_0001.bin")) == ReadFile(Path("ovl/overlay_0001.bin")));
+}
+
+/*
+ * ReadTarNames
+ * Returns the full names of the entries of a tar archive, with a trailing '/'
+ * for directories. Entries with an empty name field are returned as "".
+ */
+static std::vector<std::string> ReadTarNames(const std::string &path)
+{
+	std::vector<std::string> names;
+	std::vector<unsigned char> tar = ReadFile(path);
+
+	std::string pax_path;
+	for (size_t pos = 0; pos + 512 <= tar.size(); )
+	{
+		const char *h = (const char *)&tar[pos];
+		if (h[0] == '\0')
+			break;
+
+		std::string name(h, strnlen(h, 100));
+		std::string prefix(h + 345, strnlen(h + 345, 155));
+		char type = h[156];
+		size_t size = strtoull(std::string(h + 124, 12).c_str(), NULL, 8);
+		pos += 512;
+
+		if (type == 'x')
+		{
+			// "<length> path=<name>\n"
+			std::string record((const char *)&tar[pos], size);
+			size_t start = record.find(" path=");
+			if (start != std::string::npos)
+				pax_path = record.substr(start + 6, record.size() - start - 7);
+		}
+		else
+		{
+			if (name.empty())
+				names.push_back("");
+			else if (!pax_path.empty())
+				names.push_back(pax_path);
+			else if (!prefix.empty())
+				names.push_back(prefix + "/" + name);
+			else
+				names.push_back(name);
+			pax_path.clear();
+		}
+
+		pos += (size + 511) / 512 * 512;
+	}
+
+	return names;
+}
+
+/*
+ * TestTarLongDirectories
+ * Directories whose names need the prefix field of the header, or a pax
+ * header, are stored with one trailing '/' and a name that isn't empty.
+ */
+static void TestTarLongDirectories(void)
+{
+	// Directories of 40 characters, so that the full names of the directories
+	// in the archive go past the 100 characters of the name field and the 155
+	// characters of the prefix field.
+	std::string dir = Path("longfs");
+	mkdir(dir.c_str(), 0777);
+	for (char c = 'a'; c <= 'd'; c++)
+	{
+		dir += "/" + std::string(40, c);
+		mkdir(dir.c_str(), 0777);
+	}
+	WriteFile(dir + "/file.bin", 0x10, 0x55);
+
+	NdsContext context;
+	SetCreateOptions(context, Path("long.nds"));
+	context.filerootdirs[0] = Arg(Path("longfs"));
+	context.log_output = log_null;
+	CHECK(NdsCreate(context));
+
+	NdsContext extract;
+	extract.ndsfilename = Arg(Path("long.nds"));
+	extract.filerootdirs[extract.filerootdirs_num++] = Arg("fsout");
+	extract.tarfilename = Arg(Path("long.tar"));
+	extract.log_output = log_null;
+	CHECK(NdsExtract(extract));
+
+	std::vector<std::string> names = ReadTarNames(Path("long.tar"));
+	std::vector<std::string> expected = { "fsout/" };
+	std::string name = "fsout";
+	for (char c = 'a'; c <= 'd'; c++)
+	{
+		name += "/" + std::string(40, c);
+		expected.push_back(name + "/");
+	}
+	expected.push_back(name + "/file.bin");
+
+	CHECK(names == expected);
+	for (const std::string &n : names)
+		CHECK(n.find("//") == std::string::npos);
+}
+
+/*
+ * RemoveTree
+ */
+static void RemoveTree(const std::string &path)
+{
+	DIR *dir = opendir(path.c_str());
+	if (dir)
+	{
+		struct dirent *de;
+		while ((de = readdir(dir)))
+		{
+			if ((strcmp(de->d_name, ".") != 0) && (strcmp(de->d_name, "..") != 0))
+				RemoveTree(path + "/" + de->d_name);
+		}
+		closedir(dir);
+		rmdir(path.c_str());
+	}
+	else
+	{
+		unlink(path.c_str());
+	}
+}
+
+int main(void)
+{
+	char tmpl[] = "/tmp/libndstool_test.XXXXXX";
+	if (!mkdtemp(tmpl))
+	{
+		printf("Failed to create temporary directory\n");
+		return 1;
+	}
+	tmpdir = tmpl;
+
+	log_null = fopen("/dev/null", "w");
+
+	MakeInputs();
+
+	TestCreateTwice();
+	TestIncrementalDedup();
+	TestFailedCreate();
+	TestOverlaysWithoutFnt();
+	TestTarLongDirectories();
+
+	RemoveTree(tmpdir);
+	fclose(log_null);
+
+	if (failures)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All tests passed\n");
+	return 0;
+}